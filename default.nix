@@ -35,9 +35,9 @@ pkgs.stdenv.mkDerivation {
     boost.dev
     capnproto
     dbus
+    expat
     libuuid
     openssl
-    rapidxml
     systemd
     zlib
   ];
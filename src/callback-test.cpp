@@ -0,0 +1,107 @@
+// Copyright (c) 2023 Vaci Koblizek.
+// Licensed under the Apache 2.0 license found in the LICENSE file or at:
+//     https://opensource.org/licenses/Apache-2.0
+
+#include "callback.h"
+
+#include <kj/async-io.h>
+#include <kj/debug.h>
+#include <kj/main.h>
+#include <kj/vector.h>
+
+#include <gtest/gtest.h>
+
+using namespace aws;
+
+static int EKAM_TEST_DISABLE_INTERCEPTOR = 1;
+
+namespace {
+
+struct SingleCallbackServer
+  : Callback<capnp::Text>::Server {
+
+  kj::Promise<void> next(NextContext ctx) override {
+    values_.add(kj::str(ctx.getParams().getValue()));
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> end(EndContext) override {
+    ended_ = true;
+    return kj::READY_NOW;
+  }
+
+  kj::Vector<kj::String> values_;
+  bool ended_{false};
+};
+
+struct BatchCallbackServer
+  : SingleCallbackServer {
+
+  kj::Promise<void> nextBatch(NextBatchContext ctx) override {
+    auto values = ctx.getParams().getValues();
+    for (auto value: values) {
+      values_.add(kj::str(value));
+    }
+    ++batches_;
+    return kj::READY_NOW;
+  }
+
+  uint32_t batches_{0};
+};
+
+struct CallbackTest
+  : testing::Test {
+
+  void send(Callback<capnp::Text>::Client callback, uint32_t count, uint32_t batchSize) {
+    BatchSender<capnp::Text> sender{kj::mv(callback), batchSize, 2};
+    for (auto ii = 0u; ii < count; ++ii) {
+      sender.add(
+	[&](auto values, auto idx) {
+	  values.set(idx, kj::str(ii));
+	}
+      );
+      if (sender.full()) {
+	sender.flush().wait(waitScope_);
+      }
+    }
+    sender.end().wait(waitScope_);
+  }
+
+  kj::AsyncIoContext ioCtx_{kj::setupAsyncIo()};
+  kj::WaitScope& waitScope_{ioCtx_.waitScope};
+};
+
+}
+
+TEST_F(CallbackTest, SendsBatches) {
+  auto server = kj::heap<BatchCallbackServer>();
+  auto& callback = *server;
+  send(kj::mv(server), 25, 10);
+
+  EXPECT_EQ(callback.batches_, 3u);
+  EXPECT_TRUE(callback.ended_);
+  ASSERT_EQ(callback.values_.size(), 25u);
+  for (auto ii: kj::indices(callback.values_)) {
+    EXPECT_EQ(callback.values_[ii], kj::str(ii));
+  }
+}
+
+TEST_F(CallbackTest, FallsBackToNext) {
+  auto server = kj::heap<SingleCallbackServer>();
+  auto& callback = *server;
+  send(kj::mv(server), 25, 10);
+
+  EXPECT_TRUE(callback.ended_);
+  ASSERT_EQ(callback.values_.size(), 25u);
+  for (auto ii: kj::indices(callback.values_)) {
+    EXPECT_EQ(callback.values_[ii], kj::str(ii));
+  }
+}
+
+int main(int argc, char* argv[]) {
+  kj::TopLevelProcessContext processCtx{argv[0]};
+  processCtx.increaseLoggingVerbosity();
+
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,169 @@
+#pragma once
+
+// Copyright (c) 2023 Vaci Koblizek.
+// Licensed under the Apache 2.0 license found in the LICENSE file or at:
+//     https://opensource.org/licenses/Apache-2.0
+
+#include "s3.capnp.h"
+
+#include <capnp/message.h>
+#include <capnp/orphan.h>
+
+#include <kj/async.h>
+#include <kj/debug.h>
+
+namespace aws {
+
+// Batch size used when the caller of a listing leaves it to the server.
+constexpr uint32_t DEFAULT_BATCH_SIZE = 1000;
+constexpr uint32_t MAX_BATCH_SIZE = 10000;
+
+inline uint32_t batchSize(uint32_t hint) {
+  return hint ? kj::min(hint, MAX_BATCH_SIZE) : DEFAULT_BATCH_SIZE;
+}
+
+// Delivers values to a Callback in batches using nextBatch(), with at
+// most `window` batches awaiting a reply at once. If the callee does
+// not implement nextBatch(), the first batch is re-sent with one next()
+// per value, and so is everything after it.
+template <typename T>
+struct BatchSender {
+
+  BatchSender(typename Callback<T>::Client callback, uint32_t batchSize, uint32_t window = 4)
+    : callback_{kj::mv(callback)}
+    , batchSize_{batchSize}
+    , window_{kj::heapArray<kj::Maybe<kj::Promise<void>>>(window)} {
+    KJ_REQUIRE(batchSize_ > 0);
+    KJ_REQUIRE(window_.size() > 0);
+  }
+
+  // Adds one value to the current batch. `fill` is called with the
+  // batch's list builder and the index of the new element.
+  template <typename Func>
+  void add(Func&& fill) {
+    if (batch_ == nullptr) {
+      batch_ = kj::heap<Batch>(batchSize_);
+    }
+    auto& batch = *KJ_ASSERT_NONNULL(batch_);
+    if (batch.count_ == batch.values_.get().size()) {
+      batch.values_.truncate(batch.count_ * 2);
+    }
+    fill(batch.values_.get(), batch.count_++);
+  }
+
+  bool full() const {
+    KJ_IF_MAYBE(batch, batch_) {
+      return (*batch)->count_ >= batchSize_;
+    }
+    return false;
+  }
+
+  // Sends the current batch, if any. Resolves once another batch may
+  // be sent, so callers can keep filling while earlier ones are
+  // delivered.
+  kj::Promise<void> flush() {
+    KJ_IF_MAYBE(batch, batch_) {
+      auto promise = send(kj::mv(*batch));
+      batch_ = nullptr;
+
+      if (!probed_) {
+	// wait to learn whether the callee understands nextBatch()
+	// before anything else is sent after it
+	return
+	  promise
+	  .then(
+	    [this]{
+	      probed_ = true;
+	    }
+	  );
+      }
+
+      auto& slot = window_[sent_++ % window_.size()];
+      KJ_IF_MAYBE(previous, slot) {
+	auto ready = kj::mv(*previous);
+	slot = kj::mv(promise);
+	return kj::mv(ready);
+      }
+      slot = kj::mv(promise);
+    }
+    return kj::READY_NOW;
+  }
+
+  // Sends anything remaining, waits for every batch to be delivered
+  // and then calls end().
+  kj::Promise<void> end() {
+    return
+      flush()
+      .then(
+        [this]{
+	  auto pending = kj::heapArrayBuilder<kj::Promise<void>>(window_.size());
+	  for (auto& slot: window_) {
+	    KJ_IF_MAYBE(promise, slot) {
+	      pending.add(kj::mv(*promise));
+	    }
+	    slot = nullptr;
+	  }
+	  return kj::joinPromises(pending.finish());
+	}
+      )
+      .then(
+        [this]{
+	  return callback_.endRequest().send().ignoreResult();
+	}
+      );
+  }
+
+private:
+  struct Batch {
+    Batch(uint32_t capacity)
+      : values_{message_.getOrphanage().newOrphan<capnp::List<T>>(capacity)} {
+    }
+
+    capnp::MallocMessageBuilder message_;
+    capnp::Orphan<capnp::List<T>> values_;
+    uint32_t count_{0};
+  };
+
+  kj::Promise<void> send(kj::Own<Batch> batch) {
+    batch->values_.truncate(batch->count_);
+
+    if (!batched_) {
+      return sendEach(kj::mv(batch));
+    }
+
+    auto req = callback_.nextBatchRequest();
+    req.setValues(batch->values_.getReader());
+    return
+      req.send().ignoreResult()
+      .catch_(
+        [this, batch = kj::mv(batch)](kj::Exception&& exc) mutable -> kj::Promise<void> {
+	  if (probed_ || exc.getType() != kj::Exception::Type::UNIMPLEMENTED) {
+	    return kj::mv(exc);
+	  }
+	  batched_ = false;
+	  return sendEach(kj::mv(batch));
+	}
+      );
+  }
+
+  kj::Promise<void> sendEach(kj::Own<Batch> batch) {
+    auto values = batch->values_.getReader();
+    auto promises = kj::heapArrayBuilder<kj::Promise<void>>(values.size());
+    for (auto value: values) {
+      auto req = callback_.nextRequest();
+      req.setValue(value);
+      promises.add(req.send().ignoreResult());
+    }
+    return kj::joinPromises(promises.finish()).attach(kj::mv(batch));
+  }
+
+  typename Callback<T>::Client callback_;
+  uint32_t batchSize_;
+  kj::Array<kj::Maybe<kj::Promise<void>>> window_;
+  kj::Maybe<kj::Own<Batch>> batch_;
+  uint64_t sent_{0};
+  bool batched_{true};
+  bool probed_{false};
+};
+
+}
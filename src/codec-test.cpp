@@ -0,0 +1,161 @@
+// Copyright (c) 2023 Vaci Koblizek.
+// Licensed under the Apache 2.0 license found in the LICENSE file or at:
+//     https://opensource.org/licenses/Apache-2.0
+
+#include "codec.h"
+
+#include <kj/async-io.h>
+#include <kj/debug.h>
+#include <kj/main.h>
+#include <kj/vector.h>
+
+#include <gtest/gtest.h>
+
+using namespace aws;
+
+static int EKAM_TEST_DISABLE_INTERCEPTOR = 1;
+
+namespace {
+
+struct Collector
+  : kj::AsyncOutputStream {
+
+  kj::Promise<void> write(const void* buffer, size_t size) override {
+    bytes_.addAll(kj::arrayPtr(reinterpret_cast<const kj::byte*>(buffer), size));
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> write(kj::ArrayPtr<const kj::ArrayPtr<const kj::byte>> pieces) override {
+    for (auto piece: pieces) {
+      bytes_.addAll(piece);
+    }
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> whenWriteDisconnected() override {
+    return kj::NEVER_DONE;
+  }
+
+  kj::String text() {
+    return kj::heapString(bytes_.asPtr().asChars());
+  }
+
+  kj::Vector<kj::byte> bytes_;
+};
+
+}
+
+struct CodecTest
+  : testing::Test {
+
+  kj::AsyncIoContext ioCtx_{kj::setupAsyncIo()};
+  kj::WaitScope& waitScope_{ioCtx_.waitScope};
+};
+
+TEST_F(CodecTest, ContentEncoding) {
+  EXPECT_EQ(contentEncoding(Compression::GZIP), "gzip"_kj);
+  EXPECT_EQ(contentEncoding(Compression::NONE).size(), 0);
+  EXPECT_TRUE(parseContentEncoding(""_kj).orDefault(Compression::GZIP) == Compression::NONE);
+  EXPECT_TRUE(parseContentEncoding("gzip"_kj).orDefault(Compression::NONE) == Compression::GZIP);
+  EXPECT_EQ(contentEncoding(Compression::ZSTD), "zstd"_kj);
+  EXPECT_TRUE(parseContentEncoding("zstd"_kj).orDefault(Compression::NONE) == Compression::ZSTD);
+  EXPECT_TRUE(parseContentEncoding("br"_kj) == nullptr);
+}
+
+TEST_F(CodecTest, Gzip) {
+  auto lines = KJ_MAP(ii, kj::range(0, 1000)) {
+    return kj::str("{\"level\": \"info\", \"line\": ", ii, "}\n");
+  };
+  auto txt = kj::strArray(lines, "");
+
+  Collector compressed;
+  auto encoder = newEncoder(Compression::GZIP, compressed);
+  encoder->write(txt.begin(), txt.size()).wait(waitScope_);
+  encoder->end().wait(waitScope_);
+  EXPECT_LT(compressed.bytes_.size(), txt.size() / 4);
+  EXPECT_EQ(compressed.bytes_[0], 0x1f);
+  EXPECT_EQ(compressed.bytes_[1], 0x8b);
+
+  // decoded a few bytes at a time
+  Collector decompressed;
+  auto decoder = newDecoder(Compression::GZIP, decompressed);
+  auto bytes = compressed.bytes_.asPtr();
+  while (bytes.size()) {
+    auto size = kj::min(bytes.size(), size_t{7});
+    decoder->write(bytes.begin(), size).wait(waitScope_);
+    bytes = bytes.slice(size, bytes.size());
+  }
+  decoder->end().wait(waitScope_);
+  EXPECT_EQ(decompressed.text(), txt);
+}
+
+TEST_F(CodecTest, Zstd) {
+  // more than a buffer of zstd's output either way
+  auto lines = KJ_MAP(ii, kj::range(0, 10000)) {
+    return kj::str("{\"level\": \"info\", \"line\": ", ii, "}\n");
+  };
+  auto txt = kj::strArray(lines, "");
+
+  Collector compressed;
+  auto encoder = newEncoder(Compression::ZSTD, compressed);
+  auto half = txt.size() / 2;
+  kj::ArrayPtr<const kj::byte> pieces[] = {
+    txt.asBytes().slice(0, half), txt.asBytes().slice(half, txt.size())
+  };
+  encoder->write(pieces).wait(waitScope_);
+  encoder->end().wait(waitScope_);
+  EXPECT_LT(compressed.bytes_.size(), txt.size() / 4);
+  EXPECT_EQ(compressed.bytes_[0], 0x28);
+  EXPECT_EQ(compressed.bytes_[1], 0xb5);
+
+  // decoded a few bytes at a time
+  Collector decompressed;
+  auto decoder = newDecoder(Compression::ZSTD, decompressed);
+  auto bytes = compressed.bytes_.asPtr();
+  while (bytes.size()) {
+    auto size = kj::min(bytes.size(), size_t{7});
+    decoder->write(bytes.begin(), size).wait(waitScope_);
+    bytes = bytes.slice(size, bytes.size());
+  }
+  decoder->end().wait(waitScope_);
+  EXPECT_EQ(decompressed.text(), txt);
+
+  // and a stream cut short is refused
+  Collector truncated;
+  auto cut = newDecoder(Compression::ZSTD, truncated);
+  cut->write(compressed.bytes_.begin(), compressed.bytes_.size() - 1).wait(waitScope_);
+  EXPECT_ANY_THROW(cut->end().wait(waitScope_));
+
+  // as is one with no frame at all
+  Collector empty;
+  EXPECT_ANY_THROW(newDecoder(Compression::ZSTD, empty)->end().wait(waitScope_));
+}
+
+TEST_F(CodecTest, Range) {
+  auto collector = kj::heap<Collector>();
+  auto& c = *collector;
+  auto range = newRangeStream(kj::mv(collector), 3, 7);
+  range->write("012", 3).wait(waitScope_);
+  EXPECT_FALSE(range->done());
+  kj::ArrayPtr<const kj::byte> pieces[] = {
+    "3456"_kj.asBytes(), ""_kj.asBytes(), "789"_kj.asBytes()
+  };
+  range->write(pieces).wait(waitScope_);
+  EXPECT_EQ(c.text(), "34567"_kj);
+  EXPECT_TRUE(range->done());
+
+  auto collector2 = kj::heap<Collector>();
+  auto& c2 = *collector2;
+  auto all = newRangeStream(kj::mv(collector2), 0, 0xFFFFFFFFFFFFFFFF);
+  all->write("0123456789", 10).wait(waitScope_);
+  EXPECT_EQ(c2.text(), "0123456789"_kj);
+  EXPECT_FALSE(all->done());
+}
+
+int main(int argc, char* argv[]) {
+  kj::TopLevelProcessContext processCtx{argv[0]};
+  processCtx.increaseLoggingVerbosity();
+
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,298 @@
+// Copyright (c) 2023 Vaci Koblizek.
+// Licensed under the Apache 2.0 license found in the LICENSE file or at:
+//     https://opensource.org/licenses/Apache-2.0
+
+#include "codec.h"
+
+#include <kj/compat/gzip.h>
+#include <kj/debug.h>
+#include <kj/vector.h>
+
+#include <zstd.h>
+
+namespace aws {
+
+namespace {
+
+struct GzipCodec
+  : Codec {
+
+  template <typename... Params>
+  GzipCodec(kj::AsyncOutputStream& inner, Params&&... params)
+    : gzip_{inner, kj::fwd<Params>(params)...} {
+  }
+
+  kj::Promise<void> write(const void* buffer, size_t size) override {
+    return gzip_.write(buffer, size);
+  }
+
+  kj::Promise<void> write(kj::ArrayPtr<const kj::ArrayPtr<const kj::byte>> pieces) override {
+    return gzip_.write(pieces);
+  }
+
+  kj::Promise<void> whenWriteDisconnected() override {
+    return gzip_.whenWriteDisconnected();
+  }
+
+  kj::Promise<void> end() override {
+    return gzip_.end();
+  }
+
+  kj::GzipAsyncOutputStream gzip_;
+};
+
+// Runs each write through a zstd stream, writing out its output a
+// buffer at a time. A pending write holds the caller's bytes, so they
+// need not be copied.
+struct ZstdEncoder
+  : Codec {
+
+  ZstdEncoder(kj::AsyncOutputStream& inner)
+    : inner_{inner}
+    , ctx_{ZSTD_createCCtx()}
+    , buffer_{kj::heapArray<kj::byte>(ZSTD_CStreamOutSize())} {
+    KJ_REQUIRE(ctx_ != nullptr, "Failed to create zstd context");
+  }
+
+  ~ZstdEncoder() noexcept {
+    ZSTD_freeCCtx(ctx_);
+  }
+
+  kj::Promise<void> write(const void* buffer, size_t size) override {
+    return compress(kj::arrayPtr(reinterpret_cast<const kj::byte*>(buffer), size), ZSTD_e_continue);
+  }
+
+  kj::Promise<void> write(kj::ArrayPtr<const kj::ArrayPtr<const kj::byte>> pieces) override {
+    if (!pieces.size()) {
+      return kj::READY_NOW;
+    }
+    return
+      compress(pieces.front(), ZSTD_e_continue)
+      .then(
+	[this, pieces]{
+	  return write(pieces.slice(1, pieces.size()));
+	}
+      );
+  }
+
+  kj::Promise<void> whenWriteDisconnected() override {
+    return inner_.whenWriteDisconnected();
+  }
+
+  kj::Promise<void> end() override {
+    return compress(nullptr, ZSTD_e_end);
+  }
+
+  kj::Promise<void> compress(kj::ArrayPtr<const kj::byte> bytes, ZSTD_EndDirective mode) {
+    ZSTD_inBuffer in{bytes.begin(), bytes.size(), 0};
+    ZSTD_outBuffer out{buffer_.begin(), buffer_.size(), 0};
+    auto remaining = ZSTD_compressStream2(ctx_, &out, &in, mode);
+    KJ_REQUIRE(!ZSTD_isError(remaining), "Failed to compress", ZSTD_getErrorName(remaining));
+
+    // the end of a frame is only written once nothing remains of it
+    auto done = mode == ZSTD_e_end ? remaining == 0 : in.pos == in.size;
+    auto promise = out.pos ? inner_.write(buffer_.begin(), out.pos) : kj::Promise<void>{kj::READY_NOW};
+    if (done) {
+      return promise;
+    }
+    return
+      promise
+      .then(
+	[this, rest = bytes.slice(in.pos, bytes.size()), mode]{
+	  return compress(rest, mode);
+	}
+      );
+  }
+
+  kj::AsyncOutputStream& inner_;
+  ZSTD_CCtx* ctx_;
+  kj::Array<kj::byte> buffer_;
+};
+
+struct ZstdDecoder
+  : Codec {
+
+  ZstdDecoder(kj::AsyncOutputStream& inner)
+    : inner_{inner}
+    , ctx_{ZSTD_createDCtx()}
+    , buffer_{kj::heapArray<kj::byte>(ZSTD_DStreamOutSize())} {
+    KJ_REQUIRE(ctx_ != nullptr, "Failed to create zstd context");
+  }
+
+  ~ZstdDecoder() noexcept {
+    ZSTD_freeDCtx(ctx_);
+  }
+
+  kj::Promise<void> write(const void* buffer, size_t size) override {
+    return decompress(kj::arrayPtr(reinterpret_cast<const kj::byte*>(buffer), size));
+  }
+
+  kj::Promise<void> write(kj::ArrayPtr<const kj::ArrayPtr<const kj::byte>> pieces) override {
+    if (!pieces.size()) {
+      return kj::READY_NOW;
+    }
+    return
+      decompress(pieces.front())
+      .then(
+	[this, pieces]{
+	  return write(pieces.slice(1, pieces.size()));
+	}
+      );
+  }
+
+  kj::Promise<void> whenWriteDisconnected() override {
+    return inner_.whenWriteDisconnected();
+  }
+
+  kj::Promise<void> end() override {
+    // zstd returns 0 only once a frame is decoded and flushed, and even
+    // an empty stream has a frame
+    KJ_REQUIRE(started_ && remaining_ == 0, "Truncated zstd stream");
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> decompress(kj::ArrayPtr<const kj::byte> bytes) {
+    started_ = started_ || bytes.size();
+    ZSTD_inBuffer in{bytes.begin(), bytes.size(), 0};
+    ZSTD_outBuffer out{buffer_.begin(), buffer_.size(), 0};
+    remaining_ = ZSTD_decompressStream(ctx_, &out, &in);
+    KJ_REQUIRE(!ZSTD_isError(remaining_), "Failed to decompress", ZSTD_getErrorName(remaining_));
+
+    // a full buffer may leave decoded bytes behind in the context
+    auto done = in.pos == in.size && out.pos < out.size;
+    auto promise = out.pos ? inner_.write(buffer_.begin(), out.pos) : kj::Promise<void>{kj::READY_NOW};
+    if (done) {
+      return promise;
+    }
+    return
+      promise
+      .then(
+	[this, rest = bytes.slice(in.pos, bytes.size())]{
+	  return decompress(rest);
+	}
+      );
+  }
+
+  kj::AsyncOutputStream& inner_;
+  ZSTD_DCtx* ctx_;
+  kj::Array<kj::byte> buffer_;
+  size_t remaining_{0};
+  bool started_{false};
+};
+
+struct RangeStreamImpl
+  : RangeStream {
+
+  RangeStreamImpl(kj::Own<kj::AsyncOutputStream> inner, uint64_t first, uint64_t last)
+    : inner_{kj::mv(inner)}
+    , first_{first}
+    , last_{last} {
+  }
+
+  kj::Promise<void> write(const void* buffer, size_t size) override {
+    auto piece = clip(kj::arrayPtr(reinterpret_cast<const kj::byte*>(buffer), size));
+    if (!piece.size()) {
+      return kj::READY_NOW;
+    }
+    return inner_->write(piece.begin(), piece.size());
+  }
+
+  kj::Promise<void> write(kj::ArrayPtr<const kj::ArrayPtr<const kj::byte>> pieces) override {
+    kj::Vector<kj::ArrayPtr<const kj::byte>> clipped(pieces.size());
+    for (auto piece: pieces) {
+      piece = clip(piece);
+      if (piece.size()) {
+	clipped.add(piece);
+      }
+    }
+    if (!clipped.size()) {
+      return kj::READY_NOW;
+    }
+    auto promise = inner_->write(clipped.asPtr());
+    return promise.attach(kj::mv(clipped));
+  }
+
+  kj::Promise<void> whenWriteDisconnected() override {
+    return inner_->whenWriteDisconnected();
+  }
+
+  bool done() const override {
+    return offset_ > last_;
+  }
+
+  // The part of `bytes`, the next ones written, within the range.
+  kj::ArrayPtr<const kj::byte> clip(kj::ArrayPtr<const kj::byte> bytes) {
+    auto begin = offset_;
+    offset_ += bytes.size();
+    if (offset_ <= first_ || begin > last_) {
+      return nullptr;
+    }
+    auto from = first_ > begin ? first_ - begin : 0;
+    // `last` may be the largest offset there is, so is not incremented
+    auto to = last_ - begin >= bytes.size() ? bytes.size() : last_ - begin + 1;
+    return bytes.slice(from, to);
+  }
+
+  kj::Own<kj::AsyncOutputStream> inner_;
+  uint64_t first_;
+  uint64_t last_;
+  uint64_t offset_{0};
+};
+
+}
+
+kj::StringPtr contentEncoding(Compression compression) {
+  switch (compression) {
+    case Compression::NONE:
+      return nullptr;
+    case Compression::GZIP:
+      return "gzip"_kj;
+    case Compression::ZSTD:
+      return "zstd"_kj;
+  }
+  KJ_UNREACHABLE;
+}
+
+kj::Maybe<Compression> parseContentEncoding(kj::StringPtr txt) {
+  if (txt.size() == 0 || txt == "identity"_kj) {
+    return Compression::NONE;
+  }
+  if (txt == "gzip"_kj) {
+    return Compression::GZIP;
+  }
+  if (txt == "zstd"_kj) {
+    return Compression::ZSTD;
+  }
+  return nullptr;
+}
+
+kj::Own<Codec> newEncoder(Compression compression, kj::AsyncOutputStream& inner) {
+  switch (compression) {
+    case Compression::NONE:
+      break;
+    case Compression::GZIP:
+      return kj::heap<GzipCodec>(inner);
+    case Compression::ZSTD:
+      return kj::heap<ZstdEncoder>(inner);
+  }
+  KJ_FAIL_REQUIRE("Not a compression codec", static_cast<int>(compression));
+}
+
+kj::Own<Codec> newDecoder(Compression compression, kj::AsyncOutputStream& inner) {
+  switch (compression) {
+    case Compression::NONE:
+      break;
+    case Compression::GZIP:
+      return kj::heap<GzipCodec>(inner, kj::GzipAsyncOutputStream::DECOMPRESS);
+    case Compression::ZSTD:
+      return kj::heap<ZstdDecoder>(inner);
+  }
+  KJ_FAIL_REQUIRE("Not a compression codec", static_cast<int>(compression));
+}
+
+kj::Own<RangeStream> newRangeStream(
+    kj::Own<kj::AsyncOutputStream> inner, uint64_t first, uint64_t last) {
+  return kj::heap<RangeStreamImpl>(kj::mv(inner), first, last);
+}
+
+}
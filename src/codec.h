@@ -0,0 +1,52 @@
+#pragma once
+
+// Copyright (c) 2023 Vaci Koblizek.
+// Licensed under the Apache 2.0 license found in the LICENSE file or at:
+//     https://opensource.org/licenses/Apache-2.0
+
+#include <kj/async-io.h>
+#include <kj/string.h>
+
+namespace aws {
+
+// How object bodies are compressed when stored.
+enum class Compression {
+  NONE,
+  GZIP,
+  // faster than gzip, for much the same ratio
+  ZSTD
+};
+
+// The Content-Encoding of objects stored with `compression`, or null
+// for NONE.
+kj::StringPtr contentEncoding(Compression);
+
+// The compression of a Content-Encoding, or null if it is not one
+// known here.
+kj::Maybe<Compression> parseContentEncoding(kj::StringPtr);
+
+// Compresses or decompresses what is written to it into `inner`,
+// streaming, with end() writing out what is still buffered.
+struct Codec
+  : kj::AsyncOutputStream {
+
+  virtual kj::Promise<void> end() = 0;
+};
+
+kj::Own<Codec> newEncoder(Compression, kj::AsyncOutputStream& inner);
+kj::Own<Codec> newDecoder(Compression, kj::AsyncOutputStream& inner);
+
+// Passes bytes [first, last] of what is written to it on to `inner`,
+// and drops the rest.
+struct RangeStream
+  : kj::AsyncOutputStream {
+
+  // Whether the last byte of the range has been passed on, so that the
+  // writer need write no more.
+  virtual bool done() const = 0;
+};
+
+kj::Own<RangeStream> newRangeStream(
+  kj::Own<kj::AsyncOutputStream> inner, uint64_t first, uint64_t last);
+
+}
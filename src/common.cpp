@@ -5,8 +5,10 @@
 #include "common.h"
 
 #include <kj/debug.h>
+#include <kj/vector.h>
 
 #include <chrono>
+#include <ctime>
 
 namespace aws {
   
@@ -38,4 +40,129 @@ kj::String yyyymmdd(kj::Date date) {
   return kj::heapString(txt.begin(), c);
 }
 
+kj::FixedArray<char, 17> amzDate(kj::Date date) {
+  int64_t seconds = (date - kj::UNIX_EPOCH) / kj::SECONDS;
+  auto days = seconds / 86400;
+  auto time = seconds % 86400;
+  if (time < 0) {
+    time += 86400;
+    --days;
+  }
+
+  // civil_from_days, from Howard Hinnant's chrono-compatible date
+  // algorithms
+  days += 719468;
+  auto era = (days >= 0 ? days : days - 146096) / 146097;
+  auto doe = days - era * 146097;
+  auto yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  auto doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  auto mp = (5 * doy + 2) / 153;
+  auto day = doy - (153 * mp + 2) / 5 + 1;
+  auto month = mp < 10 ? mp + 3 : mp - 9;
+  auto year = yoe + era * 400 + (month <= 2);
+
+  kj::FixedArray<char, 17> txt;
+  auto put = [&](size_t pos, size_t width, int64_t value) {
+    for (auto ii = width; ii > 0; --ii) {
+      txt[pos + ii - 1] = '0' + value % 10;
+      value /= 10;
+    }
+  };
+  put(0, 4, year);
+  put(4, 2, month);
+  put(6, 2, day);
+  txt[8] = 'T';
+  put(9, 2, time / 3600);
+  put(11, 2, time / 60 % 60);
+  put(13, 2, time % 60);
+  txt[15] = 'Z';
+  txt[16] = '\0';
+  return txt;
+}
+
+kj::Maybe<kj::Date> parseDate(kj::StringPtr iso8601) {
+  std::tm tm{};
+  if (::strptime(iso8601.cStr(), "%Y-%m-%dT%H:%M:%S", &tm) == nullptr) {
+    return nullptr;
+  }
+  return kj::UNIX_EPOCH + ::timegm(&tm) * kj::SECONDS;
+}
+
+constexpr auto HTTP_DATE_FORMAT = "%a, %d %b %Y %H:%M:%S GMT";
+
+kj::String httpDate(kj::Date date) {
+  auto seconds = static_cast<time_t>((date - kj::UNIX_EPOCH) / kj::SECONDS);
+  std::tm tm{};
+  ::gmtime_r(&seconds, &tm);
+
+  kj::FixedArray<char, 32> txt;
+  auto c = ::strftime(txt.begin(), txt.size(), HTTP_DATE_FORMAT, &tm);
+  KJ_DREQUIRE(c != 0);
+  return kj::heapString(txt.begin(), c);
+}
+
+kj::Maybe<kj::Date> parseHttpDate(kj::StringPtr txt) {
+  std::tm tm{};
+  if (::strptime(txt.cStr(), HTTP_DATE_FORMAT, &tm) == nullptr) {
+    return nullptr;
+  }
+  return kj::UNIX_EPOCH + ::timegm(&tm) * kj::SECONDS;
+}
+
+Precondition checkETag(kj::StringPtr etag, kj::StringPtr ifMatch, kj::StringPtr ifNoneMatch) {
+  auto matches = [&](kj::StringPtr condition) {
+    return condition == "*"_kj || condition == etag;
+  };
+  if (ifMatch.size() && !matches(ifMatch)) {
+    return Precondition::FAILED;
+  }
+  if (ifNoneMatch.size() && matches(ifNoneMatch)) {
+    return Precondition::NOT_MODIFIED;
+  }
+  return Precondition::MET;
+}
+
+constexpr auto DIRECTORY_BUCKET_SUFFIX = "--x-s3"_kj;
+
+bool isDirectoryBucket(kj::ArrayPtr<const char> bucket) {
+  auto suffix = DIRECTORY_BUCKET_SUFFIX;
+  return
+    bucket.size() > suffix.size() &&
+    bucket.slice(bucket.size() - suffix.size(), bucket.size()) == suffix.asArray();
+}
+
+kj::String bucketHost(kj::StringPtr bucket, kj::StringPtr region) {
+  if (isDirectoryBucket(bucket)) {
+    // the zone id is between the last two "--"
+    auto end = bucket.size() - DIRECTORY_BUCKET_SUFFIX.size();
+    auto begin = end;
+    while (begin > 1 && !(bucket[begin - 1] == '-' && bucket[begin - 2] == '-')) {
+      --begin;
+    }
+    KJ_REQUIRE(begin > 1, "Invalid directory bucket name", bucket);
+    return kj::str(
+      bucket, ".s3express-"_kj, bucket.slice(begin, end), '.', region, ".amazonaws.com"_kj);
+  }
+  return kj::str(bucket, ".s3."_kj, region, ".amazonaws.com"_kj);
+}
+
+kj::String uriEncode(kj::ArrayPtr<const char> txt) {
+  kj::Vector<char> result(txt.size() + 1);
+  for (auto c: txt) {
+    if (('A' <= c && c <= 'Z') || ('a' <= c && c <= 'z') || ('0' <= c && c <= '9') ||
+        c == '-' || c == '_' || c == '.' || c == '~') {
+      result.add(c);
+    }
+    else {
+      constexpr char HEX[] = "0123456789ABCDEF";
+      auto byte = static_cast<kj::byte>(c);
+      result.add('%');
+      result.add(HEX[byte >> 4]);
+      result.add(HEX[byte & 0x0f]);
+    }
+  }
+  result.add('\0');
+  return kj::String(result.releaseAsArray());
+}
+
 }
@@ -4,6 +4,7 @@
 // Licensed under the Apache 2.0 license found in the LICENSE file or at:
 //     https://opensource.org/licenses/Apache-2.0
 
+#include <kj/array.h>
 #include <kj/time.h>
 #include <kj/string.h>
 
@@ -12,5 +13,41 @@ namespace aws {
 kj::String dateStr(kj::Date date, kj::StringPtr format);
 kj::String yyyymmdd(kj::Date date);
 
+// Formats `date` as the basic ISO 8601 UTC timestamp SigV4 uses, e.g.
+// "20130524T000000Z", NUL-terminated, without allocating or consulting
+// the time zone.
+kj::FixedArray<char, 17> amzDate(kj::Date date);
+
+// Percent-encodes everything but the RFC 3986 unreserved characters,
+// as SigV4 requires for canonical query strings.
+kj::String uriEncode(kj::ArrayPtr<const char>);
+
+// Parses an ISO 8601 UTC timestamp such as "2023-07-28T12:34:56Z".
+kj::Maybe<kj::Date> parseDate(kj::StringPtr iso8601);
+
+// Formats and parses HTTP dates, e.g. "Fri, 28 Jul 2023 12:34:56 GMT",
+// as in Last-Modified and If-Modified-Since.
+kj::String httpDate(kj::Date date);
+kj::Maybe<kj::Date> parseHttpDate(kj::StringPtr txt);
+
+// How a request with the preconditions If-Match `ifMatch` and
+// If-None-Match `ifNoneMatch`, each empty if unset, is answered for
+// an object whose ETag is `etag`.
+enum class Precondition {
+  MET,
+  NOT_MODIFIED,
+  FAILED
+};
+
+Precondition checkETag(kj::StringPtr etag, kj::StringPtr ifMatch, kj::StringPtr ifNoneMatch);
+
+// Whether `bucket` is an S3 Express One Zone directory bucket, which
+// are named "<base>--<zone id>--x-s3".
+bool isDirectoryBucket(kj::ArrayPtr<const char> bucket);
+
+// The virtual-hosted endpoint of `bucket`, which for directory buckets
+// is in their zone.
+kj::String bucketHost(kj::StringPtr bucket, kj::StringPtr region);
+
 }
 	       
@@ -0,0 +1,150 @@
+// Copyright (c) 2023 Vaci Koblizek.
+// Licensed under the Apache 2.0 license found in the LICENSE file or at:
+//     https://opensource.org/licenses/Apache-2.0
+
+#include "creds.h"
+
+#include <kj/async-io.h>
+#include <kj/debug.h>
+#include <kj/main.h>
+
+#include <gtest/gtest.h>
+
+using namespace aws;
+
+static int EKAM_TEST_DISABLE_INTERCEPTOR = 1;
+
+namespace {
+
+struct FakeClock
+  : kj::Clock {
+
+  kj::Date now() const override {
+    return now_;
+  }
+
+  kj::Date now_{kj::UNIX_EPOCH + 1690000000 * kj::SECONDS};
+};
+
+struct CountingProvider
+  : Credentials::Provider::Server {
+
+  CountingProvider(kj::StringPtr expiration)
+    : expiration_{expiration} {
+  }
+
+  kj::Promise<void> getCredentials(GetCredentialsContext ctx) override {
+    ++calls_;
+    KJ_REQUIRE(!failing_, "provider unavailable");
+    auto reply = ctx.getResults();
+    reply.setAccessKey(kj::str("key", calls_));
+    reply.setSecretKey("secret"_kj);
+    reply.setExpiration(expiration_);
+    return kj::READY_NOW;
+  }
+
+  kj::StringPtr expiration_;
+  uint32_t calls_{0};
+  bool failing_{false};
+};
+
+struct CredsTest
+  : testing::Test {
+
+  kj::AsyncIoContext ioCtx_{kj::setupAsyncIo()};
+  kj::WaitScope& waitScope_{ioCtx_.waitScope};
+  FakeClock clock_;
+};
+
+}
+
+TEST_F(CredsTest, SharesSingleFetch) {
+  auto server = kj::heap<CountingProvider>(""_kj);
+  auto& provider = *server;
+  auto cache = newCredentialsCache(clock_, kj::mv(server));
+
+  auto p1 = cache->getCredentials();
+  auto p2 = cache->getCredentials();
+  auto c1 = p1.wait(waitScope_);
+  auto c2 = p2.wait(waitScope_);
+  EXPECT_EQ(provider.calls_, 1u);
+  EXPECT_EQ(c1.get(), c2.get());
+
+  // credentials without an expiration are never refreshed
+  clock_.now_ = clock_.now_ + 365 * kj::DAYS;
+  cache->getCredentials().wait(waitScope_);
+  EXPECT_EQ(provider.calls_, 1u);
+}
+
+TEST_F(CredsTest, RefreshesAheadOfExpiry) {
+  // 2023-07-22T04:26:40Z is 1690000000
+  auto server = kj::heap<CountingProvider>("2023-07-22T05:26:40Z"_kj);
+  auto& provider = *server;
+  auto cache = newCredentialsCache(clock_, kj::mv(server), 5 * kj::MINUTES);
+
+  cache->getCredentials().wait(waitScope_);
+  EXPECT_EQ(provider.calls_, 1u);
+
+  clock_.now_ = clock_.now_ + 30 * kj::MINUTES;
+  cache->getCredentials().wait(waitScope_);
+  EXPECT_EQ(provider.calls_, 1u);
+
+  // inside the refresh window the cached value is still returned
+  // while a refresh runs in the background
+  clock_.now_ = clock_.now_ + 27 * kj::MINUTES;
+  auto creds = cache->getCredentials().wait(waitScope_);
+  EXPECT_EQ(creds->accessKey_, "key1"_kj);
+  kj::evalLast([]{}).wait(waitScope_);
+  EXPECT_EQ(provider.calls_, 2u);
+
+  creds = cache->getCredentials().wait(waitScope_);
+  EXPECT_EQ(creds->accessKey_, "key2"_kj);
+}
+
+TEST_F(CredsTest, BacksOffRefreshes) {
+  // credentials that are always within the refresh window
+  auto server = kj::heap<CountingProvider>("2023-07-22T04:30:00Z"_kj);
+  auto& provider = *server;
+  auto cache = newCredentialsCache(clock_, kj::mv(server), 5 * kj::MINUTES);
+
+  cache->getCredentials().wait(waitScope_);
+  EXPECT_EQ(provider.calls_, 1u);
+
+  // the same expiring credentials are not fetched again on every call
+  for (auto ii: kj::zeroTo(10)) {
+    cache->getCredentials().wait(waitScope_);
+    kj::evalLast([]{}).wait(waitScope_);
+  }
+  EXPECT_EQ(provider.calls_, 1u);
+
+  clock_.now_ = clock_.now_ + 10 * kj::SECONDS;
+  cache->getCredentials().wait(waitScope_);
+  kj::evalLast([]{}).wait(waitScope_);
+  EXPECT_EQ(provider.calls_, 2u);
+
+  // nor is a failing provider, whose credentials are kept
+  provider.failing_ = true;
+  clock_.now_ = clock_.now_ + 20 * kj::SECONDS;
+  auto creds = cache->getCredentials().wait(waitScope_);
+  kj::evalLast([]{}).wait(waitScope_);
+  EXPECT_EQ(provider.calls_, 3u);
+  EXPECT_EQ(creds->accessKey_, "key2"_kj);
+
+  clock_.now_ = clock_.now_ + 20 * kj::SECONDS;
+  cache->getCredentials().wait(waitScope_);
+  kj::evalLast([]{}).wait(waitScope_);
+  EXPECT_EQ(provider.calls_, 3u);
+
+  clock_.now_ = clock_.now_ + 30 * kj::SECONDS;
+  cache->getCredentials().wait(waitScope_);
+  kj::evalLast([]{}).wait(waitScope_);
+  EXPECT_EQ(provider.calls_, 4u);
+}
+
+int main(int argc, char* argv[]) {
+  kj::TopLevelProcessContext processCtx{argv[0]};
+  processCtx.increaseLoggingVerbosity();
+
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
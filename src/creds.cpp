@@ -1,5 +1,7 @@
 #include "creds.h"
 
+#include "common.h"
+
 #include <kj/common.h>
 #include <kj/debug.h>
 
@@ -11,6 +13,12 @@ namespace aws {
 
 namespace {
 
+// Background refreshes that fail, or that return credentials which
+// are still due for a refresh, are retried no sooner than this, and
+// the wait doubles each time up to the maximum.
+constexpr auto MIN_REFRESH_BACKOFF = 10 * kj::SECONDS;
+constexpr auto MAX_REFRESH_BACKOFF = 2 * kj::MINUTES;
+
 kj::Maybe<kj::StringPtr> getenv(kj::StringPtr name) {
   auto value = ::getenv(name.cStr());
   if (value) {
@@ -35,15 +43,119 @@ struct CredentialsProviderServer
     KJ_IF_MAYBE(value, getenv("AWS_SESSION_TOKEN"_kj)) {
       reply.setSessionToken(*value);
     }
-    KJ_LOG(INFO, reply);
     return kj::READY_NOW;
   }
 };
 
+struct CredentialsCacheImpl
+  : CredentialsCache {
+
+  CredentialsCacheImpl(
+      const kj::Clock& clock,
+      Credentials::Provider::Client provider,
+      kj::Duration refreshAhead)
+    : clock_{clock}
+    , provider_{kj::mv(provider)}
+    , refreshAhead_{refreshAhead} {
+  }
+
+  kj::Promise<kj::Own<const CachedCredentials>> getCredentials() override;
+
+private:
+  kj::Promise<void> refresh();
+
+  const kj::Clock& clock_;
+  Credentials::Provider::Client provider_;
+  kj::Duration refreshAhead_;
+
+  kj::Maybe<kj::Own<const CachedCredentials>> creds_;
+  kj::Maybe<kj::ForkedPromise<void>> refresh_;
+  bool refreshing_{false};
+  kj::Date nextRefresh_{kj::UNIX_EPOCH};
+  kj::Duration backoff_{MIN_REFRESH_BACKOFF};
+};
+
+kj::Promise<kj::Own<const CachedCredentials>> CredentialsCacheImpl::getCredentials() {
+  KJ_IF_MAYBE(creds, creds_) {
+    KJ_IF_MAYBE(expiration, (*creds)->expiration_) {
+      auto now = clock_.now();
+      if (now < *expiration) {
+        if (now >= *expiration - refreshAhead_ && now >= nextRefresh_) {
+          // still valid, so refresh in the background
+          refresh();
+        }
+        return kj::atomicAddRef(**creds);
+      }
+    }
+    else {
+      return kj::atomicAddRef(**creds);
+    }
+  }
+
+  return
+    refresh()
+    .then(
+      [this]{
+        return kj::atomicAddRef(*KJ_ASSERT_NONNULL(creds_));
+      }
+    );
+}
+
+kj::Promise<void> CredentialsCacheImpl::refresh() {
+  if (!refreshing_) {
+    refreshing_ = true;
+    nextRefresh_ = clock_.now() + backoff_;
+    backoff_ = kj::min(backoff_ * 2, MAX_REFRESH_BACKOFF);
+    refresh_ =
+      provider_.getCredentialsRequest().send()
+      .then(
+        [this](auto reply) {
+          auto creds = kj::atomicRefcounted<CachedCredentials>(reply);
+          KJ_IF_MAYBE(expiration, creds->expiration_) {
+            if (clock_.now() < *expiration - refreshAhead_) {
+              backoff_ = MIN_REFRESH_BACKOFF;
+            }
+          }
+          else {
+            backoff_ = MIN_REFRESH_BACKOFF;
+          }
+          creds_ = kj::mv(creds);
+          refreshing_ = false;
+        },
+        [this](kj::Exception&& exc) {
+          // background refreshes have no caller to report to
+          KJ_LOG(WARNING, "Failed to refresh credentials", exc);
+          refreshing_ = false;
+          kj::throwFatalException(kj::mv(exc));
+        }
+      )
+      .fork();
+  }
+  return KJ_ASSERT_NONNULL(refresh_).addBranch();
+}
+
+}
+
+CachedCredentials::CachedCredentials(Credentials::Reader creds)
+  : accessKey_{kj::str(creds.getAccessKey())}
+  , secretKey_{kj::str(creds.getSecretKey())}
+  , sessionToken_{kj::str(creds.getSessionToken())} {
+
+  auto expiration = creds.getExpiration();
+  if (expiration.size()) {
+    expiration_ = KJ_REQUIRE_NONNULL(parseDate(expiration), "invalid expiration", expiration);
+  }
 }
 
 Credentials::Provider::Client newCredentialsProvider() {
   return kj::heap<CredentialsProviderServer>();
 }
 
+kj::Own<CredentialsCache> newCredentialsCache(
+    const kj::Clock& clock,
+    Credentials::Provider::Client provider,
+    kj::Duration refreshAhead) {
+  return kj::heap<CredentialsCacheImpl>(clock, kj::mv(provider), refreshAhead);
+}
+
 }
@@ -6,8 +6,44 @@
 
 #include "s3.capnp.h"
 
+#include <kj/refcount.h>
+#include <kj/time.h>
+
 namespace aws {
 
 Credentials::Provider::Client newCredentialsProvider();
 
+struct CachedCredentials
+  : kj::AtomicRefcounted {
+
+  explicit CachedCredentials(Credentials::Reader);
+
+  kj::String accessKey_;
+  kj::String secretKey_;
+  kj::String sessionToken_;
+  kj::Maybe<kj::Date> expiration_;
+};
+
+// In-process cache in front of a Credentials::Provider.
+//
+// Credentials are handed out without a round trip to the provider
+// until they come within `refreshAhead` of their expiration, at which
+// point a single refresh is started in the background and shared by
+// every caller until it completes. Callers only wait for the provider
+// on first use or once the cached credentials have actually expired.
+// A background refresh that fails, or that hands back credentials
+// which are still due for a refresh, is retried with backoff rather
+// than on every call.
+struct CredentialsCache {
+  virtual ~CredentialsCache() noexcept(false) {}
+
+  virtual kj::Promise<kj::Own<const CachedCredentials>> getCredentials() = 0;
+};
+
+kj::Own<CredentialsCache> newCredentialsCache(
+  const kj::Clock&,
+  Credentials::Provider::Client,
+  kj::Duration refreshAhead = 5 * kj::MINUTES
+);
+
 }
@@ -0,0 +1,114 @@
+// Copyright (c) 2023 Vaci Koblizek.
+// Licensed under the Apache 2.0 license found in the LICENSE file or at:
+//     https://opensource.org/licenses/Apache-2.0
+
+#include "file-io.h"
+
+#include <kj/debug.h>
+#include <kj/mutex.h>
+#include <kj/thread.h>
+
+#include <cstdlib>
+
+namespace aws {
+
+namespace {
+
+struct Worker {
+
+  Worker()
+    : thread_{[this]{ run(); }} {
+
+    state_.when(
+      [](const State& state) {
+	return state.executor_ != nullptr;
+      },
+      [](State&) {}
+    );
+  }
+
+  ~Worker() noexcept(false) {
+    // the thread is joined once this returns and thread_ is destroyed
+    executor().executeSync(
+      [this]{
+	auto lock = state_.lockExclusive();
+	KJ_IF_MAYBE(stop, lock->stop_) {
+	  (*stop)->fulfill();
+	}
+      }
+    );
+  }
+
+  const kj::Executor& executor() {
+    return *state_.lockShared()->executor_;
+  }
+
+  void run() {
+    kj::EventLoop loop;
+    kj::WaitScope waitScope{loop};
+    auto paf = kj::newPromiseAndFulfiller<void>();
+    {
+      auto lock = state_.lockExclusive();
+      lock->executor_ = &kj::getCurrentThreadExecutor();
+      lock->stop_ = kj::mv(paf.fulfiller);
+    }
+    paf.promise.wait(waitScope);
+  }
+
+  struct State {
+    const kj::Executor* executor_{nullptr};
+    kj::Maybe<kj::Own<kj::PromiseFulfiller<void>>> stop_;
+  };
+
+  kj::MutexGuarded<State> state_;
+  kj::Thread thread_;
+};
+
+struct FileIoImpl
+  : FileIo {
+
+  FileIoImpl(uint32_t threads) {
+    KJ_REQUIRE(threads > 0);
+    auto builder = kj::heapArrayBuilder<kj::Own<Worker>>(threads);
+    for (auto ii = 0u; ii < threads; ++ii) {
+      builder.add(kj::heap<Worker>());
+    }
+    workers_ = builder.finish();
+  }
+
+  const kj::Executor& executor() override {
+    return workers_[next_++ % workers_.size()]->executor();
+  }
+
+  kj::Array<kj::Own<Worker>> workers_;
+  size_t next_{0};
+};
+
+struct AlignedDisposer
+  : kj::ArrayDisposer {
+
+  void disposeImpl(
+      void* firstElement, size_t elementSize, size_t elementCount,
+      size_t capacity, void (*destroyElement)(void*)) const override {
+    free(firstElement);
+  }
+};
+
+const AlignedDisposer alignedDisposer;
+
+}
+
+kj::Own<FileIo> newFileIo(uint32_t threads) {
+  return kj::heap<FileIoImpl>(threads);
+}
+
+kj::Array<kj::byte> alignedBuffer(size_t size) {
+  constexpr size_t ALIGNMENT = 4096;
+  // aligned_alloc requires a multiple of the alignment
+  auto rounded = (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+  auto ptr = static_cast<kj::byte*>(aligned_alloc(ALIGNMENT, rounded));
+  KJ_REQUIRE(ptr != nullptr, "Failed to allocate buffer", size);
+  return kj::Array<kj::byte>{ptr, size, alignedDisposer};
+}
+
+}
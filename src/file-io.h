@@ -0,0 +1,36 @@
+#pragma once
+
+// Copyright (c) 2023 Vaci Koblizek.
+// Licensed under the Apache 2.0 license found in the LICENSE file or at:
+//     https://opensource.org/licenses/Apache-2.0
+
+#include <kj/async.h>
+#include <kj/array.h>
+
+namespace aws {
+
+// Pool of threads, each with its own event loop, that run blocking file
+// system calls on behalf of an event loop that must not stall.
+struct FileIo {
+  virtual ~FileIo() noexcept(false) {}
+
+  // Returns the executor of the next thread in the pool, round robin.
+  virtual const kj::Executor& executor() = 0;
+
+  // Runs `func` on one of the pool's threads and delivers its result to
+  // the calling thread's event loop. Anything `func` captures by
+  // reference must outlive the returned promise; cancelling the promise
+  // waits for `func` if it has already started.
+  template <typename Func>
+  auto run(Func&& func) {
+    return executor().executeAsync(kj::fwd<Func>(func));
+  }
+};
+
+kj::Own<FileIo> newFileIo(uint32_t threads);
+
+// Allocates a page-aligned buffer, so that copies into the page cache
+// never straddle more pages than they need to.
+kj::Array<kj::byte> alignedBuffer(size_t size);
+
+}
@@ -11,50 +11,124 @@
 
 namespace aws {
 
+namespace {
+
+EVP_MAC_CTX* macCtx(void* ctx) {
+  return reinterpret_cast<EVP_MAC_CTX*>(ctx);
+}
+
+// A null key re-initialises with the key already set, which for HMAC
+// restores the pre-hashed key blocks without redoing them.
+void init(void* ctx, const unsigned char* key, size_t size) {
+  KJ_ASSERT(EVP_MAC_init(macCtx(ctx), key, size, nullptr), "EVP_MAC_init failed");
+}
+
+// An empty key is valid for HMAC, but must not be passed as null.
+const unsigned char* keyPtr(kj::ArrayPtr<const unsigned char> key) {
+  static const unsigned char EMPTY[1] = {};
+  return key.size() ? key.begin() : EMPTY;
+}
+
+void update(void* ctx, kj::ArrayPtr<const unsigned char> data) {
+  KJ_ASSERT(EVP_MAC_update(macCtx(ctx), data.begin(), data.size()), "EVP_MAC_update failed");
+}
+
+Digest finish(void* ctx) {
+  Digest digest;
+  size_t digestSize;
+  KJ_ASSERT(EVP_MAC_final(macCtx(ctx), digest.begin(), &digestSize, digest.size()),
+	    "EVP_MAC_final failed");
+  KJ_ASSERT(digestSize == digest.size());
+  return digest;
+}
+
+}
+
 HashContext::HashContext() {
-  mac_ = EVP_MAC_fetch(nullptr, "HMAC", nullptr);
+  auto* mac = EVP_MAC_fetch(nullptr, "HMAC", nullptr);
+  KJ_ASSERT(mac != nullptr, "HMAC unavailable");
+  mac_ = mac;
+
+  auto* ctx = EVP_MAC_CTX_new(mac);
+  KJ_ASSERT(ctx != nullptr);
+  ctx_ = ctx;
+
+  // the digest is fixed for the lifetime of the context, so is only
+  // set the once
+  OSSL_PARAM params[2];
+  params[0] = OSSL_PARAM_construct_utf8_string("digest", (char*)"SHA256", 0);
+  params[1] = OSSL_PARAM_construct_end();
+  KJ_ASSERT(EVP_MAC_CTX_set_params(ctx, params), "Failed to select SHA256");
 }
 
 HashContext::~HashContext() {
+  EVP_MAC_CTX_free(macCtx(ctx_));
   EVP_MAC_free(reinterpret_cast<EVP_MAC*>(mac_));
 }
 
-kj::Array<unsigned char> HashContext::hash(
+Digest HashContext::hash(
   kj::ArrayPtr<const unsigned char> key,
   kj::ArrayPtr<const unsigned char> data) {
 
-  KJ_STACK_ARRAY(unsigned char, digest, EVP_MAX_MD_SIZE, 256, 256);
-  auto digestSize = digest.size();
-  auto* macCtx = EVP_MAC_CTX_new(reinterpret_cast<EVP_MAC*>(mac_));
+  begin(key);
+  update(data);
+  return finish();
+}
 
-  OSSL_PARAM params[2];
-  params[0] = OSSL_PARAM_construct_utf8_string("digest", (char*)"SHA256", 0);
-  params[1] = OSSL_PARAM_construct_end();
+void HashContext::begin(kj::ArrayPtr<const unsigned char> key) {
+  init(ctx_, keyPtr(key), key.size());
+}
 
-  EVP_MAC_init(macCtx, key.begin(), key.size(), params);
-  EVP_MAC_update(macCtx, data.begin(), data.size());
-  EVP_MAC_final(macCtx, digest.begin(), &digestSize, digest.size());
-  EVP_MAC_CTX_free(macCtx);
+void HashContext::update(kj::ArrayPtr<const unsigned char> data) {
+  aws::update(ctx_, data);
+}
 
-  return kj::heapArray(digest.begin(), digestSize); 
+Digest HashContext::finish() {
+  return aws::finish(ctx_);
 }
 
+KeyedHashContext HashContext::withKey(kj::ArrayPtr<const unsigned char> key) {
+  auto* ctx = EVP_MAC_CTX_dup(macCtx(ctx_));
+  KJ_ASSERT(ctx != nullptr);
+  KeyedHashContext keyed{ctx};
+  init(ctx, keyPtr(key), key.size());
+  return keyed;
 }
 
-/*
-  AWS sha256 HMAC
+KeyedHashContext::KeyedHashContext(KeyedHashContext&& other)
+  : ctx_{other.ctx_} {
+  other.ctx_ = nullptr;
+}
 
-#include <aws/core/utils/crypto/Sha256HMAC.h>
-#include <aws/core/utils/Outcome.h>
+KeyedHashContext& KeyedHashContext::operator=(KeyedHashContext&& other) {
+  if (this != &other) {
+    EVP_MAC_CTX_free(macCtx(ctx_));
+    ctx_ = other.ctx_;
+    other.ctx_ = nullptr;
+  }
+  return *this;
+}
 
-  auto hmac = Aws::MakeUnique<Aws::Utils::Crypto::Sha256HMAC>("");
-  auto hashResult = hmac->Calculate(
-    {data.begin(), data.size()},
-    {key.begin(), key.size()}
-  );
+KeyedHashContext::~KeyedHashContext() {
+  EVP_MAC_CTX_free(macCtx(ctx_));
+}
 
-  KJ_REQUIRE(hashResult.IsSuccess());
-  auto result = hashResult.GetResult();
-  return kj::heapArray(&result[0], result.GetLength());
+Digest KeyedHashContext::hash(kj::ArrayPtr<const unsigned char> data) {
+  begin();
+  update(data);
+  return finish();
+}
+
+void KeyedHashContext::begin() {
+  init(ctx_, nullptr, 0);
+}
+
+void KeyedHashContext::update(kj::ArrayPtr<const unsigned char> data) {
+  aws::update(ctx_, data);
+}
+
+Digest KeyedHashContext::finish() {
+  return aws::finish(ctx_);
+}
 
-*/
+}
@@ -4,27 +4,78 @@
 // Licensed under the Apache 2.0 license found in the LICENSE file or at:
 //     https://opensource.org/licenses/Apache-2.0
 
+#include <kj/array.h>
 #include <kj/common.h>
 #include <kj/string.h>
 #include <kj/string-tree.h>
 
 namespace aws {
 
+  using Digest = kj::FixedArray<unsigned char, 32>;
+
+  struct KeyedHashContext;
+
+  // HMAC-SHA256. The MAC context is created once and reused, so that
+  // hashing allocates nothing.
   struct HashContext {
     HashContext();
     ~HashContext();
+    KJ_DISALLOW_COPY(HashContext);
 
-    kj::Array<unsigned char> hash(
+    Digest hash(
         kj::ArrayPtr<const unsigned char> key,
         kj::ArrayPtr<const unsigned char> data);
 
-    kj::Array<unsigned char> hash(
+    Digest hash(
         kj::ArrayPtr<const unsigned char> key,
         kj::StringPtr txt) {
       return hash(key, txt.asBytes());
     }
 
+    // Incremental hashing: begin() with a key, then any number of
+    // update() calls, then finish().
+    void begin(kj::ArrayPtr<const unsigned char> key);
+    void update(kj::ArrayPtr<const unsigned char> data);
+    void update(kj::StringPtr txt) {
+      update(txt.asBytes());
+    }
+    Digest finish();
+
+    // Returns a context keyed once with `key`, duplicated from this
+    // one, for keys such as a SigV4 signing key that sign many strings.
+    KeyedHashContext withKey(kj::ArrayPtr<const unsigned char> key);
+
   private:
     void* mac_;
+    void* ctx_;
+  };
+
+  // HMAC-SHA256 with a fixed key, whose padded key blocks are hashed
+  // once rather than for every message.
+  struct KeyedHashContext {
+    KeyedHashContext(KeyedHashContext&&);
+    KeyedHashContext& operator=(KeyedHashContext&&);
+    ~KeyedHashContext();
+    KJ_DISALLOW_COPY(KeyedHashContext);
+
+    Digest hash(kj::ArrayPtr<const unsigned char> data);
+    Digest hash(kj::StringPtr txt) {
+      return hash(txt.asBytes());
+    }
+
+    void begin();
+    void update(kj::ArrayPtr<const unsigned char> data);
+    void update(kj::StringPtr txt) {
+      update(txt.asBytes());
+    }
+    Digest finish();
+
+  private:
+    friend struct HashContext;
+    explicit KeyedHashContext(void* ctx)
+      : ctx_{ctx} {
+    }
+
+    void* ctx_;
   };
 }
@@ -0,0 +1,223 @@
+// Copyright (c) 2023 Vaci Koblizek.
+// Licensed under the Apache 2.0 license found in the LICENSE file or at:
+//     https://opensource.org/licenses/Apache-2.0
+
+#include "http-pool.h"
+
+#include <kj/async-io.h>
+#include <kj/compat/http.h>
+#include <kj/debug.h>
+#include <kj/main.h>
+#include <kj/map.h>
+#include <kj/vector.h>
+
+#include <gtest/gtest.h>
+
+using namespace aws;
+
+static int EKAM_TEST_DISABLE_INTERCEPTOR = 1;
+
+namespace {
+
+// Answers "ok" to everything, except /hang, which never answers.
+struct FakeService
+  : kj::HttpService {
+
+  FakeService(const kj::HttpHeaderTable& table)
+    : table_{table} {
+  }
+
+  kj::Promise<void> request(
+      kj::HttpMethod method, kj::StringPtr url, const kj::HttpHeaders& headers,
+      kj::AsyncInputStream& requestBody, Response& response) override {
+    if (url == "/hang"_kj) {
+      return kj::NEVER_DONE;
+    }
+    auto body = "ok"_kj;
+    auto stream = response.send(200, "OK"_kj, kj::HttpHeaders(table_), body.size());
+    auto promise = stream->write(body.begin(), body.size());
+    return promise.attach(kj::mv(stream));
+  }
+
+  const kj::HttpHeaderTable& table_;
+};
+
+// Serves every connection from one in-process HttpServer, counting
+// connections per host and letting the test hang up on all of them.
+struct FakeNetwork
+  : kj::Network {
+
+  struct Address
+    : kj::NetworkAddress {
+
+    Address(FakeNetwork& network, kj::StringPtr host)
+      : network_{network}
+      , host_{kj::str(host)} {
+    }
+
+    kj::Promise<kj::Own<kj::AsyncIoStream>> connect() override {
+      auto pipe = kj::newTwoWayPipe();
+      network_.connects_.upsert(kj::str(host_), 1, [](auto& existing, auto) { ++existing; });
+      network_.connections_.add(
+	network_.server_.listenHttp(kj::mv(pipe.ends[1]))
+	.eagerlyEvaluate([](kj::Exception&& exc) { KJ_LOG(ERROR, exc); })
+      );
+      return kj::mv(pipe.ends[0]);
+    }
+
+    kj::Own<kj::ConnectionReceiver> listen() override {
+      KJ_UNIMPLEMENTED("fake network");
+    }
+
+    kj::Own<kj::NetworkAddress> clone() override {
+      return kj::heap<Address>(network_, host_);
+    }
+
+    kj::String toString() override {
+      return kj::str(host_);
+    }
+
+    FakeNetwork& network_;
+    kj::String host_;
+  };
+
+  FakeNetwork(kj::Timer& timer, const kj::HttpHeaderTable& table, kj::HttpService& service)
+    : server_{timer, table, service} {
+  }
+
+  kj::Promise<kj::Own<kj::NetworkAddress>> parseAddress(kj::StringPtr addr, uint) override {
+    return kj::Own<kj::NetworkAddress>{kj::heap<Address>(*this, addr)};
+  }
+
+  kj::Own<kj::NetworkAddress> getSockaddr(const void*, uint) override {
+    KJ_UNIMPLEMENTED("fake network");
+  }
+
+  kj::Own<kj::Network> restrictPeers(
+      kj::ArrayPtr<const kj::StringPtr>, kj::ArrayPtr<const kj::StringPtr>) override {
+    KJ_UNIMPLEMENTED("fake network");
+  }
+
+  uint32_t connects(kj::StringPtr host) const {
+    KJ_IF_MAYBE(count, connects_.find(host)) {
+      return *count;
+    }
+    return 0;
+  }
+
+  // Drops the server end of every connection, as a server closing its
+  // kept-alive connections does.
+  void hangUp() {
+    connections_.clear();
+  }
+
+  kj::HttpServer server_;
+  kj::Vector<kj::Promise<void>> connections_;
+  kj::HashMap<kj::String, uint32_t> connects_;
+};
+
+struct HttpPoolTest
+  : testing::Test {
+
+  kj::Own<kj::HttpClient> newPool(const HttpPoolOptions& options = {}) {
+    return newHttpPool(timer_, table_, network_, nullptr, options, stats_);
+  }
+
+  kj::Promise<kj::String> get(kj::HttpClient& client, kj::StringPtr url) {
+    auto req = client.request(kj::HttpMethod::GET, url, kj::HttpHeaders(table_));
+    return
+      req.response
+      .then(
+	[](auto response) {
+	  KJ_REQUIRE(response.statusCode == 200, response.statusCode);
+	  auto promise = response.body->readAllText();
+	  return promise.attach(kj::mv(response.body));
+	}
+      );
+  }
+
+  kj::AsyncIoContext ioCtx_{kj::setupAsyncIo()};
+  kj::WaitScope& waitScope_{ioCtx_.waitScope};
+  kj::Timer& timer_{ioCtx_.provider->getTimer()};
+  kj::HttpHeaderTable table_;
+  FakeService service_{table_};
+  FakeNetwork network_{timer_, table_, service_};
+  HttpPoolStats stats_;
+};
+
+}
+
+TEST_F(HttpPoolTest, Reuse) {
+  auto pool = newPool();
+  for (auto ii = 0; ii < 3; ++ii) {
+    EXPECT_EQ(get(*pool, "http://a/"_kj).wait(waitScope_), "ok"_kj);
+  }
+  EXPECT_EQ(stats_.requests, 3);
+  EXPECT_EQ(stats_.opened, 1);
+  EXPECT_EQ(stats_.reused(), 2);
+  EXPECT_EQ(network_.connects("a"_kj), 1);
+}
+
+TEST_F(HttpPoolTest, PerHost) {
+  auto pool = newPool();
+  for (auto host: {"http://a/"_kj, "http://b/"_kj, "http://a/"_kj, "http://b/"_kj}) {
+    EXPECT_EQ(get(*pool, host).wait(waitScope_), "ok"_kj);
+  }
+  EXPECT_EQ(stats_.opened, 2);
+  EXPECT_EQ(stats_.reused(), 2);
+  EXPECT_EQ(network_.connects("a"_kj), 1);
+  EXPECT_EQ(network_.connects("b"_kj), 1);
+}
+
+TEST_F(HttpPoolTest, IdleEviction) {
+  HttpPoolOptions options;
+  options.idleTimeout = 10 * kj::MILLISECONDS;
+  auto pool = newPool(options);
+
+  EXPECT_EQ(get(*pool, "http://a/"_kj).wait(waitScope_), "ok"_kj);
+  EXPECT_EQ(stats_.closed, 0);
+
+  timer_.afterDelay(50 * kj::MILLISECONDS).wait(waitScope_);
+  EXPECT_EQ(stats_.closed, 1);
+
+  // the evicted connection is not reused
+  EXPECT_EQ(get(*pool, "http://a/"_kj).wait(waitScope_), "ok"_kj);
+  EXPECT_EQ(stats_.opened, 2);
+  EXPECT_EQ(network_.connects("a"_kj), 2);
+}
+
+TEST_F(HttpPoolTest, ServerClose) {
+  auto pool = newPool();
+  EXPECT_EQ(get(*pool, "http://a/"_kj).wait(waitScope_), "ok"_kj);
+
+  // once the pool has seen the idle connection close, the next request
+  // goes out on a fresh one
+  network_.hangUp();
+  waitScope_.poll();
+  EXPECT_EQ(stats_.closed, 1);
+  EXPECT_EQ(get(*pool, "http://a/"_kj).wait(waitScope_), "ok"_kj);
+  EXPECT_EQ(stats_.opened, 2);
+
+  // a request in flight when the server hangs up fails as a disconnect
+  auto hung = get(*pool, "http://a/hang"_kj);
+  waitScope_.poll();
+  network_.hangUp();
+  KJ_IF_MAYBE(exc, kj::runCatchingExceptions([&]{ hung.wait(waitScope_); })) {
+    EXPECT_EQ(exc->getType(), kj::Exception::Type::DISCONNECTED);
+  }
+  else {
+    ADD_FAILURE() << "request survived a closed connection";
+  }
+
+  // and the pool carries on
+  EXPECT_EQ(get(*pool, "http://a/"_kj).wait(waitScope_), "ok"_kj);
+  EXPECT_EQ(stats_.opened, 3);
+}
+
+int main(int argc, char* argv[]) {
+  kj::TopLevelProcessContext processCtx{argv[0]};
+  processCtx.increaseLoggingVerbosity();
+
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,183 @@
+// Copyright (c) 2023 Vaci Koblizek.
+// Licensed under the Apache 2.0 license found in the LICENSE file or at:
+//     https://opensource.org/licenses/Apache-2.0
+
+#include "http-pool.h"
+
+#include <kj/compat/url.h>
+#include <kj/debug.h>
+#include <kj/map.h>
+
+namespace aws {
+
+namespace {
+
+struct CountingAddress
+  : kj::NetworkAddress {
+
+  CountingAddress(kj::Own<kj::NetworkAddress> inner, HttpPoolStats& stats)
+    : inner_{kj::mv(inner)}
+    , stats_{stats} {
+  }
+
+  kj::Promise<kj::Own<kj::AsyncIoStream>> connect() override {
+    return
+      inner_->connect()
+      .then(
+        [this](auto stream) {
+          return counted(kj::mv(stream));
+        }
+      );
+  }
+
+  kj::Promise<kj::AuthenticatedStream> connectAuthenticated() override {
+    return
+      inner_->connectAuthenticated()
+      .then(
+        [this](auto authenticated) {
+          authenticated.stream = counted(kj::mv(authenticated.stream));
+          return kj::mv(authenticated);
+        }
+      );
+  }
+
+  kj::Own<kj::ConnectionReceiver> listen() override {
+    return inner_->listen();
+  }
+
+  kj::Own<kj::NetworkAddress> clone() override {
+    return kj::heap<CountingAddress>(inner_->clone(), stats_);
+  }
+
+  kj::String toString() override {
+    return inner_->toString();
+  }
+
+private:
+  kj::Own<kj::AsyncIoStream> counted(kj::Own<kj::AsyncIoStream> stream) {
+    ++stats_.opened;
+    return stream.attach(kj::defer([&stats = stats_]{ ++stats.closed; }));
+  }
+
+  kj::Own<kj::NetworkAddress> inner_;
+  HttpPoolStats& stats_;
+};
+
+struct CountingNetwork
+  : kj::Network {
+
+  CountingNetwork(kj::Network& inner, HttpPoolStats& stats)
+    : inner_{inner}
+    , stats_{stats} {
+  }
+
+  kj::Promise<kj::Own<kj::NetworkAddress>> parseAddress(
+      kj::StringPtr addr, uint portHint) override {
+    return
+      inner_.parseAddress(addr, portHint)
+      .then(
+        [this](auto address) -> kj::Own<kj::NetworkAddress> {
+          return kj::heap<CountingAddress>(kj::mv(address), stats_);
+        }
+      );
+  }
+
+  kj::Own<kj::NetworkAddress> getSockaddr(const void* sockaddr, uint len) override {
+    return kj::heap<CountingAddress>(inner_.getSockaddr(sockaddr, len), stats_);
+  }
+
+  kj::Own<kj::Network> restrictPeers(
+      kj::ArrayPtr<const kj::StringPtr> allow,
+      kj::ArrayPtr<const kj::StringPtr> deny) override {
+    auto inner = inner_.restrictPeers(allow, deny);
+    auto& ref = *inner;
+    return kj::heap<CountingNetwork>(ref, stats_).attach(kj::mv(inner));
+  }
+
+private:
+  kj::Network& inner_;
+  HttpPoolStats& stats_;
+};
+
+struct HttpPool
+  : kj::HttpClient {
+
+  HttpPool(
+      kj::Timer& timer,
+      const kj::HttpHeaderTable& table,
+      kj::Network& network,
+      kj::Maybe<kj::Network&> tlsNetwork,
+      const HttpPoolOptions& options,
+      kj::Maybe<HttpPoolStats&> stats)
+    : options_{options}
+    , stats_{stats} {
+
+    kj::HttpClientSettings settings;
+    settings.idleTimeout = options_.idleTimeout;
+
+    KJ_IF_MAYBE(s, stats) {
+      kj::Maybe<kj::Network&> countedTls;
+      network_ = kj::heap<CountingNetwork>(network, *s);
+      KJ_IF_MAYBE(tls, tlsNetwork) {
+        tlsNetwork_ = kj::heap<CountingNetwork>(*tls, *s);
+        countedTls = *tlsNetwork_;
+      }
+      inner_ = kj::newHttpClient(timer, table, *network_, countedTls, kj::mv(settings));
+    }
+    else {
+      inner_ = kj::newHttpClient(timer, table, network, tlsNetwork, kj::mv(settings));
+    }
+  }
+
+  Request request(
+      kj::HttpMethod method, kj::StringPtr url, const kj::HttpHeaders& headers,
+      kj::Maybe<uint64_t> expectedBodySize = nullptr) override {
+    KJ_IF_MAYBE(s, stats_) {
+      ++s->requests;
+    }
+    return forHost(url, headers).request(method, url, headers, expectedBodySize);
+  }
+
+private:
+  kj::HttpClient& forHost(kj::StringPtr url, const kj::HttpHeaders& headers) {
+    auto find = [&](kj::StringPtr host) -> kj::HttpClient& {
+      using Entry = kj::HashMap<kj::String, kj::Own<kj::HttpClient>>::Entry;
+      return *hosts_.findOrCreate(host, [&]() -> Entry {
+        return {
+          kj::str(host),
+          kj::newConcurrencyLimitingHttpClient(
+            *inner_, options_.maxConnectionsPerHost, [](uint, uint) {}
+          )
+        };
+      });
+    };
+
+    KJ_IF_MAYBE(host, headers.get(kj::HttpHeaderId::HOST)) {
+      return find(*host);
+    }
+    else {
+      return find(kj::Url::parse(url).host);
+    }
+  }
+
+  HttpPoolOptions options_;
+  kj::Maybe<HttpPoolStats&> stats_;
+  kj::Own<kj::Network> network_;
+  kj::Own<kj::Network> tlsNetwork_;
+  kj::Own<kj::HttpClient> inner_;
+  kj::HashMap<kj::String, kj::Own<kj::HttpClient>> hosts_;
+};
+
+}
+
+kj::Own<kj::HttpClient> newHttpPool(
+    kj::Timer& timer,
+    const kj::HttpHeaderTable& table,
+    kj::Network& network,
+    kj::Maybe<kj::Network&> tlsNetwork,
+    const HttpPoolOptions& options,
+    kj::Maybe<HttpPoolStats&> stats) {
+  return kj::heap<HttpPool>(timer, table, network, tlsNetwork, options, stats);
+}
+
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+// Copyright (c) 2023 Vaci Koblizek.
+// Licensed under the Apache 2.0 license found in the LICENSE file or at:
+//     https://opensource.org/licenses/Apache-2.0
+
+#include <kj/async-io.h>
+#include <kj/compat/http.h>
+
+namespace aws {
+
+struct HttpPoolOptions {
+  // Requests beyond this many to a single host are queued until a
+  // connection to that host becomes free.
+  uint32_t maxConnectionsPerHost = 16;
+
+  // Idle keep-alive connections are closed after this long.
+  kj::Duration idleTimeout = 60 * kj::SECONDS;
+};
+
+struct HttpPoolStats {
+  uint64_t requests = 0;
+  uint64_t opened = 0;
+  uint64_t closed = 0;
+
+  // Every request either opens a new connection or reuses one.
+  uint64_t reused() const {
+    return requests > opened ? requests - opened : 0;
+  }
+};
+
+// An HttpClient that keeps a pool of keep-alive connections per host,
+// optionally recording connection counts in `stats`.
+kj::Own<kj::HttpClient> newHttpPool(
+  kj::Timer&,
+  const kj::HttpHeaderTable&,
+  kj::Network& network,
+  kj::Maybe<kj::Network&> tlsNetwork,
+  const HttpPoolOptions& = {},
+  kj::Maybe<HttpPoolStats&> stats = nullptr
+);
+
+}
@@ -4,6 +4,7 @@
 
 #include "http.h"
 
+#include "common.h"
 #include "hash.h"
 #include "sha256.h"
 
@@ -12,8 +13,10 @@
 #include <kj/compat/tls.h>
 #include <kj/compat/url.h>
 #include <kj/debug.h>
+#include <kj/encoding.h>
 #include <kj/main.h>
 #include <kj/string-tree.h>
+#include <kj/vector.h>
 
 #include <aws/core/Aws.h>
 #include <aws/core/auth/AWSCredentialsProviderChain.h>
@@ -49,6 +52,218 @@ struct HttpTest
 TEST_F(HttpTest, Basic2) {
 }
 
+TEST_F(HttpTest, AmzDate) {
+  auto check = [](int64_t seconds, kj::StringPtr expected) {
+    auto txt = amzDate(kj::UNIX_EPOCH + seconds * kj::SECONDS);
+    EXPECT_EQ(kj::StringPtr(txt.begin(), txt.size() - 1), expected);
+  };
+  check(0, "19700101T000000Z"_kj);
+  check(1369353600, "20130524T000000Z"_kj);
+  check(951825599, "20000229T115959Z"_kj);
+  check(4102444799, "20991231T235959Z"_kj);
+}
+
+namespace {
+
+Digest exampleSigningKey() {
+  HashContext hashCtx;
+  auto key = hashCtx.hash(
+    "AWS4wJalrXUtnFEMI/K7MDENG/bPxRfiCYEXAMPLEKEY"_kj.asBytes(), "20130524"_kj);
+  for (auto part: {"us-east-1"_kj, "s3"_kj, "aws4_request"_kj}) {
+    key = hashCtx.hash(key, part);
+  }
+  return key;
+}
+
+constexpr auto EXAMPLE_SEED_SIGNATURE =
+  "4f232c4386841ef735655705268965c44a0e4690baa4adea153f7db9fa80a0a9"_kj;
+
+}
+
+TEST_F(HttpTest, ChunkedSigning) {
+  // the example from the S3 documentation of
+  // STREAMING-AWS4-HMAC-SHA256-PAYLOAD
+  auto data = kj::heapString(66560);
+  memset(data.begin(), 'a', data.size());
+
+  AwsServiceOptions options;
+  options.payloadSigning = PayloadSigning::STREAMING;
+  options.chunkSize = 64 * 1024;
+
+  auto pipe = kj::newOneWayPipe(data.size());
+  auto stream = newChunkedSigningStream(
+    *pipe.in, data.size(), options,
+    "20130524T000000Z"_kj, "20130524/us-east-1/s3/aws4_request"_kj,
+    exampleSigningKey(), EXAMPLE_SEED_SIGNATURE);
+
+  auto write =
+    pipe.out->write(data.begin(), data.size())
+    .then([&]{ pipe.out = nullptr; });
+  auto encoded = stream->readAllBytes().wait(waitScope_);
+  write.wait(waitScope_);
+
+  auto expected = kj::str(
+    "10000;chunk-signature=ad80c730a21e5b8d04586a2213dd63b9a0e99e0e2307b0ade35a65485a288648\r\n"_kj,
+    data.slice(0, 65536), "\r\n"_kj,
+    "400;chunk-signature=0055627c9e194cb4542bae2aa5492e3c1575bbb81b612b7d234b86a503ef5497\r\n"_kj,
+    data.slice(65536), "\r\n"_kj,
+    "0;chunk-signature=b6c6ea8a5354eaf15b3cb7646744f4275b71ea724fed81ceb9323e279d449df9\r\n\r\n"_kj);
+
+  EXPECT_EQ(KJ_ASSERT_NONNULL(stream->tryGetLength()), 66824u);
+  EXPECT_EQ(encoded.size(), expected.size());
+  EXPECT_TRUE(encoded.asPtr() == expected.asBytes());
+}
+
+TEST_F(HttpTest, ChunkedSigningTrailer) {
+  // no NULs, so that the framing can be searched as a string
+  auto data = kj::heapArray<kj::byte>(20000);
+  for (auto ii: kj::indices(data)) {
+    data[ii] = 1 + ii % 250;
+  }
+
+  AwsServiceOptions options;
+  options.payloadSigning = PayloadSigning::STREAMING_TRAILER;
+  options.chunkSize = 8192;
+
+  auto pipe = kj::newOneWayPipe(data.size());
+  auto stream = newChunkedSigningStream(
+    *pipe.in, data.size(), options,
+    "20130524T000000Z"_kj, "20130524/us-east-1/s3/aws4_request"_kj,
+    exampleSigningKey(), EXAMPLE_SEED_SIGNATURE);
+
+  auto write =
+    pipe.out->write(data.begin(), data.size())
+    .then([&]{ pipe.out = nullptr; });
+  auto encoded = stream->readAllBytes().wait(waitScope_);
+  write.wait(waitScope_);
+
+  EXPECT_EQ(KJ_ASSERT_NONNULL(stream->tryGetLength()), encoded.size());
+
+  auto txt = kj::heapString(encoded.asChars());
+  auto checksum = kj::str(
+    "\r\nx-amz-checksum-sha256:"_kj, kj::encodeBase64(hash::sha256(data)), "\r\n"_kj);
+  EXPECT_TRUE(strstr(txt.cStr(), checksum.cStr()) != nullptr);
+  EXPECT_TRUE(strstr(txt.cStr(), "\r\nx-amz-trailer-signature:") != nullptr);
+  EXPECT_TRUE(txt.endsWith("\r\n\r\n"));
+}
+
+namespace {
+
+struct StaticCredentials
+  : Credentials::Provider::Server {
+
+  kj::Promise<void> getCredentials(GetCredentialsContext ctx) override {
+    auto reply = ctx.getResults();
+    reply.setAccessKey("key");
+    reply.setSecretKey("secret");
+    reply.setSessionToken("token");
+    return kj::READY_NOW;
+  }
+};
+
+// Answers CreateSession with fixed session credentials, and records
+// how every other request was signed.
+struct FakeExpress
+  : kj::HttpService {
+
+  FakeExpress(kj::HttpHeaderTable::Builder& builder)
+    : table_{builder.getFutureTable()}
+    , auth_{builder.add("authorization")}
+    , sessionToken_{builder.add("x-amz-s3session-token")}
+    , securityToken_{builder.add("X-Amz-Security-Token")} {
+  }
+
+  kj::Promise<void> request(
+      kj::HttpMethod method,
+      kj::StringPtr url,
+      const kj::HttpHeaders& headers,
+      kj::AsyncInputStream& body,
+      Response& response) override {
+
+    auto get = [&](kj::HttpHeaderId id) {
+      KJ_IF_MAYBE(value, headers.get(id)) {
+	return kj::str(*value);
+      }
+      return kj::String{};
+    };
+
+    auto txt = ""_kj;
+    if (url.endsWith("/?session"_kj)) {
+      sessionAuths_.add(get(auth_));
+      EXPECT_EQ(get(securityToken_), "token"_kj);
+      txt =
+	"<CreateSessionResult><Credentials>"
+	"<SessionToken>session-token</SessionToken>"
+	"<SecretAccessKey>session-secret</SecretAccessKey>"
+	"<AccessKeyId>session-key</AccessKeyId>"
+	"<Expiration>2099-01-01T00:00:00Z</Expiration>"
+	"</Credentials></CreateSessionResult>"_kj;
+    }
+    else {
+      auths_.add(get(auth_));
+      EXPECT_EQ(get(sessionToken_), "session-token"_kj);
+      EXPECT_EQ(get(securityToken_), ""_kj);
+    }
+
+    return
+      body.readAllBytes()
+      .then(
+	[this, txt, &response](auto) {
+	  kj::HttpHeaders headers{table_};
+	  auto stream = response.send(200, "OK", headers, txt.size());
+	  auto& s = *stream;
+	  return s.write(txt.begin(), txt.size()).attach(kj::mv(stream));
+	}
+      );
+  }
+
+  kj::HttpHeaderTable& table_;
+  kj::HttpHeaderId auth_;
+  kj::HttpHeaderId sessionToken_;
+  kj::HttpHeaderId securityToken_;
+  kj::Vector<kj::String> sessionAuths_;
+  kj::Vector<kj::String> auths_;
+};
+
+}
+
+TEST_F(HttpTest, ExpressSession) {
+  auto host = bucketHost("shuffle--usw2-az1--x-s3"_kj, "us-west-2"_kj);
+  EXPECT_EQ(host, "shuffle--usw2-az1--x-s3.s3express-usw2-az1.us-west-2.amazonaws.com"_kj);
+  EXPECT_EQ(bucketHost("bucket"_kj, "us-west-2"_kj), "bucket.s3.us-west-2.amazonaws.com"_kj);
+
+  kj::HttpHeaderTable::Builder builder;
+  FakeExpress express{builder};
+  auto service = newAwsService(
+    kj::systemPreciseCalendarClock(), express, builder,
+    kj::heap<StaticCredentials>(), "s3", "us-west-2");
+  auto table = builder.build();
+  auto client = kj::newHttpClient(*service);
+
+  for (auto ii: kj::zeroTo(2)) {
+    kj::HttpHeaders headers{*table};
+    headers.set(kj::HttpHeaderId::HOST, host);
+    auto url = kj::str("https://"_kj, host, "/key"_kj, ii);
+    auto req = client->request(kj::HttpMethod::GET, url, headers);
+    auto response = req.response.wait(waitScope_);
+    EXPECT_EQ(response.statusCode, 200);
+    response.body->readAllBytes().wait(waitScope_);
+  }
+
+  // one session, created with the long-term credentials
+  ASSERT_EQ(express.sessionAuths_.size(), 1);
+  auto& sessionAuth = express.sessionAuths_[0];
+  EXPECT_TRUE(sessionAuth.startsWith("AWS4-HMAC-SHA256 Credential=key/"_kj));
+  EXPECT_TRUE(strstr(sessionAuth.cStr(), "/us-west-2/s3express/aws4_request") != nullptr);
+
+  ASSERT_EQ(express.auths_.size(), 2);
+  for (auto& auth: express.auths_) {
+    EXPECT_TRUE(auth.startsWith("AWS4-HMAC-SHA256 Credential=session-key/"_kj));
+    EXPECT_TRUE(strstr(auth.cStr(), "/us-west-2/s3express/aws4_request") != nullptr);
+    EXPECT_TRUE(strstr(auth.cStr(), "x-amz-s3session-token") != nullptr);
+  }
+}
+
 int main(int argc, char* argv[]) {
   kj::TopLevelProcessContext processCtx{argv[0]};
   processCtx.increaseLoggingVerbosity();
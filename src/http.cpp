@@ -3,41 +3,388 @@
 #include "s3.capnp.h"
 
 #include "common.h"
+#include "creds.h"
 #include "hash.h"
 #include "sha256.h"
 #include "uuid.h"
+#include "xml.h"
 
 #include <kj/debug.h>
 #include <kj/encoding.h>
-#include <kj/compat/url.h>
+#include <kj/vector.h>
+
+#include <algorithm>
+#include <cstring>
 
 namespace aws {
 
+namespace {
+
+// Frames a request body as aws-chunked, signing each chunk in a chain
+// seeded by the request's signature. Chunks are hashed as they are
+// read from the body, and only one is held at a time.
+struct ChunkedSigningStream
+  : kj::AsyncInputStream {
+
+  ChunkedSigningStream(
+    kj::AsyncInputStream& body,
+    uint64_t length,
+    size_t chunkSize,
+    bool trailer,
+    kj::StringPtr date,
+    kj::StringPtr scope,
+    kj::ArrayPtr<const unsigned char> signingKey,
+    kj::StringPtr seedSignature);
+
+  // The length of `length` bytes of body once framed.
+  static uint64_t encodedLength(uint64_t length, size_t chunkSize, bool trailer);
+
+  kj::Maybe<uint64_t> tryGetLength() override {
+    return encodedLength_;
+  }
+
+  kj::Promise<size_t> tryRead(void* buffer, size_t minBytes, size_t maxBytes) override;
+
+private:
+  // Room for a chunk's size and signature ahead of its data.
+  static constexpr size_t HEADER_SPACE = 128;
+  // Room for the final chunk's trailers.
+  static constexpr size_t TRAILER_SPACE = 256;
+
+  kj::Promise<void> readChunk(kj::ArrayPtr<kj::byte> data, size_t filled);
+  void frame(kj::ArrayPtr<kj::byte> data);
+  kj::String sign(kj::StringPtr algorithm, kj::StringPtr hashes);
+
+  kj::AsyncInputStream& body_;
+  uint64_t remaining_;
+  uint64_t encodedLength_;
+  size_t chunkSize_;
+  kj::String date_;
+  kj::String scope_;
+  KeyedHashContext signer_;
+  kj::String signature_;
+
+  kj::Own<hash::Sha256> chunkHash_{hash::newSha256()};
+  kj::Maybe<kj::Own<hash::Sha256>> checksum_;
+
+  kj::Array<kj::byte> buffer_;
+  kj::ArrayPtr<const kj::byte> pending_;
+  bool done_{false};
+};
+
+ChunkedSigningStream::ChunkedSigningStream(
+    kj::AsyncInputStream& body,
+    uint64_t length,
+    size_t chunkSize,
+    bool trailer,
+    kj::StringPtr date,
+    kj::StringPtr scope,
+    kj::ArrayPtr<const unsigned char> signingKey,
+    kj::StringPtr seedSignature)
+  : body_{body}
+  , remaining_{length}
+  , encodedLength_{encodedLength(length, chunkSize, trailer)}
+  , chunkSize_{chunkSize}
+  , date_{kj::str(date)}
+  , scope_{kj::str(scope)}
+  , signer_{HashContext{}.withKey(signingKey)}
+  , signature_{kj::str(seedSignature)}
+  , buffer_{kj::heapArray<kj::byte>(HEADER_SPACE + kj::max(chunkSize, TRAILER_SPACE) + 2)} {
+
+  KJ_REQUIRE(chunkSize > 0);
+  if (trailer) {
+    checksum_ = hash::newSha256();
+  }
+}
+
+uint64_t ChunkedSigningStream::encodedLength(
+    uint64_t length, size_t chunkSize, bool trailer) {
+
+  // <hex size>;chunk-signature=<signature>\r\n<data>\r\n
+  auto chunkLength = [](uint64_t size) -> uint64_t {
+    return kj::hex(size).size() + ";chunk-signature="_kj.size() + 64 + 2 + size + 2;
+  };
+
+  auto total =
+    (length / chunkSize) * chunkLength(chunkSize) +
+    (length % chunkSize ? chunkLength(length % chunkSize) : 0);
+
+  if (trailer) {
+    // 0;chunk-signature=<signature>\r\n
+    // x-amz-checksum-sha256:<base64>\r\n
+    // x-amz-trailer-signature:<signature>\r\n\r\n
+    total += chunkLength(0) - 2;
+    total += "x-amz-checksum-sha256:"_kj.size() + 44 + 2;
+    total += "x-amz-trailer-signature:"_kj.size() + 64 + 4;
+  }
+  else {
+    total += chunkLength(0);
+  }
+  return total;
+}
+
+kj::Promise<size_t> ChunkedSigningStream::tryRead(
+    void* buffer, size_t minBytes, size_t maxBytes) {
+
+  auto out = reinterpret_cast<kj::byte*>(buffer);
+  auto count = kj::min(pending_.size(), maxBytes);
+  memcpy(out, pending_.begin(), count);
+  pending_ = pending_.slice(count, pending_.size());
+
+  if (count >= minBytes || (pending_.size() == 0 && done_)) {
+    return count;
+  }
+
+  auto size = kj::min(remaining_, chunkSize_);
+  return
+    readChunk(buffer_.slice(HEADER_SPACE, HEADER_SPACE + size), 0)
+    .then(
+      [this, out, count, minBytes, maxBytes] {
+	return
+	  tryRead(out + count, minBytes - count, maxBytes - count)
+	  .then(
+	    [count](size_t n) {
+	      return count + n;
+	    }
+	  );
+      }
+    );
+}
+
+kj::Promise<void> ChunkedSigningStream::readChunk(
+    kj::ArrayPtr<kj::byte> data, size_t filled) {
+
+  if (filled == data.size()) {
+    frame(data);
+    return kj::READY_NOW;
+  }
+
+  return
+    body_.tryRead(data.begin() + filled, 1, data.size() - filled)
+    .then(
+      [this, data, filled](size_t n) {
+	KJ_REQUIRE(n > 0, "Request body ended early", remaining_ - filled);
+	auto piece = data.slice(filled, filled + n);
+	chunkHash_->update(piece);
+	KJ_IF_MAYBE(checksum, checksum_) {
+	  (*checksum)->update(piece);
+	}
+	return readChunk(data, filled + n);
+      }
+    );
+}
+
+void ChunkedSigningStream::frame(kj::ArrayPtr<kj::byte> data) {
+  auto chunkHash = kj::encodeHex(chunkHash_->digest());
+  chunkHash_ = hash::newSha256();
+
+  auto signature = sign(
+    "AWS4-HMAC-SHA256-PAYLOAD"_kj,
+    kj::str(hash::EMPTY_STRING_SHA256, '\n', chunkHash));
+
+  // the header goes immediately before the data, which was read into
+  // place, so that the framed chunk is contiguous
+  auto header = kj::str(kj::hex(data.size()), ";chunk-signature="_kj, signature, "\r\n"_kj);
+  KJ_ASSERT(header.size() <= HEADER_SPACE);
+  auto begin = data.begin() - header.size();
+  memcpy(begin, header.begin(), header.size());
+
+  auto end = data.end();
+  auto append = [&](kj::StringPtr txt) {
+    memcpy(end, txt.begin(), txt.size());
+    end += txt.size();
+  };
+
+  if (data.size()) {
+    remaining_ -= data.size();
+    append("\r\n"_kj);
+  }
+  else KJ_IF_MAYBE(checksum, checksum_) {
+    auto trailer = kj::str(
+      "x-amz-checksum-sha256:"_kj, kj::encodeBase64((*checksum)->digest()));
+    auto trailerHash = hash::newSha256();
+    trailerHash->update(trailer);
+    trailerHash->update("\n"_kj);
+    auto trailerSignature = sign(
+      "AWS4-HMAC-SHA256-TRAILER"_kj, kj::encodeHex(trailerHash->digest()));
+
+    KJ_ASSERT(trailer.size() + trailerSignature.size() + 32 <= TRAILER_SPACE);
+    append(trailer);
+    append("\r\nx-amz-trailer-signature:"_kj);
+    append(trailerSignature);
+    append("\r\n\r\n"_kj);
+    done_ = true;
+  }
+  else {
+    append("\r\n"_kj);
+    done_ = true;
+  }
+
+  pending_ = kj::arrayPtr(begin, end);
+}
+
+kj::String ChunkedSigningStream::sign(
+    kj::StringPtr algorithm, kj::StringPtr hashes) {
+
+  signer_.begin();
+  for (kj::StringPtr piece: {algorithm, date_.asPtr(), scope_.asPtr(), signature_.asPtr()}) {
+    signer_.update(piece);
+    signer_.update("\n"_kj);
+  }
+  signer_.update(hashes);
+
+  signature_ = kj::encodeHex(signer_.finish());
+  return kj::str(signature_);
+}
+
+}
+
+namespace {
+
+kj::FixedArray<char, 65> hexDigest(const Digest& digest) {
+  constexpr char HEX[] = "0123456789abcdef";
+  kj::FixedArray<char, 65> txt;
+  for (auto ii: kj::indices(digest)) {
+    txt[2 * ii] = HEX[digest[ii] >> 4];
+    txt[2 * ii + 1] = HEX[digest[ii] & 0x0f];
+  }
+  txt[64] = '\0';
+  return txt;
+}
+
+int fromHex(char c) {
+  if ('0' <= c && c <= '9') return c - '0';
+  if ('a' <= c && c <= 'f') return c - 'a' + 10;
+  if ('A' <= c && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+// Percent-decodes `txt` into `out`, encoded again as SigV4 canonical
+// requests want: everything but the RFC 3986 unreserved characters is
+// percent-encoded, except '/' in a path. In a query, '+' is a space.
+// `out` needs three bytes for every byte of `txt`.
+size_t canonicalEncode(kj::ArrayPtr<const char> txt, char* out, bool path) {
+  constexpr char HEX[] = "0123456789ABCDEF";
+  auto begin = out;
+  for (size_t ii = 0; ii < txt.size(); ++ii) {
+    auto c = txt[ii];
+    if (c == '%' && ii + 2 < txt.size() && fromHex(txt[ii + 1]) >= 0 && fromHex(txt[ii + 2]) >= 0) {
+      c = static_cast<char>(fromHex(txt[ii + 1]) << 4 | fromHex(txt[ii + 2]));
+      ii += 2;
+    }
+    else if (c == '+' && !path) {
+      c = ' ';
+    }
+
+    if (('A' <= c && c <= 'Z') || ('a' <= c && c <= 'z') || ('0' <= c && c <= '9') ||
+        c == '-' || c == '_' || c == '.' || c == '~' || (path && c == '/')) {
+      *out++ = c;
+    }
+    else {
+      auto byte = static_cast<kj::byte>(c);
+      *out++ = '%';
+      *out++ = HEX[byte >> 4];
+      *out++ = HEX[byte & 0x0f];
+    }
+  }
+  return out - begin;
+}
+
+}
+
 struct AwsService
   : kj::HttpService {
 
-  constexpr static kj::StringPtr signedHeaders =
-    "amz-sdk-invocation-id;"
-    "amz-sdk-request;host;"
-    "x-amz-content-sha256;"
-    "x-amz-date"_kj;
-
   AwsService(
     const kj::Clock& clock,
     kj::HttpService& proxy,
     kj::HttpHeaderTable::Builder& builder,
-    Credentials::Provider::Client, kj::StringPtr, kj::StringPtr);
+    Credentials::Provider::Client, kj::StringPtr, kj::StringPtr,
+    const AwsServiceOptions&);
+
+  // The parts of a request target that are signed, still
+  // percent-encoded as they were sent.
+  struct Target {
+    kj::ArrayPtr<const char> path_;
+    kj::ArrayPtr<const char> query_;
+  };
 
-  kj::String hashRequest(
+  // Splits an absolute URL or an origin-form target in place.
+  static Target splitUrl(kj::StringPtr url);
+
+  // Lists, separated by ';', the signable headers that are present,
+  // in `buffer`.
+  kj::StringPtr signedHeaders(
+    const kj::HttpHeaders& headers,
+    kj::ArrayPtr<char> buffer);
+
+  // Hashes the canonical request, streaming it into the hasher as it
+  // is built rather than assembling it first.
+  kj::FixedArray<char, 65> hashRequest(
     kj::HttpMethod method,
-    kj::StringPtr urlTxt,
-    const kj::HttpHeaders& headers);
+    const Target& target,
+    const kj::HttpHeaders& headers,
+    kj::StringPtr signedHeaders);
+
+  // The x-amz-date for `date`, formatted at most once a second.
+  kj::StringPtr amzDate(kj::Date date);
 
   kj::Promise<void> request(
     kj::HttpMethod,
     kj::StringPtr,
     const kj::HttpHeaders&, kj::AsyncInputStream&, Response&) override;
 
+  struct SigningKey {
+    kj::String secretKey_;
+    kj::String ymd_;
+    Digest key_;
+    KeyedHashContext signer_;
+  };
+
+  // The credential scope of one service name, and the signing key of
+  // the credentials it last signed with.
+  struct Signer {
+    kj::StringPtr service_;
+    kj::String scope_;
+    kj::Maybe<SigningKey> key_;
+  };
+
+  Signer newSigner(kj::StringPtr service);
+
+  // Returns the SigV4 signing key for the given secret and date,
+  // deriving it only when either has changed since the last request.
+  SigningKey& getSigningKey(
+    Signer&,
+    kj::StringPtr secretKey,
+    kj::ArrayPtr<const char> ymd);
+
+  // Signs a request with `creds` and sends it to the proxy, with the
+  // credentials' session token, if any, in `tokenHeader`.
+  kj::Promise<void> send(
+    Signer&,
+    kj::Own<const CachedCredentials> creds,
+    kj::HttpHeaderId tokenHeader,
+    kj::HttpMethod,
+    kj::StringPtr,
+    const kj::HttpHeaders&, kj::AsyncInputStream&, Response&);
+
+  // An S3 Express One Zone directory bucket is signed with the
+  // credentials of a session created for it, which come back with
+  // their expiration and so are cached and refreshed ahead of time
+  // like any others, and with a signing key of their own.
+  struct Session {
+    kj::Own<CredentialsCache> creds_;
+    Signer signer_;
+  };
+
+  // The session of the directory bucket at the request's host, if it
+  // is one, creating it on first use.
+  kj::Maybe<Session&> session(const kj::HttpHeaders&);
+
+  // Sends CreateSession requests, signed with the long-term
+  // credentials.
+  kj::HttpClient& sessionClient();
+
   const kj::Clock& clock_;
 
   struct {
@@ -45,18 +392,45 @@ struct AwsService
     kj::HttpHeaderId amzSdkInvocationId;
     kj::HttpHeaderId amzSdkRequest;
     kj::HttpHeaderId auth;
+    kj::HttpHeaderId contentEncoding;
     kj::HttpHeaderId xAmzContentSha256;
     kj::HttpHeaderId xAmzDate;
+    kj::HttpHeaderId xAmzDecodedContentLength;
+    kj::HttpHeaderId xAmzS3SessionToken;
     kj::HttpHeaderId xAmzSecurityToken;
+    kj::HttpHeaderId xAmzTrailer;
   } ids_;
 
+  // Headers that are signed when present, sorted by name as SigV4
+  // requires.
+  struct SignedHeader {
+    kj::StringPtr name_;
+    kj::HttpHeaderId id_;
+  };
+
+  kj::Array<SignedHeader> signable_;
+
   kj::HttpHeaderTable& table_;
   kj::HttpService& proxy_;
-  Credentials::Provider::Client credsProvider_;
+  kj::Own<CredentialsCache> creds_;
 
-  kj::StringPtr service_;
   kj::StringPtr region_;
-  kj::String scope_;
+  AwsServiceOptions options_;
+
+  HashContext hashCtx_;
+  Signer signer_;
+  Signer sessionSigner_;
+  kj::Own<hash::Sha256> requestHash_{hash::newSha256()};
+
+  // by host
+  kj::HashMap<kj::String, kj::Own<Session>> sessions_;
+  kj::Maybe<kj::Own<kj::HttpService>> sessionService_;
+  kj::Maybe<kj::Own<kj::HttpClient>> sessionClient_;
+
+  struct {
+    int64_t second_ = -1;
+    kj::FixedArray<char, 17> txt_;
+  } date_;
 };
   
 AwsService::AwsService(
@@ -64,23 +438,44 @@ AwsService::AwsService(
     kj::HttpService& proxy,
     kj::HttpHeaderTable::Builder& builder,
     Credentials::Provider::Client credsProvider,
-    kj::StringPtr service, kj::StringPtr region)
+    kj::StringPtr service, kj::StringPtr region,
+    const AwsServiceOptions& options)
   : clock_{clock}
   , ids_{
       .accept{builder.add("accept")},
       .amzSdkInvocationId{builder.add("amz-sdk-invocation-id")},
       .amzSdkRequest{builder.add("amz-sdk-request")},
       .auth{builder.add("authorization")},
+      .contentEncoding{builder.add("content-encoding")},
       .xAmzContentSha256{builder.add("x-amz-content-sha256")},
       .xAmzDate{builder.add("x-amz-date")},
-      .xAmzSecurityToken{builder.add("X-Amz-Security-Token")}
+      .xAmzDecodedContentLength{builder.add("x-amz-decoded-content-length")},
+      .xAmzS3SessionToken{builder.add("x-amz-s3session-token")},
+      .xAmzSecurityToken{builder.add("X-Amz-Security-Token")},
+      .xAmzTrailer{builder.add("x-amz-trailer")}
     }
+  , signable_{kj::heapArray<SignedHeader>({
+      {"amz-sdk-invocation-id"_kj, ids_.amzSdkInvocationId},
+      {"amz-sdk-request"_kj, ids_.amzSdkRequest},
+      {"content-encoding"_kj, ids_.contentEncoding},
+      {"host"_kj, kj::HttpHeaderId::HOST},
+      {"x-amz-content-sha256"_kj, ids_.xAmzContentSha256},
+      {"x-amz-date"_kj, ids_.xAmzDate},
+      {"x-amz-decoded-content-length"_kj, ids_.xAmzDecodedContentLength},
+      {"x-amz-s3session-token"_kj, ids_.xAmzS3SessionToken},
+      {"x-amz-trailer"_kj, ids_.xAmzTrailer}
+    })}
   , table_{builder.getFutureTable()}
   , proxy_{proxy}
-  , credsProvider_{kj::mv(credsProvider)}
-  , service_{service}
+  , creds_{newCredentialsCache(clock, kj::mv(credsProvider))}
   , region_{region}
-  , scope_{kj::str('/', region_, '/', service_, "/aws4_request"_kj)} {
+  , options_{options}
+  , signer_{newSigner(service)}
+  , sessionSigner_{newSigner("s3express"_kj)} {
+}
+
+AwsService::Signer AwsService::newSigner(kj::StringPtr service) {
+  return {service, kj::str('/', region_, '/', service, "/aws4_request"_kj), nullptr};
 }
 
 kj::Promise<void> AwsService::request(
@@ -92,135 +487,495 @@ kj::Promise<void> AwsService::request(
 
   KJ_DREQUIRE(table_.isReady());
 
+  KJ_IF_MAYBE(session, this->session(requestHeaders)) {
+    return
+      session->creds_->getCredentials()
+      .then(
+	[this, &signer = session->signer_, method, url, &requestHeaders, &body, &response](auto creds) {
+	  return send(
+	    signer, kj::mv(creds), ids_.xAmzS3SessionToken,
+	    method, url, requestHeaders, body, response);
+	}
+      );
+  }
+
   return
-    credsProvider_.getCredentialsRequest().send()
+    creds_->getCredentials()
     .then(
-      [this, method, url, &requestHeaders, &body, &response](auto creds) mutable {
-	auto id = uuid::random();
-	auto date = clock_.now();
-	auto ds = dateStr(date, "%Y%m%dT%H%M%SZ"_kj);
-	auto ymd = ds.slice(0, 8);
-	auto contentHash = "UNSIGNED-PAYLOAD"_kj;
-
-	KJ_IF_MAYBE(length, body.tryGetLength()) {
-	  if (length == 0u) {
-	    contentHash = hash::EMPTY_STRING_SHA256;
-	  }
-	}
+      [this, method, url, &requestHeaders, &body, &response](auto creds) {
+	return send(
+	  signer_, kj::mv(creds), ids_.xAmzSecurityToken,
+	  method, url, requestHeaders, body, response);
+      }
+    );
+}
+
+kj::Promise<void> AwsService::send(
+    Signer& signer,
+    kj::Own<const CachedCredentials> creds,
+    kj::HttpHeaderId tokenHeader,
+    kj::HttpMethod method,
+    kj::StringPtr url,
+    const kj::HttpHeaders& requestHeaders,
+    kj::AsyncInputStream& body,
+    Response& response) {
+
+  // The proxy consumes the headers before returning, so their
+  // values can live on the stack.
+  auto id = uuid::randomText();
+  auto ds = amzDate(clock_.now());
+  auto ymd = ds.slice(0, 8);
+  auto contentHash = "UNSIGNED-PAYLOAD"_kj;
+  auto headers = requestHeaders.cloneShallow();
+
+  auto streaming = false;
+  auto trailer = options_.payloadSigning == PayloadSigning::STREAMING_TRAILER;
+  kj::FixedArray<char, 21> lengthBuffer;
+  KJ_IF_MAYBE(length, body.tryGetLength()) {
+    if (*length == 0u) {
+      contentHash = hash::EMPTY_STRING_SHA256;
+    }
+    else if (options_.payloadSigning != PayloadSigning::UNSIGNED) {
+      streaming = true;
+      contentHash = trailer
+	? "STREAMING-AWS4-HMAC-SHA256-PAYLOAD-TRAILER"_kj
+	: "STREAMING-AWS4-HMAC-SHA256-PAYLOAD"_kj;
+      // any encoding of the object itself follows the framing's
+      KJ_IF_MAYBE(encoding, requestHeaders.get(ids_.contentEncoding)) {
+	headers.set(ids_.contentEncoding, kj::str("aws-chunked,"_kj, *encoding));
+      }
+      else {
+	headers.set(ids_.contentEncoding, "aws-chunked");
+      }
+      headers.set(ids_.xAmzDecodedContentLength, kj::strPreallocated(lengthBuffer, *length));
+      if (trailer) {
+	headers.set(ids_.xAmzTrailer, "x-amz-checksum-sha256");
+      }
+    }
+  }
+
+  headers.set(ids_.amzSdkInvocationId, kj::StringPtr{id.begin(), id.size() - 1});
+  if (headers.get(ids_.amzSdkRequest) == nullptr) {
+    // retries set their own attempt number
+    headers.set(ids_.amzSdkRequest, "attempt=1");
+  }
+  headers.set(ids_.xAmzDate, ds);
+  headers.set(ids_.xAmzContentSha256, contentHash);
+  {
+    auto& sessionToken = creds->sessionToken_;
+    if (sessionToken.size()) {
+      headers.set(tokenHeader, sessionToken);
+    }
+  }
+
+  kj::FixedArray<char, 256> namesBuffer;
+  auto names = signedHeaders(headers, namesBuffer);
+  auto& signingKey = getSigningKey(signer, creds->secretKey_, ymd);
+  auto& scope = signer.scope_;
+  auto signature = [&]{
+    auto requestHash = hashRequest(method, splitUrl(url), headers, names);
+
+    // the string to sign is fed to the MAC as it is
+    auto& mac = signingKey.signer_;
+    mac.begin();
+    mac.update("AWS4-HMAC-SHA256\n"_kj);
+    mac.update(ds);
+    mac.update("\n"_kj);
+    mac.update(ymd.asBytes());
+    mac.update(scope);
+    mac.update("\n"_kj);
+    mac.update(requestHash.slice(0, 64).asBytes());
+    return hexDigest(mac.finish());
+  }();
+  auto signatureTxt = kj::StringPtr{signature.begin(), 64};
+
+  auto& accessKey = creds->accessKey_;
+  KJ_STACK_ARRAY(
+    char, authBuffer,
+    128 + accessKey.size() + scope.size() + names.size() + signatureTxt.size(),
+    512, 512);
+  headers.set(
+    ids_.auth,
+    kj::strPreallocated(
+      authBuffer,
+      "AWS4-HMAC-SHA256 Credential="_kj, accessKey, '/', ymd, scope,
+      ", SignedHeaders="_kj, names,
+      ", Signature="_kj, signatureTxt));
+
+  if (streaming) {
+    auto chunked = newChunkedSigningStream(
+      body, KJ_ASSERT_NONNULL(body.tryGetLength()), options_,
+      ds, kj::str(ymd, scope), signingKey.key_, signatureTxt);
+    auto& stream = *chunked;
+    return
+      proxy_.request(method, url, headers, stream, response)
+      .attach(kj::mv(chunked), kj::mv(creds));
+  }
+  return proxy_.request(method, url, headers, body, response).attach(kj::mv(creds));
+}
+
+AwsService::SigningKey& AwsService::getSigningKey(
+    Signer& signer,
+    kj::StringPtr secretKey,
+    kj::ArrayPtr<const char> ymd) {
+
+  // The scope is fixed for the lifetime of the signer, so the key
+  // only depends on the secret and the date.
+  KJ_IF_MAYBE(cached, signer.key_) {
+    if (cached->ymd_.asArray() == ymd && cached->secretKey_ == secretKey) {
+      return *cached;
+    }
+  }
 
-	auto headers = requestHeaders.cloneShallow();	
-	headers.set(ids_.amzSdkInvocationId, id);
-	headers.set(ids_.amzSdkRequest, "attempt=1");
-	headers.set(ids_.xAmzDate, ds);
-	headers.set(ids_.xAmzContentSha256, contentHash);
-	{
-	  auto sessionToken = creds.getSessionToken();
-	  if (sessionToken.size()) {
-	    headers.set(ids_.xAmzSecurityToken, sessionToken);
-	  }
+  KJ_STACK_ARRAY(char, keyBuffer, 4 + secretKey.size() + 1, 128, 128);
+  auto secret = kj::strPreallocated(keyBuffer, "AWS4"_kj, secretKey);
+
+  auto key = hashCtx_.hash(secret.asBytes(), ymd.asBytes());
+  key = hashCtx_.hash(key, region_);
+  key = hashCtx_.hash(key, signer.service_);
+  key = hashCtx_.hash(key, "aws4_request"_kj);
+
+  // keyed once per day, or whenever the credentials rotate
+  auto mac = hashCtx_.withKey(key);
+  return signer.key_.emplace(
+    SigningKey{kj::str(secretKey), kj::heapString(ymd), key, kj::mv(mac)}
+  );
+}
+
+namespace {
+
+// Signs CreateSession requests, which use the long-term credentials
+// and the s3express service name.
+struct SessionService
+  : kj::HttpService {
+
+  SessionService(AwsService& aws)
+    : aws_{aws} {
+  }
+
+  kj::Promise<void> request(
+      kj::HttpMethod method,
+      kj::StringPtr url,
+      const kj::HttpHeaders& headers,
+      kj::AsyncInputStream& body,
+      Response& response) override {
+    return
+      aws_.creds_->getCredentials()
+      .then(
+	[this, method, url, &headers, &body, &response](auto creds) {
+	  return aws_.send(
+	    aws_.sessionSigner_, kj::mv(creds), aws_.ids_.xAmzSecurityToken,
+	    method, url, headers, body, response);
 	}
+      );
+  }
 
-	auto signature = [&]{
-	  auto requestHash = hashRequest(method, url, headers);
+  AwsService& aws_;
+};
 
-	  KJ_STACK_ARRAY(char, strBuffer, 512, 512, 512);	
-	  auto stringToSign = kj::strPreallocated(
-	    strBuffer,
-	    "AWS4-HMAC-SHA256\n"_kj,
-	    ds, '\n',
-	    ymd, scope_, '\n',
-	    requestHash
-	  );
+// Fills in credentials from a CreateSessionResult as it is parsed.
+struct SessionHandler
+  : xml::Handler {
 
-	  auto secretKey =  creds.getSecretKey();
-	  KJ_STACK_ARRAY(char, keyBuffer, 4 + secretKey.size() + 1, 128, 128);	
-	  auto signingKey = kj::strPreallocated(keyBuffer, "AWS4"_kj, secretKey);
-
-	  HashContext hashCtx{};
-	  auto hash = hashCtx.hash(signingKey.asBytes(), ymd.asBytes());
-	  hash = hashCtx.hash(hash, region_);
-	  hash = hashCtx.hash(hash, service_);
-	  hash = hashCtx.hash(hash, "aws4_request"_kj);
-	  hash = hashCtx.hash(hash, stringToSign);
-	  return kj::encodeHex(hash);
-	}();
-
-	{
-	  auto accessKey =  creds.getAccessKey();
-	  auto authTxt = kj::str(
-	    "AWS4-HMAC-SHA256 Credential="_kj, accessKey, '/', ymd, scope_,
-	    ", SignedHeaders="_kj, signedHeaders,
-	    ", Signature="_kj, signature);
-
-	  headers.set(ids_.auth, kj::mv(authTxt));
+  SessionHandler(Credentials::Builder creds)
+    : creds_{creds} {
+  }
+
+  void endElement(kj::StringPtr name, kj::StringPtr text, uint depth) override {
+    // CreateSessionResult/Credentials/*, or Error/*
+    if (depth == 3) {
+      if (name == "AccessKeyId"_kj) {
+	creds_.setAccessKey(text);
+      }
+      else if (name == "SecretAccessKey"_kj) {
+	creds_.setSecretKey(text);
+      }
+      else if (name == "SessionToken"_kj) {
+	creds_.setSessionToken(text);
+      }
+      else if (name == "Expiration"_kj) {
+	creds_.setExpiration(text);
+      }
+    }
+    else if (depth == 2 && name == "Code"_kj) {
+      code_ = kj::str(text);
+    }
+  }
+
+  Credentials::Builder creds_;
+  kj::String code_;
+};
+
+// Creates a session for one directory bucket each time the cache in
+// front of it asks for credentials.
+struct SessionProvider
+  : Credentials::Provider::Server {
+
+  SessionProvider(AwsService& aws, kj::StringPtr host)
+    : aws_{aws}
+    , host_{kj::str(host)}
+    , url_{kj::str("https://"_kj, host_, "/?session"_kj)} {
+  }
+
+  kj::Promise<void> getCredentials(GetCredentialsContext ctx) override {
+    kj::HttpHeaders headers{aws_.table_};
+    headers.set(kj::HttpHeaderId::HOST, host_);
+    auto req = aws_.sessionClient().request(kj::HttpMethod::GET, url_, headers);
+    return
+      kj::mv(req.response)
+      .then(
+	[this, ctx = kj::mv(ctx)](auto response) mutable {
+	  auto handler = kj::heap<SessionHandler>(ctx.getResults());
+	  auto& h = *handler;
+	  auto& body = *response.body;
+	  return
+	    xml::parse(body, h)
+	    .then(
+	      [this, &h, statusCode = response.statusCode]{
+		KJ_REQUIRE(
+		  statusCode / 100 == 2 && h.code_.size() == 0,
+		  "Failed to create session", host_, statusCode, h.code_);
+	      }
+	    )
+	    .attach(kj::mv(handler), kj::mv(response.body));
 	}
-	return proxy_.request(method, url, headers, body, response);
-     }
-   );
+      );
+  }
+
+  AwsService& aws_;
+  kj::String host_;
+  kj::String url_;
+};
+
+}
+
+kj::Maybe<AwsService::Session&> AwsService::session(const kj::HttpHeaders& headers) {
+  KJ_IF_MAYBE(host, headers.get(kj::HttpHeaderId::HOST)) {
+    KJ_IF_MAYBE(session, sessions_.find(*host)) {
+      return **session;
+    }
+
+    KJ_IF_MAYBE(dot, host->findFirst('.')) {
+      if (isDirectoryBucket(host->slice(0, *dot))) {
+	auto session = kj::heap<Session>(Session{
+	  newCredentialsCache(
+	    clock_, kj::heap<SessionProvider>(*this, *host), options_.sessionRefreshAhead),
+	  newSigner("s3express"_kj)
+	});
+	auto& s = *session;
+	sessions_.insert(kj::str(*host), kj::mv(session));
+	return s;
+      }
+    }
+  }
+  return nullptr;
+}
+
+kj::HttpClient& AwsService::sessionClient() {
+  KJ_IF_MAYBE(client, sessionClient_) {
+    return **client;
+  }
+  auto& service = *sessionService_.emplace(kj::heap<SessionService>(*this));
+  return *sessionClient_.emplace(kj::newHttpClient(service));
+}
+
+kj::StringPtr AwsService::amzDate(kj::Date date) {
+  auto second = (date - kj::UNIX_EPOCH) / kj::SECONDS;
+  if (second != date_.second_) {
+    date_.txt_ = aws::amzDate(date);
+    date_.second_ = second;
+  }
+  return kj::StringPtr{date_.txt_.begin(), date_.txt_.size() - 1};
+}
+
+AwsService::Target AwsService::splitUrl(kj::StringPtr url) {
+  auto begin = url.begin();
+  auto end = url.end();
+  auto pos = begin;
+
+  // skip the scheme and authority of an absolute URL
+  KJ_IF_MAYBE(colon, url.findFirst(':')) {
+    if (!url.startsWith("/"_kj) && url.slice(*colon).startsWith("://"_kj)) {
+      pos = begin + *colon + 3;
+      while (pos != end && *pos != '/' && *pos != '?' && *pos != '#') {
+        ++pos;
+      }
+    }
+  }
+
+  auto path = pos;
+  while (pos != end && *pos != '?' && *pos != '#') {
+    ++pos;
+  }
+  Target target{{path, pos}, {}};
+
+  if (pos != end && *pos == '?') {
+    auto query = ++pos;
+    while (pos != end && *pos != '#') {
+      ++pos;
+    }
+    target.query_ = {query, pos};
+  }
+  return target;
+}
+
+kj::StringPtr AwsService::signedHeaders(
+    const kj::HttpHeaders& headers,
+    kj::ArrayPtr<char> buffer) {
+  size_t size = 0;
+  for (auto& header: signable_) {
+    if (headers.get(header.id_) != nullptr) {
+      KJ_REQUIRE(size + header.name_.size() + 1 < buffer.size());
+      if (size) {
+        buffer[size++] = ';';
+      }
+      memcpy(buffer.begin() + size, header.name_.begin(), header.name_.size());
+      size += header.name_.size();
+    }
+  }
+  buffer[size] = '\0';
+  return kj::StringPtr{buffer.begin(), size};
 }
 
-kj::String AwsService::hashRequest(
+kj::FixedArray<char, 65> AwsService::hashRequest(
     kj::HttpMethod method,
-    kj::StringPtr urlTxt,
-    const kj::HttpHeaders& headers) {
+    const Target& target,
+    const kj::HttpHeaders& headers,
+    kj::StringPtr signedHeaders) {
 
-  auto get = [&](auto id) {
-    return KJ_REQUIRE_NONNULL(headers.get(id));
-  };
+  auto contentHash = KJ_REQUIRE_NONNULL(headers.get(ids_.xAmzContentSha256));
+  auto& sha256 = *requestHash_;
 
-  auto url = kj::Url::parse(urlTxt);
-  auto contentHash = get(ids_.xAmzContentSha256);
+  sha256.update(kj::toCharSequence(method));
+  sha256.update("\n"_kj);
 
-  auto path = kj::str("/", kj::strArray(url.path.asPtr(), "/"));
-  KJ_LOG(INFO, path);
-	 
-  auto sha256 = hash::newSha256();
-  sha256->update(kj::str(method));
-  sha256->update("\n"_kj);
-  sha256->update(path);
-  sha256->update("\n"_kj);
+  if (target.path_.size()) {
+    KJ_STACK_ARRAY(char, path, target.path_.size() * 3, 256, 1024);
+    auto size = canonicalEncode(target.path_, path.begin(), true);
+    sha256.update(path.slice(0, size).asBytes());
+  }
+  else {
+    sha256.update("/"_kj);
+  }
+  sha256.update("\n"_kj);
 
   {
-    auto query = KJ_MAP(param, url.query) {
-      return kj::str(param.name, "=", param.value);
+    // SigV4 wants the parameters encoded and then sorted by name,
+    // then by value
+    struct Param {
+      kj::ArrayPtr<const char> name_;
+      kj::ArrayPtr<const char> value_;
     };
-    sha256->update(kj::strArray(query, "&"));
-    sha256->update("\n"_kj);
-  }
-	  
-  auto hashHeader = [&](auto name, auto&& value) {
-    sha256->update(name);
-    sha256->update(":"_kj);
-    sha256->update(value);
-    sha256->update("\n"_kj);
-  };
 
-  hashHeader("amz-sdk-invocation-id"_kj, get(ids_.amzSdkInvocationId));
-  hashHeader("amz-sdk-request"_kj, get(ids_.amzSdkRequest));
-  hashHeader("host"_kj, get(kj::HttpHeaderId::HOST));
-  hashHeader("x-amz-content-sha256"_kj, contentHash);
-  hashHeader("x-amz-date"_kj, get(ids_.xAmzDate));
-  sha256->update("\n"_kj);
-	  
-  sha256->update(signedHeaders);
-  sha256->update("\n"_kj);
+    auto query = target.query_;
+    size_t count = 0;
+    for (auto c: query) {
+      count += c == '&';
+    }
+
+    KJ_STACK_ARRAY(char, encoded, query.size() * 3, 256, 1024);
+    KJ_STACK_ARRAY(Param, params, count + 1, 16, 64);
+    auto out = encoded.begin();
+    size_t size = 0;
+
+    auto pos = query.begin();
+    while (pos != query.end()) {
+      auto begin = pos;
+      auto equals = query.end();
+      while (pos != query.end() && *pos != '&') {
+        if (*pos == '=' && equals == query.end()) {
+          equals = pos;
+        }
+        ++pos;
+      }
+      auto end = pos;
+      if (pos != query.end()) {
+        ++pos;
+      }
+      if (begin == end) {
+        continue;
+      }
+
+      auto nameEnd = equals < end ? equals : end;
+      auto name = out;
+      out += canonicalEncode({begin, nameEnd}, out, false);
+      auto value = out;
+      if (nameEnd != end) {
+        out += canonicalEncode({nameEnd + 1, end}, out, false);
+      }
+      params[size++] = Param{{name, value}, {value, out}};
+    }
+
+    auto compare = [](kj::ArrayPtr<const char> lhs, kj::ArrayPtr<const char> rhs) {
+      auto c = memcmp(lhs.begin(), rhs.begin(), kj::min(lhs.size(), rhs.size()));
+      return c ? c : (lhs.size() > rhs.size()) - (lhs.size() < rhs.size());
+    };
+    std::sort(
+      params.begin(), params.begin() + size,
+      [&](auto& lhs, auto& rhs) {
+        auto c = compare(lhs.name_, rhs.name_);
+        return c ? c < 0 : compare(lhs.value_, rhs.value_) < 0;
+      }
+    );
 
-  sha256->update(contentHash);
-  return kj::encodeHex(sha256->digest());
+    for (auto& param: params.slice(0, size)) {
+      if (&param != params.begin()) {
+        sha256.update("&"_kj);
+      }
+      sha256.update(param.name_.asBytes());
+      sha256.update("="_kj);
+      sha256.update(param.value_.asBytes());
+    }
+    sha256.update("\n"_kj);
+  }
+
+  for (auto& header: signable_) {
+    KJ_IF_MAYBE(value, headers.get(header.id_)) {
+      sha256.update(header.name_);
+      sha256.update(":"_kj);
+      sha256.update(*value);
+      sha256.update("\n"_kj);
+    }
+  }
+  sha256.update("\n"_kj);
+
+  sha256.update(signedHeaders);
+  sha256.update("\n"_kj);
+
+  sha256.update(contentHash);
+  return hexDigest(sha256.finish());
 }
  
+kj::Own<kj::AsyncInputStream> newChunkedSigningStream(
+    kj::AsyncInputStream& body,
+    uint64_t length,
+    const AwsServiceOptions& options,
+    kj::StringPtr date,
+    kj::StringPtr scope,
+    kj::ArrayPtr<const unsigned char> signingKey,
+    kj::StringPtr seedSignature) {
+  return
+    kj::heap<ChunkedSigningStream>(
+      body, length, options.chunkSize,
+      options.payloadSigning == PayloadSigning::STREAMING_TRAILER,
+      date, scope, signingKey, seedSignature
+    );
+}
+
 kj::Own<kj::HttpService> newAwsService(
     const kj::Clock& clock,
     kj::HttpService& proxy,
     kj::HttpHeaderTable::Builder& builder,
     Credentials::Provider::Client credsProvider,
-    kj::StringPtr service, kj::StringPtr region) {
+    kj::StringPtr service, kj::StringPtr region,
+    const AwsServiceOptions& options) {
   return
     kj::heap<AwsService>(
       clock, proxy,
       builder,
       kj::mv(credsProvider),
-      service, region
+      service, region,
+      options
     );
 }
 
@@ -6,16 +6,59 @@
 
 #include "s3.capnp.h"
 
+#include <kj/async-io.h>
 #include <kj/compat/http.h>
 #include <kj/map.h>
 
 namespace aws {
+
+  // How request bodies of known, non-zero length are signed.
+  enum class PayloadSigning {
+    // Sent as is, with x-amz-content-sha256: UNSIGNED-PAYLOAD.
+    UNSIGNED,
+    // Framed as aws-chunked, each chunk signed in a chain seeded by
+    // the request's signature (STREAMING-AWS4-HMAC-SHA256-PAYLOAD).
+    STREAMING,
+    // As STREAMING, with the SHA-256 of the whole body sent in a
+    // signed x-amz-checksum-sha256 trailer.
+    STREAMING_TRAILER
+  };
+
+  struct AwsServiceOptions {
+    PayloadSigning payloadSigning = PayloadSigning::UNSIGNED;
+
+    // Size of each signed chunk; S3 requires all but the last to be at
+    // least 8 KiB. One chunk per request in flight is held in memory.
+    size_t chunkSize = 64 * 1024;
+
+    // Requests to S3 Express One Zone directory buckets are signed with
+    // session credentials from CreateSession, cached per bucket for
+    // their five minutes and refreshed in the background once within
+    // this of expiring.
+    kj::Duration sessionRefreshAhead = 1 * kj::MINUTES;
+  };
+
+  // Frames `length` bytes of `body` as aws-chunked, signing each chunk
+  // in a chain seeded by the request's signature. `date` is the
+  // request's x-amz-date and `scope` its credential scope, e.g.
+  // "20130524/us-east-1/s3/aws4_request". `body` must outlive the
+  // stream.
+  kj::Own<kj::AsyncInputStream> newChunkedSigningStream(
+      kj::AsyncInputStream& body,
+      uint64_t length,
+      const AwsServiceOptions&,
+      kj::StringPtr date,
+      kj::StringPtr scope,
+      kj::ArrayPtr<const unsigned char> signingKey,
+      kj::StringPtr seedSignature
+  );
+
   kj::Own<kj::HttpService> newAwsService(
       const kj::Clock&,
       kj::HttpService&,
       kj::HttpHeaderTable::Builder&,
       Credentials::Provider::Client,
-      kj::StringPtr service, kj::StringPtr region
+      kj::StringPtr service, kj::StringPtr region,
+      const AwsServiceOptions& = {}
   );
 }
-
@@ -0,0 +1,125 @@
+// Copyright (c) 2023 Vaci Koblizek.
+// Licensed under the Apache 2.0 license found in the LICENSE file or at:
+//     https://opensource.org/licenses/Apache-2.0
+
+#include "key-index.h"
+
+#include <kj/debug.h>
+#include <kj/encoding.h>
+#include <kj/main.h>
+
+#include <gtest/gtest.h>
+
+using namespace aws;
+
+static int EKAM_TEST_DISABLE_INTERCEPTOR = 1;
+
+namespace {
+
+kj::String join(kj::ArrayPtr<const kj::String> keys) {
+  return kj::str(kj::strArray(keys, ","));
+}
+
+struct KeyIndexTest
+  : testing::Test {
+
+  kj::Own<const kj::Directory> dir_{kj::newInMemoryDirectory(kj::nullClock())};
+};
+
+}
+
+TEST_F(KeyIndexTest, ListsInOrder) {
+  auto index = newKeyIndex(dir_->clone());
+  for (auto key: {"b/2", "a", "b/1", "c", "b/3/x", "ba"}) {
+    index->insert(key, 0);
+  }
+  index->insert("a", 1);
+  EXPECT_EQ(index->size(), 6u);
+
+  EXPECT_EQ(join(index->list({}, 100)), "a,b/1,b/2,b/3/x,ba,c");
+  EXPECT_EQ(join(index->list({"b/"}, 100)), "b/1,b/2,b/3/x");
+  EXPECT_EQ(join(index->list({"b/", "b/1"}, 100)), "b/2,b/3/x");
+  EXPECT_EQ(join(index->list({"", "", "/"}, 100)), "a,b/,ba,c");
+  EXPECT_EQ(join(index->list({"", "b/", "/"}, 100)), "ba,c");
+  EXPECT_EQ(join(index->list({"b/", "", "/"}, 100)), "b/1,b/2,b/3/");
+  EXPECT_EQ(join(index->list({}, 2)), "a,b/1");
+
+  index->erase("b/1");
+  EXPECT_FALSE(index->contains("b/1"));
+  EXPECT_EQ(join(index->list({"b/"}, 100)), "b/2,b/3/x");
+}
+
+TEST_F(KeyIndexTest, Persists) {
+  {
+    auto index = newKeyIndex(dir_->clone());
+    index->insert("x", 0);
+    index->insert("y", 3);
+    index->erase("x");
+  }
+
+  auto index = newKeyIndex(dir_->clone());
+  EXPECT_EQ(join(index->list({}, 100)), "y");
+  EXPECT_EQ(KJ_ASSERT_NONNULL(index->latest("y")), 3u);
+
+  // enough changes to fold the log into the table
+  for (auto ii = 0u; ii < 2000; ++ii) {
+    index->insert(kj::str("k", ii), ii);
+  }
+  index = nullptr;
+  index = newKeyIndex(dir_->clone());
+  EXPECT_EQ(index->size(), 2001u);
+  EXPECT_EQ(KJ_ASSERT_NONNULL(index->latest("k1999")), 1999u);
+}
+
+TEST_F(KeyIndexTest, AssignsVersions) {
+  auto index = newKeyIndex(dir_->clone());
+  EXPECT_EQ(index->nextVersion("a"), 0u);
+  EXPECT_EQ(index->nextVersion("a"), 1u);
+  EXPECT_FALSE(index->contains("a"));
+
+  // versions complete out of order
+  index->insert("a", 1);
+  EXPECT_EQ(KJ_ASSERT_NONNULL(index->latest("a")), 1u);
+  EXPECT_EQ(index->nextVersion("a"), 2u);
+
+  for (auto ii = 3u; ii <= 10; ++ii) {
+    EXPECT_EQ(index->nextVersion("a"), ii);
+  }
+  index->insert("a", 10);
+  EXPECT_EQ(index->nextVersion("a"), 11u);
+}
+
+TEST_F(KeyIndexTest, ListsVersionsNumerically) {
+  auto dir = dir_->openSubdir(kj::Path{"versions"}, kj::WriteMode::CREATE);
+  for (auto name: {"9", "10", "2", "tmp"}) {
+    dir->openFile(kj::Path{name}, kj::WriteMode::CREATE);
+  }
+  auto versions = listVersions(*dir);
+  ASSERT_EQ(versions.size(), 3u);
+  EXPECT_EQ(versions[0], 10u);
+  EXPECT_EQ(versions[1], 9u);
+  EXPECT_EQ(versions[2], 2u);
+}
+
+TEST_F(KeyIndexTest, RebuildsFromKeyDirectories) {
+  for (auto key: {"foo", "bar"}) {
+    auto hex = kj::encodeHex(kj::StringPtr{key}.asBytes());
+    auto versions = dir_->openSubdir(kj::Path{hex, "versions"}, kj::WriteMode::CREATE | kj::WriteMode::CREATE_PARENT);
+    for (auto name: {"9", "10"}) {
+      versions->openFile(kj::Path{name}, kj::WriteMode::CREATE);
+    }
+  }
+
+  auto index = newKeyIndex(dir_->clone());
+  EXPECT_EQ(join(index->list({}, 100)), "bar,foo");
+  EXPECT_EQ(KJ_ASSERT_NONNULL(index->latest("foo")), 10u);
+  EXPECT_EQ(index->nextVersion("bar"), 11u);
+}
+
+int main(int argc, char* argv[]) {
+  kj::TopLevelProcessContext processCtx{argv[0]};
+  processCtx.increaseLoggingVerbosity();
+
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,404 @@
+// Copyright (c) 2023 Vaci Koblizek.
+// Licensed under the Apache 2.0 license found in the LICENSE file or at:
+//     https://opensource.org/licenses/Apache-2.0
+
+#include "key-index.h"
+
+#include <kj/debug.h>
+#include <kj/encoding.h>
+#include <kj/map.h>
+#include <kj/vector.h>
+
+#include <algorithm>
+#include <functional>
+#include <string_view>
+
+namespace aws {
+
+namespace {
+
+// Keys are UTF-8, which never contains 0xff, so this sorts after all of
+// them.
+constexpr kj::StringPtr END = "\xff"_kj;
+
+// Returns the smallest string that sorts after every string starting
+// with `prefix`.
+kj::String prefixEnd(kj::StringPtr prefix) {
+  auto end = kj::heapString(prefix);
+  for (auto ii = end.size(); ii > 0; --ii) {
+    auto& c = reinterpret_cast<kj::byte&>(end[ii - 1]);
+    if (c != 0xff) {
+      ++c;
+      return kj::heapString(end.begin(), ii);
+    }
+  }
+  return kj::str(END);
+}
+
+kj::Maybe<size_t> find(kj::StringPtr str, kj::StringPtr delimiter) {
+  auto pos = std::string_view{str.begin(), str.size()}.find(
+    std::string_view{delimiter.begin(), delimiter.size()}
+  );
+  if (pos == std::string_view::npos) {
+    return nullptr;
+  }
+  return pos;
+}
+
+struct KeyIndexImpl
+  : KeyIndex {
+
+  KeyIndexImpl(kj::Own<const kj::Directory> dir);
+
+  uint32_t nextVersion(kj::StringPtr key) override;
+  void insert(kj::StringPtr key, uint32_t latest) override;
+  void erase(kj::StringPtr key) override;
+  kj::Maybe<uint32_t> latest(kj::StringPtr key) const override;
+  kj::Own<const kj::FsNode> log() const override;
+  bool contains(kj::StringPtr key) const override;
+  size_t size() const override;
+  kj::Array<kj::String> list(const ListQuery& query, size_t limit) const override;
+
+  void load();
+  void rebuild();
+  void append(kj::StringPtr line);
+  void compact();
+
+  // Newest version of `key` found on disk, for keys the index does not
+  // record a version for.
+  kj::Maybe<uint32_t> scan(kj::StringPtr key) const;
+
+  // Calls `func` for each complete line of `file`.
+  template <typename Func>
+  static void forEachLine(const kj::ReadableFile& file, Func&& func);
+
+  struct Entry {
+    uint32_t latest_;
+    // next version to hand out, if one has been handed out since the
+    // index was opened
+    uint32_t next_;
+  };
+
+  kj::Own<const kj::Directory> dir_;
+  kj::TreeMap<kj::String, Entry> keys_;
+  // next versions of keys being written for the first time
+  kj::HashMap<kj::String, uint32_t> pending_;
+  kj::Own<const kj::AppendableFile> log_;
+  size_t logEntries_{0};
+
+  static constexpr kj::StringPtr TABLE = "index"_kj;
+  static constexpr kj::StringPtr LOG = "index.log"_kj;
+  static constexpr size_t MIN_LOG_ENTRIES = 1024;
+};
+
+KeyIndexImpl::KeyIndexImpl(kj::Own<const kj::Directory> dir)
+  : dir_{kj::mv(dir)} {
+
+  if (dir_->exists(kj::Path{TABLE}) || dir_->exists(kj::Path{LOG})) {
+    load();
+  }
+  else {
+    rebuild();
+  }
+
+  log_ = dir_->appendFile(kj::Path{LOG}, kj::WriteMode::CREATE | kj::WriteMode::MODIFY);
+}
+
+template <typename Func>
+void KeyIndexImpl::forEachLine(const kj::ReadableFile& file, Func&& func) {
+  auto size = file.stat().size;
+  if (!size) {
+    return;
+  }
+  auto mapping = file.mmap(0, size);
+  auto data = mapping.asChars();
+  auto begin = 0ul;
+  for (auto ii: kj::indices(data)) {
+    if (data[ii] == '\n') {
+      func(data.slice(begin, ii));
+      begin = ii + 1;
+    }
+  }
+  // anything after the last newline is a write torn by a crash
+}
+
+// Table lines are "<hex key> <latest>" and log lines are either
+// "+<hex key> <latest>" or "-<hex key>".
+void KeyIndexImpl::load() {
+  struct Line {
+    kj::String key_;
+    uint32_t latest_;
+  };
+
+  auto parse = [&](kj::ArrayPtr<const char> line) {
+    auto hex = line;
+    kj::Maybe<uint32_t> latest;
+    for (auto ii: kj::indices(line)) {
+      if (line[ii] == ' ') {
+	hex = line.slice(0, ii);
+	latest = kj::heapString(line.slice(ii + 1, line.size())).tryParseAs<uint32_t>();
+	KJ_REQUIRE(latest != nullptr, "Corrupt key index");
+	break;
+      }
+    }
+
+    auto bytes = kj::decodeHex(hex);
+    KJ_REQUIRE(!bytes.hadErrors, "Corrupt key index");
+    auto key = kj::heapString(bytes.asChars());
+    KJ_IF_MAYBE(l, latest) {
+      return Line{kj::mv(key), *l};
+    }
+    // written before versions were recorded
+    auto l = KJ_REQUIRE_NONNULL(scan(key), "Corrupt key index", key);
+    return Line{kj::mv(key), l};
+  };
+
+  KJ_IF_MAYBE(table, dir_->tryOpenFile(kj::Path{TABLE})) {
+    forEachLine(**table,
+      [&](auto line) {
+	auto entry = parse(line);
+	keys_.insert(kj::mv(entry.key_), Entry{entry.latest_, 0});
+      }
+    );
+  }
+
+  KJ_IF_MAYBE(log, dir_->tryOpenFile(kj::Path{LOG})) {
+    forEachLine(**log,
+      [&](auto line) {
+	KJ_REQUIRE(line.size(), "Corrupt key index log");
+	if (line[0] == '+') {
+	  auto entry = parse(line.slice(1, line.size()));
+	  keys_.upsert(kj::mv(entry.key_), Entry{entry.latest_, 0},
+	    [](auto& existing, auto&& replacement) {
+	      existing = replacement;
+	    }
+	  );
+	}
+	else {
+	  auto bytes = kj::decodeHex(line.slice(1, line.size()));
+	  KJ_REQUIRE(!bytes.hadErrors, "Corrupt key index log");
+	  keys_.erase(kj::heapString(bytes.asChars()));
+	}
+	++logEntries_;
+      }
+    );
+  }
+}
+
+void KeyIndexImpl::rebuild() {
+  // key directories are hex-encoded names, so anything that does not
+  // decode is not one of them
+  for (auto&& name: dir_->listNames()) {
+    auto bytes = kj::decodeHex(name);
+    if (bytes.hadErrors || name.size() == 0) {
+      continue;
+    }
+    auto key = kj::heapString(bytes.asChars());
+    KJ_IF_MAYBE(latest, scan(key)) {
+      keys_.insert(kj::mv(key), Entry{*latest, 0});
+    }
+  }
+  compact();
+}
+
+kj::Maybe<uint32_t> KeyIndexImpl::scan(kj::StringPtr key) const {
+  auto path = kj::Path{kj::encodeHex(key.asBytes()), "versions"};
+  KJ_IF_MAYBE(dir, dir_->tryOpenSubdir(path)) {
+    auto versions = listVersions(**dir);
+    if (versions.size()) {
+      return versions[0];
+    }
+  }
+  return nullptr;
+}
+
+uint32_t KeyIndexImpl::nextVersion(kj::StringPtr key) {
+  KJ_IF_MAYBE(entry, keys_.find(key)) {
+    auto version = kj::max(entry->next_, entry->latest_ + 1);
+    entry->next_ = version + 1;
+    return version;
+  }
+
+  auto& next = pending_.findOrCreate(key,
+    [&]() -> decltype(pending_)::Entry {
+      // versions a previous run left behind, or wrote before the
+      // index existed, must not be overwritten
+      auto first = scan(key).map([](uint32_t v) { return v + 1; }).orDefault(0);
+      return {kj::str(key), first};
+    }
+  );
+  return next++;
+}
+
+void KeyIndexImpl::insert(kj::StringPtr key, uint32_t latest) {
+  KJ_IF_MAYBE(entry, keys_.find(key)) {
+    if (entry->latest_ == latest) {
+      return;
+    }
+    entry->latest_ = latest;
+  }
+  else {
+    uint32_t next = 0;
+    KJ_IF_MAYBE(pending, pending_.find(key)) {
+      next = *pending;
+      pending_.erase(key);
+    }
+    keys_.insert(kj::str(key), Entry{latest, next});
+  }
+  append(kj::str('+', kj::encodeHex(key.asBytes()), ' ', latest, '\n'));
+}
+
+void KeyIndexImpl::erase(kj::StringPtr key) {
+  pending_.erase(key);
+  if (keys_.erase(key)) {
+    append(kj::str('-', kj::encodeHex(key.asBytes()), '\n'));
+  }
+}
+
+kj::Maybe<uint32_t> KeyIndexImpl::latest(kj::StringPtr key) const {
+  return keys_.find(key).map(
+    [](const Entry& entry) {
+      return entry.latest_;
+    }
+  );
+}
+
+kj::Own<const kj::FsNode> KeyIndexImpl::log() const {
+  return log_->clone();
+}
+
+bool KeyIndexImpl::contains(kj::StringPtr key) const {
+  return keys_.find(key) != nullptr;
+}
+
+size_t KeyIndexImpl::size() const {
+  return keys_.size();
+}
+
+void KeyIndexImpl::append(kj::StringPtr line) {
+  log_->write(line.begin(), line.size());
+
+  if (++logEntries_ >= kj::max(MIN_LOG_ENTRIES, keys_.size())) {
+    compact();
+    log_ = dir_->appendFile(kj::Path{LOG}, kj::WriteMode::CREATE | kj::WriteMode::MODIFY);
+  }
+}
+
+void KeyIndexImpl::compact() {
+  {
+    auto replacer = dir_->replaceFile(
+      kj::Path{TABLE}, kj::WriteMode::CREATE | kj::WriteMode::MODIFY
+    );
+    auto& file = replacer->get();
+
+    kj::Vector<char> buffer;
+    uint64_t offset = 0;
+    auto flush = [&]{
+      file.write(offset, buffer.asPtr().asBytes());
+      offset += buffer.size();
+      buffer.clear();
+    };
+
+    for (auto& entry: keys_) {
+      buffer.addAll(kj::str(kj::encodeHex(entry.key.asBytes()), ' ', entry.value.latest_, '\n'));
+      if (buffer.size() >= 65536) {
+	flush();
+      }
+    }
+    flush();
+    replacer->commit();
+  }
+
+  // replaying the old log over the new table is harmless, so a crash
+  // between the two commits loses nothing
+  dir_->replaceFile(kj::Path{LOG}, kj::WriteMode::CREATE | kj::WriteMode::MODIFY)->commit();
+  logEntries_ = 0;
+}
+
+kj::Array<kj::String> KeyIndexImpl::list(const ListQuery& query, size_t limit) const {
+  kj::Vector<kj::String> results;
+  if (!limit) {
+    return results.releaseAsArray();
+  }
+
+  auto end = query.prefix.size() ? prefixEnd(query.prefix) : kj::str(END);
+
+  // first key to consider
+  auto begin = [&]{
+    auto& after = query.startAfter;
+    if (after.size() == 0 || after < query.prefix) {
+      return kj::str(query.prefix);
+    }
+    if (query.delimiter.size() &&
+	after.startsWith(query.prefix) &&
+	after.endsWith(query.delimiter) &&
+	after.size() > query.prefix.size()) {
+      // skip the rest of a rolled-up common prefix
+      return prefixEnd(after);
+    }
+    // the first string after `after` is `after` followed by a NUL
+    auto next = kj::heapString(after.size() + 1);
+    memcpy(next.begin(), after.begin(), after.size());
+    next[after.size()] = '\0';
+    return next;
+  }();
+
+  while (results.size() < limit && kj::StringPtr{begin} < end) {
+    auto range = keys_.range(begin, end);
+    auto iter = range.begin();
+    if (iter == range.end()) {
+      break;
+    }
+
+    kj::StringPtr key = iter->key;
+    if (query.delimiter.size()) {
+      auto rest = key.slice(query.prefix.size());
+      KJ_IF_MAYBE(pos, find(rest, query.delimiter)) {
+	auto common = kj::heapString(key.begin(), query.prefix.size() + *pos + query.delimiter.size());
+	begin = prefixEnd(common);
+	results.add(kj::mv(common));
+	continue;
+      }
+    }
+
+    results.add(kj::str(key));
+
+    // keys are distinct, so scan forward within this range for as long
+    // as no roll up is needed
+    bool rolled = false;
+    for (++iter; iter != range.end() && results.size() < limit; ++iter) {
+      kj::StringPtr next = iter->key;
+      if (query.delimiter.size() &&
+	  find(next.slice(query.prefix.size()), query.delimiter) != nullptr) {
+	begin = kj::str(next);
+	rolled = true;
+	break;
+      }
+      results.add(kj::str(next));
+    }
+    if (!rolled) {
+      break;
+    }
+  }
+
+  return results.releaseAsArray();
+}
+
+}
+
+kj::Own<KeyIndex> newKeyIndex(kj::Own<const kj::Directory> dir) {
+  return kj::heap<KeyIndexImpl>(kj::mv(dir));
+}
+
+kj::Array<uint32_t> listVersions(const kj::Directory& dir) {
+  kj::Vector<uint32_t> versions;
+  for (auto&& name: dir.listNames()) {
+    KJ_IF_MAYBE(version, name.tryParseAs<uint32_t>()) {
+      versions.add(*version);
+    }
+  }
+  std::sort(versions.begin(), versions.end(), std::greater<uint32_t>{});
+  return versions.releaseAsArray();
+}
+
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+// Copyright (c) 2023 Vaci Koblizek.
+// Licensed under the Apache 2.0 license found in the LICENSE file or at:
+//     https://opensource.org/licenses/Apache-2.0
+
+#include <kj/array.h>
+#include <kj/filesystem.h>
+#include <kj/string.h>
+
+namespace aws {
+
+struct ListQuery {
+  kj::StringPtr prefix;
+
+  // Only entries that sort after this are listed. A common prefix
+  // previously returned for the same delimiter skips all of its keys.
+  kj::StringPtr startAfter;
+
+  // If not empty, keys containing the delimiter after the prefix are
+  // rolled up into a single entry: the key up to and including the
+  // first such delimiter.
+  kj::StringPtr delimiter;
+};
+
+// Sorted set of the keys in a bucket and the latest complete version of
+// each, persisted in the bucket directory as a sorted table plus a log
+// of changes made since it was written. The log is replayed when the
+// index is opened and folded back into the table once it grows as large
+// as the table itself.
+struct KeyIndex {
+  virtual ~KeyIndex() noexcept(false) {}
+
+  // Reserves the next version number of `key`. Versions are numbered
+  // from zero and never reused while the index is open; a reserved
+  // version left incomplete by a crash may be handed out again.
+  virtual uint32_t nextVersion(kj::StringPtr key) = 0;
+
+  // Records that `key` exists and that `latest` is its newest complete
+  // version.
+  virtual void insert(kj::StringPtr key, uint32_t latest) = 0;
+  virtual void erase(kj::StringPtr key) = 0;
+
+  virtual kj::Maybe<uint32_t> latest(kj::StringPtr key) const = 0;
+
+  // Returns a new handle on the log of changes, so that it can be
+  // synced off the thread that owns the index.
+  virtual kj::Own<const kj::FsNode> log() const = 0;
+  virtual bool contains(kj::StringPtr key) const = 0;
+  virtual size_t size() const = 0;
+
+  // Returns up to `limit` keys or common prefixes matching `query`, in
+  // order. Costs O(log n) per entry returned, however many keys are
+  // skipped or rolled up. Pass the last entry returned as startAfter
+  // to continue.
+  virtual kj::Array<kj::String> list(const ListQuery& query, size_t limit) const = 0;
+};
+
+// Opens the index stored in `dir`, creating it from the key
+// directories already there if it does not exist yet.
+//
+// Each key directory holds its versions as files named by their
+// decimal version number, in a "versions" subdirectory.
+kj::Own<KeyIndex> newKeyIndex(kj::Own<const kj::Directory> dir);
+
+// Returns the versions in a "versions" directory, newest first.
+kj::Array<uint32_t> listVersions(const kj::Directory& versions);
+
+}
@@ -0,0 +1,159 @@
+// Copyright (c) 2023 Vaci Koblizek.
+// Licensed under the Apache 2.0 license found in the LICENSE file or at:
+//     https://opensource.org/licenses/Apache-2.0
+
+#include "metrics.h"
+
+#include <capnp/message.h>
+
+#include <kj/async-io.h>
+#include <kj/compat/http.h>
+#include <kj/debug.h>
+#include <kj/main.h>
+
+#include <gtest/gtest.h>
+
+#include <cstring>
+
+using namespace aws;
+
+static int EKAM_TEST_DISABLE_INTERCEPTOR = 1;
+
+namespace {
+
+// Answers GETs with ten digits, and everything else with a SlowDown
+// error.
+struct FakeS3
+  : kj::HttpService {
+
+  FakeS3(kj::HttpHeaderTable::Builder& builder)
+    : table_{builder.getFutureTable()} {
+  }
+
+  kj::Promise<void> request(
+      kj::HttpMethod method,
+      kj::StringPtr url,
+      const kj::HttpHeaders&,
+      kj::AsyncInputStream& body,
+      Response& response) override {
+
+    return
+      body.readAllBytes()
+      .then(
+        [this, method, &response](auto) {
+	  kj::HttpHeaders headers{table_};
+	  auto txt = method == kj::HttpMethod::GET
+	    ? "0123456789"_kj
+	    : "<Error><Code>SlowDown</Code><Message>Reduce your request rate.</Message></Error>"_kj;
+	  auto stream = response.send(
+	    method == kj::HttpMethod::GET ? 200 : 503, "", headers, txt.size());
+	  auto& s = *stream;
+	  return s.write(txt.begin(), txt.size()).attach(kj::mv(stream));
+	}
+      );
+  }
+
+  kj::HttpHeaderTable& table_;
+};
+
+}
+
+TEST(Metrics, Histogram) {
+  LatencyHistogram histogram;
+  histogram.record(10 * kj::MICROSECONDS);
+  histogram.record(100 * kj::MICROSECONDS);
+  histogram.record(1 * kj::HOURS);
+  EXPECT_EQ(histogram.counts_[0].load(), 1);
+  EXPECT_EQ(histogram.counts_[1].load(), 1);
+  EXPECT_EQ(histogram.counts_[LatencyHistogram::BUCKETS].load(), 1);
+  EXPECT_EQ(histogram.count_.load(), 3);
+  EXPECT_DOUBLE_EQ(LatencyHistogram::bound(1), 128e-6);
+}
+
+TEST(Metrics, Service) {
+  auto io = kj::setupAsyncIo();
+  kj::HttpHeaderTable::Builder builder;
+  FakeS3 inner{builder};
+  auto metrics = kj::refcounted<ClientMetrics>();
+  auto service = newMetricsService(inner, builder, *metrics);
+  auto amzSdkRequest = builder.add("amz-sdk-request");
+  auto table = builder.build();
+  auto client = kj::newHttpClient(*service);
+
+  {
+    kj::HttpHeaders headers{*table};
+    auto req = client->request(kj::HttpMethod::GET, "https://bucket.s3.amazonaws.com/key"_kj, headers);
+    auto response = req.response.wait(io.waitScope);
+    EXPECT_EQ(response.body->readAllText().wait(io.waitScope), "0123456789"_kj);
+  }
+
+  {
+    kj::HttpHeaders headers{*table};
+    headers.set(amzSdkRequest, "attempt=2; max=3");
+    auto req = client->request(
+      kj::HttpMethod::PUT, "https://bucket.s3.amazonaws.com/key?partNumber=1&uploadId=x"_kj,
+      headers, 4ul);
+    req.body->write("data", 4).wait(io.waitScope);
+    req.body = nullptr;
+    auto response = req.response.wait(io.waitScope);
+    EXPECT_EQ(response.statusCode, 503);
+    response.body->readAllText().wait(io.waitScope);
+  }
+  io.waitScope.poll();
+
+  capnp::MallocMessageBuilder message;
+  auto snapshot = message.initRoot<Metrics::Snapshot>();
+  metrics->get(snapshot);
+
+  auto read = static_cast<size_t>(S3Operation::READ);
+  auto part = static_cast<size_t>(S3Operation::PART);
+  EXPECT_EQ(snapshot.getTotal()[read].getOperation(), "read"_kj);
+  EXPECT_EQ(snapshot.getTotal()[read].getCount(), 1);
+  EXPECT_EQ(snapshot.getFirstByte()[part].getCount(), 1);
+  EXPECT_EQ(snapshot.getRequests(), 2);
+  EXPECT_EQ(snapshot.getRetries(), 1);
+  EXPECT_EQ(snapshot.getBytesOut(), 4);
+  EXPECT_GE(snapshot.getBytesIn(), 10);
+  EXPECT_EQ(snapshot.getInFlight(), 0);
+  ASSERT_EQ(snapshot.getErrors().size(), 1);
+  EXPECT_EQ(snapshot.getErrors()[0].getCode(), "SlowDown"_kj);
+  EXPECT_EQ(snapshot.getErrors()[0].getCount(), 1);
+
+  auto txt = metrics->prometheus();
+  EXPECT_TRUE(strstr(txt.cStr(), "aws_s3_errors_total{code=\"SlowDown\"} 1\n") != nullptr);
+  EXPECT_TRUE(strstr(txt.cStr(), "aws_s3_request_duration_seconds_count{operation=\"read\"} 1\n") != nullptr);
+  EXPECT_TRUE(strstr(txt.cStr(), "aws_s3_retries_total 1\n") != nullptr);
+}
+
+TEST(Metrics, Sum) {
+  auto io = kj::setupAsyncIo();
+  auto shard = [](uint64_t requests, kj::Duration duration) {
+    auto metrics = kj::refcounted<ClientMetrics>();
+    metrics->requests_ = requests;
+    metrics->total_[0].record(duration);
+    metrics->error("SlowDown"_kj);
+    return newMetricsServer(kj::mv(metrics));
+  };
+
+  auto shards = kj::heapArrayBuilder<Metrics::Client>(2);
+  shards.add(shard(1, 100 * kj::MICROSECONDS));
+  shards.add(shard(2, 1 * kj::HOURS));
+  auto sum = newMetricsServer(shards.finish());
+
+  auto snapshot = sum.getRequest().send().wait(io.waitScope);
+  EXPECT_EQ(snapshot.getRequests(), 3);
+  auto total = snapshot.getTotal()[0];
+  EXPECT_EQ(total.getCount(), 2);
+  EXPECT_EQ(total.getCounts()[1], 1);
+  EXPECT_EQ(total.getCounts()[LatencyHistogram::BUCKETS], 1);
+  ASSERT_EQ(snapshot.getErrors().size(), 1);
+  EXPECT_EQ(snapshot.getErrors()[0].getCount(), 2);
+}
+
+int main(int argc, char* argv[]) {
+  kj::TopLevelProcessContext processCtx{argv[0]};
+  processCtx.increaseLoggingVerbosity();
+
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
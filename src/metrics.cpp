@@ -0,0 +1,520 @@
+// Copyright (c) 2023 Vaci Koblizek.
+// Licensed under the Apache 2.0 license found in the LICENSE file or at:
+//     https://opensource.org/licenses/Apache-2.0
+
+#include "metrics.h"
+
+#include <kj/debug.h>
+#include <kj/string-tree.h>
+#include <kj/vector.h>
+
+namespace aws {
+
+namespace {
+
+constexpr auto RELAXED = std::memory_order_relaxed;
+
+// Whether the query of `url` has a parameter `name`.
+bool hasParam(kj::StringPtr url, kj::StringPtr name) {
+  KJ_IF_MAYBE(pos, url.findFirst('?')) {
+    auto query = url.slice(*pos + 1);
+    while (query.size()) {
+      auto end = query.findFirst('&').orDefault(query.size());
+      if (query.startsWith(name) &&
+	  (end == name.size() || query[name.size()] == '=')) {
+	return true;
+      }
+      if (end == query.size()) {
+	break;
+      }
+      query = query.slice(end + 1);
+    }
+  }
+  return false;
+}
+
+S3Operation classify(kj::HttpMethod method, kj::StringPtr url) {
+  switch (method) {
+    case kj::HttpMethod::HEAD:
+      return S3Operation::HEAD;
+    case kj::HttpMethod::GET:
+      return hasParam(url, "list-type"_kj) || hasParam(url, "versions"_kj)
+	? S3Operation::LIST
+	: S3Operation::READ;
+    case kj::HttpMethod::PUT:
+      return hasParam(url, "partNumber"_kj)
+	? S3Operation::PART
+	: S3Operation::WRITE;
+    case kj::HttpMethod::POST:
+      return hasParam(url, "uploadId"_kj)
+	? S3Operation::COMPLETE
+	: S3Operation::OTHER;
+    default:
+      return S3Operation::OTHER;
+  }
+}
+
+// The <Code> of an S3 <Error> document.
+kj::Maybe<kj::String> errorCode(kj::ArrayPtr<const char> body) {
+  auto txt = kj::heapString(body);
+  for (auto ii = 0u; ii + 6 <= txt.size(); ++ii) {
+    if (txt.slice(ii).startsWith("<Code>"_kj)) {
+      auto code = txt.slice(ii + 6);
+      KJ_IF_MAYBE(end, code.findFirst('<')) {
+	return kj::heapString(code.slice(0, *end));
+      }
+    }
+  }
+  return nullptr;
+}
+
+// Counts the bytes of a response body, keeping the start of error
+// documents for their code.
+struct CountingStream
+  : kj::AsyncOutputStream {
+
+  static constexpr size_t MAX_ERROR_BYTES = 1024;
+
+  CountingStream(
+      kj::Own<kj::AsyncOutputStream> inner,
+      ClientMetrics& metrics,
+      bool error)
+    : inner_{kj::mv(inner)}
+    , metrics_{metrics}
+    , error_{error} {
+  }
+
+  kj::Promise<void> write(const void* buffer, size_t size) override {
+    observe(kj::arrayPtr(reinterpret_cast<const char*>(buffer), size));
+    return inner_->write(buffer, size);
+  }
+
+  kj::Promise<void> write(kj::ArrayPtr<const kj::ArrayPtr<const kj::byte>> pieces) override {
+    for (auto piece: pieces) {
+      observe(piece.asChars());
+    }
+    return inner_->write(pieces);
+  }
+
+  kj::Promise<void> whenWriteDisconnected() override {
+    return inner_->whenWriteDisconnected();
+  }
+
+  void observe(kj::ArrayPtr<const char> data) {
+    metrics_.bytesIn_.fetch_add(data.size(), RELAXED);
+    if (error_ && body_.size() < MAX_ERROR_BYTES) {
+      body_.addAll(data.slice(0, kj::min(data.size(), MAX_ERROR_BYTES - body_.size())));
+    }
+  }
+
+  kj::Own<kj::AsyncOutputStream> inner_;
+  ClientMetrics& metrics_;
+  bool error_;
+  kj::Vector<char> body_;
+};
+
+struct MetricsService
+  : kj::HttpService {
+
+  MetricsService(
+      kj::HttpService& inner,
+      kj::HttpHeaderTable::Builder& builder,
+      ClientMetrics& metrics)
+    : inner_{inner}
+    , amzSdkRequest_{builder.add("amz-sdk-request")}
+    , metrics_{metrics} {
+  }
+
+  kj::Promise<void> request(
+    kj::HttpMethod method,
+    kj::StringPtr url,
+    const kj::HttpHeaders& headers,
+    kj::AsyncInputStream& body,
+    Response& response) override;
+
+  kj::HttpService& inner_;
+  kj::HttpHeaderId amzSdkRequest_;
+  ClientMetrics& metrics_;
+  const kj::MonotonicClock& clock_{kj::systemPreciseMonotonicClock()};
+};
+
+// Times one request and counts what comes back.
+struct Observer
+  : kj::HttpService::Response {
+
+  Observer(MetricsService& service, S3Operation op, Response& response)
+    : service_{service}
+    , op_{static_cast<size_t>(op)}
+    , response_{response}
+    , started_{service.clock_.now()} {
+  }
+
+  kj::Own<kj::AsyncOutputStream> send(
+      uint statusCode,
+      kj::StringPtr statusText,
+      const kj::HttpHeaders& headers,
+      kj::Maybe<uint64_t> expectedBodySize) override {
+
+    auto& metrics = service_.metrics_;
+    metrics.firstByte_[op_].record(service_.clock_.now() - started_);
+    statusCode_ = statusCode;
+    auto stream = kj::heap<CountingStream>(
+      response_.send(statusCode, statusText, headers, expectedBodySize),
+      metrics, statusCode >= 300);
+    body_ = *stream;
+    return stream;
+  }
+
+  kj::Own<kj::WebSocket> acceptWebSocket(const kj::HttpHeaders& headers) override {
+    return response_.acceptWebSocket(headers);
+  }
+
+  void finish() {
+    auto& metrics = service_.metrics_;
+    metrics.total_[op_].record(service_.clock_.now() - started_);
+    if (statusCode_ >= 300) {
+      kj::Maybe<kj::String> code;
+      KJ_IF_MAYBE(body, body_) {
+	code = errorCode(body->body_.asPtr());
+      }
+      KJ_IF_MAYBE(c, code) {
+	metrics.error(*c);
+      }
+      else {
+	metrics.error(kj::str("Http"_kj, statusCode_));
+      }
+    }
+  }
+
+  MetricsService& service_;
+  size_t op_;
+  Response& response_;
+  kj::TimePoint started_;
+  uint statusCode_{0};
+  kj::Maybe<CountingStream&> body_;
+};
+
+kj::Promise<void> MetricsService::request(
+    kj::HttpMethod method,
+    kj::StringPtr url,
+    const kj::HttpHeaders& headers,
+    kj::AsyncInputStream& body,
+    Response& response) {
+
+  auto& metrics = metrics_;
+  metrics.requests_.fetch_add(1, RELAXED);
+  KJ_IF_MAYBE(attempt, headers.get(amzSdkRequest_)) {
+    if (!attempt->startsWith("attempt=1;"_kj) && *attempt != "attempt=1"_kj) {
+      metrics.retries_.fetch_add(1, RELAXED);
+    }
+  }
+  KJ_IF_MAYBE(length, body.tryGetLength()) {
+    metrics.bytesOut_.fetch_add(*length, RELAXED);
+  }
+
+  metrics.inFlight_.fetch_add(1, RELAXED);
+  auto done = kj::defer([&metrics]{ metrics.inFlight_.fetch_sub(1, RELAXED); });
+  auto observer = kj::heap<Observer>(*this, classify(method, url), response);
+  auto& o = *observer;
+  return
+    inner_.request(method, url, headers, body, o)
+    .then(
+      [&o]{
+	o.finish();
+      },
+      [&metrics](kj::Exception&& exc) {
+	metrics.error(kj::str(exc.getType()));
+	kj::throwFatalException(kj::mv(exc));
+      }
+    )
+    .attach(kj::mv(observer), kj::mv(done));
+}
+
+template <typename T>
+void setHistograms(
+    capnp::List<Metrics::Histogram>::Builder histograms,
+    const T& values) {
+
+  for (auto ii: kj::indices(histograms)) {
+    auto histogram = histograms[ii];
+    auto& value = values[ii];
+    histogram.setOperation(operationName(static_cast<S3Operation>(ii)));
+    auto bounds = histogram.initBounds(LatencyHistogram::BUCKETS);
+    auto counts = histogram.initCounts(LatencyHistogram::BUCKETS + 1);
+    for (auto jj: kj::zeroTo(LatencyHistogram::BUCKETS + 1)) {
+      if (jj < LatencyHistogram::BUCKETS) {
+	bounds.set(jj, LatencyHistogram::bound(jj));
+      }
+      counts.set(jj, value.counts_[jj].load(RELAXED));
+    }
+    histogram.setSum(value.sumNs_.load(RELAXED) / 1e9);
+    histogram.setCount(value.count_.load(RELAXED));
+  }
+}
+
+kj::StringTree prometheusHistogram(
+    kj::StringPtr name,
+    kj::StringPtr help,
+    const LatencyHistogram (&histograms)[S3_OPERATIONS]) {
+
+  auto txt = kj::strTree(
+    "# HELP "_kj, name, ' ', help, "\n"_kj,
+    "# TYPE "_kj, name, " histogram\n"_kj
+  );
+  for (auto ii: kj::zeroTo(S3_OPERATIONS)) {
+    auto& histogram = histograms[ii];
+    auto op = operationName(static_cast<S3Operation>(ii));
+    uint64_t cumulative = 0;
+    for (auto jj: kj::zeroTo(LatencyHistogram::BUCKETS)) {
+      cumulative += histogram.counts_[jj].load(RELAXED);
+      txt = kj::strTree(
+	kj::mv(txt), name, "_bucket{operation=\""_kj, op, "\",le=\""_kj,
+	LatencyHistogram::bound(jj), "\"} "_kj, cumulative, '\n'
+      );
+    }
+    txt = kj::strTree(
+      kj::mv(txt),
+      name, "_bucket{operation=\""_kj, op, "\",le=\"+Inf\"} "_kj,
+      histogram.count_.load(RELAXED), '\n',
+      name, "_sum{operation=\""_kj, op, "\"} "_kj,
+      histogram.sumNs_.load(RELAXED) / 1e9, '\n',
+      name, "_count{operation=\""_kj, op, "\"} "_kj,
+      histogram.count_.load(RELAXED), '\n'
+    );
+  }
+  return txt;
+}
+
+kj::StringTree prometheusValue(
+    kj::StringPtr name, kj::StringPtr type, kj::StringPtr help, int64_t value) {
+  return kj::strTree(
+    "# HELP "_kj, name, ' ', help, "\n"_kj,
+    "# TYPE "_kj, name, ' ', type, '\n',
+    name, ' ', value, '\n'
+  );
+}
+
+struct MetricsServer
+  : Metrics::Server {
+
+  MetricsServer(kj::Own<ClientMetrics> metrics)
+    : metrics_{kj::mv(metrics)} {
+  }
+
+  kj::Promise<void> get(GetContext ctx) override {
+    metrics_->get(ctx.getResults());
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> prometheus(PrometheusContext ctx) override {
+    ctx.getResults().setText(metrics_->prometheus());
+    return kj::READY_NOW;
+  }
+
+  kj::Own<ClientMetrics> metrics_;
+};
+
+struct SumServer
+  : Metrics::Server {
+
+  SumServer(kj::Array<Metrics::Client> clients)
+    : clients_{kj::mv(clients)} {
+  }
+
+  kj::Promise<void> get(GetContext ctx) override {
+    return
+      sum()
+      .then(
+        [ctx = kj::mv(ctx)](auto metrics) mutable {
+	  metrics->get(ctx.getResults());
+	}
+      );
+  }
+
+  kj::Promise<void> prometheus(PrometheusContext ctx) override {
+    return
+      sum()
+      .then(
+        [ctx = kj::mv(ctx)](auto metrics) mutable {
+	  ctx.getResults().setText(metrics->prometheus());
+	}
+      );
+  }
+
+  kj::Promise<kj::Own<ClientMetrics>> sum() {
+    auto promises = KJ_MAP(client, clients_) {
+      return client.getRequest().send();
+    };
+    return
+      kj::joinPromises(kj::mv(promises))
+      .then(
+        [](auto snapshots) {
+	  auto metrics = kj::refcounted<ClientMetrics>();
+	  for (auto& snapshot: snapshots) {
+	    metrics->add(snapshot);
+	  }
+	  return metrics;
+	}
+      );
+  }
+
+  kj::Array<Metrics::Client> clients_;
+};
+
+template <typename T>
+void addHistograms(T& values, capnp::List<Metrics::Histogram>::Reader histograms) {
+  for (auto ii: kj::zeroTo(kj::min(histograms.size(), S3_OPERATIONS))) {
+    values[ii].add(histograms[ii]);
+  }
+}
+
+}
+
+kj::StringPtr operationName(S3Operation op) {
+  switch (op) {
+    case S3Operation::HEAD: return "head"_kj;
+    case S3Operation::READ: return "read"_kj;
+    case S3Operation::WRITE: return "write"_kj;
+    case S3Operation::PART: return "part"_kj;
+    case S3Operation::COMPLETE: return "complete"_kj;
+    case S3Operation::LIST: return "list"_kj;
+    case S3Operation::OTHER: return "other"_kj;
+  }
+  KJ_UNREACHABLE;
+}
+
+void LatencyHistogram::record(kj::Duration duration) {
+  auto ns = kj::max(duration / kj::NANOSECONDS, int64_t{0});
+  auto us = static_cast<uint64_t>(ns) / 1000;
+
+  // bucket ii holds durations below 2^(FIRST_BOUND_LOG2 + ii) us
+  size_t bucket = 0;
+  if (us >> FIRST_BOUND_LOG2) {
+    auto log2 = 63 - __builtin_clzll(us);
+    bucket = kj::min(size_t(log2 - FIRST_BOUND_LOG2 + 1), BUCKETS);
+  }
+  counts_[bucket].fetch_add(1, RELAXED);
+  sumNs_.fetch_add(ns, RELAXED);
+  count_.fetch_add(1, RELAXED);
+}
+
+void LatencyHistogram::add(Metrics::Histogram::Reader histogram) {
+  auto counts = histogram.getCounts();
+  for (auto ii: kj::zeroTo(kj::min(counts.size(), BUCKETS + 1))) {
+    counts_[ii].fetch_add(counts[ii], RELAXED);
+  }
+  sumNs_.fetch_add(static_cast<uint64_t>(histogram.getSum() * 1e9), RELAXED);
+  count_.fetch_add(histogram.getCount(), RELAXED);
+}
+
+double LatencyHistogram::bound(size_t ii) {
+  return (uint64_t{1} << (FIRST_BOUND_LOG2 + ii)) / 1e6;
+}
+
+void ClientMetrics::error(kj::StringPtr code) {
+  auto errors = errors_.lockExclusive();
+  errors->upsert(kj::str(code), 1,
+    [](uint64_t& existing, uint64_t&&) {
+      ++existing;
+    }
+  );
+}
+
+void ClientMetrics::add(Metrics::Snapshot::Reader snapshot) {
+  addHistograms(firstByte_, snapshot.getFirstByte());
+  addHistograms(total_, snapshot.getTotal());
+  bytesIn_.fetch_add(snapshot.getBytesIn(), RELAXED);
+  bytesOut_.fetch_add(snapshot.getBytesOut(), RELAXED);
+  requests_.fetch_add(snapshot.getRequests(), RELAXED);
+  retries_.fetch_add(snapshot.getRetries(), RELAXED);
+  inFlight_.fetch_add(snapshot.getInFlight(), RELAXED);
+  multipartBuffers_.fetch_add(snapshot.getMultipartBuffers(), RELAXED);
+
+  auto errors = errors_.lockExclusive();
+  for (auto error: snapshot.getErrors()) {
+    errors->upsert(kj::str(error.getCode()), error.getCount(),
+      [](uint64_t& existing, uint64_t&& count) {
+	existing += count;
+      }
+    );
+  }
+}
+
+void ClientMetrics::get(Metrics::Snapshot::Builder snapshot) const {
+  setHistograms(snapshot.initFirstByte(S3_OPERATIONS), firstByte_);
+  setHistograms(snapshot.initTotal(S3_OPERATIONS), total_);
+  snapshot.setBytesIn(bytesIn_.load(RELAXED));
+  snapshot.setBytesOut(bytesOut_.load(RELAXED));
+  snapshot.setRequests(requests_.load(RELAXED));
+  snapshot.setRetries(retries_.load(RELAXED));
+  snapshot.setInFlight(inFlight_.load(RELAXED));
+  snapshot.setMultipartBuffers(multipartBuffers_.load(RELAXED));
+
+  auto errors = errors_.lockShared();
+  auto counts = snapshot.initErrors(errors->size());
+  auto ii = 0u;
+  for (auto& entry: *errors) {
+    auto count = counts[ii++];
+    count.setCode(entry.key);
+    count.setCount(entry.value);
+  }
+}
+
+kj::String ClientMetrics::prometheus() const {
+  auto txt = kj::strTree(
+    prometheusHistogram(
+      "aws_s3_first_byte_seconds"_kj,
+      "Time from sending a request to its response headers."_kj,
+      firstByte_),
+    prometheusHistogram(
+      "aws_s3_request_duration_seconds"_kj,
+      "Time from sending a request to the end of its response."_kj,
+      total_),
+    prometheusValue(
+      "aws_s3_received_bytes_total"_kj, "counter"_kj,
+      "Response body bytes received."_kj, bytesIn_.load(RELAXED)),
+    prometheusValue(
+      "aws_s3_sent_bytes_total"_kj, "counter"_kj,
+      "Request body bytes sent."_kj, bytesOut_.load(RELAXED)),
+    prometheusValue(
+      "aws_s3_requests_total"_kj, "counter"_kj,
+      "Requests sent, including retries."_kj, requests_.load(RELAXED)),
+    prometheusValue(
+      "aws_s3_retries_total"_kj, "counter"_kj,
+      "Requests that were retries of earlier attempts."_kj, retries_.load(RELAXED)),
+    prometheusValue(
+      "aws_s3_requests_in_flight"_kj, "gauge"_kj,
+      "Requests awaiting the end of their response."_kj, inFlight_.load(RELAXED)),
+    prometheusValue(
+      "aws_s3_multipart_buffers"_kj, "gauge"_kj,
+      "Part buffers held by multipart uploads."_kj, multipartBuffers_.load(RELAXED)),
+    "# HELP aws_s3_errors_total Failed requests by S3 error code.\n"_kj,
+    "# TYPE aws_s3_errors_total counter\n"_kj
+  );
+
+  auto errors = errors_.lockShared();
+  for (auto& entry: *errors) {
+    txt = kj::strTree(
+      kj::mv(txt),
+      "aws_s3_errors_total{code=\""_kj, entry.key, "\"} "_kj, entry.value, '\n'
+    );
+  }
+  return txt.flatten();
+}
+
+kj::Own<kj::HttpService> newMetricsService(
+    kj::HttpService& inner,
+    kj::HttpHeaderTable::Builder& builder,
+    ClientMetrics& metrics) {
+  return kj::heap<MetricsService>(inner, builder, metrics);
+}
+
+Metrics::Client newMetricsServer(kj::Own<ClientMetrics> metrics) {
+  return kj::heap<MetricsServer>(kj::mv(metrics));
+}
+
+Metrics::Client newMetricsServer(kj::Array<Metrics::Client> clients) {
+  return kj::heap<SumServer>(kj::mv(clients));
+}
+
+}
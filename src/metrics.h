@@ -0,0 +1,91 @@
+#pragma once
+
+// Copyright (c) 2023 Vaci Koblizek.
+// Licensed under the Apache 2.0 license found in the LICENSE file or at:
+//     https://opensource.org/licenses/Apache-2.0
+
+#include "s3.capnp.h"
+
+#include <kj/compat/http.h>
+#include <kj/map.h>
+#include <kj/mutex.h>
+#include <kj/refcount.h>
+#include <kj/time.h>
+
+#include <atomic>
+
+namespace aws {
+
+enum class S3Operation : uint8_t {
+  HEAD,
+  READ,
+  WRITE,
+  PART,
+  COMPLETE,
+  LIST,
+  OTHER
+};
+
+constexpr size_t S3_OPERATIONS = 7;
+
+kj::StringPtr operationName(S3Operation);
+
+// Counts of durations in buckets of powers of two microseconds, from
+// 64us up to about a minute. Recording is a few relaxed atomic adds.
+struct LatencyHistogram {
+
+  static constexpr size_t BUCKETS = 21;
+  static constexpr uint32_t FIRST_BOUND_LOG2 = 6;
+
+  void record(kj::Duration);
+  void add(Metrics::Histogram::Reader);
+
+  // Upper bound of bucket `ii`, in seconds.
+  static double bound(size_t ii);
+
+  std::atomic<uint64_t> counts_[BUCKETS + 1] = {};
+  std::atomic<uint64_t> sumNs_{0};
+  std::atomic<uint64_t> count_{0};
+};
+
+// What the S3 client has been doing. Everything but the error counts,
+// which are only updated on failure, is lock-free.
+struct ClientMetrics
+  : kj::Refcounted {
+
+  LatencyHistogram firstByte_[S3_OPERATIONS];
+  LatencyHistogram total_[S3_OPERATIONS];
+
+  std::atomic<uint64_t> bytesIn_{0};
+  std::atomic<uint64_t> bytesOut_{0};
+  std::atomic<uint64_t> requests_{0};
+  std::atomic<uint64_t> retries_{0};
+  std::atomic<int64_t> inFlight_{0};
+  std::atomic<int64_t> multipartBuffers_{0};
+
+  void error(kj::StringPtr code);
+
+  // Adds the counts of another client's snapshot to these.
+  void add(Metrics::Snapshot::Reader);
+
+  void get(Metrics::Snapshot::Builder) const;
+  kj::String prometheus() const;
+
+  kj::MutexGuarded<kj::HashMap<kj::String, uint64_t>> errors_;
+};
+
+// Records every request to `inner`, and each attempt separately when
+// retried.
+kj::Own<kj::HttpService> newMetricsService(
+  kj::HttpService& inner,
+  kj::HttpHeaderTable::Builder&,
+  ClientMetrics&
+);
+
+Metrics::Client newMetricsServer(kj::Own<ClientMetrics>);
+
+// Sums the metrics of several clients on each call, e.g. those of the
+// shards of a sharded S3 client.
+Metrics::Client newMetricsServer(kj::Array<Metrics::Client>);
+
+}
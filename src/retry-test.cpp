@@ -0,0 +1,169 @@
+// Copyright (c) 2023 Vaci Koblizek.
+// Licensed under the Apache 2.0 license found in the LICENSE file or at:
+//     https://opensource.org/licenses/Apache-2.0
+
+#include "retry.h"
+
+#include <kj/async-io.h>
+#include <kj/compat/http.h>
+#include <kj/debug.h>
+#include <kj/main.h>
+#include <kj/vector.h>
+
+#include <gtest/gtest.h>
+
+using namespace aws;
+
+static int EKAM_TEST_DISABLE_INTERCEPTOR = 1;
+
+namespace {
+
+// Answers the first `failures` requests with `status`, or never if it
+// is zero, and the rest with 200 OK.
+struct FlakyService
+  : kj::HttpService {
+
+  FlakyService(kj::HttpHeaderTable::Builder& builder, uint failures, uint status)
+    : table_{builder.getFutureTable()}
+    , amzSdkRequest_{builder.add("amz-sdk-request")}
+    , failures_{failures}
+    , status_{status} {
+  }
+
+  kj::Promise<void> request(
+      kj::HttpMethod method,
+      kj::StringPtr url,
+      const kj::HttpHeaders& headers,
+      kj::AsyncInputStream& body,
+      Response& response) override {
+
+    attempts_.add(kj::str(KJ_ASSERT_NONNULL(headers.get(amzSdkRequest_))));
+    return
+      body.readAllText()
+      .then(
+        [this, &response](auto text) -> kj::Promise<void> {
+	  bodies_.add(kj::mv(text));
+	  kj::HttpHeaders headers{table_};
+	  if (attempts_.size() <= failures_) {
+	    if (status_ == 0) {
+	      return kj::NEVER_DONE;
+	    }
+	    response.send(status_, "Slow Down"_kj, headers, 0ul);
+	    return kj::READY_NOW;
+	  }
+	  auto stream = response.send(200, "OK"_kj, headers, 2ul);
+	  auto& s = *stream;
+	  return s.write("ok", 2).attach(kj::mv(stream));
+	}
+      );
+  }
+
+  kj::HttpHeaderTable& table_;
+  kj::HttpHeaderId amzSdkRequest_;
+  uint failures_;
+  uint status_;
+  kj::Vector<kj::String> attempts_;
+  kj::Vector<kj::String> bodies_;
+};
+
+struct RetryTest
+  : testing::Test {
+
+  RetryTest() {
+    options_.baseDelay = 1 * kj::MILLISECONDS;
+  }
+
+  ~RetryTest() noexcept {}
+
+  struct Result {
+    uint statusCode_;
+    kj::String body_;
+  };
+
+  Result send(
+      uint failures, uint status,
+      kj::HttpMethod method = kj::HttpMethod::GET,
+      kj::StringPtr body = nullptr,
+      kj::Maybe<kj::StringPtr> range = nullptr) {
+
+    kj::HttpHeaderTable::Builder builder;
+    inner_ = kj::heap<FlakyService>(builder, failures, status);
+    auto rangeId = builder.add("range");
+    auto service = newRetryService(timer_, *inner_, builder, options_);
+    auto table = builder.build();
+    auto client = kj::newHttpClient(*service);
+
+    kj::HttpHeaders headers{*table};
+    KJ_IF_MAYBE(value, range) {
+      headers.set(rangeId, *value);
+    }
+    auto req = client->request(method, "https://bucket.s3.amazonaws.com/key"_kj, headers, body.size());
+    if (body.size()) {
+      req.body->write(body.begin(), body.size()).wait(waitScope_);
+    }
+    req.body = nullptr;
+    auto response = req.response.wait(waitScope_);
+    auto text = response.body->readAllText().wait(waitScope_);
+    return {response.statusCode, kj::mv(text)};
+  }
+
+  kj::AsyncIoContext ioCtx_{kj::setupAsyncIo()};
+  kj::WaitScope& waitScope_{ioCtx_.waitScope};
+  kj::Timer& timer_{ioCtx_.provider->getTimer()};
+  RetryOptions options_;
+  kj::Own<FlakyService> inner_;
+};
+
+}
+
+TEST_F(RetryTest, RetriesSlowDown) {
+  auto result = send(2, 503);
+  EXPECT_EQ(result.statusCode_, 200);
+  EXPECT_EQ(result.body_, "ok"_kj);
+  ASSERT_EQ(inner_->attempts_.size(), 3);
+  EXPECT_EQ(inner_->attempts_[0], "attempt=1; max=3"_kj);
+  EXPECT_EQ(inner_->attempts_[2], "attempt=3; max=3"_kj);
+}
+
+TEST_F(RetryTest, ReplaysBody) {
+  auto result = send(1, 500, kj::HttpMethod::PUT, "content"_kj);
+  EXPECT_EQ(result.statusCode_, 200);
+  ASSERT_EQ(inner_->bodies_.size(), 2);
+  EXPECT_EQ(inner_->bodies_[1], "content"_kj);
+}
+
+TEST_F(RetryTest, GivesUp) {
+  auto result = send(5, 503);
+  EXPECT_EQ(result.statusCode_, 503);
+  EXPECT_EQ(inner_->attempts_.size(), 3);
+}
+
+TEST_F(RetryTest, NotRetryable) {
+  auto result = send(1, 403);
+  EXPECT_EQ(result.statusCode_, 403);
+  EXPECT_EQ(inner_->attempts_.size(), 1);
+}
+
+TEST_F(RetryTest, AttemptTimeout) {
+  options_.attemptTimeout = 10 * kj::MILLISECONDS;
+  auto result = send(1, 0);
+  EXPECT_EQ(result.statusCode_, 200);
+  EXPECT_EQ(inner_->attempts_.size(), 2);
+}
+
+TEST_F(RetryTest, Hedge) {
+  options_.hedge = true;
+  options_.hedgeDelay = 10 * kj::MILLISECONDS;
+  auto result = send(1, 0, kj::HttpMethod::GET, nullptr, "bytes=0-1"_kj);
+  EXPECT_EQ(result.statusCode_, 200);
+  ASSERT_EQ(inner_->attempts_.size(), 2);
+  EXPECT_EQ(inner_->attempts_[1], "attempt=2; max=3"_kj);
+}
+
+int main(int argc, char* argv[]) {
+  kj::TopLevelProcessContext processCtx{argv[0]};
+  processCtx.increaseLoggingVerbosity();
+
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,464 @@
+// Copyright (c) 2023 Vaci Koblizek.
+// Licensed under the Apache 2.0 license found in the LICENSE file or at:
+//     https://opensource.org/licenses/Apache-2.0
+
+#include "retry.h"
+
+#include <kj/debug.h>
+
+#include <algorithm>
+#include <cstring>
+#include <random>
+
+namespace aws {
+
+namespace {
+
+// Swallows the body of a response that is not being used.
+struct NullStream
+  : kj::AsyncOutputStream {
+
+  kj::Promise<void> write(const void*, size_t) override {
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> write(kj::ArrayPtr<const kj::ArrayPtr<const kj::byte>>) override {
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> whenWriteDisconnected() override {
+    return kj::NEVER_DONE;
+  }
+};
+
+// Sends a buffered request body again.
+struct ReplayStream
+  : kj::AsyncInputStream {
+
+  ReplayStream(kj::ArrayPtr<const kj::byte> data)
+    : data_{data} {
+  }
+
+  kj::Promise<size_t> tryRead(void* buffer, size_t minBytes, size_t maxBytes) override {
+    auto count = kj::min(maxBytes, data_.size());
+    memcpy(buffer, data_.begin(), count);
+    data_ = data_.slice(count, data_.size());
+    return count;
+  }
+
+  kj::Maybe<uint64_t> tryGetLength() override {
+    return data_.size();
+  }
+
+  kj::ArrayPtr<const kj::byte> data_;
+};
+
+// The 95th percentile of the most recent times to response headers.
+struct Latencies {
+
+  static constexpr size_t SIZE = 128;
+  static constexpr size_t MIN_SAMPLES = 32;
+
+  kj::Duration p95(kj::Duration fallback) const {
+    KJ_IF_MAYBE(p95, p95_) {
+      return *p95;
+    }
+    return fallback;
+  }
+
+  void add(kj::Duration latency) {
+    samples_[count_++ % SIZE] = latency / kj::NANOSECONDS;
+    if (count_ < MIN_SAMPLES || count_ % 16) {
+      return;
+    }
+
+    auto size = kj::min(count_, SIZE);
+    int64_t sorted[SIZE];
+    std::copy(samples_.begin(), samples_.begin() + size, sorted);
+    auto nth = sorted + size * 95 / 100;
+    std::nth_element(sorted, nth, sorted + size);
+    p95_ = *nth * kj::NANOSECONDS;
+  }
+
+  kj::FixedArray<int64_t, SIZE> samples_;
+  size_t count_{0};
+  kj::Maybe<kj::Duration> p95_;
+};
+
+// Parses the decimal digits of `txt`.
+kj::Maybe<uint64_t> parseDecimal(kj::ArrayPtr<const char> txt) {
+  if (txt.size() == 0 || txt.size() > 19) {
+    return nullptr;
+  }
+  uint64_t value = 0;
+  for (auto c: txt) {
+    if (c < '0' || c > '9') {
+      return nullptr;
+    }
+    value = value * 10 + (c - '0');
+  }
+  return value;
+}
+
+struct Exchange;
+
+struct RetryService
+  : kj::HttpService {
+
+  RetryService(
+      kj::Timer& timer,
+      kj::HttpService& inner,
+      kj::HttpHeaderTable::Builder& builder,
+      const RetryOptions& options)
+    : timer_{timer}
+    , inner_{inner}
+    , ids_{
+        .amzSdkRequest{builder.add("amz-sdk-request")},
+        .range{builder.add("range")}
+      }
+    , options_{options} {
+  }
+
+  kj::Promise<void> request(
+    kj::HttpMethod method,
+    kj::StringPtr url,
+    const kj::HttpHeaders& headers,
+    kj::AsyncInputStream& body,
+    Response& response) override;
+
+  // Whether the request is small and idempotent enough to send twice
+  // at once.
+  bool isHedgeable(kj::HttpMethod, const kj::HttpHeaders&) const;
+
+  kj::Timer& timer_;
+  kj::HttpService& inner_;
+
+  struct {
+    kj::HttpHeaderId amzSdkRequest;
+    kj::HttpHeaderId range;
+  } ids_;
+
+  RetryOptions options_;
+  Latencies latencies_;
+};
+
+// A request and its attempts, of which at most one has its response
+// forwarded to the caller.
+struct Exchange {
+
+  Exchange(
+      RetryService& service,
+      kj::HttpMethod method,
+      kj::StringPtr url,
+      const kj::HttpHeaders& headers,
+      kj::Array<kj::byte> body,
+      kj::HttpService::Response& response)
+    : service_{service}
+    , method_{method}
+    , url_{url}
+    , headers_{headers}
+    , body_{kj::mv(body)}
+    , response_{response}
+    , hedgeable_{service.isHedgeable(method, headers)} {
+  }
+
+  // Sends an attempt, and a hedge if it is slow, backing off and
+  // starting over while they fail with something worth retrying.
+  kj::Promise<void> run();
+
+  // Resolves to true once this attempt's response has been forwarded,
+  // or false if it failed and no other attempt is outstanding, so that
+  // the next should be sent.
+  kj::Promise<bool> attempt();
+
+  kj::Promise<bool> settle();
+
+  bool canRetry() const {
+    return attempts_ < service_.options_.maxAttempts;
+  }
+
+  RetryService& service_;
+  kj::HttpMethod method_;
+  kj::StringPtr url_;
+  const kj::HttpHeaders& headers_;
+  kj::Array<kj::byte> body_;
+  kj::HttpService::Response& response_;
+  bool hedgeable_;
+
+  uint32_t attempts_{0};
+  // attempts still waiting for response headers
+  uint32_t pending_{0};
+  bool forwarded_{false};
+  kj::Maybe<kj::Exception> failure_;
+};
+
+// Receives the response to one attempt, forwarding it to the caller
+// unless it is worth retrying and there is still a chance of a better
+// one.
+struct Attempt
+  : kj::HttpService::Response {
+
+  Attempt(Exchange& exchange)
+    : exchange_{exchange}
+    , started_{exchange.service_.timer_.now()} {
+    ++exchange_.pending_;
+  }
+
+  kj::Own<kj::AsyncOutputStream> send(
+      uint statusCode,
+      kj::StringPtr statusText,
+      const kj::HttpHeaders& headers,
+      kj::Maybe<uint64_t> expectedBodySize) override {
+
+    answered();
+    auto& exchange = exchange_;
+    if (exchange.forwarded_) {
+      // a hedge got there first
+      return kj::heap<NullStream>();
+    }
+
+    if (isRetryable(statusCode) && (exchange.pending_ || exchange.canRetry())) {
+      exchange.failure_ = KJ_EXCEPTION(FAILED, "Request failed", statusCode, statusText);
+      return kj::heap<NullStream>();
+    }
+
+    exchange.forwarded_ = true;
+    forwarded_ = true;
+    if (exchange.hedgeable_) {
+      auto& service = exchange.service_;
+      service.latencies_.add(service.timer_.now() - started_);
+    }
+    return exchange.response_.send(statusCode, statusText, headers, expectedBodySize);
+  }
+
+  kj::Own<kj::WebSocket> acceptWebSocket(const kj::HttpHeaders&) override {
+    KJ_UNIMPLEMENTED("WebSocket requests are not retried");
+  }
+
+  // The attempt has its response headers, or has failed.
+  void answered() {
+    if (!answered_) {
+      answered_ = true;
+      --exchange_.pending_;
+    }
+  }
+
+  Exchange& exchange_;
+  kj::TimePoint started_;
+  bool answered_{false};
+  bool forwarded_{false};
+};
+
+kj::Promise<void> Exchange::run() {
+  auto promise = attempt();
+  if (hedgeable_ && canRetry()) {
+    auto& service = service_;
+    auto delay = service.latencies_.p95(service.options_.hedgeDelay);
+    promise = promise.exclusiveJoin(
+      service.timer_.afterDelay(delay)
+      .then(
+        [this]() -> kj::Promise<bool> {
+	  if (forwarded_ || !canRetry()) {
+	    return kj::NEVER_DONE;
+	  }
+	  return attempt();
+	}
+      )
+    );
+  }
+
+  return
+    promise
+    .then(
+      [this](auto done) -> kj::Promise<void> {
+	if (done) {
+	  return kj::READY_NOW;
+	}
+	auto& service = service_;
+	return
+	  service.timer_.afterDelay(backoff(service.options_, attempts_))
+	  .then(
+	    [this]{
+	      return run();
+	    }
+	  );
+      }
+    );
+}
+
+kj::Promise<bool> Exchange::attempt() {
+  auto& service = service_;
+  auto& options = service.options_;
+  auto number = ++attempts_;
+
+  auto headers = kj::heap(headers_.cloneShallow());
+  headers->set(
+    service.ids_.amzSdkRequest,
+    kj::str("attempt="_kj, number, "; max="_kj, options.maxAttempts));
+  auto body = kj::heap<ReplayStream>(body_);
+  auto attempt = kj::heap<Attempt>(*this);
+  auto& a = *attempt;
+
+  // only the wait for the response headers is limited
+  auto deadline =
+    service.timer_.afterDelay(options.attemptTimeout)
+    .then(
+      [&a]() -> kj::Promise<void> {
+	if (a.answered_) {
+	  return kj::NEVER_DONE;
+	}
+	return KJ_EXCEPTION(OVERLOADED, "Timed out waiting for response");
+      }
+    );
+
+  return
+    service.inner_.request(method_, url_, *headers, *body, a)
+    .exclusiveJoin(kj::mv(deadline))
+    .then(
+      [this, &a]() -> kj::Promise<bool> {
+	a.answered();
+	if (a.forwarded_) {
+	  return true;
+	}
+	return settle();
+      },
+      [this, &a](kj::Exception&& exc) -> kj::Promise<bool> {
+	a.answered();
+	if (!a.forwarded_ && forwarded_) {
+	  // the winning hedge completes the exchange
+	  return kj::NEVER_DONE;
+	}
+	if (a.forwarded_ || !isRetryable(exc)) {
+	  return kj::mv(exc);
+	}
+	failure_ = kj::mv(exc);
+	return settle();
+      }
+    )
+    .attach(kj::mv(attempt), kj::mv(body), kj::mv(headers));
+}
+
+// Called when an attempt has failed in a way worth retrying.
+kj::Promise<bool> Exchange::settle() {
+  if (forwarded_ || pending_) {
+    // another attempt may yet succeed
+    return kj::NEVER_DONE;
+  }
+  if (canRetry()) {
+    return false;
+  }
+  return kj::cp(KJ_ASSERT_NONNULL(failure_));
+}
+
+kj::Promise<void> RetryService::request(
+    kj::HttpMethod method,
+    kj::StringPtr url,
+    const kj::HttpHeaders& headers,
+    kj::AsyncInputStream& body,
+    Response& response) {
+
+  auto replayable = false;
+  KJ_IF_MAYBE(length, body.tryGetLength()) {
+    replayable = *length <= options_.maxReplayBytes;
+  }
+
+  // callers that set the attempt number retry for themselves
+  if (!replayable ||
+      options_.maxAttempts < 2 ||
+      headers.get(ids_.amzSdkRequest) != nullptr) {
+    return inner_.request(method, url, headers, body, response);
+  }
+
+  auto size = KJ_ASSERT_NONNULL(body.tryGetLength());
+  auto buffer = kj::heapArray<kj::byte>(size);
+  auto promise = size
+    ? body.read(buffer.begin(), size)
+    : kj::Promise<void>{kj::READY_NOW};
+
+  return
+    promise
+    .then(
+      [this, method, url, &headers, &response, buffer = kj::mv(buffer)]() mutable {
+	auto exchange = kj::heap<Exchange>(
+	  *this, method, url, headers, kj::mv(buffer), response);
+	auto& e = *exchange;
+	return e.run().attach(kj::mv(exchange));
+      }
+    );
+}
+
+bool RetryService::isHedgeable(
+    kj::HttpMethod method,
+    const kj::HttpHeaders& headers) const {
+
+  if (!options_.hedge) {
+    return false;
+  }
+  if (method == kj::HttpMethod::HEAD) {
+    return true;
+  }
+  if (method != kj::HttpMethod::GET) {
+    return false;
+  }
+
+  // Range: bytes=<first>-<last>
+  KJ_IF_MAYBE(range, headers.get(ids_.range)) {
+    if (!range->startsWith("bytes="_kj)) {
+      return false;
+    }
+    auto spec = range->slice(6);
+    KJ_IF_MAYBE(dash, spec.findFirst('-')) {
+      KJ_IF_MAYBE(first, parseDecimal(spec.slice(0, *dash))) {
+	KJ_IF_MAYBE(last, parseDecimal(spec.slice(*dash + 1))) {
+	  return *first <= *last && *last - *first < options_.hedgeMaxBytes;
+	}
+      }
+    }
+  }
+  return false;
+}
+
+}
+
+bool isRetryable(uint statusCode) {
+  switch (statusCode) {
+    case 408:
+    case 429:
+    case 500:
+    case 502:
+    case 503:
+    case 504:
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool isRetryable(const kj::Exception& exc) {
+  auto type = exc.getType();
+  return
+    type == kj::Exception::Type::DISCONNECTED ||
+    type == kj::Exception::Type::OVERLOADED;
+}
+
+kj::Duration backoff(const RetryOptions& options, uint32_t attempt) {
+  auto ceiling = options.baseDelay;
+  for (auto ii = 1u; ii < attempt && ceiling < options.maxDelay; ++ii) {
+    ceiling = ceiling * 2;
+  }
+  ceiling = kj::min(ceiling, options.maxDelay);
+
+  thread_local std::minstd_rand rng{std::random_device{}()};
+  std::uniform_int_distribution<int64_t> jitter{0, ceiling / kj::NANOSECONDS};
+  return jitter(rng) * kj::NANOSECONDS;
+}
+
+kj::Own<kj::HttpService> newRetryService(
+    kj::Timer& timer,
+    kj::HttpService& inner,
+    kj::HttpHeaderTable::Builder& builder,
+    const RetryOptions& options) {
+  return kj::heap<RetryService>(timer, inner, builder, options);
+}
+
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+// Copyright (c) 2023 Vaci Koblizek.
+// Licensed under the Apache 2.0 license found in the LICENSE file or at:
+//     https://opensource.org/licenses/Apache-2.0
+
+#include <kj/async.h>
+#include <kj/compat/http.h>
+#include <kj/time.h>
+#include <kj/timer.h>
+
+namespace aws {
+
+struct RetryOptions {
+  // Attempts per request, including the first.
+  uint32_t maxAttempts = 3;
+
+  // The delay before retrying after attempt n is drawn uniformly from
+  // [0, min(maxDelay, baseDelay * 2^(n-1))].
+  kj::Duration baseDelay = 50 * kj::MILLISECONDS;
+  kj::Duration maxDelay = 5 * kj::SECONDS;
+
+  // How long an attempt may wait for the response headers, or for a
+  // multipart part to be sent and acknowledged.
+  kj::Duration attemptTimeout = 30 * kj::SECONDS;
+
+  // Request bodies up to this size are buffered so that they can be
+  // sent again. Larger ones are sent once.
+  size_t maxReplayBytes = 64 * 1024;
+
+  // Hedging of HEADs, and of GETs of ranges of at most hedgeMaxBytes:
+  // if no response headers arrive within the 95th percentile of recent
+  // ones (hedgeDelay until enough have been seen), a second attempt is
+  // sent and whichever answers first is used.
+  bool hedge = false;
+  uint64_t hedgeMaxBytes = 1024 * 1024;
+  kj::Duration hedgeDelay = 100 * kj::MILLISECONDS;
+};
+
+// Whether a status is worth retrying: S3's 500 InternalError and 503
+// SlowDown, as well as gateway errors and throttling.
+bool isRetryable(uint statusCode);
+
+// Whether an exception is worth retrying: connection resets and
+// timeouts.
+bool isRetryable(const kj::Exception&);
+
+// The jittered delay before retrying after `attempt`, counting from 1.
+kj::Duration backoff(const RetryOptions&, uint32_t attempt);
+
+// Retries requests to `inner` with replayable bodies that fail with a
+// retryable status or exception, setting amz-sdk-request to the
+// attempt, so that AwsService signs it.
+kj::Own<kj::HttpService> newRetryService(
+  kj::Timer&,
+  kj::HttpService& inner,
+  kj::HttpHeaderTable::Builder&,
+  const RetryOptions& = {}
+);
+
+}
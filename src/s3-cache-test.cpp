@@ -0,0 +1,376 @@
+// Copyright (c) 2023 Vaci Koblizek.
+// Licensed under the Apache 2.0 license found in the LICENSE file or at:
+//     https://opensource.org/licenses/Apache-2.0
+
+#include "s3-cache.h"
+
+#include "s3-server.h"
+
+#include <capnp/compat/byte-stream.h>
+
+#include <kj/async-io.h>
+#include <kj/debug.h>
+#include <kj/encoding.h>
+#include <kj/filesystem.h>
+#include <kj/main.h>
+
+#include <gtest/gtest.h>
+
+using namespace aws;
+
+static int EKAM_TEST_DISABLE_INTERCEPTOR = 1;
+
+namespace {
+
+// Forwards to `inner`, but fails writes while `failures_` is non-zero,
+// counting it down with each one.
+struct FlakyObject
+  : S3::Object::Server {
+
+  FlakyObject(S3::Object::Client inner, uint32_t& failures)
+    : inner_{kj::mv(inner)}
+    , failures_{failures} {
+  }
+
+  kj::Promise<void> head(HeadContext ctx) override {
+    auto params = ctx.getParams();
+    auto req = inner_.headRequest();
+    req.setVersion(params.getVersion());
+    req.setConditions(params.getConditions());
+    return ctx.tailCall(kj::mv(req));
+  }
+
+  kj::Promise<void> read(ReadContext ctx) override {
+    auto params = ctx.getParams();
+    auto req = inner_.readRequest();
+    req.setStream(params.getStream());
+    req.setFirst(params.getFirst());
+    req.setLast(params.getLast());
+    req.setVersion(params.getVersion());
+    req.setConditions(params.getConditions());
+    return ctx.tailCall(kj::mv(req));
+  }
+
+  kj::Promise<void> write(WriteContext ctx) override {
+    if (failures_) {
+      --failures_;
+      KJ_FAIL_REQUIRE("Write failed");
+    }
+    auto req = inner_.writeRequest();
+    req.setLength(ctx.getParams().getLength());
+    return ctx.tailCall(kj::mv(req));
+  }
+
+  kj::Promise<void> delete_(DeleteContext ctx) override {
+    auto req = inner_.deleteRequest();
+    req.setVersion(ctx.getParams().getVersion());
+    return ctx.tailCall(kj::mv(req));
+  }
+
+  S3::Object::Client inner_;
+  uint32_t& failures_;
+};
+
+struct FlakyBucket
+  : S3::Bucket::Server {
+
+  FlakyBucket(S3::Bucket::Client inner, uint32_t& failures)
+    : inner_{kj::mv(inner)}
+    , failures_{failures} {
+  }
+
+  kj::Promise<void> getObject(GetObjectContext ctx) override {
+    auto req = inner_.getObjectRequest();
+    req.setKey(ctx.getParams().getKey());
+    ctx.getResults().setObject(kj::heap<FlakyObject>(req.send().getObject(), failures_));
+    return kj::READY_NOW;
+  }
+
+  S3::Bucket::Client inner_;
+  uint32_t& failures_;
+};
+
+struct FlakyS3
+  : S3::Server {
+
+  FlakyS3(S3::Client inner, uint32_t& failures)
+    : inner_{kj::mv(inner)}
+    , failures_{failures} {
+  }
+
+  kj::Promise<void> createBucket(CreateBucketContext ctx) override {
+    auto req = inner_.createBucketRequest();
+    req.setName(ctx.getParams().getName());
+    ctx.getResults().setBucket(kj::heap<FlakyBucket>(req.send().getBucket(), failures_));
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> getBucket(GetBucketContext ctx) override {
+    auto req = inner_.getBucketRequest();
+    req.setName(ctx.getParams().getName());
+    ctx.getResults().setBucket(kj::heap<FlakyBucket>(req.send().getBucket(), failures_));
+    return kj::READY_NOW;
+  }
+
+  S3::Client inner_;
+  uint32_t& failures_;
+};
+
+struct S3CacheTest
+  : testing::Test {
+
+  S3CacheTest() {}
+  ~S3CacheTest() noexcept {}
+
+  S3::Client cache(const S3CacheOptions& options = {}) {
+    return cache(remote_, options);
+  }
+
+  S3::Client cache(S3::Client remote, const S3CacheOptions& options) {
+    return newS3Cache(timer_, kj::mv(remote), newS3Server(localDir_->clone(), factory_), options);
+  }
+
+  // Whether `object` exists, waiting up to a second for it to.
+  bool eventuallyExists(S3::Object::Client object) {
+    auto exists = [&]{
+      return
+	object.headRequest().send()
+	.then(
+	  [](auto) { return true; },
+	  [](kj::Exception&&) { return false; }
+	)
+	.wait(waitScope_);
+    };
+    for (auto ii = 0; ii < 100; ++ii) {
+      if (exists()) {
+	return true;
+      }
+      timer_.afterDelay(10 * kj::MILLISECONDS).wait(waitScope_);
+    }
+    return false;
+  }
+
+  S3::Object::Client object(S3::Client& s3, kj::StringPtr key) {
+    auto bucket = [&]{
+      auto req = s3.createBucketRequest();
+      req.setName("bucket");
+      return req.send().getBucket();
+    }();
+    auto req = bucket.getObjectRequest();
+    req.setKey(key);
+    return req.send().getObject();
+  }
+
+  void write(S3::Object::Client object, char c, size_t size = 10000) {
+    auto data = kj::heapArray<kj::byte>(size);
+    memset(data.begin(), c, data.size());
+    auto req = object.writeRequest();
+    req.setLength(size);
+    auto stream = req.send().getStream();
+    {
+      auto req = stream.writeRequest();
+      req.setBytes(data);
+      req.send().wait(waitScope_);
+    }
+    stream.endRequest().send().wait(waitScope_);
+    waitScope_.poll();
+  }
+
+  kj::Promise<kj::Array<kj::byte>> read(S3::Object::Client object, size_t size = 10000) {
+    auto pipe = kj::newOneWayPipe();
+    auto req = object.readRequest();
+    req.setStream(factory_.kjToCapnp(kj::mv(pipe.out)));
+    auto promise = req.send().ignoreResult();
+    auto data = kj::heapArray<kj::byte>(size);
+    auto& in = *pipe.in;
+    return
+      in.read(data.begin(), data.size())
+      .then(
+        [promise = kj::mv(promise)]() mutable {
+	  return kj::mv(promise);
+	}
+      )
+      .then(
+        [data = kj::mv(data)]() mutable {
+	  return kj::mv(data);
+	}
+      )
+      .attach(kj::mv(pipe.in));
+  }
+
+  // Whether the local store holds any version of `key`.
+  bool inLocalStore(kj::StringPtr key) {
+    waitScope_.poll();
+    return localDir_->exists(kj::Path{
+      kj::encodeHex("bucket"_kj.asBytes()), kj::encodeHex(key.asBytes())
+    });
+  }
+
+  kj::AsyncIoContext ioCtx_{kj::setupAsyncIo()};
+  kj::WaitScope& waitScope_{ioCtx_.waitScope};
+  kj::Timer& timer_{ioCtx_.provider->getTimer()};
+  capnp::ByteStreamFactory factory_;
+  kj::Own<const kj::Directory> remoteDir_{kj::newInMemoryDirectory(kj::systemPreciseCalendarClock())};
+  kj::Own<const kj::Directory> localDir_{kj::newInMemoryDirectory(kj::systemPreciseCalendarClock())};
+  S3::Client remote_{newS3Server(remoteDir_->clone(), factory_)};
+};
+
+}
+
+TEST_F(S3CacheTest, ReadThrough) {
+  auto s3 = cache();
+  auto remote = object(remote_, "foo"_kj);
+  auto cached = object(s3, "foo"_kj);
+
+  write(remote, 'a');
+  EXPECT_FALSE(inLocalStore("foo"_kj));
+  EXPECT_EQ(read(cached).wait(waitScope_)[9999], 'a');
+  EXPECT_TRUE(inLocalStore("foo"_kj));
+
+  // the changed ETag is noticed on the next read
+  write(remote, 'b');
+  EXPECT_EQ(read(cached).wait(waitScope_)[0], 'b');
+}
+
+TEST_F(S3CacheTest, Revalidate) {
+  S3CacheOptions options;
+  options.revalidateAfter = 1 * kj::HOURS;
+  auto s3 = cache(options);
+  auto remote = object(remote_, "foo"_kj);
+  auto cached = object(s3, "foo"_kj);
+
+  write(remote, 'a');
+  EXPECT_EQ(read(cached).wait(waitScope_)[0], 'a');
+
+  // still trusted, so the local copy is read
+  write(remote, 'b');
+  EXPECT_EQ(read(cached).wait(waitScope_)[0], 'a');
+}
+
+TEST_F(S3CacheTest, CollapseMisses) {
+  auto s3 = cache();
+  write(object(remote_, "foo"_kj), 'a');
+
+  auto cached = object(s3, "foo"_kj);
+  auto reads = kj::heapArrayBuilder<kj::Promise<kj::Array<kj::byte>>>(4);
+  for (auto ii = 0; ii < 4; ++ii) {
+    reads.add(read(cached));
+  }
+  for (auto& data: kj::joinPromises(reads.finish()).wait(waitScope_)) {
+    EXPECT_EQ(data[5000], 'a');
+  }
+
+  // a single fetch, so a single local version
+  auto versions = kj::Path{
+    kj::encodeHex("bucket"_kj.asBytes()), kj::encodeHex("foo"_kj.asBytes()), "versions"
+  };
+  EXPECT_TRUE(localDir_->exists(versions.append("0")));
+  EXPECT_FALSE(localDir_->exists(versions.append("1")));
+}
+
+TEST_F(S3CacheTest, Evict) {
+  S3CacheOptions options;
+  options.capacity = 15000;
+  auto s3 = cache(options);
+  write(object(remote_, "foo"_kj), 'a');
+  write(object(remote_, "bar"_kj), 'b');
+
+  EXPECT_EQ(read(object(s3, "foo"_kj)).wait(waitScope_)[0], 'a');
+  EXPECT_TRUE(inLocalStore("foo"_kj));
+  EXPECT_EQ(read(object(s3, "bar"_kj)).wait(waitScope_)[0], 'b');
+  EXPECT_TRUE(inLocalStore("bar"_kj));
+  EXPECT_FALSE(inLocalStore("foo"_kj));
+}
+
+TEST_F(S3CacheTest, WriteAround) {
+  S3CacheOptions options;
+  options.writePolicy = WritePolicy::AROUND;
+  options.revalidateAfter = 1 * kj::HOURS;
+  auto s3 = cache(options);
+  write(object(remote_, "foo"_kj), 'a');
+
+  // a write while the copy is being fetched is not hidden by it
+  auto cached = object(s3, "foo"_kj);
+  auto fetch = read(cached);
+  write(cached, 'b');
+  fetch.wait(waitScope_);
+  EXPECT_EQ(read(object(remote_, "foo"_kj)).wait(waitScope_)[0], 'b');
+  EXPECT_EQ(read(cached).wait(waitScope_)[0], 'b');
+}
+
+TEST_F(S3CacheTest, WriteThrough) {
+  S3CacheOptions options;
+  options.writePolicy = WritePolicy::THROUGH;
+  auto s3 = cache(options);
+
+  write(object(s3, "foo"_kj), 'c');
+  EXPECT_TRUE(inLocalStore("foo"_kj));
+  EXPECT_EQ(read(object(remote_, "foo"_kj)).wait(waitScope_)[0], 'c');
+  EXPECT_EQ(read(object(s3, "foo"_kj)).wait(waitScope_)[0], 'c');
+}
+
+TEST_F(S3CacheTest, WriteBack) {
+  S3CacheOptions options;
+  options.writePolicy = WritePolicy::BACK;
+  auto s3 = cache(options);
+  auto cached = object(s3, "foo"_kj);
+
+  write(cached, 'd');
+  EXPECT_EQ(read(cached).wait(waitScope_)[0], 'd');
+
+  // copied to S3 in the background
+  auto remote = object(remote_, "foo"_kj);
+  auto uploaded = [&]{
+    return
+      remote.headRequest().send()
+      .then(
+        [](auto) { return true; },
+	[](kj::Exception&&) { return false; }
+      )
+      .wait(waitScope_);
+  };
+  for (auto ii = 0; ii < 100 && !uploaded(); ++ii) {
+    timer_.afterDelay(10 * kj::MILLISECONDS).wait(waitScope_);
+  }
+  EXPECT_EQ(read(remote).wait(waitScope_)[0], 'd');
+}
+
+TEST_F(S3CacheTest, WriteBackFailure) {
+  uint32_t failures = 2;
+  S3CacheOptions options;
+  options.writePolicy = WritePolicy::BACK;
+  options.writeBackAttempts = 2;
+  options.writeBackBackoff = 1 * kj::MILLISECONDS;
+  options.capacity = 0;
+  auto s3 = cache(kj::heap<FlakyS3>(remote_, failures), options);
+  auto cached = object(s3, "foo"_kj);
+  auto remote = object(remote_, "foo"_kj);
+
+  // both attempts fail, and the copy is kept however full the cache
+  write(cached, 'e');
+  EXPECT_FALSE(eventuallyExists(remote));
+  EXPECT_EQ(failures, 0);
+  EXPECT_TRUE(inLocalStore("foo"_kj));
+  EXPECT_EQ(read(cached).wait(waitScope_)[0], 'e');
+
+  // that read tried again, this time successfully
+  EXPECT_TRUE(eventuallyExists(remote));
+  EXPECT_EQ(read(remote).wait(waitScope_)[0], 'e');
+
+  // a failure that a retry recovers from
+  failures = 1;
+  write(cached, 'f');
+  for (auto ii = 0; ii < 100 && read(remote).wait(waitScope_)[0] != 'f'; ++ii) {
+    timer_.afterDelay(10 * kj::MILLISECONDS).wait(waitScope_);
+  }
+  EXPECT_EQ(read(remote).wait(waitScope_)[0], 'f');
+  EXPECT_EQ(failures, 0);
+}
+
+int main(int argc, char* argv[]) {
+  kj::TopLevelProcessContext processCtx{argv[0]};
+  processCtx.increaseLoggingVerbosity();
+
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
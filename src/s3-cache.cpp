@@ -0,0 +1,995 @@
+// Copyright (c) 2023 Vaci Koblizek.
+// Licensed under the Apache 2.0 license found in the LICENSE file or at:
+//     https://opensource.org/licenses/Apache-2.0
+
+#include "s3-cache.h"
+
+#include "common.h"
+
+#include <kj/debug.h>
+#include <kj/map.h>
+#include <kj/vector.h>
+
+namespace aws {
+
+namespace {
+
+// The copy in the local store of an object, or of one version of it.
+struct LocalCopy {
+  LocalCopy(kj::StringPtr name, S3::Object::Client local, bool versioned)
+    : name_{kj::str(name)}
+    , local_{kj::mv(local)}
+    , versioned_{versioned} {
+  }
+
+  kj::String name_;
+  S3::Object::Client local_;
+  bool versioned_;
+
+  // The copy is complete, and had `etag_` in S3 when last checked. A
+  // copy written through the cache adopts S3's tag when first checked.
+  bool valid_{false};
+  kj::Maybe<kj::String> etag_;
+  uint64_t size_{0};
+  kj::Maybe<kj::TimePoint> checked_;
+
+  // written back, but not yet copied to S3, and why the last attempt
+  // to copy it failed, if it did
+  bool dirty_{false};
+  kj::Maybe<kj::Exception> failed_;
+
+  // A fetch, check or write is in progress, and `pending_` resolves
+  // once it is done.
+  bool busy_{false};
+  kj::Maybe<kj::ForkedPromise<void>> pending_;
+  // S3's object was written while the copy was busy, so it is dropped
+  // once whatever holds it is done
+  bool stale_{false};
+
+  // Requests using the copy, which is not evicted while there are any.
+  uint32_t users_{0};
+
+  // position in the cache's least recently used order
+  uint64_t used_{0};
+};
+
+// The ETag and length of an object, from its HEAD.
+struct ObjectInfo {
+  kj::String etag_;
+  uint64_t length_;
+};
+
+ObjectInfo objectInfo(S3::Object::Properties::Reader props) {
+  // S3 answers a HEAD of a missing key without an ETag
+  auto etag = props.getEtag();
+  KJ_REQUIRE(etag.size(), "No such key", props.getKey());
+  return {kj::str(etag), props.getSize()};
+}
+
+// Forwards `length` bytes of an object to `out`, and fulfils `done`
+// once they have all been written. Reads complete before the data they
+// send does, and leave the stream they write open, so `out` is ended
+// by whoever is waiting on `done`.
+struct ForwardStream
+  : capnp::ByteStream::Server {
+
+  ForwardStream(
+      capnp::ByteStream::Client out,
+      uint64_t length,
+      kj::Own<kj::PromiseFulfiller<void>> done)
+    : out_{kj::mv(out)}
+    , remaining_{length}
+    , done_{kj::mv(done)} {
+  }
+
+  ~ForwardStream() noexcept(false) {
+    if (done_->isWaiting()) {
+      done_->reject(KJ_EXCEPTION(DISCONNECTED, "Object ended early", remaining_));
+    }
+  }
+
+  kj::Promise<void> write(WriteContext ctx) override {
+    auto bytes = ctx.getParams().getBytes();
+    KJ_REQUIRE(bytes.size() <= remaining_, "Object longer than expected");
+    remaining_ -= bytes.size();
+    ++writing_;
+
+    auto req = out_.writeRequest();
+    req.setBytes(bytes);
+    return
+      req.send()
+      .then(
+        [this]{
+	  if (--writing_ == 0 && remaining_ == 0) {
+	    done_->fulfill();
+	  }
+	}
+      );
+  }
+
+  kj::Promise<void> end(EndContext) override {
+    return kj::READY_NOW;
+  }
+
+  capnp::ByteStream::Client out_;
+  uint64_t remaining_;
+  uint32_t writing_{0};
+  kj::Own<kj::PromiseFulfiller<void>> done_;
+};
+
+// Copies what is written to it to each of `outs`, and ends them all
+// when it is ended, fulfilling `done` with the length written.
+struct TeeStream
+  : capnp::ByteStream::Server {
+
+  TeeStream(
+      kj::Array<capnp::ByteStream::Client> outs,
+      kj::Own<kj::PromiseFulfiller<uint64_t>> done)
+    : outs_{kj::mv(outs)}
+    , done_{kj::mv(done)} {
+  }
+
+  ~TeeStream() noexcept(false) {
+    if (done_->isWaiting()) {
+      done_->reject(KJ_EXCEPTION(DISCONNECTED, "Write not ended", length_));
+    }
+  }
+
+  kj::Promise<void> write(WriteContext ctx) override {
+    auto bytes = ctx.getParams().getBytes();
+    length_ += bytes.size();
+    return kj::joinPromises(
+      KJ_MAP(out, outs_) {
+	auto req = out.writeRequest();
+	req.setBytes(bytes);
+	return req.send();
+      }
+    );
+  }
+
+  kj::Promise<void> end(EndContext) override {
+    return
+      kj::joinPromises(
+        KJ_MAP(out, outs_) {
+	  return out.endRequest().send().ignoreResult();
+	}
+      )
+      .then(
+        [this]{
+	  done_->fulfill(kj::cp(length_));
+	}
+      );
+  }
+
+  kj::Array<capnp::ByteStream::Client> outs_;
+  kj::Own<kj::PromiseFulfiller<uint64_t>> done_;
+  uint64_t length_{0};
+};
+
+// Copies `length` bytes from `in` to a new stream from `out`, ending it
+// once they have all been written.
+kj::Promise<void> transfer(
+    S3::Object::Client in,
+    kj::StringPtr version,
+    S3::Object::Client out,
+    uint64_t length) {
+
+  auto req = out.writeRequest();
+  req.setLength(length);
+  auto stream = req.send().getStream();
+  if (!length) {
+    return stream.endRequest().send().ignoreResult();
+  }
+
+  auto paf = kj::newPromiseAndFulfiller<void>();
+  auto read = in.readRequest();
+  read.setStream(kj::heap<ForwardStream>(stream, length, kj::mv(paf.fulfiller)));
+  read.setLast(length - 1);
+  read.setVersion(version);
+  return
+    read.send().ignoreResult()
+    .then(
+      [done = kj::mv(paf.promise)]() mutable {
+	return kj::mv(done);
+      }
+    )
+    .then(
+      [stream = kj::mv(stream)]() mutable {
+	return stream.endRequest().send().ignoreResult();
+      }
+    );
+}
+
+// A stream writing `length` bytes to `object`, or an upload if the
+// length is not known.
+capnp::ByteStream::Client writeTo(S3::Object::Client& object, kj::Maybe<uint64_t> length) {
+  KJ_IF_MAYBE(l, length) {
+    auto req = object.writeRequest();
+    req.setLength(*l);
+    return req.send().getStream();
+  }
+  return object.uploadRequest().send().getStream();
+}
+
+struct CacheServer
+  : S3::Server
+  , kj::Refcounted
+  , kj::TaskSet::ErrorHandler {
+
+  CacheServer(
+      kj::Timer& timer,
+      S3::Client remote,
+      S3::Client local,
+      const S3CacheOptions& options)
+    : timer_{timer}
+    , remote_{kj::mv(remote)}
+    , local_{kj::mv(local)}
+    , options_{options} {
+  }
+
+  kj::Own<CacheServer> addRef() {
+    return kj::addRef(*this);
+  }
+
+  void taskFailed(kj::Exception&& exc) override {
+    KJ_LOG(ERROR, exc);
+  }
+
+  kj::Promise<void> listBuckets(ListBucketsContext) override;
+  kj::Promise<void> getBucket(GetBucketContext) override;
+  kj::Promise<void> createBucket(CreateBucketContext) override;
+  kj::Promise<void> getMetrics(GetMetricsContext) override;
+
+  // Returns the copy of `key` in the local bucket `bucket`, named
+  // `bucketName`, and marks it as the most recently used.
+  LocalCopy& find(
+    S3::Bucket::Client& bucket, kj::StringPtr bucketName,
+    kj::StringPtr key, bool versioned);
+
+  // Resolves once `copy` is valid, checking its ETag against `remote`
+  // and fetching it again if that has changed. Concurrent callers share
+  // one check and one fetch.
+  kj::Promise<void> check(LocalCopy&, S3::Object::Client remote, kj::String version);
+  kj::Promise<void> refresh(LocalCopy&, S3::Object::Client remote, kj::String version);
+
+  // Marks `copy` busy until `promise` settles.
+  kj::Promise<void> hold(LocalCopy&, kj::Promise<void> promise);
+
+  // Copies the `length` bytes of dirty `copy` to `remote`, retrying
+  // with backoff. If every attempt fails the copy stays dirty.
+  kj::Promise<void> writeBack(
+    LocalCopy&, S3::Object::Client remote, uint64_t length, uint32_t attempt = 0);
+
+  // Runs `func` once nothing else holds `copy`.
+  template <typename Func>
+  kj::Promise<void> whenIdle(LocalCopy&, Func&& func);
+
+  // Records `length` bytes written to `copy` through the cache.
+  void written(LocalCopy&, uint64_t length, bool dirty);
+
+  // Drops the local data of `copy`, which is fetched again on next use.
+  // A dirty copy is only dropped when it is replaced or deleted.
+  void invalidate(LocalCopy&);
+  // Invalidates `copy` now, or once it is no longer busy.
+  void drop(LocalCopy&);
+
+  void touch(LocalCopy&);
+
+  // Evicts the least recently used copies that are not in use until
+  // the cache is within its capacity.
+  void evict();
+
+  kj::Timer& timer_;
+  S3::Client remote_;
+  S3::Client local_;
+  S3CacheOptions options_;
+
+  kj::HashMap<kj::String, kj::Own<LocalCopy>> copies_;
+  kj::TreeMap<uint64_t, LocalCopy*> lru_;
+  uint64_t tick_{0};
+  uint64_t size_{0};
+  kj::TaskSet tasks_{*this};
+};
+
+struct CacheBucket
+  : S3::Bucket::Server
+  , kj::Refcounted {
+
+  CacheBucket(kj::Own<CacheServer>, kj::StringPtr name, S3::Bucket::Client remote);
+
+  kj::Own<CacheBucket> addRef() {
+    return kj::addRef(*this);
+  }
+
+  kj::Promise<void> head(HeadContext) override;
+  kj::Promise<void> listObjects(ListObjectsContext) override;
+  kj::Promise<void> listObjectVersions(ListObjectVersionsContext) override;
+  kj::Promise<void> getObject(GetObjectContext) override;
+  kj::Promise<void> deleteObjects(DeleteObjectsContext) override;
+  kj::Promise<void> headObjects(HeadObjectsContext) override;
+
+  kj::Own<CacheServer> cache_;
+  kj::String name_;
+  S3::Bucket::Client remote_;
+
+  // Latest versions are kept under their own key, and specific
+  // versions in a second bucket whose name S3 would not allow.
+  S3::Bucket::Client local_;
+  kj::String versionsName_;
+  S3::Bucket::Client localVersions_;
+};
+
+struct CacheObject
+  : S3::Object::Server
+  , kj::Refcounted {
+
+  CacheObject(kj::Own<CacheBucket> bucket, kj::StringPtr key, S3::Object::Client remote)
+    : bucket_{kj::mv(bucket)}
+    , key_{kj::str(key)}
+    , remote_{kj::mv(remote)} {
+  }
+
+  kj::Own<CacheObject> addRef() {
+    return kj::addRef(*this);
+  }
+
+  kj::Promise<void> head(HeadContext) override;
+  kj::Promise<void> getBucket(GetBucketContext) override;
+  kj::Promise<void> read(ReadContext) override;
+  kj::Promise<void> write(WriteContext) override;
+  kj::Promise<void> multipart(MultipartContext) override;
+  kj::Promise<void> delete_(DeleteContext) override;
+  kj::Promise<void> upload(UploadContext) override;
+  kj::Promise<void> copyFrom(CopyFromContext) override;
+  kj::Promise<void> resumeMultipart(ResumeMultipartContext) override;
+
+  // Replies to a write or upload of `length` bytes, if known, with a
+  // stream as the write policy requires.
+  template <typename Context>
+  kj::Promise<void> startWrite(Context ctx, kj::Maybe<uint64_t> length);
+
+  // The copy of the latest version, or of `version`.
+  LocalCopy& localCopy(kj::StringPtr version);
+
+  // A read of the remote object with the same parameters.
+  capnp::Request<S3::Object::ReadParams, S3::Object::ReadResults> remoteRead(
+    S3::Object::ReadParams::Reader);
+
+  // Keeps `copy` from eviction until the returned value is destroyed.
+  auto use(LocalCopy& copy) {
+    ++copy.users_;
+    return kj::defer([&copy]{ --copy.users_; });
+  }
+
+  kj::Own<CacheBucket> bucket_;
+  kj::String key_;
+  S3::Object::Client remote_;
+};
+
+S3::Bucket::Client localBucket(S3::Client& local, kj::StringPtr name) {
+  auto req = local.createBucketRequest();
+  req.setName(name);
+  return req.send().getBucket();
+}
+
+kj::Promise<void> CacheServer::listBuckets(ListBucketsContext ctx) {
+  return ctx.tailCall(remote_.listBucketsRequest());
+}
+
+kj::Promise<void> CacheServer::getMetrics(GetMetricsContext ctx) {
+  return ctx.tailCall(remote_.getMetricsRequest());
+}
+
+kj::Promise<void> CacheServer::getBucket(GetBucketContext ctx) {
+  auto name = ctx.getParams().getName();
+  auto req = remote_.getBucketRequest();
+  req.setName(name);
+  auto reply = ctx.getResults();
+  reply.setBucket(
+    kj::refcounted<CacheBucket>(addRef(), name, req.send().getBucket())
+  );
+  return kj::READY_NOW;
+}
+
+kj::Promise<void> CacheServer::createBucket(CreateBucketContext ctx) {
+  auto name = kj::str(ctx.getParams().getName());
+  auto req = remote_.createBucketRequest();
+  req.setName(name);
+  return
+    req.send()
+    .then(
+      [this, ctx = kj::mv(ctx), name = kj::mv(name)](auto reply) mutable {
+	ctx.getResults().setBucket(
+	  kj::refcounted<CacheBucket>(addRef(), name, reply.getBucket())
+	);
+      }
+    );
+}
+
+LocalCopy& CacheServer::find(
+    S3::Bucket::Client& bucket, kj::StringPtr bucketName,
+    kj::StringPtr key, bool versioned) {
+
+  auto name = kj::str(bucketName, '/', key);
+  auto& copy = *copies_.findOrCreate(name,
+    [&]() -> decltype(copies_)::Entry {
+      auto req = bucket.getObjectRequest();
+      req.setKey(key);
+      return {
+	kj::str(name),
+	kj::heap<LocalCopy>(name, req.send().getObject(), versioned)
+      };
+    }
+  );
+  touch(copy);
+  return copy;
+}
+
+kj::Promise<void> CacheServer::check(
+    LocalCopy& copy, S3::Object::Client remote, kj::String version) {
+
+  if (copy.valid_) {
+    if (copy.dirty_ && !copy.busy_) {
+      // every attempt to write it back failed, so try again
+      tasks_.add(hold(copy, writeBack(copy, remote, copy.size_)));
+    }
+    // versions never change, and nor does a copy until it is written back
+    if (copy.versioned_ || copy.dirty_) {
+      return kj::READY_NOW;
+    }
+    KJ_IF_MAYBE(checked, copy.checked_) {
+      if (timer_.now() - *checked < options_.revalidateAfter) {
+        return kj::READY_NOW;
+      }
+    }
+  }
+
+  if (copy.busy_) {
+    // Whatever is in progress leaves the copy as fresh as a check
+    // would, unless it was invalidated meanwhile.
+    return
+      KJ_ASSERT_NONNULL(copy.pending_).addBranch()
+      .then(
+        [this, &copy, remote = kj::mv(remote), version = kj::mv(version)]() mutable
+	  -> kj::Promise<void> {
+	  if (copy.valid_) {
+	    return kj::READY_NOW;
+	  }
+	  return check(copy, kj::mv(remote), kj::mv(version));
+	}
+      );
+  }
+
+  return hold(copy, refresh(copy, kj::mv(remote), kj::mv(version)));
+}
+
+kj::Promise<void> CacheServer::refresh(
+    LocalCopy& copy, S3::Object::Client remote, kj::String version) {
+
+  auto req = remote.headRequest();
+  req.setVersion(version);
+  return
+    req.send()
+    .then(
+      [this, &copy, remote = kj::mv(remote), version = kj::mv(version)](auto reply) mutable
+        -> kj::Promise<void> {
+	auto info = objectInfo(reply);
+	if (copy.valid_) {
+	  KJ_IF_MAYBE(etag, copy.etag_) {
+	    if (*etag == info.etag_) {
+	      copy.checked_ = timer_.now();
+	      return kj::READY_NOW;
+	    }
+	  }
+	  else if (copy.size_ == info.length_) {
+	    copy.etag_ = kj::mv(info.etag_);
+	    copy.checked_ = timer_.now();
+	    return kj::READY_NOW;
+	  }
+	}
+
+	// Replace any stale copy, so that the new one is the local
+	// store's only version of the key.
+	invalidate(copy);
+	auto length = info.length_;
+	return
+	  copy.local_.deleteRequest().send().ignoreResult()
+	  .then(
+	    [&copy, remote = kj::mv(remote), version = kj::mv(version), length]() mutable {
+	      return transfer(kj::mv(remote), version, copy.local_, length);
+	    }
+	  )
+	  .then(
+	    [this, &copy, etag = kj::mv(info.etag_), length]() mutable {
+	      copy.valid_ = true;
+	      copy.etag_ = kj::mv(etag);
+	      copy.size_ = length;
+	      copy.checked_ = timer_.now();
+	      size_ += length;
+	      evict();
+	    }
+	  );
+      }
+    );
+}
+
+kj::Promise<void> CacheServer::hold(LocalCopy& copy, kj::Promise<void> promise) {
+  KJ_ASSERT(!copy.busy_);
+  copy.busy_ = true;
+  auto& pending = copy.pending_.emplace(
+    promise
+    .then(
+      [this, &copy]{
+	copy.busy_ = false;
+	if (copy.stale_) {
+	  drop(copy);
+	}
+      },
+      [this, &copy](kj::Exception&& exc) {
+	copy.busy_ = false;
+	if (copy.stale_) {
+	  drop(copy);
+	}
+	kj::throwFatalException(kj::mv(exc));
+      }
+    )
+    .fork()
+  );
+  return pending.addBranch();
+}
+
+kj::Promise<void> CacheServer::writeBack(
+    LocalCopy& copy, S3::Object::Client remote, uint64_t length, uint32_t attempt) {
+
+  return
+    transfer(copy.local_, nullptr, remote, length)
+    .then(
+      [&copy]() -> kj::Promise<void> {
+	copy.dirty_ = false;
+	copy.failed_ = nullptr;
+	return kj::READY_NOW;
+      },
+      [this, &copy, remote, length, attempt](kj::Exception&& exc) mutable -> kj::Promise<void> {
+	if (attempt + 1 >= options_.writeBackAttempts) {
+	  copy.failed_ = kj::cp(exc);
+	  kj::throwFatalException(kj::mv(exc));
+	}
+	KJ_LOG(WARNING, "Write back failed, retrying", copy.name_, attempt, exc);
+	return
+	  timer_.afterDelay(options_.writeBackBackoff * (int64_t{1} << kj::min(attempt, 16u)))
+	  .then(
+	    [this, &copy, remote = kj::mv(remote), length, attempt]() mutable {
+	      return writeBack(copy, kj::mv(remote), length, attempt + 1);
+	    }
+	  );
+      }
+    );
+}
+
+template <typename Func>
+kj::Promise<void> CacheServer::whenIdle(LocalCopy& copy, Func&& func) {
+  if (!copy.busy_) {
+    return func();
+  }
+
+  // whether or not whatever held the copy succeeded
+  return
+    KJ_ASSERT_NONNULL(copy.pending_).addBranch()
+    .then([]{}, [](kj::Exception&&){})
+    .then(
+      [this, &copy, func = kj::fwd<Func>(func)]() mutable {
+	return whenIdle(copy, kj::mv(func));
+      }
+    );
+}
+
+void CacheServer::written(LocalCopy& copy, uint64_t length, bool dirty) {
+  copy.valid_ = true;
+  copy.etag_ = nullptr;
+  copy.size_ = length;
+  copy.checked_ = timer_.now();
+  copy.dirty_ = dirty;
+  size_ += length;
+  evict();
+}
+
+void CacheServer::invalidate(LocalCopy& copy) {
+  KJ_IF_MAYBE(exc, copy.failed_) {
+    KJ_LOG(WARNING, "Replacing a copy that was not written back", copy.name_, *exc);
+  }
+  if (copy.valid_) {
+    size_ -= copy.size_;
+    tasks_.add(copy.local_.deleteRequest().send().ignoreResult());
+  }
+  copy.valid_ = false;
+  copy.etag_ = nullptr;
+  copy.size_ = 0;
+  copy.checked_ = nullptr;
+  copy.dirty_ = false;
+  copy.failed_ = nullptr;
+}
+
+void CacheServer::drop(LocalCopy& copy) {
+  if (copy.busy_) {
+    copy.stale_ = true;
+    return;
+  }
+  copy.stale_ = false;
+  invalidate(copy);
+}
+
+void CacheServer::touch(LocalCopy& copy) {
+  if (copy.used_) {
+    lru_.erase(copy.used_);
+  }
+  copy.used_ = ++tick_;
+  lru_.insert(copy.used_, &copy);
+}
+
+void CacheServer::evict() {
+  kj::Vector<LocalCopy*> victims;
+  auto size = size_;
+  for (auto& entry: lru_) {
+    if (size <= options_.capacity) {
+      break;
+    }
+    auto& copy = *entry.value;
+    if (copy.busy_ || copy.users_ || copy.dirty_) {
+      continue;
+    }
+    size -= copy.size_;
+    victims.add(&copy);
+  }
+
+  for (auto copy: victims) {
+    invalidate(*copy);
+    lru_.erase(copy->used_);
+    auto name = kj::mv(copy->name_);
+    copies_.erase(name);
+  }
+}
+
+CacheBucket::CacheBucket(
+    kj::Own<CacheServer> cache,
+    kj::StringPtr name,
+    S3::Bucket::Client remote)
+  : cache_{kj::mv(cache)}
+  , name_{kj::str(name)}
+  , remote_{kj::mv(remote)}
+  , local_{localBucket(cache_->local_, name_)}
+  , versionsName_{kj::str(name_, "?versions")}
+  , localVersions_{localBucket(cache_->local_, versionsName_)} {
+}
+
+kj::Promise<void> CacheBucket::head(HeadContext ctx) {
+  return ctx.tailCall(remote_.headRequest());
+}
+
+kj::Promise<void> CacheBucket::listObjects(ListObjectsContext ctx) {
+  auto params = ctx.getParams();
+  auto req = remote_.listObjectsRequest();
+  req.setPrefix(params.getPrefix());
+  req.setCallback(params.getCallback());
+  req.setBatchSize(params.getBatchSize());
+  req.setStartAfter(params.getStartAfter());
+  req.setDelimiter(params.getDelimiter());
+  return ctx.tailCall(kj::mv(req));
+}
+
+kj::Promise<void> CacheBucket::listObjectVersions(ListObjectVersionsContext ctx) {
+  auto params = ctx.getParams();
+  auto req = remote_.listObjectVersionsRequest();
+  req.setPrefix(params.getPrefix());
+  req.setCallback(params.getCallback());
+  req.setBatchSize(params.getBatchSize());
+  return ctx.tailCall(kj::mv(req));
+}
+
+kj::Promise<void> CacheBucket::getObject(GetObjectContext ctx) {
+  auto key = ctx.getParams().getKey();
+  auto req = remote_.getObjectRequest();
+  req.setKey(key);
+  auto reply = ctx.getResults();
+  reply.setObject(
+    kj::refcounted<CacheObject>(addRef(), key, req.send().getObject())
+  );
+  return kj::READY_NOW;
+}
+
+kj::Promise<void> CacheBucket::deleteObjects(DeleteObjectsContext ctx) {
+  auto& cache = *cache_;
+  auto keys = ctx.getParams().getKeys();
+
+  // as for delete_, wait for any write back of a cached copy, but
+  // leave keys that are not cached alone
+  kj::Vector<kj::Promise<void>> idle;
+  for (auto key: keys) {
+    KJ_IF_MAYBE(found, cache.copies_.find(kj::str(name_, '/', key))) {
+      auto& copy = **found;
+      ++copy.users_;
+      idle.add(
+	cache.whenIdle(copy,
+	  [&cache, &copy]{
+	    cache.invalidate(copy);
+	    return kj::READY_NOW;
+	  }
+	)
+	.attach(kj::defer([&copy]{ --copy.users_; }))
+      );
+    }
+  }
+
+  return
+    kj::joinPromises(idle.releaseAsArray())
+    .then(
+      [this, ctx = kj::mv(ctx)]() mutable {
+	auto req = remote_.deleteObjectsRequest();
+	req.setKeys(ctx.getParams().getKeys());
+	return ctx.tailCall(kj::mv(req));
+      }
+    )
+    .attach(addRef());
+}
+
+kj::Promise<void> CacheBucket::headObjects(HeadObjectsContext ctx) {
+  auto req = remote_.headObjectsRequest();
+  req.setKeys(ctx.getParams().getKeys());
+  return ctx.tailCall(kj::mv(req));
+}
+
+LocalCopy& CacheObject::localCopy(kj::StringPtr version) {
+  auto& bucket = *bucket_;
+  if (version.size()) {
+    return bucket.cache_->find(
+      bucket.localVersions_, bucket.versionsName_, kj::str(version, '/', key_), true
+    );
+  }
+  return bucket.cache_->find(bucket.local_, bucket.name_, key_, false);
+}
+
+capnp::Request<S3::Object::ReadParams, S3::Object::ReadResults> CacheObject::remoteRead(
+    S3::Object::ReadParams::Reader params) {
+  auto req = remote_.readRequest();
+  req.setStream(params.getStream());
+  req.setFirst(params.getFirst());
+  req.setLast(params.getLast());
+  req.setVersion(params.getVersion());
+  req.setConditions(params.getConditions());
+  return req;
+}
+
+kj::Promise<void> CacheObject::head(HeadContext ctx) {
+  auto params = ctx.getParams();
+  auto req = remote_.headRequest();
+  req.setVersion(params.getVersion());
+  req.setConditions(params.getConditions());
+  return ctx.tailCall(kj::mv(req));
+}
+
+kj::Promise<void> CacheObject::getBucket(GetBucketContext ctx) {
+  auto reply = ctx.getResults();
+  reply.setBucket(bucket_->addRef());
+  return kj::READY_NOW;
+}
+
+kj::Promise<void> CacheObject::read(ReadContext ctx) {
+  auto& cache = *bucket_->cache_;
+  auto params = ctx.getParams();
+  auto version = params.getVersion();
+
+  // the copy does not know when the object was last modified
+  if (params.getConditions().getIfModifiedSince().size()) {
+    return ctx.tailCall(remoteRead(params));
+  }
+
+  auto& copy = localCopy(version);
+  auto inUse = use(copy);
+
+  return
+    cache.check(copy, remote_, kj::str(version))
+    .then(
+      [this, &copy, ctx = kj::mv(ctx)]() mutable -> kj::Promise<void> {
+	auto params = ctx.getParams();
+	auto conditions = params.getConditions();
+	if (conditions.getIfNoneMatch().size() || conditions.getIfMatch().size()) {
+	  KJ_IF_MAYBE(etag, copy.etag_) {
+	    switch (checkETag(*etag, conditions.getIfMatch(), conditions.getIfNoneMatch())) {
+	      case Precondition::FAILED:
+		KJ_FAIL_REQUIRE("PreconditionFailed");
+	      case Precondition::NOT_MODIFIED:
+		ctx.getResults().setNotModified(true);
+		return kj::READY_NOW;
+	      case Precondition::MET:
+		break;
+	    }
+	  }
+	  else {
+	    return ctx.tailCall(remoteRead(params));
+	  }
+	}
+
+	auto req = copy.local_.readRequest();
+	req.setStream(params.getStream());
+	req.setFirst(params.getFirst());
+	req.setLast(params.getLast());
+	return req.send().ignoreResult();
+      }
+    )
+    .attach(kj::mv(inUse), addRef());
+}
+
+kj::Promise<void> CacheObject::write(WriteContext ctx) {
+  auto length = ctx.getParams().getLength();
+  return startWrite(kj::mv(ctx), length);
+}
+
+kj::Promise<void> CacheObject::upload(UploadContext ctx) {
+  return startWrite(kj::mv(ctx), nullptr);
+}
+
+template <typename Context>
+kj::Promise<void> CacheObject::startWrite(Context ctx, kj::Maybe<uint64_t> length) {
+  auto& cache = *bucket_->cache_;
+  auto policy = cache.options_.writePolicy;
+  auto& copy = localCopy(nullptr);
+  auto inUse = use(copy);
+
+  if (policy == WritePolicy::AROUND) {
+    // The copy is dropped as the write starts, and again once it ends,
+    // so that neither the copy from before it nor one fetched while it
+    // is in progress is served afterwards.
+    cache.drop(copy);
+    auto paf = kj::newPromiseAndFulfiller<uint64_t>();
+    cache.tasks_.add(
+      paf.promise
+      .then(
+        [&cache, &copy](auto) {
+	  cache.drop(copy);
+	},
+	[&cache, &copy](kj::Exception&&) {
+	  // a failed write may still have replaced the object
+	  cache.drop(copy);
+	}
+      )
+      .attach(kj::mv(inUse), addRef())
+    );
+    auto outs = kj::heapArrayBuilder<capnp::ByteStream::Client>(1);
+    outs.add(writeTo(remote_, length));
+    ctx.getResults().setStream(kj::heap<TeeStream>(outs.finish(), kj::mv(paf.fulfiller)));
+    return kj::READY_NOW;
+  }
+
+  return
+    cache.whenIdle(copy,
+      [this, &cache, &copy, policy, length, ctx = kj::mv(ctx)]() mutable -> kj::Promise<void> {
+	cache.invalidate(copy);
+	auto back = policy == WritePolicy::BACK;
+
+	// Reads wait for the copy until the write ends, and a write back
+	// holds it until it has been copied to S3 too, with any failure
+	// logged by the cache, as nobody else waits for it.
+	auto paf = kj::newPromiseAndFulfiller<uint64_t>();
+	auto held = cache.hold(copy,
+	  paf.promise
+	  .then(
+	    [&cache, &copy, back, remote = remote_](auto length) mutable -> kj::Promise<void> {
+	      cache.written(copy, length, back);
+	      if (!back) {
+		return kj::READY_NOW;
+	      }
+	      return cache.writeBack(copy, kj::mv(remote), length);
+	    }
+	  )
+	);
+	if (back) {
+	  cache.tasks_.add(kj::mv(held));
+	}
+
+	return
+	  copy.local_.deleteRequest().send().ignoreResult()
+	  .then(
+	    [this, &copy, back, length, ctx = kj::mv(ctx), done = kj::mv(paf.fulfiller)]() mutable {
+	      auto outs = kj::heapArrayBuilder<capnp::ByteStream::Client>(back ? 1 : 2);
+	      outs.add(writeTo(copy.local_, length));
+	      if (!back) {
+		outs.add(writeTo(remote_, length));
+	      }
+	      ctx.getResults().setStream(kj::heap<TeeStream>(outs.finish(), kj::mv(done)));
+	    }
+	  );
+      }
+    )
+    .attach(kj::mv(inUse), addRef());
+}
+
+kj::Promise<void> CacheObject::multipart(MultipartContext ctx) {
+  auto& cache = *bucket_->cache_;
+  auto& copy = localCopy(nullptr);
+  if (!copy.dirty_) {
+    cache.drop(copy);
+  }
+  return ctx.tailCall(remote_.multipartRequest());
+}
+
+kj::Promise<void> CacheObject::resumeMultipart(ResumeMultipartContext ctx) {
+  auto& cache = *bucket_->cache_;
+  auto& copy = localCopy(nullptr);
+  if (!copy.dirty_) {
+    cache.drop(copy);
+  }
+  auto req = remote_.resumeMultipartRequest();
+  req.setUploadId(ctx.getParams().getUploadId());
+  return ctx.tailCall(kj::mv(req));
+}
+
+kj::Promise<void> CacheObject::delete_(DeleteContext ctx) {
+  auto& cache = *bucket_->cache_;
+  auto version = kj::str(ctx.getParams().getVersion());
+  auto& copy = localCopy(version);
+  auto inUse = use(copy);
+
+  // after any write back of the copy has reached S3
+  return
+    cache.whenIdle(copy,
+      [this, &cache, &copy, version = kj::mv(version)]() mutable {
+	cache.invalidate(copy);
+	auto req = remote_.deleteRequest();
+	req.setVersion(version);
+	return req.send().ignoreResult();
+      }
+    )
+    .attach(kj::mv(inUse), addRef());
+}
+
+kj::Promise<void> CacheObject::copyFrom(CopyFromContext ctx) {
+  auto& cache = *bucket_->cache_;
+  auto params = ctx.getParams();
+  auto& copy = localCopy(nullptr);
+  auto inUse = use(copy);
+
+  // a cached source may still be being written back to S3
+  kj::Promise<void> source = kj::READY_NOW;
+  if (!params.getVersion().size()) {
+    KJ_IF_MAYBE(found, cache.copies_.find(kj::str(params.getBucket(), '/', params.getKey()))) {
+      auto& from = **found;
+      ++from.users_;
+      source =
+	cache.whenIdle(from, []{ return kj::READY_NOW; })
+	.attach(kj::defer([&from]{ --from.users_; }));
+    }
+  }
+
+  return
+    source
+    .then(
+      [this, &cache, &copy, ctx = kj::mv(ctx)]() mutable {
+	return
+	  cache.whenIdle(copy,
+	    [this, &cache, &copy, ctx = kj::mv(ctx)]() mutable {
+	      cache.invalidate(copy);
+	      auto params = ctx.getParams();
+	      auto req = remote_.copyFromRequest();
+	      req.setBucket(params.getBucket());
+	      req.setKey(params.getKey());
+	      req.setVersion(params.getVersion());
+	      req.setFirst(params.getFirst());
+	      req.setLast(params.getLast());
+	      return req.send().ignoreResult();
+	    }
+	  );
+      }
+    )
+    .attach(kj::mv(inUse), addRef());
+}
+
+}
+
+aws::S3::Client newS3Cache(
+  kj::Timer& timer,
+  S3::Client remote,
+  S3::Client local,
+  const S3CacheOptions& options) {
+  return kj::refcounted<CacheServer>(timer, kj::mv(remote), kj::mv(local), options);
+}
+
+}
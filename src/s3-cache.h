@@ -0,0 +1,55 @@
+#pragma once
+
+// Copyright (c) 2023 Vaci Koblizek.
+// Licensed under the Apache 2.0 license found in the LICENSE file or at:
+//     https://opensource.org/licenses/Apache-2.0
+
+#include "s3.capnp.h"
+
+#include <kj/async.h>
+#include <kj/time.h>
+
+namespace aws {
+
+// What a write through the cache does with the local copy.
+enum class WritePolicy {
+  // Writes only go to S3, and the local copy is dropped.
+  AROUND,
+  // Writes go to S3 and the local store at once.
+  THROUGH,
+  // Writes complete once they are in the local store, and are copied
+  // to S3 in the background. Until then the copy is never evicted.
+  BACK
+};
+
+struct S3CacheOptions {
+  // Bytes of object data kept in the local store. The least recently
+  // read objects are evicted beyond this, unless they are in use.
+  uint64_t capacity = 64ull * 1024 * 1024 * 1024;
+
+  // How long a copy is trusted after its ETag was last checked with a
+  // HEAD. Copies of specific versions never change, so are never
+  // checked.
+  kj::Duration revalidateAfter = 0 * kj::SECONDS;
+
+  WritePolicy writePolicy = WritePolicy::AROUND;
+
+  // How often a write back is tried before the copy is left dirty, and
+  // the delay before the first retry, which doubles after each one. A
+  // copy left dirty is tried again when it is next read.
+  uint32_t writeBackAttempts = 5;
+  kj::Duration writeBackBackoff = 1 * kj::SECONDS;
+};
+
+// Serves objects from `remote`, reading them through a copy in `local`,
+// typically a newS3Server. Concurrent misses for one object share a
+// single fetch of the whole object. The cache starts cold: anything
+// already in `local` is fetched again on first use.
+aws::S3::Client newS3Cache(
+  kj::Timer&,
+  S3::Client remote,
+  S3::Client local,
+  const S3CacheOptions& = {}
+);
+
+}
@@ -0,0 +1,842 @@
+// Copyright (c) 2023 Vaci Koblizek.
+// Licensed under the Apache 2.0 license found in the LICENSE file or at:
+//     https://opensource.org/licenses/Apache-2.0
+
+#include "s3.h"
+
+#include "capnp/compat/byte-stream.h"
+
+#include <capnp/message.h>
+#include <capnp/serialize.h>
+
+#include <kj/async-io.h>
+#include <kj/compat/http.h>
+#include <kj/compat/url.h>
+#include <kj/debug.h>
+#include <kj/filesystem.h>
+#include <kj/main.h>
+#include <kj/map.h>
+#include <kj/vector.h>
+
+#include <gtest/gtest.h>
+
+using namespace aws;
+
+static int EKAM_TEST_DISABLE_INTERCEPTOR = 1;
+
+namespace {
+
+struct StaticCredentials
+  : Credentials::Provider::Server {
+
+  kj::Promise<void> getCredentials(GetCredentialsContext ctx) override {
+    auto reply = ctx.getResults();
+    reply.setAccessKey("key");
+    reply.setSecretKey("secret");
+    return kj::READY_NOW;
+  }
+};
+
+// Just enough of S3 for the client: objects, ranged and conditional
+// GETs, copies and multipart uploads, all in memory, whatever the
+// bucket.
+struct FakeS3
+  : kj::HttpService {
+
+  struct Object {
+    kj::Array<kj::byte> bytes_;
+    kj::String etag_;
+    kj::String contentEncoding_;
+  };
+
+  struct Upload {
+    kj::String key_;
+    kj::String contentEncoding_;
+    kj::TreeMap<uint32_t, Object> parts_;
+  };
+
+  FakeS3(kj::Timer& timer, kj::HttpHeaderTable::Builder& builder)
+    : timer_{timer}
+    , table_{builder.getFutureTable()}
+    , contentEncoding_{builder.add("content-encoding")}
+    , contentRange_{builder.add("content-range")}
+    , etag_{builder.add("etag")}
+    , ifMatch_{builder.add("if-match")}
+    , ifNoneMatch_{builder.add("if-none-match")}
+    , lastModified_{builder.add("last-modified")}
+    , range_{builder.add("range")}
+    , xAmzCopySource_{builder.add("x-amz-copy-source")} {
+  }
+
+  kj::Promise<void> request(
+      kj::HttpMethod method,
+      kj::StringPtr url,
+      const kj::HttpHeaders& headers,
+      kj::AsyncInputStream& body,
+      Response& response) override {
+
+    auto parsed = kj::Url::parse(url, kj::Url::HTTP_REQUEST);
+    auto part = method == kj::HttpMethod::PUT && param(parsed, "partNumber"_kj) != nullptr;
+    auto copy = method == kj::HttpMethod::PUT && headers.get(xAmzCopySource_) != nullptr;
+    if (part) {
+      maxPartsInFlight_ = kj::max(maxPartsInFlight_, ++partsInFlight_);
+    }
+
+    return
+      body.readAllBytes()
+      .then(
+	[this, part, copy](auto bytes) {
+	  // parts and copies are held a while, so that requests sent
+	  // alongside them overlap them
+	  return part || copy
+	    ? timer_.afterDelay(partDelay_).then([bytes = kj::mv(bytes)]() mutable { return kj::mv(bytes); })
+	    : kj::Promise<kj::Array<kj::byte>>(kj::mv(bytes));
+	}
+      )
+      .then(
+	[this, method, parsed = kj::mv(parsed), &headers, &response, part](auto bytes) mutable {
+	  if (part) {
+	    --partsInFlight_;
+	  }
+	  return handle(method, parsed, headers, kj::mv(bytes), response);
+	}
+      );
+  }
+
+  kj::Promise<void> handle(
+      kj::HttpMethod method,
+      const kj::Url& url,
+      const kj::HttpHeaders& headers,
+      kj::Array<kj::byte> body,
+      Response& response) {
+
+    auto key = kj::strArray(url.path, "/");
+    kj::HttpHeaders reply{table_};
+
+    if (method == kj::HttpMethod::POST && param(url, "uploads"_kj) != nullptr) {
+      auto uploadId = kj::str("upload", ++next_);
+      uploads_.insert(
+	kj::str(uploadId),
+	Upload{kj::str(key), kj::str(headers.get(contentEncoding_).orDefault(""_kj)), {}}
+      );
+      return send(response, 200, reply, kj::str(
+	"<InitiateMultipartUploadResult><UploadId>"_kj, uploadId, "</UploadId></InitiateMultipartUploadResult>"_kj
+      ).asBytes());
+    }
+
+    KJ_IF_MAYBE(uploadId, param(url, "uploadId"_kj)) {
+      KJ_IF_MAYBE(upload, uploads_.find(*uploadId)) {
+	return handleUpload(method, url, *uploadId, *upload, kj::mv(body), response);
+      }
+      return send(response, 404, reply, error("NoSuchUpload"_kj));
+    }
+
+    switch (method) {
+      case kj::HttpMethod::PUT: {
+	++puts_;
+	if (failPuts_) {
+	  return send(response, 403, reply, error("AccessDenied"_kj));
+	}
+	auto etag = kj::str("\"etag"_kj, ++next_, '"');
+	KJ_IF_MAYBE(source, headers.get(xAmzCopySource_)) {
+	  // /<bucket>/<key>
+	  auto path = source->slice(1);
+	  auto from = path.slice(KJ_ASSERT_NONNULL(path.findFirst('/')) + 1);
+	  KJ_IF_MAYBE(object, objects_.find(from)) {
+	    body = kj::heapArray(object->bytes_.asPtr());
+	  }
+	  else {
+	    return send(response, 404, reply, error("NoSuchKey"_kj));
+	  }
+	  auto txt = kj::str("<CopyObjectResult><ETag>"_kj, etag, "</ETag></CopyObjectResult>"_kj);
+	  objects_.upsert(
+	    kj::str(key), Object{kj::mv(body), kj::mv(etag), nullptr},
+	    [](auto& existing, auto&& replacement) {
+	      existing = kj::mv(replacement);
+	    }
+	  );
+	  return send(response, 200, reply, txt.asBytes());
+	}
+	reply.set(etag_, etag);
+	objects_.upsert(
+	  kj::str(key),
+	  Object{kj::mv(body), kj::mv(etag), kj::str(headers.get(contentEncoding_).orDefault(""_kj))},
+	  [](auto& existing, auto&& replacement) {
+	    existing = kj::mv(replacement);
+	  }
+	);
+	return send(response, 200, reply, nullptr);
+      }
+      case kj::HttpMethod::DELETE:
+	objects_.erase(key);
+	return send(response, 204, reply, nullptr);
+      case kj::HttpMethod::HEAD:
+	++heads_;
+	return get(key, headers, response);
+      case kj::HttpMethod::GET:
+	++gets_;
+	return get(key, headers, response);
+      default:
+	return send(response, 405, reply, error("MethodNotAllowed"_kj));
+    }
+  }
+
+  kj::Promise<void> handleUpload(
+      kj::HttpMethod method,
+      const kj::Url& url,
+      kj::StringPtr uploadId,
+      Upload& upload,
+      kj::Array<kj::byte> body,
+      Response& response) {
+
+    kj::HttpHeaders reply{table_};
+    switch (method) {
+      case kj::HttpMethod::PUT: {
+	auto partNumber = KJ_ASSERT_NONNULL(param(url, "partNumber"_kj)).parseAs<uint32_t>();
+	if (failParts_) {
+	  --failParts_;
+	  return send(response, 403, reply, error("AccessDenied"_kj));
+	}
+	auto etag = kj::str("\"part"_kj, ++next_, '"');
+	reply.set(etag_, etag);
+	upload.parts_.upsert(
+	  partNumber, Object{kj::mv(body), kj::mv(etag), nullptr},
+	  [](auto& existing, auto&& replacement) {
+	    existing = kj::mv(replacement);
+	  }
+	);
+	return send(response, 200, reply, nullptr);
+      }
+      case kj::HttpMethod::GET: {
+	auto txt = kj::strTree("<ListPartsResult>"_kj);
+	for (auto& entry: upload.parts_) {
+	  txt = kj::strTree(
+	    kj::mv(txt),
+	    "<Part><PartNumber>"_kj, entry.key,
+	    "</PartNumber><ETag>"_kj, entry.value.etag_,
+	    "</ETag><Size>"_kj, entry.value.bytes_.size(),
+	    "</Size></Part>"_kj
+	  );
+	}
+	auto body = kj::strTree(kj::mv(txt), "<IsTruncated>false</IsTruncated></ListPartsResult>"_kj);
+	return send(response, 200, reply, body.flatten().asBytes());
+      }
+      case kj::HttpMethod::POST: {
+	// only the parts listed, as <PartNumber>n</PartNumber>
+	kj::Vector<kj::byte> bytes;
+	auto txt = kj::heapString(body.asChars());
+	auto tag = "<PartNumber>"_kj;
+	for (kj::StringPtr rest = txt; ; ) {
+	  KJ_IF_MAYBE(start, findString(rest, tag)) {
+	    rest = rest.slice(*start + tag.size());
+	    auto end = KJ_ASSERT_NONNULL(rest.findFirst('<'));
+	    auto partNumber = kj::str(rest.slice(0, end)).parseAs<uint32_t>();
+	    KJ_IF_MAYBE(part, upload.parts_.find(partNumber)) {
+	      bytes.addAll(part->bytes_);
+	    }
+	    else {
+	      return send(response, 400, reply, error("InvalidPart"_kj));
+	    }
+	  }
+	  else {
+	    break;
+	  }
+	}
+	auto etag = kj::str("\"etag"_kj, ++next_, "-"_kj, upload.parts_.size(), '"');
+	auto result = kj::str(
+	  "<CompleteMultipartUploadResult><ETag>"_kj, etag, "</ETag></CompleteMultipartUploadResult>"_kj
+	);
+	objects_.upsert(
+	  kj::mv(upload.key_),
+	  Object{bytes.releaseAsArray(), kj::mv(etag), kj::mv(upload.contentEncoding_)},
+	  [](auto& existing, auto&& replacement) {
+	    existing = kj::mv(replacement);
+	  }
+	);
+	uploads_.erase(uploadId);
+	++completed_;
+	return send(response, 200, reply, result.asBytes());
+      }
+      case kj::HttpMethod::DELETE:
+	uploads_.erase(uploadId);
+	return send(response, 204, reply, nullptr);
+      default:
+	return send(response, 405, reply, error("MethodNotAllowed"_kj));
+    }
+  }
+
+  kj::Promise<void> get(kj::StringPtr key, const kj::HttpHeaders& headers, Response& response) {
+    kj::HttpHeaders reply{table_};
+    KJ_IF_MAYBE(object, objects_.find(key)) {
+      reply.set(etag_, object->etag_);
+      reply.set(lastModified_, "Wed, 01 Jan 2020 00:00:00 GMT"_kj);
+      if (object->contentEncoding_.size()) {
+	reply.set(contentEncoding_, object->contentEncoding_);
+      }
+      KJ_IF_MAYBE(etag, headers.get(ifMatch_)) {
+	if (*etag != object->etag_) {
+	  return send(response, 412, reply, error("PreconditionFailed"_kj));
+	}
+      }
+      KJ_IF_MAYBE(etag, headers.get(ifNoneMatch_)) {
+	if (*etag == object->etag_) {
+	  return send(response, 304, reply, nullptr);
+	}
+      }
+
+      auto bytes = object->bytes_.asPtr();
+      KJ_IF_MAYBE(range, headers.get(range_)) {
+	if (!ignoreRanges_) {
+	  // bytes=<first>-[<last>]
+	  auto spec = range->slice("bytes="_kj.size());
+	  auto dash = KJ_ASSERT_NONNULL(spec.findFirst('-'));
+	  auto first = kj::str(spec.slice(0, dash)).parseAs<uint64_t>();
+	  auto last = dash + 1 < spec.size()
+	    ? spec.slice(dash + 1).parseAs<uint64_t>()
+	    : uint64_t(kj::maxValue);
+	  if (first >= bytes.size()) {
+	    reply.set(contentRange_, kj::str("bytes */"_kj, bytes.size()));
+	    return send(response, 416, reply, error("InvalidRange"_kj));
+	  }
+	  last = kj::min(last, bytes.size() - 1);
+	  reply.set(contentRange_, kj::str("bytes "_kj, first, '-', last, '/', bytes.size()));
+	  return send(response, 206, reply, bytes.slice(first, last + 1));
+	}
+      }
+      return send(response, 200, reply, bytes);
+    }
+    return send(response, 404, reply, error("NoSuchKey"_kj));
+  }
+
+  kj::Promise<void> send(
+      Response& response, uint statusCode, const kj::HttpHeaders& headers,
+      kj::ArrayPtr<const kj::byte> bytes) {
+    auto stream = response.send(statusCode, "Fake"_kj, headers, uint64_t{bytes.size()});
+    if (bytes.size() == 0) {
+      return kj::READY_NOW;
+    }
+    auto copy = kj::heapArray(bytes);
+    auto& s = *stream;
+    return s.write(copy.begin(), copy.size()).attach(kj::mv(stream), kj::mv(copy));
+  }
+
+  static kj::Array<kj::byte> error(kj::StringPtr code) {
+    auto txt = kj::str("<Error><Code>"_kj, code, "</Code><Message>fake</Message></Error>"_kj);
+    return kj::heapArray(txt.asBytes());
+  }
+
+  static kj::Maybe<size_t> findString(kj::StringPtr txt, kj::StringPtr needle) {
+    for (size_t ii = 0; ii + needle.size() <= txt.size(); ++ii) {
+      if (txt.slice(ii).startsWith(needle)) {
+	return ii;
+      }
+    }
+    return nullptr;
+  }
+
+  static kj::Maybe<kj::StringPtr> param(const kj::Url& url, kj::StringPtr name) {
+    for (auto& query: url.query) {
+      if (query.name == name) {
+	return query.value.asPtr();
+      }
+    }
+    return nullptr;
+  }
+
+  kj::Timer& timer_;
+  kj::HttpHeaderTable& table_;
+  kj::HttpHeaderId contentEncoding_;
+  kj::HttpHeaderId contentRange_;
+  kj::HttpHeaderId etag_;
+  kj::HttpHeaderId ifMatch_;
+  kj::HttpHeaderId ifNoneMatch_;
+  kj::HttpHeaderId lastModified_;
+  kj::HttpHeaderId range_;
+  kj::HttpHeaderId xAmzCopySource_;
+
+  kj::HashMap<kj::String, Object> objects_;
+  kj::HashMap<kj::String, Upload> uploads_;
+  uint64_t next_{0};
+
+  // Ranges are ignored, as by stores that answer every GET in full.
+  bool ignoreRanges_{false};
+  bool failPuts_{false};
+  uint32_t failParts_{0};
+  kj::Duration partDelay_{1 * kj::MILLISECONDS};
+
+  uint32_t puts_{0};
+  uint32_t heads_{0};
+  uint32_t gets_{0};
+  uint32_t completed_{0};
+  uint32_t partsInFlight_{0};
+  uint32_t maxPartsInFlight_{0};
+};
+
+// Connects every address to one in-process HttpServer, so that the
+// client's connection pool, signing and retries all run for real.
+struct FakeNetwork
+  : kj::Network
+  , kj::TaskSet::ErrorHandler {
+
+  struct Address
+    : kj::NetworkAddress {
+
+    Address(FakeNetwork& network)
+      : network_{network} {
+    }
+
+    kj::Promise<kj::Own<kj::AsyncIoStream>> connect() override {
+      auto pipe = kj::newTwoWayPipe();
+      network_.tasks_.add(network_.server_.listenHttp(kj::mv(pipe.ends[1])));
+      return kj::mv(pipe.ends[0]);
+    }
+
+    kj::Own<kj::ConnectionReceiver> listen() override {
+      KJ_UNIMPLEMENTED("fake network");
+    }
+
+    kj::Own<kj::NetworkAddress> clone() override {
+      return kj::heap<Address>(network_);
+    }
+
+    kj::String toString() override {
+      return kj::str("fake"_kj);
+    }
+
+    FakeNetwork& network_;
+  };
+
+  FakeNetwork(kj::Timer& timer, const kj::HttpHeaderTable& table, kj::HttpService& service)
+    : server_{timer, table, service} {
+  }
+
+  void taskFailed(kj::Exception&& exc) override {
+    KJ_LOG(ERROR, exc);
+  }
+
+  kj::Promise<kj::Own<kj::NetworkAddress>> parseAddress(kj::StringPtr, uint) override {
+    return kj::Own<kj::NetworkAddress>{kj::heap<Address>(*this)};
+  }
+
+  kj::Own<kj::NetworkAddress> getSockaddr(const void*, uint) override {
+    KJ_UNIMPLEMENTED("fake network");
+  }
+
+  kj::Own<kj::Network> restrictPeers(
+      kj::ArrayPtr<const kj::StringPtr>, kj::ArrayPtr<const kj::StringPtr>) override {
+    KJ_UNIMPLEMENTED("fake network");
+  }
+
+  kj::HttpServer server_;
+  kj::TaskSet tasks_{*this};
+};
+
+struct S3ClientTest
+  : testing::Test {
+
+  // A client of the fake with `options`, once per test.
+  S3::Client newClient(const S3Options& options) {
+    auto s3 = newS3(
+      kj::systemPreciseCalendarClock(), timer_, network_, network_, builder_,
+      kj::heap<StaticCredentials>(), "us-east-1"_kj, options
+    );
+    table_ = builder_.build();
+    return s3;
+  }
+
+  S3::Object::Client getObject(S3::Client& s3, kj::StringPtr key) {
+    auto bucket = [&]{
+      auto req = s3.getBucketRequest();
+      req.setName("bucket"_kj);
+      return req.send().getBucket();
+    }();
+    auto req = bucket.getObjectRequest();
+    req.setKey(key);
+    return req.send().getObject();
+  }
+
+  void put(kj::StringPtr key, kj::ArrayPtr<const kj::byte> bytes) {
+    fake_.objects_.upsert(
+      kj::str(key), FakeS3::Object{kj::heapArray(bytes), kj::str("\"etag"_kj, ++fake_.next_, '"'), nullptr},
+      [](auto& existing, auto&& replacement) {
+	existing = kj::mv(replacement);
+      }
+    );
+  }
+
+  // Reads `size` bytes of [first, last] of `object`.
+  kj::Array<kj::byte> read(
+      S3::Object::Client& object, size_t size, uint64_t first = 0, uint64_t last = kj::maxValue) {
+    auto pipe = kj::newOneWayPipe();
+    auto req = object.readRequest();
+    req.setStream(factory_.kjToCapnp(kj::mv(pipe.out)));
+    req.setFirst(first);
+    req.setLast(last);
+    auto promise = req.send();
+    auto data = kj::heapArray<kj::byte>(size);
+    if (size) {
+      pipe.in->read(data.begin(), data.size()).wait(waitScope_);
+    }
+    promise.wait(waitScope_);
+    return data;
+  }
+
+  kj::AsyncIoContext ioCtx_{kj::setupAsyncIo()};
+  kj::WaitScope& waitScope_{ioCtx_.waitScope};
+  kj::Timer& timer_{ioCtx_.provider->getTimer()};
+  kj::HttpHeaderTable::Builder builder_;
+  FakeS3 fake_{timer_, builder_};
+  FakeNetwork network_{timer_, builder_.getFutureTable(), fake_};
+  kj::Own<kj::HttpHeaderTable> table_;
+  capnp::ByteStreamFactory factory_;
+};
+
+kj::Array<kj::byte> pattern(size_t size) {
+  auto data = kj::heapArray<kj::byte>(size);
+  for (auto ii: kj::indices(data)) {
+    data[ii] = ii % 251;
+  }
+  return data;
+}
+
+}
+
+TEST_F(S3ClientTest, ParallelRead) {
+  S3Options options;
+  options.readParallelism = 3;
+  options.readChunkSize = 1000;
+  auto s3 = newClient(options);
+
+  auto data = pattern(10500);
+  put("object"_kj, data);
+  auto object = getObject(s3, "object"_kj);
+
+  // by default, to the end of the object
+  auto whole = read(object, data.size());
+  EXPECT_TRUE(whole == data);
+
+  auto range = read(object, 2500, 1500, 3999);
+  EXPECT_TRUE(range == data.slice(1500, 4000));
+}
+
+TEST_F(S3ClientTest, ParallelReadOverwritten) {
+  S3Options options;
+  options.readParallelism = 3;
+  options.readChunkSize = 1000;
+  auto s3 = newClient(options);
+
+  auto data = pattern(10500);
+  put("object"_kj, data);
+  auto object = getObject(s3, "object"_kj);
+
+  auto pipe = kj::newOneWayPipe();
+  auto req = object.readRequest();
+  req.setStream(factory_.kjToCapnp(kj::mv(pipe.out)));
+  auto promise = req.send();
+  auto head = kj::heapArray<kj::byte>(1000);
+  pipe.in->read(head.begin(), head.size()).wait(waitScope_);
+  promise.wait(waitScope_);
+
+  // chunks fetched after the overwrite are refused, rather than
+  // spliced into the stream from the new version
+  put("object"_kj, pattern(20000).slice(10000, 20000));
+  auto rest = kj::heapArray<kj::byte>(data.size() - head.size());
+  auto count = pipe.in->tryRead(rest.begin(), rest.size(), rest.size()).wait(waitScope_);
+  EXPECT_LT(count, rest.size());
+  EXPECT_TRUE(head == data.slice(0, 1000));
+  EXPECT_TRUE(rest.slice(0, count) == data.slice(1000, 1000 + count));
+}
+
+TEST_F(S3ClientTest, ParallelReadEmpty) {
+  S3Options options;
+  options.readParallelism = 3;
+  options.readChunkSize = 1000;
+  auto s3 = newClient(options);
+
+  // S3 refuses any range of an empty object
+  put("empty"_kj, nullptr);
+  auto object = getObject(s3, "empty"_kj);
+  read(object, 0);
+
+  // and stores that ignore ranges answer with the whole object
+  fake_.ignoreRanges_ = true;
+  read(object, 0);
+
+  auto data = pattern(500);
+  put("small"_kj, data);
+  auto small = getObject(s3, "small"_kj);
+  auto whole = read(small, data.size());
+  EXPECT_TRUE(whole == data);
+}
+
+TEST_F(S3ClientTest, MetadataCache) {
+  S3Options options;
+  options.metadataTtl = 1 * kj::HOURS;
+  auto s3 = newClient(options);
+
+  auto data = pattern(100);
+  put("object"_kj, data);
+  auto object = getObject(s3, "object"_kj);
+  auto etag = [&]{
+    return kj::str(object.headRequest().send().wait(waitScope_).getEtag());
+  };
+
+  auto first = etag();
+  EXPECT_EQ(etag(), first);
+  EXPECT_EQ(fake_.heads_, 1);
+
+  // conditions are answered from the cache, without a GET
+  auto conditionalRead = [&](kj::StringPtr ifNoneMatch, kj::StringPtr ifMatch) {
+    auto pipe = kj::newOneWayPipe();
+    auto req = object.readRequest();
+    req.setStream(factory_.kjToCapnp(kj::mv(pipe.out)));
+    auto conditions = req.initConditions();
+    conditions.setIfNoneMatch(ifNoneMatch);
+    conditions.setIfMatch(ifMatch);
+    return req.send().wait(waitScope_).getNotModified();
+  };
+  EXPECT_TRUE(conditionalRead(first, ""_kj));
+  EXPECT_ANY_THROW(conditionalRead(""_kj, "\"other\""_kj));
+  EXPECT_EQ(fake_.gets_, 0);
+
+  // a HEAD while a PUT is in progress sees the old tag, which is
+  // dropped again once the PUT completes
+  {
+    auto req = object.writeRequest();
+    req.setLength(data.size());
+    auto stream = req.send().getStream();
+    auto write = [&](kj::ArrayPtr<const kj::byte> bytes) {
+      auto req = stream.writeRequest();
+      req.setBytes(bytes);
+      req.send().wait(waitScope_);
+    };
+    write(data.slice(0, 50));
+    EXPECT_EQ(etag(), first);
+    write(data.slice(50, data.size()));
+    stream.endRequest().send().wait(waitScope_);
+    while (fake_.puts_ == 0) {
+      timer_.afterDelay(1 * kj::MILLISECONDS).wait(waitScope_);
+    }
+    timer_.afterDelay(10 * kj::MILLISECONDS).wait(waitScope_);
+  }
+  auto second = etag();
+  EXPECT_NE(second, first);
+  EXPECT_EQ(second, KJ_ASSERT_NONNULL(fake_.objects_.find("object"_kj)).etag_);
+
+  // and likewise for a copy, held long enough for the HEAD to overlap it
+  put("source"_kj, pattern(10));
+  fake_.partDelay_ = 50 * kj::MILLISECONDS;
+  {
+    auto req = object.copyFromRequest();
+    req.setBucket("bucket"_kj);
+    req.setKey("source"_kj);
+    auto promise = req.send();
+    EXPECT_EQ(etag(), second);
+    promise.wait(waitScope_);
+  }
+  auto third = etag();
+  EXPECT_NE(third, second);
+  EXPECT_EQ(third, KJ_ASSERT_NONNULL(fake_.objects_.find("object"_kj)).etag_);
+}
+
+TEST_F(S3ClientTest, Conditional) {
+  auto s3 = newClient({});
+  put("object"_kj, pattern(100));
+  auto object = getObject(s3, "object"_kj);
+  auto etag = kj::str(KJ_ASSERT_NONNULL(fake_.objects_.find("object"_kj)).etag_);
+
+  auto conditionalRead = [&](kj::StringPtr ifNoneMatch, kj::StringPtr ifMatch) {
+    auto pipe = kj::newOneWayPipe();
+    auto req = object.readRequest();
+    req.setStream(factory_.kjToCapnp(kj::mv(pipe.out)));
+    auto conditions = req.initConditions();
+    conditions.setIfNoneMatch(ifNoneMatch);
+    conditions.setIfMatch(ifMatch);
+    return req.send().wait(waitScope_).getNotModified();
+  };
+
+  // S3's 304 and 412
+  EXPECT_TRUE(conditionalRead(etag, ""_kj));
+  EXPECT_ANY_THROW(conditionalRead(""_kj, "\"other\""_kj));
+  EXPECT_EQ(fake_.gets_, 2);
+}
+
+TEST_F(S3ClientTest, Compression) {
+  S3Options options;
+  options.compression = Compression::ZSTD;
+  auto s3 = newClient(options);
+  auto object = getObject(s3, "object"_kj);
+
+  auto data = pattern(20000);
+  {
+    auto stream = object.uploadRequest().send().wait(waitScope_).getStream();
+    auto req = stream.writeRequest();
+    req.setBytes(data);
+    req.send().wait(waitScope_);
+    stream.endRequest().send().wait(waitScope_);
+  }
+  auto& stored = KJ_ASSERT_NONNULL(fake_.objects_.find("object"_kj));
+  EXPECT_EQ(stored.contentEncoding_, "zstd"_kj);
+  EXPECT_LT(stored.bytes_.size(), 1000u);
+
+  // ranges are of the decoded bytes, even past the end of the stored
+  // ones, each read with a single GET
+  EXPECT_TRUE(read(object, data.size()) == data);
+  EXPECT_TRUE(read(object, 100, 50, 149) == data.slice(50, 150));
+  EXPECT_TRUE(read(object, 100, data.size() - 100) == data.slice(data.size() - 100, data.size()));
+  EXPECT_EQ(fake_.gets_, 3);
+
+  // objects stored before compression was enabled are clipped as they are
+  put("plain"_kj, data);
+  auto plain = getObject(s3, "plain"_kj);
+  EXPECT_TRUE(read(plain, 100, 1000, 1099) == data.slice(1000, 1100));
+}
+
+TEST_F(S3ClientTest, MultipartWrites) {
+  S3Options options;
+  options.partSize = 1000;
+  options.uploadConcurrency = 2;
+  auto s3 = newClient(options);
+  auto object = getObject(s3, "object"_kj);
+  // long enough for buffered parts to still be in flight when whole
+  // parts are sent from a later write
+  fake_.partDelay_ = 20 * kj::MILLISECONDS;
+
+  auto data = pattern(6700);
+  auto stream = object.multipartRequest().send().wait(waitScope_).getStream();
+  size_t offset = 0;
+  for (auto size: {700, 700, 600, 3500, 1200}) {
+    // writes that straddle parts, that end on one, that start on one
+    // with whole parts to send directly and a tail to buffer, and that
+    // complete a buffered part
+    auto req = stream.writeRequest();
+    req.setBytes(data.slice(offset, offset + size));
+    req.send().wait(waitScope_);
+    offset += size;
+  }
+  stream.endRequest().send().wait(waitScope_);
+
+  EXPECT_TRUE(KJ_ASSERT_NONNULL(fake_.objects_.find("object"_kj)).bytes_ == data);
+  // buffered and direct parts share the one limit
+  EXPECT_EQ(fake_.maxPartsInFlight_, 2u);
+}
+
+TEST_F(S3ClientTest, ResumeMultipart) {
+  // S3's smallest part but the last
+  constexpr size_t PART_SIZE = 5 * 1024 * 1024;
+  auto dir = kj::newInMemoryDirectory(kj::systemPreciseCalendarClock());
+  S3Options options;
+  options.partSize = PART_SIZE;
+  options.uploadConcurrency = 2;
+  options.checkpoints = *dir;
+  auto s3 = newClient(options);
+  auto object = getObject(s3, "object"_kj);
+  auto data = pattern(3 * PART_SIZE + 1000);
+
+  // Starts an upload that is interrupted once its checkpoint is on
+  // disk, and returns its id.
+  auto interrupt = [&]{
+    auto names = dir->listNames().size();
+    auto reply = object.multipartRequest().send().wait(waitScope_);
+    while (dir->listNames().size() == names) {
+      timer_.afterDelay(1 * kj::MILLISECONDS).wait(waitScope_);
+    }
+    return kj::str(reply.getUploadId());
+  };
+
+  // Gives the upload the parts `uploaded` in S3, and a checkpoint of
+  // `saved` parts, whose last `torn` bytes were never written.
+  struct Saved {
+    uint32_t number_;
+    kj::StringPtr etag_;
+  };
+  auto prepare = [&](
+      kj::StringPtr uploadId, std::initializer_list<uint32_t> uploaded,
+      std::initializer_list<Saved> saved, size_t torn) {
+    auto& upload = KJ_ASSERT_NONNULL(fake_.uploads_.find(uploadId));
+    for (auto number: uploaded) {
+      auto first = (number - 1) * PART_SIZE;
+      auto bytes = data.slice(first, kj::min(first + PART_SIZE, data.size()));
+      upload.parts_.insert(number, FakeS3::Object{kj::heapArray(bytes), kj::str("\"part-"_kj, number, '"'), nullptr});
+    }
+
+    kj::Vector<kj::byte> bytes;
+    {
+      capnp::MallocMessageBuilder message;
+      message.initRoot<MultipartCheckpoint>().setUploadId(uploadId);
+      bytes.addAll(capnp::messageToFlatArray(message).asBytes());
+    }
+    for (auto& part: saved) {
+      capnp::MallocMessageBuilder message;
+      auto builder = message.initRoot<MultipartCheckpoint::Part>();
+      builder.setNumber(part.number_);
+      builder.setEtag(part.etag_);
+      builder.setSize(PART_SIZE);
+      bytes.addAll(capnp::messageToFlatArray(message).asBytes());
+    }
+    bytes.resize(bytes.size() - torn);
+
+    // the checkpoint naming the upload
+    for (auto& name: dir->listNames()) {
+      auto path = kj::Path{kj::mv(name)};
+      auto file = dir->openFile(path)->readAllBytes();
+      auto words = kj::heapArray<capnp::word>(file.size() / sizeof(capnp::word));
+      memcpy(words.begin(), file.begin(), words.asBytes().size());
+      capnp::FlatArrayMessageReader reader{words};
+      if (reader.getRoot<MultipartCheckpoint>().getUploadId() == uploadId) {
+	auto replacer = dir->replaceFile(path, kj::WriteMode::MODIFY);
+	replacer->get().writeAll(bytes);
+	replacer->commit();
+	return;
+      }
+    }
+    KJ_FAIL_ASSERT("No checkpoint", uploadId);
+  };
+
+  // Resumes `uploadId`, or by default the upload last checkpointed, and
+  // sends the rest of the data from where it left off.
+  auto resume = [&](kj::StringPtr uploadId) {
+    auto req = object.resumeMultipartRequest();
+    req.setUploadId(uploadId);
+    auto reply = req.send().wait(waitScope_);
+    auto offset = reply.getOffset();
+    auto stream = reply.getStream();
+    auto write = stream.writeRequest();
+    write.setBytes(data.slice(offset, data.size()));
+    write.send().wait(waitScope_);
+    stream.endRequest().send().wait(waitScope_);
+    EXPECT_TRUE(KJ_ASSERT_NONNULL(fake_.objects_.find("object"_kj)).bytes_ == data);
+    return offset;
+  };
+
+  // a part left half written is ignored, and S3's listing kept
+  {
+    auto uploadId = interrupt();
+    prepare(uploadId, {1, 2, 3}, {{1, "\"part-1\""_kj}, {2, "\"part-2\""_kj}, {3, "\"part-3\""_kj}}, 8);
+    EXPECT_EQ(resume(""_kj), 3 * PART_SIZE);
+    EXPECT_EQ(dir->listNames().size(), 0);
+  }
+
+  // concurrent uploads of the key keep their own checkpoints, and a
+  // part overwritten since it was saved is sent again, as are those
+  // after a part missing from S3
+  {
+    auto overwritten = interrupt();
+    auto missing = interrupt();
+    EXPECT_EQ(dir->listNames().size(), 2);
+    prepare(overwritten, {1, 2, 3}, {{1, "\"part-1\""_kj}, {2, "\"stale\""_kj}}, 0);
+    prepare(missing, {1, 2, 4}, {}, 0);
+    EXPECT_EQ(resume(overwritten), PART_SIZE);
+    EXPECT_EQ(dir->listNames().size(), 1);
+    EXPECT_EQ(resume(missing), 2 * PART_SIZE);
+    EXPECT_EQ(dir->listNames().size(), 0);
+  }
+}
+
+int main(int argc, char* argv[]) {
+  kj::TopLevelProcessContext processCtx{argv[0]};
+  processCtx.increaseLoggingVerbosity();
+
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -4,52 +4,304 @@
 
 #include "s3.h"
 
+#include "callback.h"
+#include "codec.h"
 #include "common.h"
+#include "file-io.h"
 #include "http.h"
+#include "metrics.h"
+#include "sha256.h"
+#include "xml.h"
 
 #include "capnp/compat/byte-stream.h"
 
+#include <capnp/message.h>
+#include <capnp/serialize.h>
+
 #include <kj/io.h>
 #include <kj/compat/url.h>
 #include <kj/debug.h>
 #include <kj/encoding.h>
+#include <kj/function.h>
 #include <kj/refcount.h>
 #include <kj/vector.h>
 
-#include <rapidxml/rapidxml.hpp>
-#include <iostream>
+#include <algorithm>
+#include <deque>
 
-namespace rapidxml {
+namespace aws {
 
-auto KJ_STRINGIFY(const xml_node<>& node) {
-  return kj::StringPtr{node.value(), node.value_size()};
-}
+namespace {
 
-}
+// Base for handlers of S3 XML responses, which are either the
+// expected result document or an <Error> document.
+struct ResponseHandler
+  : xml::Handler {
 
-kj::Maybe<const rapidxml::xml_node<>&> firstNode(const rapidxml::xml_node<>& node, kj::StringPtr name) {
-  auto result = node.first_node(name.begin(), name.size());
-  if (result != nullptr) {
-    return *result;
+  void startElement(kj::StringPtr name, uint depth) override {
+    if (depth == 1) {
+      error_ = name == "Error"_kj;
+    }
+    if (!error_) {
+      start(name, depth);
+    }
   }
-  else {
-    return nullptr;
+
+  void endElement(kj::StringPtr name, kj::StringPtr text, uint depth) override {
+    if (!error_) {
+      end(name, text, depth);
+    }
+    else if (depth == 2 && name == "Code"_kj) {
+      code_ = kj::str(text);
+    }
+    else if (depth == 2 && name == "Message"_kj) {
+      message_ = kj::str(text);
+    }
+  }
+
+  virtual void start(kj::StringPtr name, uint depth) {}
+  virtual void end(kj::StringPtr name, kj::StringPtr text, uint depth) {}
+
+  void requireNoError(kj::StringPtr what) {
+    if (error_) {
+      KJ_FAIL_REQUIRE(what, code_, message_);
+    }
   }
+
+  bool error_{false};
+  kj::String code_;
+  kj::String message_;
 };
 
-kj::Maybe<const rapidxml::xml_node<>&> nextSibling(const rapidxml::xml_node<>& node, kj::StringPtr name) {
-  auto result = node.next_sibling(name.begin(), name.size());
-  if (result != nullptr) {
-    return *result;
+// Captures the text of a single element directly under the root.
+struct ValueHandler
+  : ResponseHandler {
+
+  ValueHandler(kj::StringPtr name)
+    : name_{name} {
   }
-  else {
-    return nullptr;
+
+  void end(kj::StringPtr name, kj::StringPtr text, uint depth) override {
+    if (depth == 2 && name == name_) {
+      value_ = kj::str(text);
+    }
   }
+
+  kj::StringPtr name_;
+  kj::Maybe<kj::String> value_;
 };
 
-namespace aws {
+// Streams the body of `response` through `handler` as it arrives.
+kj::Promise<void> parseResponse(
+    kj::HttpClient::Response response,
+    ResponseHandler& handler,
+    kj::StringPtr what) {
 
-namespace {
+  auto statusCode = response.statusCode;
+  auto& body = *response.body;
+  return
+    xml::parse(body, handler)
+    .then(
+      [&handler, what, statusCode]{
+	handler.requireNoError(what);
+	KJ_REQUIRE(statusCode / 100 == 2, what, statusCode);
+      },
+      [what, statusCode](kj::Exception&& exc) {
+	if (statusCode / 100 != 2) {
+	  KJ_FAIL_REQUIRE(what, statusCode);
+	}
+	kj::throwFatalException(kj::mv(exc));
+      }
+    )
+    .attach(kj::mv(response.body));
+}
+
+// Calls `func` with each index in [0, count), with at most
+// `concurrency` of the returned promises outstanding at once.
+kj::Promise<void> forEachConcurrently(
+    size_t count,
+    uint32_t concurrency,
+    kj::Function<kj::Promise<void>(size_t)> func) {
+
+  struct Workers {
+    Workers(size_t count, kj::Function<kj::Promise<void>(size_t)> func)
+      : count_{count}
+      , func_{kj::mv(func)} {
+    }
+
+    kj::Promise<void> run() {
+      if (next_ == count_) {
+        return kj::READY_NOW;
+      }
+      return
+        func_(next_++)
+        .then(
+          [this]{
+            return run();
+          }
+        );
+    }
+
+    size_t count_;
+    kj::Function<kj::Promise<void>(size_t)> func_;
+    size_t next_{0};
+  };
+
+  auto workers = kj::heap<Workers>(count, kj::mv(func));
+  auto size = kj::min(count, kj::max(concurrency, 1u));
+  auto promises = kj::heapArrayBuilder<kj::Promise<void>>(size);
+  for (auto ii = 0u; ii < size; ++ii) {
+    promises.add(workers->run());
+  }
+  return kj::joinPromises(promises.finish()).attach(kj::mv(workers));
+}
+
+// Pumps `in` into `out` until `in` ends, or `range`, which `out` writes
+// to, has had all of its bytes, so that the rest is never read.
+// Resolves to whether `in` ended.
+kj::Promise<bool> pumpRange(
+    kj::AsyncInputStream& in, kj::AsyncOutputStream& out, const RangeStream& range,
+    kj::Array<kj::byte> buffer) {
+  auto& b = buffer;
+  return
+    in.tryRead(b.begin(), 1, b.size())
+    .then(
+      [&in, &out, &range, buffer = kj::mv(buffer)](size_t count) mutable -> kj::Promise<bool> {
+	if (count == 0) {
+	  return true;
+	}
+	return
+	  out.write(buffer.begin(), count)
+	  .then(
+	    [&in, &out, &range, buffer = kj::mv(buffer)]() mutable -> kj::Promise<bool> {
+	      if (range.done()) {
+		return false;
+	      }
+	      return pumpRange(in, out, range, kj::mv(buffer));
+	    }
+	  );
+      }
+    );
+}
+
+constexpr size_t PUMP_BUFFER_SIZE = 64 * 1024;
+
+struct FailedKey {
+  kj::String key_;
+  kj::String code_;
+  kj::String message_;
+};
+
+void setErrors(
+    capnp::List<S3::Bucket::KeyError>::Builder builder,
+    kj::ArrayPtr<const FailedKey> errors) {
+  for (auto ii: kj::indices(errors)) {
+    auto error = builder[ii];
+    error.setKey(errors[ii].key_);
+    error.setCode(errors[ii].code_);
+    error.setMessage(errors[ii].message_);
+  }
+}
+
+// Collects the keys that a quiet multi-object delete failed to remove.
+struct DeleteHandler
+  : ResponseHandler {
+
+  DeleteHandler(kj::Vector<FailedKey>& errors)
+    : errors_{errors} {
+  }
+
+  void end(kj::StringPtr name, kj::StringPtr text, uint depth) override {
+    // DeleteResult/Error/{Key,Code,Message}
+    if (depth == 3) {
+      if (name == "Key"_kj) {
+        current_.key_ = kj::str(text);
+      }
+      else if (name == "Code"_kj) {
+        current_.code_ = kj::str(text);
+      }
+      else if (name == "Message"_kj) {
+        current_.message_ = kj::str(text);
+      }
+    }
+    else if (depth == 2 && name == "Error"_kj) {
+      errors_.add(kj::mv(current_));
+      current_ = {};
+    }
+  }
+
+  kj::Vector<FailedKey>& errors_;
+  FailedKey current_;
+};
+
+struct UploadedPart {
+  uint32_t partNumber_;
+  kj::String etag_;
+  uint64_t size_;
+};
+
+// What a multipart upload's checkpoint file records.
+struct Checkpoint {
+  kj::String uploadId_;
+  kj::Vector<UploadedPart> parts_;
+};
+
+// One message of a checkpoint file.
+kj::Array<capnp::word> checkpointMessage(kj::StringPtr uploadId) {
+  capnp::MallocMessageBuilder message;
+  message.initRoot<MultipartCheckpoint>().setUploadId(uploadId);
+  return capnp::messageToFlatArray(message);
+}
+
+kj::Array<capnp::word> checkpointMessage(const UploadedPart& part) {
+  capnp::MallocMessageBuilder message;
+  auto builder = message.initRoot<MultipartCheckpoint::Part>();
+  builder.setNumber(part.partNumber_);
+  builder.setEtag(part.etag_);
+  builder.setSize(part.size_);
+  return capnp::messageToFlatArray(message);
+}
+
+// Collects the parts of a multipart upload, a page at a time.
+struct ListPartsHandler
+  : ResponseHandler {
+
+  ListPartsHandler(kj::Vector<UploadedPart>& parts)
+    : parts_{parts} {
+  }
+
+  void end(kj::StringPtr name, kj::StringPtr text, uint depth) override {
+    // ListPartsResult/Part/{PartNumber,ETag,Size}
+    if (depth == 3) {
+      if (name == "PartNumber"_kj) {
+        current_.partNumber_ = text.parseAs<uint32_t>();
+      }
+      else if (name == "ETag"_kj) {
+        current_.etag_ = kj::str(text);
+      }
+      else if (name == "Size"_kj) {
+        current_.size_ = text.parseAs<uint64_t>();
+      }
+    }
+    else if (depth == 2) {
+      if (name == "Part"_kj) {
+        parts_.add(kj::mv(current_));
+        current_ = {};
+      }
+      else if (name == "IsTruncated"_kj) {
+        truncated_ = text == "true"_kj;
+      }
+      else if (name == "NextPartNumberMarker"_kj) {
+        marker_ = kj::str(text);
+      }
+    }
+  }
+
+  kj::Vector<UploadedPart>& parts_;
+  UploadedPart current_{};
+  bool truncated_{false};
+  kj::Maybe<kj::String> marker_;
+};
 
 struct S3Server;
 struct BucketServer;
@@ -76,6 +328,36 @@ struct ObjectServer
   kj::Promise<void> write(WriteContext) override;
   kj::Promise<void> multipart(MultipartContext) override;
   kj::Promise<void> delete_(DeleteContext) override;
+  kj::Promise<void> upload(UploadContext) override;
+  kj::Promise<void> copyFrom(CopyFromContext) override;
+  kj::Promise<void> resumeMultipart(ResumeMultipartContext) override;
+
+  // Sends an object, or starts a multipart upload of one, stored with
+  // `contentEncoding` if it is not null.
+  kj::Promise<void> put(kj::Array<const kj::byte>, kj::StringPtr contentEncoding = nullptr);
+  kj::Promise<uint64_t> size(kj::StringPtr version);
+
+  // The name of `version` in the metadata cache.
+  kj::String metadataName(kj::StringPtr version);
+  // Drops the cached metadata of the latest version, and of `version`.
+  void invalidate(kj::StringPtr version = nullptr);
+
+  kj::Promise<kj::String> initiateMultipart(kj::StringPtr contentEncoding = nullptr);
+  kj::Promise<void> abortMultipart(kj::StringPtr uploadId);
+
+  // Adds the parts of `uploadId` after `marker` to `parts`, following
+  // truncated listings.
+  kj::Promise<void> listParts(
+    kj::StringPtr uploadId, kj::Maybe<kj::StringPtr> marker, kj::Vector<UploadedPart>& parts);
+
+  // The name of the checkpoint file of `uploadId` of this object, which
+  // starts with a prefix unique to the bucket and key.
+  kj::String checkpointPrefix();
+  kj::Path checkpointPath(kj::StringPtr uploadId);
+  // The checkpoint of `uploadId`, or by default the one last saved for
+  // this object, and its parts up to any left half written by a crash.
+  kj::Maybe<Checkpoint> readCheckpoint(kj::StringPtr uploadId = nullptr);
+  void removeCheckpoint(kj::StringPtr uploadId);
 
   kj::Own<BucketServer> bucket_;
   kj::String key_;
@@ -91,7 +373,33 @@ struct BucketServer
     return kj::addRef(*this);
   }
 
+  kj::Promise<void> listObjects(ListObjectsContext) override;
+  kj::Promise<void> listObjectVersions(ListObjectVersionsContext) override;
   kj::Promise<void> getObject(GetObjectContext) override;
+  kj::Promise<void> deleteObjects(DeleteObjectsContext) override;
+  kj::Promise<void> headObjects(HeadObjectsContext) override;
+
+  // Deletes keys [first, last) of `keys` with one request.
+  kj::Promise<void> deleteBatch(
+    capnp::List<capnp::Text>::Reader keys, size_t first, size_t last,
+    kj::Vector<FailedKey>& errors);
+
+  struct Query {
+    kj::String prefix_;
+    kj::String delimiter_;
+  };
+
+  kj::Promise<kj::HttpClient::Response> listObjectsPage(
+    const Query&, kj::StringPtr startAfter, kj::Maybe<kj::StringPtr> continuationToken);
+  kj::Promise<kj::HttpClient::Response> listVersionsPage(
+    kj::StringPtr prefix, kj::Maybe<kj::StringPtr> keyMarker, kj::Maybe<kj::StringPtr> versionIdMarker);
+
+  kj::Promise<void> deliverObjects(
+    kj::Promise<kj::HttpClient::Response> page, Query,
+    kj::Own<BatchSender<capnp::Text>>);
+  kj::Promise<void> deliverVersions(
+    kj::Promise<kj::HttpClient::Response> page, Query,
+    kj::Own<BatchSender<S3::Bucket::ObjectVersion>>);
 
   kj::String getPath() const {
     return kj::str("https://", name_, "s3.amazonaws.com");
@@ -110,9 +418,15 @@ struct MultipartStream
   , kj::AsyncOutputStream
   , kj::TaskSet::ErrorHandler {
 
+  // If `checkpoint`, and the client has a checkpoint directory, the
+  // upload and its parts, starting with `parts` already uploaded, are
+  // saved there as they complete.
   MultipartStream(
     kj::Own<ObjectServer> object,
-    kj::StringPtr uploadId);
+    kj::StringPtr uploadId,
+    bool checkpoint = false,
+    kj::Vector<UploadedPart> parts = {});
+  ~MultipartStream() noexcept;
 
   kj::Promise<void> write(WriteContext ctx) override {
     auto params = ctx.getParams();
@@ -130,21 +444,7 @@ struct MultipartStream
 
   kj::Promise<void> write(
       kj::ArrayPtr<const kj::ArrayPtr<const kj::byte>> pieces) override {
-    while (pieces.size() > 0 && pieces[0].size() == 0) {
-      pieces = pieces.slice(1, pieces.size());
-    }
-
-    if (pieces.size() == 0) {
-      return kj::READY_NOW;
-    }
-
-    return
-      write(pieces.front())
-      .then(
-        [this, pieces] {
-	  return write(pieces.slice(1, pieces.size()));
-	}
-      );
+    return write(pieces, 0);
   }
 
   kj::Promise<void> whenWriteDisconnected() override {
@@ -152,42 +452,301 @@ struct MultipartStream
   }
 
 private:
-    void taskFailed(kj::Exception&& exc) override {
-    KJ_LOG(ERROR, exc);
-  }
+  void taskFailed(kj::Exception&& exc) override;
 
   kj::Promise<void> write(kj::ArrayPtr<const kj::byte>);
-  kj::Promise<void> sendPart(kj::ArrayPtr<kj::byte const>);
+  // Writes `pieces` from `offset` in the first of them.
+  kj::Promise<void> write(
+    kj::ArrayPtr<const kj::ArrayPtr<const kj::byte>> pieces, size_t offset);
+
+  kj::Promise<void> sendPart(kj::Array<kj::byte> buffer, size_t size);
+  // Sends `count` whole parts of `pieces` from `offset` in the first of
+  // them straight from the caller's memory, each gathered from the
+  // pieces it spans, at most uploadConcurrency parts at once, counting
+  // buffered parts still in flight.
+  kj::Promise<void> sendParts(
+    kj::ArrayPtr<const kj::ArrayPtr<const kj::byte>> pieces, size_t offset, size_t count);
+  // Sends the part made of `segments` as a single vectored write.
+  kj::Promise<void> uploadPart(
+    uint32_t partNumber, kj::ArrayPtr<const kj::ArrayPtr<const kj::byte>> segments,
+    uint32_t attempt);
   kj::Promise<kj::String> complete();
+
+public:
   kj::Promise<kj::String> finish();
 
+  // Adds bytes [first, last] of `copySource`, an x-amz-copy-source
+  // value, as parts copied by S3 itself, at most uploadConcurrency at
+  // once.
+  kj::Promise<void> copy(kj::StringPtr copySource, uint64_t first, uint64_t last);
+
+private:
+  kj::Promise<void> copyPart(
+    uint32_t partNumber, kj::StringPtr copySource, uint64_t first, uint64_t last);
+
+private:
+
+  // Makes a free buffer current, waiting for an in-flight part to
+  // complete if the pool is exhausted.
+  kj::Promise<void> acquireBuffer();
+  void releaseBuffer(kj::Array<kj::byte>);
+
+  // Runs `func`, which sends a part, once fewer than uploadConcurrency
+  // parts, buffered or not, are in flight.
+  template <typename Func>
+  kj::Promise<void> withSlot(Func&& func);
+  void releaseSlot();
+
+  // Appends an acknowledged part to the checkpoint, if any, on the
+  // client's checkpoint thread once earlier saves are durable.
+  void save(const UploadedPart&);
+
   kj::Own<ObjectServer> object_;
   kj::String uploadId_;
-  std::size_t bufferSize_{8*1024*1024};
+  std::size_t partSize_;
+  uint32_t poolSize_;
+
+  kj::Array<kj::byte> buffer_;
+  std::size_t filled_{0};
+  // The bytes of a single write, as the one piece of a vectored write;
+  // writes are never concurrent.
+  kj::ArrayPtr<const kj::byte> piece_;
+
+  uint32_t allocated_{0};
+  kj::Vector<kj::Array<kj::byte>> free_;
+  kj::Maybe<kj::Own<kj::PromiseFulfiller<kj::Array<kj::byte>>>> waiter_;
+
+  uint32_t sending_{0};
+  // woken in order, so that no part waits behind later ones
+  std::deque<kj::Own<kj::PromiseFulfiller<void>>> slotWaiters_;
+
+  kj::Vector<UploadedPart> parts_;
+  bool checkpointing_{false};
+  kj::Maybe<kj::Own<const kj::AppendableFile>> checkpoint_;
+  // the latest save, which follows all earlier ones
+  kj::Promise<void> saved_{kj::READY_NOW};
+  kj::Maybe<kj::Exception> failure_;
+  kj::TaskSet tasks_{*this};
+};
+
+// Buffers an upload of unknown length, sending it as a single PUT if
+// it ends within the threshold, or else as a multipart upload. The
+// multipart upload is initiated once half the threshold is buffered,
+// so that switching over does not wait a round trip; it is aborted
+// again if the upload turns out to be small.
+struct AdaptiveStream
+  : capnp::ByteStream::Server
+  , kj::AsyncOutputStream {
+
+  // The object is stored with `contentEncoding`, if it is not null.
+  AdaptiveStream(kj::Own<ObjectServer> object, kj::StringPtr contentEncoding = nullptr);
+  ~AdaptiveStream() noexcept;
+
+  kj::Promise<void> write(WriteContext ctx) override {
+    auto bytes = ctx.getParams().getBytes();
+    return write(bytes.begin(), bytes.size());
+  }
+
+  kj::Promise<void> end(EndContext) override {
+    return finish();
+  }
+
+  kj::Promise<void> write(void const* data, size_t size) override {
+    auto bytes = kj::arrayPtr(reinterpret_cast<kj::byte const*>(data), size);
+    KJ_IF_MAYBE(multipart, multipart_) {
+      return (*multipart)->write(bytes.begin(), bytes.size());
+    }
+
+    buffer_.addAll(bytes);
+    if (buffer_.size() > threshold_) {
+      return startMultipart();
+    }
+
+    if (uploadId_ == nullptr && buffer_.size() > threshold_ / 2) {
+      uploadId_ = object_->initiateMultipart(contentEncoding_).eagerlyEvaluate(nullptr);
+    }
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> write(
+      kj::ArrayPtr<const kj::ArrayPtr<const kj::byte>> pieces) override {
+    KJ_IF_MAYBE(multipart, multipart_) {
+      return (*multipart)->write(pieces);
+    }
+
+    for (auto ii: kj::indices(pieces)) {
+      buffer_.addAll(pieces[ii]);
+      if (buffer_.size() > threshold_) {
+	auto rest = pieces.slice(ii + 1, pieces.size());
+	return
+	  startMultipart()
+	  .then(
+	    [this, rest]{
+	      return KJ_ASSERT_NONNULL(multipart_)->write(rest);
+	    }
+	  );
+      }
+    }
+
+    if (uploadId_ == nullptr && buffer_.size() > threshold_ / 2) {
+      uploadId_ = object_->initiateMultipart(contentEncoding_).eagerlyEvaluate(nullptr);
+    }
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> whenWriteDisconnected() override {
+    return kj::NEVER_DONE;
+  }
+
+  kj::Promise<void> finish() {
+    KJ_IF_MAYBE(multipart, multipart_) {
+      return (*multipart)->finish().ignoreResult();
+    }
+    return object_->put(buffer_.releaseAsArray(), contentEncoding_);
+  }
+
+private:
+  // Moves the buffered bytes to a multipart upload, which takes all
+  // further writes.
+  kj::Promise<void> startMultipart();
+
+  kj::Own<ObjectServer> object_;
+  kj::StringPtr contentEncoding_;
+  size_t threshold_;
+  kj::Vector<kj::byte> buffer_;
+  kj::Maybe<kj::Promise<kj::String>> uploadId_;
+  kj::Maybe<kj::Own<MultipartStream>> multipart_;
+};
+
+// Fetches [first, last] of an object as fixed-size ranged GETs issued
+// concurrently, writing the chunks to the output stream in order.
+struct ParallelRead {
+
+  ParallelRead(
+    kj::Own<ObjectServer> object,
+    kj::String url,
+    kj::Own<kj::AsyncOutputStream> out,
+    uint64_t first,
+    uint64_t last);
+
+  // Resolves once the first chunk has arrived and the size of the
+  // object is known.
+  kj::Promise<void> start();
 
-  kj::Array<kj::byte> buffer_{kj::heapArray<kj::byte>(bufferSize_)};
+  // Streams the remaining chunks to the output.
+  kj::Promise<void> run();
 
-  struct Part {
-    uint32_t partNumber_;
+private:
+  struct Chunk {
+    kj::Array<kj::byte> data_;
+    uint64_t total_;
     kj::String etag_;
   };
 
-  kj::Vector<Part> parts_;
-  kj::Own<kj::ArrayOutputStream> out_{kj::heap<kj::ArrayOutputStream>(buffer_)};
-  kj::TaskSet tasks_{*this};
+  // Fetches chunk `index`, eagerly, so that the chunks in the window
+  // are read from their connections while earlier ones are written.
+  kj::Promise<Chunk> fetch(uint64_t index);
+  kj::Promise<void> pump(uint64_t index);
+
+  kj::Own<ObjectServer> object_;
+  kj::String url_;
+  kj::Own<kj::AsyncOutputStream> out_;
+  uint64_t first_;
+  uint64_t last_;
+  uint64_t chunkSize_;
+  uint64_t count_{1};
+  kj::Array<kj::Maybe<kj::Promise<Chunk>>> window_;
+  kj::Maybe<Chunk> head_;
+  // The ETag of the first chunk, which the rest must match so that they
+  // are all of the same version.
+  kj::String etag_;
+};
+
+// The ETag, size and last modified time of objects, from their last
+// HEAD or GET, for a fixed time.
+struct MetadataCache {
+  struct Entry {
+    kj::String etag_;
+    uint64_t size_;
+    kj::String lastModified_;
+    kj::TimePoint expires_;
+  };
+
+  MetadataCache(kj::Timer& timer, kj::Duration ttl, size_t capacity)
+    : timer_{timer}
+    , ttl_{ttl}
+    , capacity_{capacity} {
+  }
+
+  // Neither bucket names nor version ids contain '/'.
+  static kj::String name(kj::StringPtr bucket, kj::StringPtr version, kj::StringPtr key) {
+    return kj::str(bucket, '/', version, '/', key);
+  }
+
+  kj::Maybe<const Entry&> find(kj::StringPtr name);
+  // Sets the entry's expiry.
+  void put(kj::String name, Entry);
+  void erase(kj::StringPtr name);
+
+  kj::Timer& timer_;
+  kj::Duration ttl_;
+  size_t capacity_;
+  kj::HashMap<kj::String, Entry> entries_;
 };
 
+kj::Maybe<const MetadataCache::Entry&> MetadataCache::find(kj::StringPtr name) {
+  KJ_IF_MAYBE(entry, entries_.find(name)) {
+    if (timer_.now() < entry->expires_) {
+      return *entry;
+    }
+    entries_.erase(name);
+  }
+  return nullptr;
+}
+
+void MetadataCache::put(kj::String name, Entry entry) {
+  if (ttl_ == 0 * kj::SECONDS) {
+    return;
+  }
+
+  auto now = timer_.now();
+  if (entries_.size() >= capacity_ && entries_.find(name) == nullptr) {
+    entries_.eraseAll(
+      [now](auto&, auto& entry) {
+	return entry.expires_ <= now;
+      }
+    );
+    if (entries_.size() >= capacity_) {
+      return;
+    }
+  }
+  entry.expires_ = now + ttl_;
+  entries_.upsert(
+    kj::mv(name), kj::mv(entry),
+    [](auto& existing, auto&& replacement) {
+      existing = kj::mv(replacement);
+    }
+  );
+}
+
+void MetadataCache::erase(kj::StringPtr name) {
+  entries_.erase(name);
+}
+
 struct S3Server
   : S3::Server
   , kj::Refcounted
   , kj::TaskSet::ErrorHandler {
 
   S3Server(
+    kj::Timer&,
     kj::HttpHeaderTable::Builder& builder,
     Credentials::Provider::Client credsProvider,
     kj::Own<kj::HttpClient> client,
+    kj::Own<ClientMetrics> metrics,
     kj::StringPtr region,
-    capnp::ByteStreamFactory&
+    capnp::ByteStreamFactory&,
+    const S3Options&
   );
 
   kj::Own<S3Server> addRef() {
@@ -200,98 +759,261 @@ struct S3Server
 
   kj::Promise<void> listBuckets(ListBucketsContext) override;
   kj::Promise<void> getBucket(GetBucketContext) override;
+  kj::Promise<void> getMetrics(GetMetricsContext) override;
+
+  // Establishes `count` keep-alive connections to the bucket's host.
+  void prewarm(kj::StringPtr bucket, uint32_t count);
+
+  // Sets the request headers of `conditions`.
+  void setConditions(kj::HttpHeaders&, S3::Object::Conditions::Reader conditions);
+
+  // The metadata in HEAD or GET response headers, if they have an ETag
+  // and size. Ranged GETs give the size in their Content-Range.
+  kj::Maybe<MetadataCache::Entry> metadata(const kj::HttpHeaders&);
+
+  // The codec that decodes a response body, if compression is enabled
+  // and the body is stored compressed with one.
+  kj::Maybe<Compression> decoding(const kj::HttpHeaders&);
+
+  // Replies to a write, upload or multipart upload with a stream that
+  // compresses into `inner`, and finishes it with `finish`.
+  capnp::ByteStream::Client encode(
+    kj::Own<kj::AsyncOutputStream> inner, kj::Function<kj::Promise<void>()> finish);
 
   struct {
+    kj::HttpHeaderId amzSdkRequest;
+    kj::HttpHeaderId contentEncoding;
+    kj::HttpHeaderId contentRange;
     kj::HttpHeaderId etag;
+    kj::HttpHeaderId ifMatch;
+    kj::HttpHeaderId ifModifiedSince;
+    kj::HttpHeaderId ifNoneMatch;
+    kj::HttpHeaderId lastModified;
     kj::HttpHeaderId range;
+    kj::HttpHeaderId xAmzChecksumSha256;
+    kj::HttpHeaderId xAmzCopySource;
+    kj::HttpHeaderId xAmzCopySourceRange;
+    kj::HttpHeaderId xAmzSdkChecksumAlgorithm;
   } ids_;
   
+  kj::Timer& timer_;
   Credentials::Provider::Client credsProvider_;
   kj::HttpHeaderTable& table_;
   kj::Own<kj::HttpClient> client_;
+  kj::Own<ClientMetrics> metrics_;
   kj::StringPtr region_;
   kj::String hostname_;
   capnp::ByteStreamFactory& factory_;
+  S3Options options_;
+  MetadataCache metadata_;
+  // runs the writes and syncs of checkpoints, in the order saved
+  kj::Maybe<kj::Own<FileIo>> checkpointIo_;
   kj::TaskSet tasks_{*this};
 };
 
 S3Server::S3Server(
+  kj::Timer& timer,
   kj::HttpHeaderTable::Builder& builder,
   Credentials::Provider::Client credsProvider,
   kj::Own<kj::HttpClient> client,
+  kj::Own<ClientMetrics> metrics,
   kj::StringPtr region,
-  capnp::ByteStreamFactory& factory)
-  : credsProvider_{kj::mv(credsProvider)}
-  , ids_{ 
+  capnp::ByteStreamFactory& factory,
+  const S3Options& options)
+  : ids_{
+      .amzSdkRequest{builder.add("amz-sdk-request")},
+      .contentEncoding{builder.add("content-encoding")},
+      .contentRange{builder.add("content-range")},
       .etag{builder.add("etag")},
-      .range{builder.add("range")}
+      .ifMatch{builder.add("if-match")},
+      .ifModifiedSince{builder.add("if-modified-since")},
+      .ifNoneMatch{builder.add("if-none-match")},
+      .lastModified{builder.add("last-modified")},
+      .range{builder.add("range")},
+      .xAmzChecksumSha256{builder.add("x-amz-checksum-sha256")},
+      .xAmzCopySource{builder.add("x-amz-copy-source")},
+      .xAmzCopySourceRange{builder.add("x-amz-copy-source-range")},
+      .xAmzSdkChecksumAlgorithm{builder.add("x-amz-sdk-checksum-algorithm")}
   }
+  , timer_{timer}
+  , credsProvider_{kj::mv(credsProvider)}
   , table_{builder.getFutureTable()}
   , client_{kj::mv(client)}
+  , metrics_{kj::mv(metrics)}
   , region_{region}
   , hostname_{kj::str("s3."_kj, region_, ".amazonaws.com")}
-  , factory_{factory} {
+  , factory_{factory}
+  , options_{options}
+  , metadata_{timer, options.metadataTtl, options.metadataCacheSize} {
+  if (options.checkpoints != nullptr) {
+    checkpointIo_ = newFileIo(1);
+  }
 }
 
-kj::Promise<void> S3Server::listBuckets(ListBucketsContext ctx) {
-  KJ_DREQUIRE(headerTable_.isReady());
-  auto params = ctx.getParams();
+void S3Server::setConditions(
+    kj::HttpHeaders& headers, S3::Object::Conditions::Reader conditions) {
+  if (conditions.getIfNoneMatch().size()) {
+    headers.set(ids_.ifNoneMatch, conditions.getIfNoneMatch());
+  }
+  if (conditions.getIfMatch().size()) {
+    headers.set(ids_.ifMatch, conditions.getIfMatch());
+  }
+  if (conditions.getIfModifiedSince().size()) {
+    headers.set(ids_.ifModifiedSince, conditions.getIfModifiedSince());
+  }
+}
 
-  auto url = kj::str("https://"_kj, hostname_, "/"_kj);
-  kj::HttpHeaders headers{table_};
-  headers.set(kj::HttpHeaderId::HOST, hostname_);
-  auto req = client_->request(kj::HttpMethod::GET, url, headers);
-  return
-    kj::mv(req.response)
+kj::Maybe<MetadataCache::Entry> S3Server::metadata(const kj::HttpHeaders& headers) {
+  kj::Maybe<uint64_t> size;
+  KJ_IF_MAYBE(range, headers.get(ids_.contentRange)) {
+    // bytes <first>-<last>/<total>
+    KJ_IF_MAYBE(slash, range->findLast('/')) {
+      size = range->slice(*slash + 1).tryParseAs<uint64_t>();
+    }
+  }
+  else KJ_IF_MAYBE(length, headers.get(kj::HttpHeaderId::CONTENT_LENGTH)) {
+    size = length->tryParseAs<uint64_t>();
+  }
 
-    .then(
-      [](auto response) mutable {
-	KJ_LOG(INFO, response.statusCode);
-	KJ_LOG(INFO, response.statusText);
-	KJ_REQUIRE(response.statusCode != 400);
-	KJ_REQUIRE(response.body);
-	return response.body->readAllText().attach(kj::mv(response.body));
+  KJ_IF_MAYBE(etag, headers.get(ids_.etag)) {
+    KJ_IF_MAYBE(s, size) {
+      return MetadataCache::Entry{
+	kj::str(*etag), *s, kj::str(headers.get(ids_.lastModified).orDefault(""_kj)),
+	kj::origin<kj::TimePoint>()
+      };
+    }
+  }
+  return nullptr;
+}
+
+kj::Maybe<Compression> S3Server::decoding(const kj::HttpHeaders& headers) {
+  if (options_.compression == Compression::NONE) {
+    return nullptr;
+  }
+  KJ_IF_MAYBE(encoding, headers.get(ids_.contentEncoding)) {
+    KJ_IF_MAYBE(compression, parseContentEncoding(*encoding)) {
+      if (*compression != Compression::NONE) {
+	return *compression;
       }
-    )
-    .then(
-      [ctx = kj::mv(ctx)](kj::String txt) mutable {
-	KJ_LOG(INFO, txt);
-	kj::Vector<capnp::Text::Reader> names;
+    }
+  }
+  return nullptr;
+}
 
-	rapidxml::xml_document<> doc;
-	doc.parse<rapidxml::parse_non_destructive>(const_cast<char*>(txt.cStr()));
+// Compresses what is written to it before passing it on to an upload,
+// which is finished once the encoder has written out the rest.
+struct EncodingStream
+  : capnp::ByteStream::Server {
+
+  EncodingStream(
+      Compression compression,
+      kj::Own<kj::AsyncOutputStream> inner,
+      kj::Function<kj::Promise<void>()> finish)
+    : inner_{kj::mv(inner)}
+    , encoder_{newEncoder(compression, *inner_)}
+    , finish_{kj::mv(finish)} {
+  }
+
+  kj::Promise<void> write(WriteContext ctx) override {
+    auto bytes = ctx.getParams().getBytes();
+    return encoder_->write(bytes.begin(), bytes.size());
+  }
 
-	KJ_IF_MAYBE(error, firstNode(doc, "Error"_kj)) {
-	  auto& code = KJ_REQUIRE_NONNULL(firstNode(*error, "Code"_kj));
-	  auto& msg = KJ_REQUIRE_NONNULL(firstNode(*error, "Message"_kj));
-	  KJ_FAIL_REQUIRE("Failed to list buckets", code, msg);
+  kj::Promise<void> end(EndContext) override {
+    return
+      encoder_->end()
+      .then(
+        [this]{
+	  return finish_();
 	}
+      );
+  }
 
-	auto& result = KJ_REQUIRE_NONNULL(firstNode(doc, "ListAllMyBucketsResult"_kj));
-	auto& buckets = KJ_REQUIRE_NONNULL(firstNode(result, "Buckets"_kj));
-	auto bucket = firstNode(buckets, "Bucket"_kj);
+  kj::Own<kj::AsyncOutputStream> inner_;
+  kj::Own<Codec> encoder_;
+  kj::Function<kj::Promise<void>()> finish_;
+};
 
-	while (true) {
-	  KJ_IF_MAYBE(b, bucket) {
-	    auto& name = KJ_REQUIRE_NONNULL(firstNode(*b, "Name"_kj));
-	    names.add(name.value(), name.value_size());
-	    bucket = nextSibling(*b, "Bucket"_kj);
-	  }
-	  else {
-	    break;
-	  }
-	}
+capnp::ByteStream::Client S3Server::encode(
+    kj::Own<kj::AsyncOutputStream> inner, kj::Function<kj::Promise<void>()> finish) {
+  return kj::heap<EncodingStream>(options_.compression, kj::mv(inner), kj::mv(finish));
+}
 
-	auto reply = ctx.getResults();
-	reply.setBucketNames(names);
-      }
-    );
+// Sets the typed properties of an object.
+void setProperties(const MetadataCache::Entry& entry, S3::Object::Properties::Builder props) {
+  props.setEtag(entry.etag_);
+  props.setSize(entry.size_);
+  props.setLastModified(entry.lastModified_);
 }
 
-kj::Promise<void> S3Server::getBucket(GetBucketContext ctx) {
-  auto params = ctx.getParams();
-  auto name = params.getName();
-  auto reply = ctx.getResults();
+struct ListBucketsHandler
+  : ResponseHandler {
+
+  void end(kj::StringPtr name, kj::StringPtr text, uint depth) override {
+    // ListAllMyBucketsResult/Buckets/Bucket/Name
+    if (depth == 4 && name == "Name"_kj) {
+      names_.add(kj::str(text));
+    }
+  }
+
+  kj::Vector<kj::String> names_;
+};
+
+kj::Promise<void> S3Server::listBuckets(ListBucketsContext ctx) {
+  KJ_DREQUIRE(table_.isReady());
+
+  auto url = kj::str("https://"_kj, hostname_, "/"_kj);
+  kj::HttpHeaders headers{table_};
+  headers.set(kj::HttpHeaderId::HOST, hostname_);
+  auto req = client_->request(kj::HttpMethod::GET, url, headers);
+  return
+    kj::mv(req.response)
+    .then(
+      [ctx = kj::mv(ctx)](auto response) mutable {
+	auto handler = kj::heap<ListBucketsHandler>();
+	auto& h = *handler;
+	return
+	  parseResponse(kj::mv(response), h, "Failed to list buckets"_kj)
+	  .then(
+	    [ctx = kj::mv(ctx), &h]() mutable {
+	      auto reply = ctx.getResults();
+	      auto names = reply.initBucketNames(h.names_.size());
+	      for (auto ii: kj::indices(h.names_)) {
+		names.set(ii, h.names_[ii]);
+	      }
+	    }
+	  )
+	  .attach(kj::mv(handler));
+      }
+    );
+}
+
+kj::Promise<void> S3Server::getMetrics(GetMetricsContext ctx) {
+  ctx.getResults().setMetrics(newMetricsServer(kj::addRef(*metrics_)));
+  return kj::READY_NOW;
+}
+
+void S3Server::prewarm(kj::StringPtr bucket, uint32_t count) {
+  for (auto ii = 0u; ii < count; ++ii) {
+    tasks_.add(
+      // defer until the header table has been built
+      kj::evalLater(
+        [this, hostname = bucketHost(bucket, region_)]{
+          auto url = kj::str("https://"_kj, hostname, "/"_kj);
+          kj::HttpHeaders headers{table_};
+          headers.set(kj::HttpHeaderId::HOST, hostname);
+          auto req = client_->request(kj::HttpMethod::HEAD, url, headers, 0ul);
+          return req.response.ignoreResult();
+        }
+      )
+    );
+  }
+}
+
+kj::Promise<void> S3Server::getBucket(GetBucketContext ctx) {
+  auto params = ctx.getParams();
+  auto name = params.getName();
+  auto reply = ctx.getResults();
   reply.setBucket(kj::refcounted<BucketServer>(addRef(), name, region_));
   return kj::READY_NOW;
 }
@@ -299,200 +1021,1545 @@ kj::Promise<void> S3Server::getBucket(GetBucketContext ctx) {
 BucketServer::BucketServer(kj::Own<S3Server> s3, kj::StringPtr name, kj::StringPtr region)
   : s3_{kj::mv(s3)}
   , name_{kj::str(name)}
-  , hostname_{kj::str(name_, ".s3.", region, ".amazonaws.com")}
+  , hostname_{bucketHost(name_, region)}
   , url_{kj::str("https"), nullptr, kj::str(hostname_), {}, false, {}, nullptr, {}}
   , headers_{s3_->table_} {
 
-  headers_.set(kj::HttpHeaderId::HOST, hostname_);
+  headers_.set(kj::HttpHeaderId::HOST, hostname_);
+}
+
+// Streams the entries of one page of a listing to a callback as they
+// are parsed, holding back further input while a full batch waits to
+// be sent. The request for the following page is started as soon as
+// its marker has been parsed, so that it downloads while this page is
+// delivered.
+template <typename T>
+struct PageHandler
+  : ResponseHandler {
+
+  PageHandler(BucketServer& bucket, BucketServer::Query query, kj::Own<BatchSender<T>> sender)
+    : bucket_{bucket}
+    , query_{kj::mv(query)}
+    , sender_{kj::mv(sender)} {
+  }
+
+  kj::Promise<void> flush() override {
+    return sender_->full() ? sender_->flush() : kj::READY_NOW;
+  }
+
+  BucketServer& bucket_;
+  BucketServer::Query query_;
+  kj::Own<BatchSender<T>> sender_;
+  kj::Maybe<kj::Promise<kj::HttpClient::Response>> next_;
+};
+
+struct ObjectsPageHandler
+  : PageHandler<capnp::Text> {
+
+  using PageHandler::PageHandler;
+
+  void end(kj::StringPtr name, kj::StringPtr text, uint depth) override {
+    if (depth == 3 && (name == "Key"_kj || name == "Prefix"_kj)) {
+      // ListBucketResult/Contents/Key or ListBucketResult/CommonPrefixes/Prefix
+      sender_->add(
+	[&](auto values, auto ii) {
+	  values.set(ii, text);
+	}
+      );
+    }
+    else if (depth == 2 && name == "NextContinuationToken"_kj) {
+      next_ = bucket_.listObjectsPage(query_, ""_kj, text);
+    }
+  }
+};
+
+struct VersionsPageHandler
+  : PageHandler<S3::Bucket::ObjectVersion> {
+
+  using PageHandler::PageHandler;
+
+  void end(kj::StringPtr name, kj::StringPtr text, uint depth) override {
+    if (depth == 3) {
+      if (name == "Key"_kj) {
+	key_ = kj::str(text);
+      }
+      else if (name == "VersionId"_kj) {
+	version_ = kj::str(text);
+      }
+    }
+    else if (depth == 2) {
+      // versions and delete markers are interleaved in key order
+      auto deleted = name == "DeleteMarker"_kj;
+      if (deleted || name == "Version"_kj) {
+	sender_->add(
+	  [&](auto values, auto ii) {
+	    auto value = values[ii];
+	    value.setKey(key_);
+	    value.setVersion(version_);
+	    value.setDeleted(deleted);
+	  }
+	);
+      }
+      else if (name == "NextKeyMarker"_kj) {
+	keyMarker_ = kj::str(text);
+      }
+      else if (name == "NextVersionIdMarker"_kj) {
+	startNext(text);
+      }
+    }
+    else if (depth == 1) {
+      startNext(nullptr);
+    }
+  }
+
+  void startNext(kj::Maybe<kj::StringPtr> versionIdMarker) {
+    if (next_ != nullptr) {
+      return;
+    }
+    KJ_IF_MAYBE(keyMarker, keyMarker_) {
+      next_ = bucket_.listVersionsPage(query_.prefix_, kj::StringPtr{*keyMarker}, versionIdMarker);
+    }
+  }
+
+  kj::String key_;
+  kj::String version_;
+  kj::Maybe<kj::String> keyMarker_;
+};
+
+kj::Promise<kj::HttpClient::Response> BucketServer::listObjectsPage(
+    const Query& query,
+    kj::StringPtr startAfter,
+    kj::Maybe<kj::StringPtr> continuationToken) {
+
+  auto url = url_.clone();
+  url.query.add(kj::str("list-type"_kj), kj::str("2"_kj));
+  if (query.prefix_.size()) {
+    url.query.add(kj::str("prefix"_kj), kj::str(query.prefix_));
+  }
+  if (query.delimiter_.size()) {
+    url.query.add(kj::str("delimiter"_kj), kj::str(query.delimiter_));
+  }
+  if (startAfter.size()) {
+    url.query.add(kj::str("start-after"_kj), kj::str(startAfter));
+  }
+  KJ_IF_MAYBE(token, continuationToken) {
+    url.query.add(kj::str("continuation-token"_kj), kj::str(*token));
+  }
+
+  auto req = s3_->client_->request(
+    kj::HttpMethod::GET, url.toString(), headers_, 0ul
+  );
+  return kj::mv(req.response);
+}
+
+kj::Promise<kj::HttpClient::Response> BucketServer::listVersionsPage(
+    kj::StringPtr prefix,
+    kj::Maybe<kj::StringPtr> keyMarker,
+    kj::Maybe<kj::StringPtr> versionIdMarker) {
+
+  auto url = url_.clone();
+  url.query.add(kj::str("versions"_kj), nullptr);
+  if (prefix.size()) {
+    url.query.add(kj::str("prefix"_kj), kj::str(prefix));
+  }
+  KJ_IF_MAYBE(marker, keyMarker) {
+    url.query.add(kj::str("key-marker"_kj), kj::str(*marker));
+  }
+  KJ_IF_MAYBE(marker, versionIdMarker) {
+    url.query.add(kj::str("version-id-marker"_kj), kj::str(*marker));
+  }
+
+  auto req = s3_->client_->request(
+    kj::HttpMethod::GET, url.toString(), headers_, 0ul
+  );
+  return kj::mv(req.response);
+}
+
+kj::Promise<void> BucketServer::deliverObjects(
+    kj::Promise<kj::HttpClient::Response> page,
+    Query query,
+    kj::Own<BatchSender<capnp::Text>> sender) {
+
+  return
+    page
+    .then(
+      [this, query = kj::mv(query), sender = kj::mv(sender)](auto response) mutable {
+	auto handler = kj::heap<ObjectsPageHandler>(*this, kj::mv(query), kj::mv(sender));
+	auto& h = *handler;
+	return
+	  parseResponse(kj::mv(response), h, "Failed to list objects"_kj)
+	  .then(
+	    [this, &h]() mutable -> kj::Promise<void> {
+	      KJ_IF_MAYBE(next, h.next_) {
+		return deliverObjects(kj::mv(*next), kj::mv(h.query_), kj::mv(h.sender_));
+	      }
+	      auto& sender = *h.sender_;
+	      return sender.end().attach(kj::mv(h.sender_));
+	    }
+	  )
+	  .attach(kj::mv(handler));
+      }
+    );
+}
+
+kj::Promise<void> BucketServer::deliverVersions(
+    kj::Promise<kj::HttpClient::Response> page,
+    Query query,
+    kj::Own<BatchSender<S3::Bucket::ObjectVersion>> sender) {
+
+  return
+    page
+    .then(
+      [this, query = kj::mv(query), sender = kj::mv(sender)](auto response) mutable {
+	auto handler = kj::heap<VersionsPageHandler>(*this, kj::mv(query), kj::mv(sender));
+	auto& h = *handler;
+	return
+	  parseResponse(kj::mv(response), h, "Failed to list object versions"_kj)
+	  .then(
+	    [this, &h]() mutable -> kj::Promise<void> {
+	      KJ_IF_MAYBE(next, h.next_) {
+		return deliverVersions(kj::mv(*next), kj::mv(h.query_), kj::mv(h.sender_));
+	      }
+	      auto& sender = *h.sender_;
+	      return sender.end().attach(kj::mv(h.sender_));
+	    }
+	  )
+	  .attach(kj::mv(handler));
+      }
+    );
+}
+
+kj::Promise<void> BucketServer::listObjects(ListObjectsContext ctx) {
+  auto params = ctx.getParams();
+  Query query{kj::str(params.getPrefix()), kj::str(params.getDelimiter())};
+  auto sender = kj::heap<BatchSender<capnp::Text>>(
+    params.getCallback(), batchSize(params.getBatchSize())
+  );
+  auto page = listObjectsPage(query, params.getStartAfter(), nullptr);
+  return deliverObjects(kj::mv(page), kj::mv(query), kj::mv(sender));
+}
+
+kj::Promise<void> BucketServer::listObjectVersions(ListObjectVersionsContext ctx) {
+  auto params = ctx.getParams();
+  Query query{kj::str(params.getPrefix())};
+  auto sender = kj::heap<BatchSender<S3::Bucket::ObjectVersion>>(
+    params.getCallback(), batchSize(params.getBatchSize())
+  );
+  auto page = listVersionsPage(query.prefix_, nullptr, nullptr);
+  return deliverVersions(kj::mv(page), kj::mv(query), kj::mv(sender));
+}
+
+kj::Promise<void> BucketServer::getObject(GetObjectContext ctx) {
+  auto params = ctx.getParams();
+  auto key = params.getKey();
+  auto reply = ctx.getResults();
+  reply.setObject(kj::refcounted<ObjectServer>(addRef(), key));
+  return kj::READY_NOW;
+}
+
+// The most keys S3 accepts in one multi-object delete.
+constexpr size_t MAX_DELETE_KEYS = 1000;
+
+kj::Promise<void> BucketServer::deleteObjects(DeleteObjectsContext ctx) {
+  auto keys = ctx.getParams().getKeys();
+  auto batches = (keys.size() + MAX_DELETE_KEYS - 1) / MAX_DELETE_KEYS;
+  auto errors = kj::heap<kj::Vector<FailedKey>>();
+  auto& e = *errors;
+
+  return
+    forEachConcurrently(
+      batches, s3_->options_.deleteConcurrency,
+      [this, keys, &e](size_t batch) {
+        auto first = batch * MAX_DELETE_KEYS;
+        auto last = kj::min(first + MAX_DELETE_KEYS, size_t{keys.size()});
+        return deleteBatch(keys, first, last, e);
+      }
+    )
+    .then(
+      [ctx = kj::mv(ctx), errors = kj::mv(errors)]() mutable {
+        auto reply = ctx.getResults();
+        setErrors(reply.initErrors(errors->size()), errors->asPtr());
+      }
+    );
+}
+
+kj::Promise<void> BucketServer::deleteBatch(
+    capnp::List<capnp::Text>::Reader keys, size_t first, size_t last,
+    kj::Vector<FailedKey>& errors) {
+
+  // quiet, so that only failures are reported
+  auto txt = kj::strTree("<Delete><Quiet>true</Quiet>"_kj);
+  for (auto ii = first; ii < last; ++ii) {
+    txt = kj::strTree(
+      kj::mv(txt),
+      "<Object><Key>"_kj, xml::escape(keys[ii]), "</Key></Object>"_kj
+    );
+  }
+  auto body = kj::strTree(kj::mv(txt), "</Delete>"_kj).flatten();
+
+  auto url = url_.clone();
+  url.query.add(kj::str("delete"_kj), nullptr);
+
+  // S3 requires a checksum of the body
+  auto checksum = kj::encodeBase64(hash::sha256(body.asBytes()));
+  auto headers = headers_.cloneShallow();
+  headers.set(kj::HttpHeaderId::CONTENT_TYPE, "application/xml");
+  headers.set(s3_->ids_.xAmzSdkChecksumAlgorithm, "SHA256");
+  headers.set(s3_->ids_.xAmzChecksumSha256, checksum);
+  auto req = s3_->client_->request(
+    kj::HttpMethod::POST, url.toString(), headers, body.size()
+  );
+
+  return
+    req.body->write(body.begin(), body.size()).attach(kj::mv(req.body), kj::mv(body))
+    .then(
+      [response = kj::mv(req.response)]() mutable {
+	return kj::mv(response);
+      }
+    )
+    .then(
+      [&errors](auto response) {
+	auto handler = kj::heap<DeleteHandler>(errors);
+	auto& h = *handler;
+	return
+	  parseResponse(kj::mv(response), h, "Failed to delete objects"_kj)
+	  .attach(kj::mv(handler));
+      }
+    );
+}
+
+kj::Promise<void> BucketServer::headObjects(HeadObjectsContext ctx) {
+  auto keys = ctx.getParams().getKeys();
+
+  // Response headers are copied so that each connection goes back to
+  // the pool as soon as its HEAD has been answered.
+  struct Head {
+    uint statusCode_{0};
+    kj::String statusText_;
+    kj::Maybe<kj::HttpHeaders> headers_;
+  };
+  auto heads = kj::heapArray<Head>(keys.size());
+  auto h = heads.begin();
+
+  return
+    forEachConcurrently(
+      keys.size(), s3_->options_.headConcurrency,
+      [this, keys, h](size_t ii) {
+        auto url = url_.clone();
+        url.path.add(kj::str(keys[ii]));
+        auto req = s3_->client_->request(
+          kj::HttpMethod::HEAD, url.toString(), headers_, 0ul
+        );
+        return
+          req.response
+          .then(
+            [&head = h[ii]](auto response) {
+              head.statusCode_ = response.statusCode;
+              head.statusText_ = kj::str(response.statusText);
+              if (response.statusCode == 200) {
+                head.headers_ = response.headers->clone();
+              }
+            }
+          );
+      }
+    )
+    .then(
+      [this, ctx = kj::mv(ctx), heads = kj::mv(heads)]() mutable {
+        auto keys = ctx.getParams().getKeys();
+        auto found = 0u;
+        for (auto& head: heads) {
+          found += head.headers_ != nullptr;
+        }
+
+        auto reply = ctx.getResults();
+        auto objects = reply.initObjects(found);
+        auto errors = reply.initErrors(heads.size() - found);
+        auto nextObject = 0u;
+        auto nextError = 0u;
+        for (auto ii: kj::indices(heads)) {
+          auto& head = heads[ii];
+          KJ_IF_MAYBE(headers, head.headers_) {
+            auto object = objects[nextObject++];
+            object.setKey(keys[ii]);
+            auto values = object.initHeaders(headers->size());
+            auto jj = 0u;
+            headers->forEach(
+              [&](auto name, auto value) {
+                auto header = values[jj++].initUncommon();
+                header.setName(name);
+                header.setValue(value);
+              }
+            );
+            KJ_IF_MAYBE(entry, s3_->metadata(*headers)) {
+              setProperties(*entry, object);
+              s3_->metadata_.put(MetadataCache::name(name_, nullptr, keys[ii]), kj::mv(*entry));
+            }
+          }
+          else {
+            // HEAD responses have no body to carry an error code
+            auto error = errors[nextError++];
+            error.setKey(keys[ii]);
+            error.setCode(
+              head.statusCode_ == 404
+                ? kj::str("NoSuchKey"_kj)
+                : kj::str(head.statusCode_)
+            );
+            error.setMessage(head.statusText_);
+          }
+        }
+      }
+    );
+}
+
+kj::String ObjectServer::metadataName(kj::StringPtr version) {
+  return MetadataCache::name(bucket_->name_, version, key_);
+}
+
+void ObjectServer::invalidate(kj::StringPtr version) {
+  auto& metadata = bucket_->s3_->metadata_;
+  metadata.erase(metadataName(nullptr));
+  if (version.size()) {
+    metadata.erase(metadataName(version));
+  }
+}
+
+kj::Promise<void> ObjectServer::head(HeadContext ctx) {
+  auto params = ctx.getParams();
+  auto version = params.getVersion();
+  auto conditions = params.getConditions();
+  auto& s3 = *bucket_->s3_;
+
+  // only S3 can tell whether an object was modified since a date
+  auto name = metadataName(version);
+  if (conditions.getIfModifiedSince().size() == 0) {
+    KJ_IF_MAYBE(entry, s3.metadata_.find(name)) {
+      auto reply = ctx.getResults();
+      reply.setKey(key_);
+      switch (checkETag(entry->etag_, conditions.getIfMatch(), conditions.getIfNoneMatch())) {
+	case Precondition::FAILED:
+	  KJ_FAIL_REQUIRE("PreconditionFailed", key_);
+	case Precondition::NOT_MODIFIED:
+	  reply.setNotModified(true);
+	  reply.setEtag(entry->etag_);
+	  break;
+	case Precondition::MET: {
+	  setProperties(*entry, reply);
+	  auto size = kj::str(entry->size_);
+	  auto headers = reply.initHeaders(3);
+	  auto set = [&](auto ii, kj::StringPtr name, kj::StringPtr value) {
+	    auto header = headers[ii].initUncommon();
+	    header.setName(name);
+	    header.setValue(value);
+	  };
+	  set(0, "ETag"_kj, entry->etag_);
+	  set(1, "Content-Length"_kj, size);
+	  set(2, "Last-Modified"_kj, entry->lastModified_);
+	  break;
+	}
+      }
+      return kj::READY_NOW;
+    }
+  }
+
+  auto url = bucket_->url_.clone();
+  url.path.add(kj::str(key_));
+  if (version.size()) {
+    url.query.add(kj::str("versionId"_kj), kj::str(version));
+  }
+
+  auto headers = bucket_->headers_.cloneShallow();
+  s3.setConditions(headers, conditions);
+  auto req = s3.client_->request(
+    kj::HttpMethod::HEAD, url.toString(), headers, 0ul
+  );
+
+  return
+    req.response
+    .then(
+      [this, &s3, name = kj::mv(name), ctx = kj::mv(ctx)](auto response) mutable {
+	KJ_REQUIRE(response.statusCode != 412, "PreconditionFailed", key_);
+	auto reply = ctx.getResults();
+	reply.setKey(key_);
+	if (response.statusCode == 304) {
+	  reply.setNotModified(true);
+	  reply.setEtag(response.headers->get(s3.ids_.etag).orDefault(""_kj));
+	  return;
+	}
+
+	auto headers = reply.initHeaders(response.headers->size());
+	auto ii = 0u;
+	response.headers->forEach(
+          [&](auto name, auto value) {
+	    auto header = headers[ii++].initUncommon();
+	    header.setName(name);
+	    header.setValue(value);
+	  }
+	);
+	if (response.statusCode == 200) {
+	  KJ_IF_MAYBE(entry, s3.metadata(*response.headers)) {
+	    setProperties(*entry, reply);
+	    s3.metadata_.put(kj::mv(name), kj::mv(*entry));
+	  }
+	}
+      }
+    );
+}
+
+kj::Promise<void> ObjectServer::getBucket(GetBucketContext ctx) {
+  auto reply = ctx.getResults();
+  reply.setBucket(bucket_->addRef());
+  return kj::READY_NOW;
+}
+
+kj::Promise<void> ObjectServer::read(ReadContext ctx) {
+  auto params = ctx.getParams();;
+  auto first = params.getFirst();
+  auto last = params.getLast();
+  auto version = params.getVersion();
+  auto conditions = params.getConditions();
+  auto& s3 = *bucket_->s3_;
+  auto name = metadataName(version);
+
+  auto conditional =
+    conditions.getIfNoneMatch().size() ||
+    conditions.getIfMatch().size() ||
+    conditions.getIfModifiedSince().size();
+  if (conditional && conditions.getIfModifiedSince().size() == 0) {
+    KJ_IF_MAYBE(entry, s3.metadata_.find(name)) {
+      switch (checkETag(entry->etag_, conditions.getIfMatch(), conditions.getIfNoneMatch())) {
+	case Precondition::FAILED:
+	  KJ_FAIL_REQUIRE("PreconditionFailed", key_);
+	case Precondition::NOT_MODIFIED:
+	  ctx.getResults().setNotModified(true);
+	  return kj::READY_NOW;
+	case Precondition::MET:
+	  break;
+      }
+    }
+  }
+
+  auto out = s3.factory_.capnpToKj(params.getStream());
+
+  auto url = bucket_->url_.clone();
+  url.path.add(kj::str(key_));
+  if (version.size()) {
+    url.query.add(kj::str("versionId"_kj), kj::str(version));
+  }
+
+  // conditions are left to a single GET, rather than every chunk, and
+  // compressed objects can only be decoded from their start
+  auto& options = s3.options_;
+  if (!conditional && options.compression == Compression::NONE &&
+      options.readParallelism > 1 && last - first >= options.readChunkSize) {
+    auto reader = kj::heap<ParallelRead>(addRef(), url.toString(), kj::mv(out), first, last);
+    auto promise = reader->start();
+    return
+      promise
+      .then(
+        [this, reader = kj::mv(reader)]() mutable {
+          auto& r = *reader;
+          bucket_->s3_->tasks_.add(r.run().attach(kj::mv(reader)));
+        }
+      );
+  }
+
+  // With compression, the range is of the decoded bytes, which are
+  // only known once the stored object has been decoded from its start,
+  // so it is fetched without a range, clipped after decoding, and only
+  // read as far as the range's end.
+  auto headers = bucket_->headers_.cloneShallow();
+  auto clip = options.compression != Compression::NONE;
+  if (!clip) {
+    headers.set(s3.ids_.range, kj::str("bytes="_kj, first, '-', last));
+  }
+  s3.setConditions(headers, conditions);
+
+  auto req = s3.client_->request(
+    kj::HttpMethod::GET, url.toString(), headers, 0ul
+  );
+
+  return
+    req.response
+    .then(
+      [this, &s3, name = kj::mv(name), ctx = kj::mv(ctx), out = kj::mv(out),
+       clip, first, last](auto response) mutable {
+	KJ_REQUIRE(response.statusCode != 412, "PreconditionFailed", key_);
+	if (response.statusCode == 304) {
+	  ctx.getResults().setNotModified(true);
+	  return;
+	}
+	if (response.statusCode / 100 == 2) {
+	  KJ_IF_MAYBE(entry, s3.metadata(*response.headers)) {
+	    s3.metadata_.put(kj::mv(name), kj::mv(*entry));
+	  }
+	  KJ_IF_MAYBE(compression, s3.decoding(*response.headers)) {
+	    auto range = newRangeStream(kj::mv(out), first, last);
+	    auto decoder = newDecoder(*compression, *range);
+	    auto& body = *response.body;
+	    auto& d = *decoder;
+	    s3.tasks_.add(
+	      pumpRange(body, d, *range, kj::heapArray<kj::byte>(PUMP_BUFFER_SIZE))
+	      .then(
+	        [&d](bool ended) -> kj::Promise<void> {
+		  if (!ended) {
+		    return kj::READY_NOW;
+		  }
+		  return d.end();
+		}
+	      )
+	      .attach(kj::mv(decoder), kj::mv(range), kj::mv(response.body))
+	    );
+	    return;
+	  }
+	  if (clip) {
+	    // an object stored before compression was enabled
+	    auto range = newRangeStream(kj::mv(out), first, last);
+	    auto& body = *response.body;
+	    s3.tasks_.add(
+	      pumpRange(body, *range, *range, kj::heapArray<kj::byte>(PUMP_BUFFER_SIZE))
+	      .ignoreResult()
+	      .attach(kj::mv(range), kj::mv(response.body))
+	    );
+	    return;
+	  }
+	}
+	bucket_->s3_->tasks_.add(
+	  response.body->pumpTo(*out).ignoreResult()
+	  .attach(kj::mv(response.body), kj::mv(out))
+	);
+      }
+    );
+}
+
+// S3 refuses single PUTs of more than 5 GiB.
+constexpr uint64_t MAX_SINGLE_PUT = 5ull * 1024 * 1024 * 1024;
+
+kj::Promise<void> ObjectServer::write(WriteContext ctx) {
+  auto params = ctx.getParams();
+  auto length = params.getLength();
+  auto& s3 = *bucket_->s3_;
+  invalidate();
+
+  // the compressed length is only known at the end
+  auto compression = s3.options_.compression;
+  if (compression != Compression::NONE) {
+    auto stream = kj::heap<AdaptiveStream>(addRef(), contentEncoding(compression));
+    auto& st = *stream;
+    ctx.getResults().setStream(s3.encode(kj::mv(stream), [&st]{ return st.finish(); }));
+    return kj::READY_NOW;
+  }
+
+  if (length > MAX_SINGLE_PUT) {
+    return
+      initiateMultipart()
+      .then(
+        [this, ctx = kj::mv(ctx)](auto uploadId) mutable {
+	  auto reply = ctx.getResults();
+	  reply.setStream(kj::heap<MultipartStream>(addRef(), uploadId));
+	}
+      );
+  }
+
+  auto url = bucket_->url_.clone();
+  url.path.add(kj::str(key_));
+
+  auto headers = bucket_->headers_.cloneShallow();
+  auto req = bucket_->s3_->client_->request(
+    kj::HttpMethod::PUT, url.toString(), headers, length
+  );
+
+  auto stream = bucket_->s3_->factory_.kjToCapnp(kj::mv(req.body));
+  auto reply = ctx.getResults();
+  reply.setStream(kj::mv(stream));
+  bucket_->s3_->tasks_.add(
+    req.response
+    .then(
+      [this](auto) {
+	// a HEAD while the PUT was in progress may have cached the old tag
+	invalidate();
+      }
+    )
+    .attach(addRef())
+  );
+  return kj::READY_NOW;
+}
+
+kj::Promise<void> ObjectServer::put(
+    kj::Array<const kj::byte> bytes, kj::StringPtr contentEncoding) {
+  invalidate();
+  auto url = bucket_->url_.clone();
+  url.path.add(kj::str(key_));
+
+  auto headers = bucket_->headers_.cloneShallow();
+  if (contentEncoding.size()) {
+    headers.set(bucket_->s3_->ids_.contentEncoding, contentEncoding);
+  }
+  auto req = bucket_->s3_->client_->request(
+    kj::HttpMethod::PUT, url.toString(), headers, bytes.size()
+  );
+
+  return
+    req.body->write(bytes.begin(), bytes.size()).attach(kj::mv(req.body), kj::mv(bytes))
+    .then(
+      [response = kj::mv(req.response)]() mutable {
+	return kj::mv(response);
+      }
+    )
+    .then(
+      [this](auto response) {
+	KJ_REQUIRE(response.statusCode == 200, "Failed to put object",
+		   response.statusCode, response.statusText);
+	invalidate();
+      }
+    );
+}
+
+kj::Promise<void> ObjectServer::upload(UploadContext ctx) {
+  auto& s3 = *bucket_->s3_;
+  invalidate();
+  auto reply = ctx.getResults();
+  auto compression = s3.options_.compression;
+  if (compression != Compression::NONE) {
+    auto stream = kj::heap<AdaptiveStream>(addRef(), contentEncoding(compression));
+    auto& st = *stream;
+    reply.setStream(s3.encode(kj::mv(stream), [&st]{ return st.finish(); }));
+    return kj::READY_NOW;
+  }
+  reply.setStream(kj::heap<AdaptiveStream>(addRef()));
+  return kj::READY_NOW;
+}
+
+kj::Promise<void> ObjectServer::delete_(DeleteContext ctx) {
+  auto version = ctx.getParams().getVersion();
+  invalidate(version);
+
+  auto url = bucket_->url_.clone();
+  url.path.add(kj::str(key_));
+  if (version.size()) {
+    url.query.add(kj::str("versionId"_kj), kj::str(version));
+  }
+
+  auto headers = bucket_->headers_.cloneShallow();
+  auto req = bucket_->s3_->client_->request(
+    kj::HttpMethod::DELETE, url.toString(), headers, 0ul
+  );
+  return
+    req.response
+    .then(
+      [this, version = kj::str(version)](auto) {
+	invalidate(version);
+      }
+    );
+}
+
+kj::Promise<kj::String> ObjectServer::initiateMultipart(kj::StringPtr contentEncoding) {
+  auto url = bucket_->url_.clone();
+  url.path.add(kj::str(key_));
+  url.query.add(kj::str("uploads"_kj), nullptr);
+
+  auto headers = bucket_->headers_.cloneShallow();
+  if (contentEncoding.size()) {
+    headers.set(bucket_->s3_->ids_.contentEncoding, contentEncoding);
+  }
+  auto req = bucket_->s3_->client_->request(
+    kj::HttpMethod::POST, url.toString(), headers, 0ul
+  );
+
+  return
+    req.response
+    .then(
+      [](auto response) {
+	auto handler = kj::heap<ValueHandler>("UploadId"_kj);
+	auto& h = *handler;
+	return
+	  parseResponse(kj::mv(response), h, "Failed to create multipart upload"_kj)
+	  .then(
+	    [&h]() {
+	      return kj::mv(KJ_REQUIRE_NONNULL(h.value_, "Missing UploadId"));
+	    }
+	  )
+	  .attach(kj::mv(handler));
+      }
+    );
+}
+
+kj::Promise<void> ObjectServer::abortMultipart(kj::StringPtr uploadId) {
+  removeCheckpoint(uploadId);
+
+  auto url = bucket_->url_.clone();
+  url.path.add(kj::str(key_));
+  url.query.add(kj::str("uploadId"_kj), kj::str(uploadId));
+
+  auto headers = bucket_->headers_.cloneShallow();
+  auto req = bucket_->s3_->client_->request(
+    kj::HttpMethod::DELETE, url.toString(), headers, 0ul
+  );
+  return req.response.ignoreResult();
+}
+
+kj::Promise<uint64_t> ObjectServer::size(kj::StringPtr version) {
+  auto url = bucket_->url_.clone();
+  url.path.add(kj::str(key_));
+  if (version.size()) {
+    url.query.add(kj::str("versionId"_kj), kj::str(version));
+  }
+
+  auto req = bucket_->s3_->client_->request(
+    kj::HttpMethod::HEAD, url.toString(), bucket_->headers_, 0ul
+  );
+  return
+    req.response
+    .then(
+      [this](auto response) {
+	KJ_REQUIRE(response.statusCode == 200, "Failed to head object",
+		   key_, response.statusCode, response.statusText);
+	auto length = KJ_REQUIRE_NONNULL(
+	  response.headers->get(kj::HttpHeaderId::CONTENT_LENGTH), "Missing Content-Length");
+	return length.template parseAs<uint64_t>();
+      }
+    );
+}
+
+kj::Promise<void> ObjectServer::copyFrom(CopyFromContext ctx) {
+  auto params = ctx.getParams();
+  auto& s3 = *bucket_->s3_;
+  invalidate();
+  auto source = kj::refcounted<ObjectServer>(
+    kj::refcounted<BucketServer>(s3.addRef(), params.getBucket(), s3.region_),
+    params.getKey()
+  );
+
+  auto copySource = kj::str(
+    '/', params.getBucket(), '/', kj::encodeUriPath(params.getKey())
+  );
+  if (params.getVersion().size()) {
+    copySource = kj::str(copySource, "?versionId="_kj, params.getVersion());
+  }
+
+  auto promise = source->size(params.getVersion());
+  return
+    promise
+    .then(
+      [this, ctx = kj::mv(ctx), copySource = kj::mv(copySource)](auto size) mutable -> kj::Promise<void> {
+	auto params = ctx.getParams();
+	auto first = params.getFirst();
+	auto last = kj::min(params.getLast(), size ? size - 1 : 0);
+	KJ_REQUIRE(first <= last, "Invalid range", first, last);
+
+	if (size <= MAX_SINGLE_PUT && first == 0 && last + 1 >= size) {
+	  auto url = bucket_->url_.clone();
+	  url.path.add(kj::str(key_));
+
+	  auto headers = bucket_->headers_.cloneShallow();
+	  headers.set(bucket_->s3_->ids_.xAmzCopySource, copySource);
+	  auto req = bucket_->s3_->client_->request(
+	    kj::HttpMethod::PUT, url.toString(), headers, 0ul
+	  );
+
+	  return
+	    req.response
+	    .then(
+	      [this](auto response) {
+		// CopyObject can fail after sending a 200, so success is
+		// only known from the body
+		auto handler = kj::heap<ValueHandler>("ETag"_kj);
+		auto& h = *handler;
+		return
+		  parseResponse(kj::mv(response), h, "Failed to copy object"_kj)
+		  .then(
+		    [this]{
+		      invalidate();
+		    }
+		  )
+		  .attach(kj::mv(handler));
+	      }
+	    )
+	    .attach(kj::mv(copySource));
+	}
+
+	KJ_REQUIRE(first < size, "Range not satisfiable", first, size);
+	return
+	  initiateMultipart()
+	  .then(
+	    [this, copySource = kj::mv(copySource), first, last](auto uploadId) mutable {
+	      auto stream = kj::heap<MultipartStream>(addRef(), uploadId);
+	      auto& s = *stream;
+	      return
+		s.copy(copySource, first, last)
+		.then(
+		  [&s]{
+		    return s.finish().ignoreResult();
+		  }
+		)
+		.catch_(
+		  [this, uploadId = kj::mv(uploadId)](kj::Exception&& exc) {
+		    bucket_->s3_->tasks_.add(abortMultipart(uploadId));
+		    kj::throwFatalException(kj::mv(exc));
+		  }
+		)
+		.attach(kj::mv(stream), kj::mv(copySource));
+	    }
+	  );
+      }
+    )
+    .attach(kj::mv(source));
+}
+
+kj::Promise<void> ObjectServer::multipart(MultipartContext ctx) {
+  invalidate();
+  auto compression = bucket_->s3_->options_.compression;
+  return
+    initiateMultipart(contentEncoding(compression))
+    .then(
+      [this, ctx = kj::mv(ctx), compression](auto uploadId) mutable {
+	auto reply = ctx.getResults();
+	reply.setUploadId(uploadId);
+	if (compression != Compression::NONE) {
+	  // a compressor's state cannot be resumed, so nor can the upload
+	  auto stream = kj::heap<MultipartStream>(addRef(), uploadId);
+	  auto& st = *stream;
+	  reply.setStream(bucket_->s3_->encode(
+	    kj::mv(stream), [&st]{ return st.finish().ignoreResult(); }
+	  ));
+	  return;
+	}
+	reply.setStream(kj::heap<MultipartStream>(addRef(), uploadId, true));
+      }
+    );
+}
+
+// S3 requires every part but the last to be at least 5 MiB.
+constexpr uint64_t MIN_PART_SIZE = 5ull * 1024 * 1024;
+
+kj::Promise<void> ObjectServer::resumeMultipart(ResumeMultipartContext ctx) {
+  invalidate();
+  auto uploadId = kj::str(ctx.getParams().getUploadId());
+  auto checkpoint = readCheckpoint(uploadId);
+  if (uploadId.size() == 0) {
+    KJ_IF_MAYBE(saved, checkpoint) {
+      uploadId = kj::str(saved->uploadId_);
+    }
+    else {
+      KJ_FAIL_REQUIRE("No multipart upload to resume", key_);
+    }
+  }
+
+  auto parts = kj::heap<kj::Vector<UploadedPart>>();
+  auto promise = listParts(uploadId, nullptr, *parts);
+  return
+    promise
+    .then(
+      [this, ctx = kj::mv(ctx), uploadId = kj::mv(uploadId),
+       &parts = *parts, checkpoint = kj::mv(checkpoint)]() mutable {
+
+	// S3's listing is authoritative, but a part whose ETag differs
+	// from the one checkpointed was overwritten by someone else
+	kj::HashMap<uint32_t, kj::StringPtr> saved;
+	KJ_IF_MAYBE(c, checkpoint) {
+	  if (c->uploadId_ == uploadId) {
+	    for (auto& part: c->parts_) {
+	      saved.upsert(part.partNumber_, part.etag_, [](auto& old, auto&& etag) { old = etag; });
+	    }
+	  }
+	}
+
+	// keep the parts up to the first one missing, or too small to
+	// be followed by another
+	std::sort(parts.begin(), parts.end(),
+	  [](auto& a, auto& b) {
+	    return a.partNumber_ < b.partNumber_;
+	  }
+	);
+	kj::Vector<UploadedPart> kept;
+	uint64_t offset = 0;
+	for (auto& part: parts) {
+	  if (part.partNumber_ != kept.size() + 1 || part.size_ < MIN_PART_SIZE) {
+	    break;
+	  }
+	  KJ_IF_MAYBE(etag, saved.find(part.partNumber_)) {
+	    if (*etag != part.etag_) {
+	      break;
+	    }
+	  }
+	  offset += part.size_;
+	  kept.add(kj::mv(part));
+	}
+
+	auto reply = ctx.getResults();
+	reply.setOffset(offset);
+	reply.setStream(kj::heap<MultipartStream>(addRef(), uploadId, true, kj::mv(kept)));
+      }
+    )
+    .attach(kj::mv(parts));
+}
+
+kj::Promise<void> ObjectServer::listParts(
+    kj::StringPtr uploadId, kj::Maybe<kj::StringPtr> marker, kj::Vector<UploadedPart>& parts) {
+  auto url = bucket_->url_.clone();
+  url.path.add(kj::str(key_));
+  url.query.add(kj::str("uploadId"_kj), kj::str(uploadId));
+  KJ_IF_MAYBE(m, marker) {
+    url.query.add(kj::str("part-number-marker"_kj), kj::str(*m));
+  }
+
+  auto req = bucket_->s3_->client_->request(
+    kj::HttpMethod::GET, url.toString(), bucket_->headers_, 0ul
+  );
+  return
+    req.response
+    .then(
+      [this, uploadId, &parts](auto response) {
+	auto handler = kj::heap<ListPartsHandler>(parts);
+	auto& h = *handler;
+	return
+	  parseResponse(kj::mv(response), h, "Failed to list parts"_kj)
+	  .then(
+	    [this, uploadId, &parts, &h]() -> kj::Promise<void> {
+	      if (!h.truncated_) {
+		return kj::READY_NOW;
+	      }
+	      auto marker = kj::mv(KJ_REQUIRE_NONNULL(h.marker_, "Missing NextPartNumberMarker"));
+	      auto promise = listParts(uploadId, marker.asPtr(), parts);
+	      return promise.attach(kj::mv(marker));
+	    }
+	  )
+	  .attach(kj::mv(handler));
+      }
+    );
+}
+
+kj::String ObjectServer::checkpointPrefix() {
+  auto name = kj::str(bucket_->name_, '/', key_);
+  return kj::str(kj::encodeHex(hash::sha256(name.asBytes())), '.');
+}
+
+kj::Path ObjectServer::checkpointPath(kj::StringPtr uploadId) {
+  // concurrent uploads of one key each have their own
+  return kj::Path{kj::str(checkpointPrefix(), kj::encodeHex(hash::sha256(uploadId.asBytes())))};
+}
+
+kj::Maybe<Checkpoint> ObjectServer::readCheckpoint(kj::StringPtr uploadId) {
+  KJ_IF_MAYBE(dir, bucket_->s3_->options_.checkpoints) {
+    auto path = [&]() -> kj::Maybe<kj::Path> {
+      if (uploadId.size()) {
+	return checkpointPath(uploadId);
+      }
+      auto prefix = checkpointPrefix();
+      kj::Maybe<kj::Path> latest;
+      kj::Date modified = kj::UNIX_EPOCH;
+      for (auto& name: dir->listNames()) {
+	if (name.startsWith(prefix)) {
+	  auto path = kj::Path{kj::mv(name)};
+	  KJ_IF_MAYBE(meta, dir->tryLstat(path)) {
+	    if (latest == nullptr || meta->lastModified > modified) {
+	      modified = meta->lastModified;
+	      latest = kj::mv(path);
+	    }
+	  }
+	}
+      }
+      return latest;
+    }();
+
+    KJ_IF_MAYBE(p, path) {
+      KJ_IF_MAYBE(file, dir->tryOpenFile(*p)) {
+	auto bytes = (*file)->readAllBytes();
+	auto words = kj::heapArray<capnp::word>(bytes.size() / sizeof(capnp::word));
+	memcpy(words.begin(), bytes.begin(), words.asBytes().size());
+
+	kj::Maybe<Checkpoint> checkpoint;
+	kj::ArrayPtr<const capnp::word> rest = words;
+	while (rest.size() && capnp::expectedSizeInWordsFromPrefix(rest) <= rest.size()) {
+	  capnp::FlatArrayMessageReader reader{rest};
+	  KJ_IF_MAYBE(c, checkpoint) {
+	    auto part = reader.getRoot<MultipartCheckpoint::Part>();
+	    c->parts_.add(UploadedPart{part.getNumber(), kj::str(part.getEtag()), part.getSize()});
+	  }
+	  else {
+	    auto header = reader.getRoot<MultipartCheckpoint>();
+	    checkpoint = Checkpoint{kj::str(header.getUploadId()), {}};
+	  }
+	  rest = kj::arrayPtr(reader.getEnd(), rest.end());
+	}
+	return checkpoint;
+      }
+    }
+  }
+  return nullptr;
+}
+
+void ObjectServer::removeCheckpoint(kj::StringPtr uploadId) {
+  KJ_IF_MAYBE(dir, bucket_->s3_->options_.checkpoints) {
+    dir->tryRemove(checkpointPath(uploadId));
+  }
+}
+
+AdaptiveStream::AdaptiveStream(kj::Own<ObjectServer> object, kj::StringPtr contentEncoding)
+  : object_{kj::mv(object)}
+  , contentEncoding_{contentEncoding} {
+  auto& options = object_->bucket_->s3_->options_;
+  threshold_ = kj::min(options.singlePutThreshold, size_t{MAX_SINGLE_PUT});
+}
+
+AdaptiveStream::~AdaptiveStream() noexcept {
+  KJ_IF_MAYBE(uploadId, uploadId_) {
+    // initiated but not needed
+    auto& tasks = object_->bucket_->s3_->tasks_;
+    tasks.add(
+      uploadId->then(
+        [object = kj::mv(object_)](auto uploadId) {
+	  return object->abortMultipart(uploadId);
+	}
+      )
+    );
+  }
+}
+
+kj::Promise<void> AdaptiveStream::startMultipart() {
+  auto uploadId = [this]() -> kj::Promise<kj::String> {
+    KJ_IF_MAYBE(pending, uploadId_) {
+      auto promise = kj::mv(*pending);
+      uploadId_ = nullptr;
+      return promise;
+    }
+    return object_->initiateMultipart(contentEncoding_);
+  }();
+
+  return
+    uploadId
+    .then(
+      [this](auto uploadId) {
+	auto multipart = kj::heap<MultipartStream>(object_->addRef(), uploadId);
+	auto& m = *multipart;
+	multipart_ = kj::mv(multipart);
+	auto buffer = buffer_.releaseAsArray();
+	return m.write(buffer.begin(), buffer.size()).attach(kj::mv(buffer));
+      }
+    );
 }
 
-kj::Promise<void> BucketServer::getObject(GetObjectContext ctx) {
-  auto params = ctx.getParams();
-  auto key = params.getKey();
-  auto reply = ctx.getResults();
-  reply.setObject(kj::refcounted<ObjectServer>(addRef(), key));
-  return kj::READY_NOW;
+ParallelRead::ParallelRead(
+    kj::Own<ObjectServer> object,
+    kj::String url,
+    kj::Own<kj::AsyncOutputStream> out,
+    uint64_t first,
+    uint64_t last)
+  : object_{kj::mv(object)}
+  , url_{kj::mv(url)}
+  , out_{kj::mv(out)}
+  , first_{first}
+  , last_{last} {
+
+  auto& options = object_->bucket_->s3_->options_;
+  chunkSize_ = options.readChunkSize;
+  window_ = kj::heapArray<kj::Maybe<kj::Promise<Chunk>>>(options.readParallelism);
 }
 
-kj::Promise<void> ObjectServer::head(HeadContext ctx) {
-  auto params = ctx.getParams();
-  auto version = params.getVersion();
+kj::Promise<void> ParallelRead::start() {
+  return
+    fetch(0)
+    .then(
+      [this](auto chunk) {
+        if (chunk.total_ == 0) {
+          // an empty object
+          head_ = kj::mv(chunk);
+          return;
+        }
 
-  auto url = bucket_->url_.clone();
-  url.path.add(kj::str(key_));
-  if (version.size()) {
-    url.query.add(kj::str("versionId"_kj), kj::str(version));
-  }
-  
-  auto req = bucket_->s3_->client_->request(
-    kj::HttpMethod::HEAD, url.toString(), bucket_->headers_, 0ul
-  );
+        // Now that the size of the object is known, clamp the range
+        // and fill the window with the chunks that follow.
+        last_ = kj::min(last_, chunk.total_ - 1);
+        count_ = (last_ - first_) / chunkSize_ + 1;
+        etag_ = kj::mv(chunk.etag_);
+        for (auto index = 1u; index <= window_.size() && index < count_; ++index) {
+          window_[index % window_.size()] = fetch(index);
+        }
+        head_ = kj::mv(chunk);
+      }
+    );
+}
 
+kj::Promise<void> ParallelRead::run() {
+  auto& chunk = KJ_ASSERT_NONNULL(head_);
   return
-    req.response
+    out_->write(chunk.data_.begin(), chunk.data_.size())
     .then(
-      [this, ctx = kj::mv(ctx)](auto response) mutable {
-	auto reply = ctx.getResults();
-	auto headers = reply.initHeaders(response.headers->size());
-	auto ii = 0u;
-	response.headers->forEach(
-          [&](auto name, auto value) {
-	    auto header = headers[ii++].initUncommon();
-	    header.setName(name);
-	    header.setValue(value);
-	  }
-	);
+      [this]{
+        head_ = nullptr;
+        return pump(1);
       }
     );
 }
 
-kj::Promise<void> ObjectServer::getBucket(GetBucketContext ctx) {
-  auto reply = ctx.getResults();
-  reply.setBucket(bucket_->addRef());
-  return kj::READY_NOW;
+kj::Promise<void> ParallelRead::pump(uint64_t index) {
+  if (index >= count_) {
+    return kj::READY_NOW;
+  }
+
+  auto& slot = window_[index % window_.size()];
+  auto promise = kj::mv(KJ_ASSERT_NONNULL(slot));
+  slot = nullptr;
+
+  return
+    promise
+    .then(
+      [this, index](auto chunk) {
+        auto next = index + window_.size();
+        if (next < count_) {
+          window_[next % window_.size()] = fetch(next);
+        }
+        auto& data = chunk.data_;
+        return out_->write(data.begin(), data.size()).attach(kj::mv(data));
+      }
+    )
+    .then(
+      [this, index]{
+        return pump(index + 1);
+      }
+    );
 }
 
-kj::Promise<void> ObjectServer::read(ReadContext ctx) {
-  auto params = ctx.getParams();;
-  auto first = params.getFirst();
-  auto last = params.getLast();
-  auto version = params.getVersion();
-  auto out = bucket_->s3_->factory_.capnpToKj(params.getStream());
+kj::Promise<ParallelRead::Chunk> ParallelRead::fetch(uint64_t index) {
+  auto& s3 = *object_->bucket_->s3_;
+  auto first = first_ + index * chunkSize_;
+  auto last = kj::min(first + chunkSize_ - 1, last_);
 
-  auto url = bucket_->url_.clone();
-  url.path.add(kj::str(key_));
-  if (version.size()) {
-    url.query.add(kj::str("versionId"_kj), kj::str(version));
+  auto headers = object_->bucket_->headers_.cloneShallow();
+  headers.set(s3.ids_.range, kj::str("bytes="_kj, first, '-', last));
+  if (etag_.size()) {
+    headers.set(s3.ids_.ifMatch, etag_);
   }
 
-  auto headers = bucket_->headers_.cloneShallow();
-  headers.set(bucket_->s3_->ids_.range, kj::str(first, '-', last));
-				    
-  auto req = bucket_->s3_->client_->request(
-    kj::HttpMethod::GET, url.toString(), headers, 0ul
-  );
-
+  auto req = s3.client_->request(kj::HttpMethod::GET, url_, headers, 0ul);
   return
     req.response
     .then(
-      [this, out = kj::mv(out)](auto response) mutable {
-	bucket_->s3_->tasks_.add(
-	  response.body->pumpTo(*out).ignoreResult()
-	  .attach(kj::mv(response.body), kj::mv(out))
-	);
+      [this, &s3, index, first, last](auto response) -> kj::Promise<Chunk> {
+        KJ_REQUIRE(response.statusCode != 412, "Object changed during read", object_->key_);
+        auto etag = kj::str(response.headers->get(s3.ids_.etag).orDefault(""_kj));
+        uint64_t total;
+        if (index == 0 && response.statusCode == 416) {
+          // only an empty object has no bytes at all to hand back
+          // Content-Range: bytes */<total>
+          auto range = response.headers->get(s3.ids_.contentRange).orDefault("bytes */0"_kj);
+          auto slash = KJ_REQUIRE_NONNULL(range.findLast('/'), range);
+          total = range.slice(slash + 1).template parseAs<uint64_t>();
+          KJ_REQUIRE(first == 0 && total == 0, "Range not satisfiable", first, total);
+          return Chunk{nullptr, 0, kj::mv(etag)};
+        }
+        else if (index == 0 && first == 0 && response.statusCode == 200) {
+          // the whole object, from a store that answers ranges of
+          // empty or small objects in full
+          auto length = KJ_REQUIRE_NONNULL(
+            response.headers->get(kj::HttpHeaderId::CONTENT_LENGTH), "Missing Content-Length");
+          total = length.template parseAs<uint64_t>();
+          if (total == 0) {
+            return Chunk{nullptr, 0, kj::mv(etag)};
+          }
+          KJ_REQUIRE(total - 1 <= last, "Range ignored", total, last);
+        }
+        else {
+          KJ_REQUIRE(response.statusCode == 206, "Ranged read failed",
+                     response.statusCode, response.statusText);
+
+          // Content-Range: bytes <first>-<last>/<total>
+          auto range = KJ_REQUIRE_NONNULL(response.headers->get(s3.ids_.contentRange));
+          auto slash = KJ_REQUIRE_NONNULL(range.findLast('/'), range);
+          total = range.slice(slash + 1).template parseAs<uint64_t>();
+        }
+        KJ_REQUIRE(first < total, "Range not satisfiable", first, total);
+
+        auto size = kj::min(last, total - 1) - first + 1;
+        auto data = kj::heapArray<kj::byte>(size);
+        auto& body = *response.body;
+        return
+          body.tryRead(data.begin(), size, size)
+          .then(
+            [data = kj::mv(data), total, etag = kj::mv(etag)](auto count) mutable {
+              KJ_REQUIRE(count == data.size(), "Premature end of ranged read");
+              return Chunk{kj::mv(data), total, kj::mv(etag)};
+            }
+          )
+          .attach(kj::mv(response.body));
       }
-    );
+    )
+    .eagerlyEvaluate(nullptr);
 }
 
-kj::Promise<void> ObjectServer::write(WriteContext ctx) {
-  auto params = ctx.getParams();
-  auto length = params.getLength();
+MultipartStream::MultipartStream(
+    kj::Own<ObjectServer> object,
+    kj::StringPtr uploadId,
+    bool checkpoint,
+    kj::Vector<UploadedPart> parts)
+  : object_{kj::mv(object)}
+  , uploadId_{kj::str(uploadId)}
+  , parts_{kj::mv(parts)} {
+
+  auto& options = object_->bucket_->s3_->options_;
+  partSize_ = options.partSize;
+  // one buffer being filled plus one per part in flight
+  poolSize_ = kj::max(options.uploadConcurrency, 1u) + 1;
+
+  KJ_IF_MAYBE(dir, options.checkpoints) {
+    if (checkpoint) {
+      // the header and carried over parts replace any earlier
+      // checkpoint at once, and later parts are appended
+      kj::Vector<kj::byte> bytes;
+      bytes.addAll(checkpointMessage(uploadId_).asBytes());
+      for (auto& part: parts_) {
+	bytes.addAll(checkpointMessage(part).asBytes());
+      }
 
-  auto url = bucket_->url_.clone();
-  url.path.add(kj::str(key_));
+      checkpointing_ = true;
+      auto& io = *KJ_ASSERT_NONNULL(object_->bucket_->s3_->checkpointIo_);
+      saved_ =
+	io.run(
+	  [&dir = *dir, path = object_->checkpointPath(uploadId_), bytes = bytes.releaseAsArray()]{
+	    auto replacer = dir.replaceFile(path, kj::WriteMode::CREATE | kj::WriteMode::MODIFY);
+	    auto& file = replacer->get();
+	    file.writeAll(bytes);
+	    file.datasync();
+	    replacer->commit();
+	    return dir.appendFile(path, kj::WriteMode::MODIFY);
+	  }
+	)
+	.then(
+	  [this](auto file) {
+	    checkpoint_ = kj::mv(file);
+	  }
+	)
+	.eagerlyEvaluate(nullptr);
+    }
+  }
+}
 
-  auto headers = bucket_->headers_.cloneShallow();
-  auto req = bucket_->s3_->client_->request(
-    kj::HttpMethod::PUT, url.toString(), headers, length
-  );
+MultipartStream::~MultipartStream() noexcept {
+  auto& metrics = *object_->bucket_->s3_->metrics_;
+  metrics.multipartBuffers_.fetch_sub(allocated_, std::memory_order_relaxed);
+}
 
-  auto stream = bucket_->s3_->factory_.kjToCapnp(kj::mv(req.body));
-  auto reply = ctx.getResults();
-  reply.setStream(kj::mv(stream));
-  bucket_->s3_->tasks_.add(req.response.ignoreResult());
-  return kj::READY_NOW;
+void MultipartStream::taskFailed(kj::Exception&& exc) {
+  KJ_LOG(ERROR, exc);
+  KJ_IF_MAYBE(waiter, waiter_) {
+    (*waiter)->reject(kj::cp(exc));
+    waiter_ = nullptr;
+  }
+  if (failure_ == nullptr) {
+    failure_ = kj::mv(exc);
+  }
 }
 
-kj::Promise<void> ObjectServer::delete_(DeleteContext ctx) {
-  auto url = bucket_->url_.clone();
-  url.path.add(kj::str(key_));
+void MultipartStream::save(const UploadedPart& part) {
+  if (!checkpointing_) {
+    return;
+  }
 
-  auto headers = bucket_->headers_.cloneShallow();
-  auto req = bucket_->s3_->client_->request(
-    kj::HttpMethod::DELETE, url.toString(), headers, 0ul
-  );
-  return req.response.ignoreResult();
+  // a part is many megabytes, so syncing each is cheap by comparison
+  auto& io = *KJ_ASSERT_NONNULL(object_->bucket_->s3_->checkpointIo_);
+  saved_ =
+    saved_
+    .then(
+      [this, &io, message = checkpointMessage(part)]() mutable {
+	auto& file = *KJ_ASSERT_NONNULL(checkpoint_);
+	return io.run(
+	  [&file, message = kj::mv(message)]{
+	    auto bytes = message.asBytes();
+	    file.write(bytes.begin(), bytes.size());
+	    file.datasync();
+	  }
+	);
+      }
+    )
+    .eagerlyEvaluate(nullptr);
 }
 
-kj::Promise<void> ObjectServer::multipart(MultipartContext ctx) {
-  auto url = bucket_->url_.clone();
-  url.path.add(kj::str(key_));
-  url.query.add(kj::str("uploads"_kj), nullptr);
+kj::Promise<void> MultipartStream::acquireBuffer() {
+  KJ_IF_MAYBE(exc, failure_) {
+    return kj::cp(*exc);
+  }
 
-  auto headers = bucket_->headers_.cloneShallow();
-  auto req = bucket_->s3_->client_->request(
-    kj::HttpMethod::POST, url.toString(), headers, 0ul
-  );
+  if (free_.size()) {
+    buffer_ = kj::mv(free_.back());
+    free_.removeLast();
+    return kj::READY_NOW;
+  }
+
+  if (allocated_ < poolSize_) {
+    ++allocated_;
+    object_->bucket_->s3_->metrics_->multipartBuffers_.fetch_add(1, std::memory_order_relaxed);
+    buffer_ = kj::heapArray<kj::byte>(partSize_);
+    return kj::READY_NOW;
+  }
 
+  KJ_REQUIRE(waiter_ == nullptr, "concurrent writes to multipart stream");
+  auto paf = kj::newPromiseAndFulfiller<kj::Array<kj::byte>>();
+  waiter_ = kj::mv(paf.fulfiller);
   return
-    req.response
+    paf.promise
     .then(
-      [](auto response) mutable {
-	return response.body->readAllText().attach(kj::mv(response.body));
+      [this](auto buffer) {
+        buffer_ = kj::mv(buffer);
       }
-    )
-    .then(
-      [this, ctx = kj::mv(ctx)](auto txt) mutable {
-	rapidxml::xml_document<> doc;
-	doc.parse<rapidxml::parse_non_destructive>(const_cast<char*>(txt.cStr()));
+    );
+}
 
-	KJ_IF_MAYBE(error, firstNode(doc, "Error"_kj)) {
-	  auto& code = KJ_REQUIRE_NONNULL(firstNode(*error, "Code"_kj));
-	  auto& msg = KJ_REQUIRE_NONNULL(firstNode(*error, "Message"_kj));
-	  KJ_FAIL_REQUIRE("Failed to complete multipart upload", code, msg);
-	}
+void MultipartStream::releaseBuffer(kj::Array<kj::byte> buffer) {
+  KJ_IF_MAYBE(waiter, waiter_) {
+    auto fulfiller = kj::mv(*waiter);
+    waiter_ = nullptr;
+    fulfiller->fulfill(kj::mv(buffer));
+  }
+  else {
+    free_.add(kj::mv(buffer));
+  }
+}
 
-	auto& result = KJ_REQUIRE_NONNULL(firstNode(doc, "InitiateMultipartUploadResult"_kj));
-	auto& uploadId = KJ_REQUIRE_NONNULL(firstNode(result, "UploadId"_kj));
+template <typename Func>
+kj::Promise<void> MultipartStream::withSlot(Func&& func) {
+  auto& options = object_->bucket_->s3_->options_;
+  auto slot = [&]() -> kj::Promise<void> {
+    if (sending_ < kj::max(options.uploadConcurrency, 1u)) {
+      ++sending_;
+      return kj::READY_NOW;
+    }
+    auto paf = kj::newPromiseAndFulfiller<void>();
+    slotWaiters_.push_back(kj::mv(paf.fulfiller));
+    return kj::mv(paf.promise);
+  }();
 
-	auto reply = ctx.getResults();
-	reply.setStream(kj::heap<MultipartStream>(addRef(), kj::str(uploadId)));
+  return
+    slot
+    .then(
+      [this, func = kj::fwd<Func>(func)]() mutable {
+	return
+	  func()
+	  .then(
+	    [this]{
+	      releaseSlot();
+	    },
+	    [this](kj::Exception&& exc) {
+	      releaseSlot();
+	      kj::throwFatalException(kj::mv(exc));
+	    }
+	  );
       }
     );
 }
 
-MultipartStream::MultipartStream(
-    kj::Own<ObjectServer> object,
-    kj::StringPtr uploadId)
-  : object_{kj::mv(object)}
-  , uploadId_{kj::str(uploadId)} {
+void MultipartStream::releaseSlot() {
+  // the slot passes straight to a waiting part, if there is one
+  if (slotWaiters_.size()) {
+    auto fulfiller = kj::mv(slotWaiters_.front());
+    slotWaiters_.pop_front();
+    fulfiller->fulfill();
+  }
+  else {
+    --sending_;
+  }
 }
 
 kj::Promise<void> MultipartStream::write(kj::ArrayPtr<kj::byte const> bytes) {
-  if (bytes.size() == 0) {
-    return kj::READY_NOW;
+  piece_ = bytes;
+  return write(kj::arrayPtr(&piece_, 1), 0);
+}
+
+kj::Promise<void> MultipartStream::write(
+    kj::ArrayPtr<const kj::ArrayPtr<const kj::byte>> pieces, size_t offset) {
+  KJ_IF_MAYBE(exc, failure_) {
+    return kj::cp(*exc);
   }
 
-  auto remaining = buffer_.size() - out_->getArray().size();
-  KJ_DREQUIRE(remaining);
+  // only waiting for a buffer, or for parts sent without one, takes a
+  // continuation, rather than every piece
+  while (pieces.size()) {
+    if (offset >= pieces.front().size()) {
+      offset -= pieces.front().size();
+      pieces = pieces.slice(1, pieces.size());
+      continue;
+    }
 
-  if (remaining <= bytes.size()) {
-    return write(bytes.slice(0, remaining))
-      .then(
-          [this, remaining, bytes]{
-            return write(bytes.slice(remaining, bytes.size()));
+    if (filled_ == 0) {
+      // the caller's memory stays valid until the write completes, so
+      // whole parts of it need not be copied, however many pieces they
+      // are gathered from
+      size_t size = 0;
+      for (auto& piece: pieces) {
+	size += piece.size();
+      }
+      auto count = (size - offset) / partSize_;
+      if (count) {
+	return
+	  sendParts(pieces, offset, count)
+	  .then(
+	    [this, pieces, offset = offset + count * partSize_]{
+	      return write(pieces, offset);
+	    }
+	  );
+      }
+    }
+
+    auto bytes = pieces.front().slice(offset, pieces.front().size());
+
+    if (buffer_ == nullptr) {
+      return
+        acquireBuffer()
+        .then(
+          [this, pieces, offset]{
+            return write(pieces, offset);
           }
-      );
-  }
+        );
+    }
 
-  out_->write(bytes.begin(), bytes.size());
+    auto count = kj::min(bytes.size(), buffer_.size() - filled_);
+    memcpy(buffer_.begin() + filled_, bytes.begin(), count);
+    filled_ += count;
+    offset += count;
 
-  if (bytes.size() == remaining) {
-    auto data = out_->getArray();
-    tasks_.add(sendPart(buffer_.slice(0, data.size())).attach(kj::mv(buffer_)));
-    buffer_ = kj::heapArray<kj::byte>(bufferSize_);
-    out_ = kj::heap<kj::ArrayOutputStream>(buffer_);
+    if (filled_ == buffer_.size()) {
+      tasks_.add(sendPart(kj::mv(buffer_), filled_));
+      filled_ = 0;
+    }
   }
 
-  return kj::READY_NOW;
+  // Only complete the write once there is somewhere to put the next
+  // one, so that the sender is throttled to the upload rate.
+  return buffer_ == nullptr
+    ? acquireBuffer()
+    : kj::READY_NOW;
 }
 
 kj::Promise<void> MultipartStream::sendPart(
-    kj::ArrayPtr<const kj::byte> buffer) {
+    kj::Array<kj::byte> buffer, size_t size) {
 
   auto& part = parts_.add();
   auto partNumber = parts_.size();
   part.partNumber_ = partNumber;
+  part.size_ = size;
+  auto segments = kj::heapArray<kj::ArrayPtr<const kj::byte>>({buffer.slice(0, size)});
+  auto ptr = segments.asPtr();
+  return
+    withSlot(
+      [this, partNumber, ptr]{
+	return uploadPart(partNumber, ptr, 1);
+      }
+    )
+    .then(
+      [this, buffer = kj::mv(buffer)]() mutable {
+	releaseBuffer(kj::mv(buffer));
+      }
+    )
+    .attach(kj::mv(segments));
+}
+
+// Parts are too big for the retry service to buffer, so each is
+// retried from the bytes it was first sent from, which are only
+// released once S3 has acknowledged it.
+kj::Promise<void> MultipartStream::uploadPart(
+    uint32_t partNumber, kj::ArrayPtr<const kj::ArrayPtr<const kj::byte>> segments,
+    uint32_t attempt) {
+
+  auto& s3 = *object_->bucket_->s3_;
+  auto& retry = s3.options_.retry;
 
   auto url = object_->bucket_->url_.clone();
   url.path.add(kj::str(object_->key_));
@@ -500,31 +2567,184 @@ kj::Promise<void> MultipartStream::sendPart(
   url.query.add(kj::str("uploadId"_kj), kj::str(uploadId_));
 		
   auto headers = object_->bucket_->headers_.cloneShallow();
-  auto req = object_->bucket_->s3_->client_->request(
-    kj::HttpMethod::PUT, url.toString(), headers, buffer.size()
+  headers.set(
+    s3.ids_.amzSdkRequest,
+    kj::str("attempt="_kj, attempt, "; max="_kj, retry.maxAttempts));
+  size_t size = 0;
+  for (auto& segment: segments) {
+    size += segment.size();
+  }
+  auto req = s3.client_->request(
+    kj::HttpMethod::PUT, url.toString(), headers, size
   );
 
-  return
-    req.body->write(buffer.begin(), buffer.size())
+  auto upload =
+    req.body->write(segments)
     .then(
       [req = kj::mv(req)]() mutable {
 	return kj::mv(req.response);
       }
+    );
+
+  return
+    s3.timer_.timeoutAfter(retry.attemptTimeout, kj::mv(upload))
+    .then(
+      [&s3, partNumber, attempt](auto response) -> kj::Maybe<kj::String> {
+	auto& retry = s3.options_.retry;
+	if (isRetryable(response.statusCode) && attempt < retry.maxAttempts) {
+	  KJ_LOG(WARNING, "Retrying part", partNumber, attempt, response.statusCode);
+	  return nullptr;
+	}
+	KJ_REQUIRE(response.statusCode == 200, "Failed to upload part",
+		   partNumber, response.statusCode, response.statusText);
+	auto etag = KJ_REQUIRE_NONNULL(response.headers->get(s3.ids_.etag));
+	return kj::str(etag);
+      },
+      [&s3, partNumber, attempt](kj::Exception&& exc) -> kj::Maybe<kj::String> {
+	auto& retry = s3.options_.retry;
+	if (isRetryable(exc) && attempt < retry.maxAttempts) {
+	  KJ_LOG(WARNING, "Retrying part", partNumber, attempt, exc);
+	  return nullptr;
+	}
+	kj::throwFatalException(kj::mv(exc));
+      }
     )
     .then(
-      [this, partNumber](auto response) {
-	KJ_LOG(INFO, response.statusText);
-	auto& headers = response.headers;
-	auto etag = KJ_REQUIRE_NONNULL(headers->get(object_->bucket_->s3_->ids_.etag));
-	parts_[partNumber-1].etag_ = kj::str(etag);
+      [this, &s3, partNumber, segments, attempt](auto etag) -> kj::Promise<void> {
+	KJ_IF_MAYBE(value, etag) {
+	  auto& part = parts_[partNumber-1];
+	  part.etag_ = kj::mv(*value);
+	  save(part);
+	  return kj::READY_NOW;
+	}
+	return
+	  s3.timer_.afterDelay(backoff(s3.options_.retry, attempt))
+	  .then(
+	    [this, partNumber, segments, attempt]{
+	      return uploadPart(partNumber, segments, attempt + 1);
+	    }
+	  );
       }
     );
 } 
 
-kj::Promise<kj::String> MultipartStream::complete() {
-  KJ_LOG(INFO, "Completing", uploadId_);
-  KJ_DREQUIRE(started_);
+// S3 allows at most 10000 parts per upload.
+constexpr uint64_t MAX_PARTS = 10000;
+
+kj::Promise<void> MultipartStream::sendParts(
+    kj::ArrayPtr<const kj::ArrayPtr<const kj::byte>> pieces, size_t offset, size_t count) {
+  auto base = parts_.size();
+  KJ_REQUIRE(base + count <= MAX_PARTS, "Too many parts", base, count);
+
+  // the segments of each part, which point into the pieces
+  auto segments = KJ_MAP(ii, kj::range(size_t{0}, count)) {
+    auto& part = parts_.add();
+    part.partNumber_ = base + ii + 1;
+    part.size_ = partSize_;
+
+    kj::Vector<kj::ArrayPtr<const kj::byte>> gathered;
+    for (auto needed = partSize_; needed; ) {
+      if (offset == pieces.front().size()) {
+	pieces = pieces.slice(1, pieces.size());
+	offset = 0;
+	continue;
+      }
+      auto size = kj::min(needed, pieces.front().size() - offset);
+      gathered.add(pieces.front().slice(offset, offset + size));
+      offset += size;
+      needed -= size;
+    }
+    return gathered.releaseAsArray();
+  };
+
+  auto& options = object_->bucket_->s3_->options_;
+  auto parts = segments.asPtr();
+  return
+    forEachConcurrently(count, options.uploadConcurrency,
+      [this, parts, base](size_t ii) {
+	auto part = parts[ii].asPtr();
+	// shares the limit with buffered parts still in flight
+	return withSlot(
+	  [this, base, ii, part]{
+	    return uploadPart(base + ii + 1, part, 1);
+	  }
+	);
+      }
+    )
+    .catch_(
+      [this](kj::Exception&& exc) {
+	// as for a failed buffered part, later writes and finish() fail
+	if (failure_ == nullptr) {
+	  failure_ = kj::cp(exc);
+	}
+	kj::throwFatalException(kj::mv(exc));
+      }
+    )
+    .attach(kj::mv(segments));
+}
+
+kj::Promise<void> MultipartStream::copy(
+    kj::StringPtr copySource, uint64_t first, uint64_t last) {
+
+  // copied parts take no buffers, but may need to be larger than the
+  // usual part size to fit in the part limit
+  auto size = last - first + 1;
+  auto partSize = kj::max(uint64_t{partSize_}, (size + MAX_PARTS - 1) / MAX_PARTS);
+  auto count = (size + partSize - 1) / partSize;
+  auto base = parts_.size();
+  KJ_REQUIRE(base + count <= MAX_PARTS, "Too many parts", base, count);
+  for (auto ii = 0u; ii < count; ++ii) {
+    parts_.add().partNumber_ = base + ii + 1;
+  }
+
+  auto& options = object_->bucket_->s3_->options_;
+  return
+    forEachConcurrently(count, options.uploadConcurrency,
+      [this, copySource = kj::str(copySource), first, last, partSize, base](size_t ii) {
+	auto begin = first + ii * partSize;
+	auto end = kj::min(begin + partSize - 1, last);
+	return copyPart(base + ii + 1, copySource, begin, end);
+      }
+    );
+}
+
+kj::Promise<void> MultipartStream::copyPart(
+    uint32_t partNumber, kj::StringPtr copySource, uint64_t first, uint64_t last) {
+
+  auto& s3 = *object_->bucket_->s3_;
+  auto url = object_->bucket_->url_.clone();
+  url.path.add(kj::str(object_->key_));
+  url.query.add(kj::str("partNumber"_kj), kj::str(partNumber));
+  url.query.add(kj::str("uploadId"_kj), kj::str(uploadId_));
+
+  // without a body, the request is retried by the retry service
+  auto headers = object_->bucket_->headers_.cloneShallow();
+  headers.set(s3.ids_.xAmzCopySource, copySource);
+  headers.set(s3.ids_.xAmzCopySourceRange, kj::str("bytes="_kj, first, '-', last));
+  auto req = s3.client_->request(
+    kj::HttpMethod::PUT, url.toString(), headers, 0ul
+  );
+
+  return
+    req.response
+    .then(
+      [this, partNumber](auto response) {
+	// CopyPartResult/ETag
+	auto handler = kj::heap<ValueHandler>("ETag"_kj);
+	auto& h = *handler;
+	return
+	  parseResponse(kj::mv(response), h, "Failed to copy part"_kj)
+	  .then(
+	    [this, partNumber, &h]{
+	      parts_[partNumber-1].etag_ = kj::mv(KJ_REQUIRE_NONNULL(h.value_, "Missing ETag"));
+	    }
+	  )
+	  .attach(kj::mv(handler));
+      }
+    );
+}
 
+kj::Promise<kj::String> MultipartStream::complete() {
   auto txt = kj::strTree(
     "<CompleteMultipartUpload>"_kj,
     KJ_MAP(part, parts_) {
@@ -558,42 +2778,52 @@ kj::Promise<kj::String> MultipartStream::complete() {
     )
     .then(
       [this](auto response) {
-	return response.body->readAllText().attach(kj::mv(response.body));
-      }
-    )
-    .then(
-      [this](auto txt) {
-	rapidxml::xml_document<> doc;
-	doc.parse<rapidxml::parse_non_destructive>(const_cast<char*>(txt.cStr()));
-
-	KJ_IF_MAYBE(error, firstNode(doc, "Error"_kj)) {
-	  auto& code = KJ_REQUIRE_NONNULL(firstNode(*error, "Code"_kj));
-	  auto& msg = KJ_REQUIRE_NONNULL(firstNode(*error, "Message"_kj));
-	  KJ_FAIL_REQUIRE("Failed to complete multipart upload", code, msg);
-	}
-
-	auto& result = KJ_REQUIRE_NONNULL(firstNode(doc, "CompleteMultipartUploadResult"_kj));
-	auto& etag = KJ_REQUIRE_NONNULL(firstNode(result, "ETag"_kj));
-	return kj::str(etag);
+	auto handler = kj::heap<ValueHandler>("ETag"_kj);
+	auto& h = *handler;
+	return
+	  parseResponse(kj::mv(response), h, "Failed to complete multipart upload"_kj)
+	  .then(
+	    [this, &h]() {
+	      object_->invalidate();
+	      return kj::mv(KJ_REQUIRE_NONNULL(h.value_, "Missing ETag"));
+	    }
+	  )
+	  .attach(kj::mv(handler));
       }
     );
 }
 
 kj::Promise<kj::String> MultipartStream::finish() {
+  if (filled_) {
+    // send any remaining partial data
+    tasks_.add(sendPart(kj::mv(buffer_), filled_));
+    filled_ = 0;
+  }
+
   return
     tasks_.onEmpty()
     .then(
         [this]{
-          // send any remaining partial data
-          auto data = out_->getArray();
-          return data.size()
-            ? sendPart(buffer_.slice(0, data.size()))
-            : kj::READY_NOW;
-        }
-    )
-    .then(
-        [this]{
-          return complete();
+          KJ_IF_MAYBE(exc, failure_) {
+            kj::throwFatalException(kj::cp(*exc));
+          }
+          return
+	    kj::mv(saved_)
+	    .then(
+	      [this]{
+		return complete();
+	      }
+	    )
+	    .then(
+	      [this](auto etag) {
+		if (checkpointing_) {
+		  checkpointing_ = false;
+		  checkpoint_ = nullptr;
+		  object_->removeCheckpoint(uploadId_);
+		}
+		return etag;
+	      }
+	    );
         }
     );
 }
@@ -607,15 +2837,27 @@ aws::S3::Client newS3(
   kj::Maybe<kj::Network&> tlsNetwork,
   kj::HttpHeaderTable::Builder& builder,
   Credentials::Provider::Client credsProvider,
-  kj::StringPtr region) {
-  auto client = kj::newHttpClient(timer, builder.getFutureTable(), network, tlsNetwork);
+  kj::StringPtr region,
+  const S3Options& options) {
+  auto client = newHttpPool(
+    timer, builder.getFutureTable(), network, tlsNetwork,
+    options.pool, options.poolStats
+  );
   auto proxy = kj::newHttpService(*client).attach(kj::mv(client));
-  auto awsService = newAwsService(clock, *proxy, builder, credsProvider, "s3", region).attach(kj::mv(proxy));
-  auto awsClient = kj::newHttpClient(*awsService).attach(kj::mv(awsService));
+  auto awsService = newAwsService(clock, *proxy, builder, credsProvider, "s3", region, options.signing).attach(kj::mv(proxy));
+  auto metrics = kj::refcounted<ClientMetrics>();
+  auto metricsService = newMetricsService(*awsService, builder, *metrics).attach(kj::mv(awsService), kj::addRef(*metrics));
+  auto retryService = newRetryService(timer, *metricsService, builder, options.retry).attach(kj::mv(metricsService));
+  auto awsClient = kj::newHttpClient(*retryService).attach(kj::mv(retryService));
   auto factory = kj::heap<capnp::ByteStreamFactory>();
 
-  auto server = kj::refcounted<S3Server>(builder, kj::mv(credsProvider), kj::mv(awsClient), region, *factory).attach(kj::mv(factory));
-  return server;
+  auto server = kj::refcounted<S3Server>(
+    timer, builder, kj::mv(credsProvider), kj::mv(awsClient), kj::mv(metrics), region, *factory, options
+  );
+  for (auto bucket: options.prewarmBuckets) {
+    server->prewarm(bucket, options.prewarmConnections);
+  }
+  return server.attach(kj::mv(factory));
 }
 
 }
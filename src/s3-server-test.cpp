@@ -4,6 +4,9 @@
 // Licensed under the Apache 2.0 license found in the LICENSE file or at:
 //     https://opensource.org/licenses/Apache-2.0
 
+#include "common.h"
+#include "sha256.h"
+
 #include <boost/filesystem.hpp>
 #include <boost/process.hpp>
 #include <boost/asio/ip/udp.hpp>
@@ -11,6 +14,7 @@
 #include <kj/async-io.h>
 #include <kj/compat/tls.h>
 #include <kj/debug.h>
+#include <kj/encoding.h>
 #include <kj/main.h>
 
 #include <gtest/gtest.h>
@@ -38,6 +42,17 @@ struct S3ServerTest
   kj::Own<kj::Network> tlsNetwork_{tlsCtx_.wrapNetwork(network_)};
 };
 
+// A clock for file times that only moves when told to.
+struct FakeClock
+  : kj::Clock {
+
+  kj::Date now() const override {
+    return now_;
+  }
+
+  kj::Date now_{kj::UNIX_EPOCH + 1000 * kj::DAYS};
+};
+
 }
 
 TEST_F(S3ServerTest, ListBuckets) {
@@ -55,7 +70,633 @@ TEST_F(S3ServerTest, ListBuckets) {
 }
 TEST_F(S3ServerTest, WriteObject) {
   auto dir = kj::newInMemoryDirectory(kj::systemPreciseCalendarClock());
-  auto s3 = newS3Server(dir->clone());
+  capnp::ByteStreamFactory factory;
+
+  // small buffers, so that objects span several of them
+  S3ServerOptions options;
+  options.ioThreads = 2;
+  options.ioBufferSize = 4096;
+  auto s3 = newS3Server(dir->clone(), factory, options);
+
+  auto bucket = [&]{
+    auto req = s3.createBucketRequest();
+    req.setName("bucket");
+    return req.send().getBucket();
+  }();
+
+  auto object = [&]{
+    auto req = bucket.getObjectRequest();
+    req.setKey("foo");
+    return req.send().getObject();
+  }();
+
+  auto write = [&](char c) {
+    auto data = kj::heapArray<kj::byte>(10000);
+    memset(data.begin(), c, data.size());
+    auto stream = object.writeRequest().send().getStream();
+    {
+      auto req = stream.writeRequest();
+      req.setBytes(data);
+      req.send().wait(waitScope_);
+    }
+    stream.endRequest().send().wait(waitScope_);
+  };
+
+  auto read = [&](kj::StringPtr version) {
+    auto pipe = kj::newOneWayPipe();
+    auto req = object.readRequest();
+    req.setStream(factory.kjToCapnp(kj::mv(pipe.out)));
+    req.setVersion(version);
+    auto promise = req.send();
+    auto data = kj::heapArray<kj::byte>(10000);
+    pipe.in->read(data.begin(), data.size()).wait(waitScope_);
+    promise.wait(waitScope_);
+    return data;
+  };
+
+  write('a');
+  write('b');
+
+  auto latest = read(""_kj);
+  EXPECT_EQ(latest[0], 'b');
+  EXPECT_EQ(latest[9999], 'b');
+
+  auto first = read("0"_kj);
+  EXPECT_EQ(first[0], 'a');
+  EXPECT_EQ(first[9999], 'a');
+}
+
+TEST_F(S3ServerTest, ReadRange) {
+  auto dir = kj::newInMemoryDirectory(kj::systemPreciseCalendarClock());
+  capnp::ByteStreamFactory factory;
+
+  S3ServerOptions options;
+  options.ioBufferSize = 4096;
+  auto s3 = newS3Server(dir->clone(), factory, options);
+
+  auto bucket = [&]{
+    auto req = s3.createBucketRequest();
+    req.setName("bucket");
+    return req.send().getBucket();
+  }();
+
+  auto object = [&]{
+    auto req = bucket.getObjectRequest();
+    req.setKey("foo");
+    return req.send().getObject();
+  }();
+
+  auto data = kj::heapArray<kj::byte>(20000);
+  for (auto ii: kj::indices(data)) {
+    data[ii] = ii % 251;
+  }
+
+  {
+    auto stream = object.writeRequest().send().getStream();
+    auto req = stream.writeRequest();
+    req.setBytes(data);
+    req.send().wait(waitScope_);
+    stream.endRequest().send().wait(waitScope_);
+  }
+
+  // spans several buffers, starting and ending part way through them
+  auto first = 1000u;
+  auto last = 15000u;
+  auto pipe = kj::newOneWayPipe();
+  auto req = object.readRequest();
+  req.setStream(factory.kjToCapnp(kj::mv(pipe.out)));
+  req.setFirst(first);
+  req.setLast(last);
+  auto promise = req.send();
+
+  auto range = kj::heapArray<kj::byte>(last - first + 1);
+  pipe.in->read(range.begin(), range.size()).wait(waitScope_);
+  promise.wait(waitScope_);
+  EXPECT_TRUE(range.asPtr() == data.slice(first, last + 1));
+}
+
+TEST_F(S3ServerTest, ReadLarge) {
+  auto tmp = fs::temp_directory_path() / fs::unique_path();
+  fs::create_directories(tmp);
+  KJ_DEFER(fs::remove_all(tmp));
+  auto disk = kj::newDiskFilesystem();
+  auto dir = disk->getRoot().openSubdir(
+    kj::Path::parse(tmp.string().substr(1)), kj::WriteMode::MODIFY
+  );
+  capnp::ByteStreamFactory factory;
+  auto s3 = newS3Server(dir->clone(), factory);
+
+  auto object = [&]{
+    auto req = s3.createBucketRequest();
+    req.setName("bucket");
+    auto getObject = req.send().getBucket().getObjectRequest();
+    getObject.setKey("foo");
+    return getObject.send().getObject();
+  }();
+
+  {
+    auto stream = object.writeRequest().send().getStream();
+    auto req = stream.writeRequest();
+    req.setBytes("head"_kj.asBytes());
+    req.send().wait(waitScope_);
+    stream.endRequest().send().wait(waitScope_);
+  }
+
+  // grown in place into a sparse file past 4 GiB
+  constexpr uint64_t SIZE = (uint64_t{1} << 32) + 4096;
+  {
+    auto file = dir->openFile(
+      kj::Path{
+	kj::encodeHex("bucket"_kj.asBytes()), kj::encodeHex("foo"_kj.asBytes()), "versions", "0"
+      },
+      kj::WriteMode::MODIFY
+    );
+    file->write(SIZE - 4, "tail"_kj.asBytes());
+  }
+  EXPECT_EQ(object.headRequest().send().wait(waitScope_).getSize(), SIZE);
+
+  // the default `last` reaches the end of the object
+  auto pipe = kj::newOneWayPipe();
+  auto req = object.readRequest();
+  req.setStream(factory.kjToCapnp(kj::mv(pipe.out)));
+  req.setFirst(SIZE - 8);
+  auto promise = req.send();
+  char data[8];
+  pipe.in->read(data, sizeof(data)).wait(waitScope_);
+  promise.wait(waitScope_);
+  EXPECT_EQ(kj::heapString(data + 4, 4), "tail"_kj);
+  EXPECT_EQ(pipe.in->tryRead(data, 1, 1).wait(waitScope_), 0);
+}
+
+TEST_F(S3ServerTest, Upload) {
+  auto dir = kj::newInMemoryDirectory(kj::systemPreciseCalendarClock());
+  capnp::ByteStreamFactory factory;
+  auto s3 = newS3Server(dir->clone(), factory);
+
+  auto object = [&]{
+    auto req = s3.createBucketRequest();
+    req.setName("bucket");
+    auto getObject = req.send().getBucket().getObjectRequest();
+    getObject.setKey("foo");
+    return getObject.send().getObject();
+  }();
+
+  // several writes, without saying how long the object is
+  auto stream = object.uploadRequest().send().getStream();
+  for (auto txt: {"abc"_kj, "def"_kj}) {
+    auto req = stream.writeRequest();
+    req.setBytes(txt.asBytes());
+    req.send().wait(waitScope_);
+  }
+  stream.endRequest().send().wait(waitScope_);
+
+  auto pipe = kj::newOneWayPipe();
+  auto req = object.readRequest();
+  req.setStream(factory.kjToCapnp(kj::mv(pipe.out)));
+  auto promise = req.send();
+  char data[6];
+  pipe.in->read(data, sizeof(data)).wait(waitScope_);
+  promise.wait(waitScope_);
+  EXPECT_EQ(kj::arrayPtr(data, sizeof(data)), "abcdef"_kj.asArray());
+}
+
+TEST_F(S3ServerTest, Conditional) {
+  auto dir = kj::newInMemoryDirectory(kj::systemPreciseCalendarClock());
+  capnp::ByteStreamFactory factory;
+  auto s3 = newS3Server(dir->clone(), factory);
+
+  auto object = [&]{
+    auto req = s3.createBucketRequest();
+    req.setName("bucket");
+    auto getObject = req.send().getBucket().getObjectRequest();
+    getObject.setKey("foo");
+    return getObject.send().getObject();
+  }();
+
+  {
+    auto stream = object.uploadRequest().send().getStream();
+    auto req = stream.writeRequest();
+    req.setBytes("abc"_kj.asBytes());
+    req.send().wait(waitScope_);
+    stream.endRequest().send().wait(waitScope_);
+  }
+
+  auto props = object.headRequest().send().wait(waitScope_);
+  auto etag = kj::str(props.getEtag());
+  EXPECT_TRUE(etag.size());
+  EXPECT_EQ(props.getSize(), 3);
+  EXPECT_FALSE(props.getNotModified());
+  EXPECT_TRUE(parseHttpDate(props.getLastModified()) != nullptr);
+
+  {
+    auto req = object.headRequest();
+    req.initConditions().setIfNoneMatch(etag);
+    auto reply = req.send().wait(waitScope_);
+    EXPECT_TRUE(reply.getNotModified());
+    EXPECT_EQ(reply.getEtag(), etag);
+  }
+
+  {
+    auto req = object.headRequest();
+    req.initConditions().setIfModifiedSince(props.getLastModified());
+    EXPECT_TRUE(req.send().wait(waitScope_).getNotModified());
+  }
+
+  {
+    auto req = object.headRequest();
+    req.initConditions().setIfMatch("\"other\"");
+    EXPECT_ANY_THROW(req.send().wait(waitScope_));
+  }
+
+  // an unchanged object is not sent again
+  {
+    auto pipe = kj::newOneWayPipe();
+    auto req = object.readRequest();
+    req.setStream(factory.kjToCapnp(kj::mv(pipe.out)));
+    req.initConditions().setIfNoneMatch(etag);
+    EXPECT_TRUE(req.send().wait(waitScope_).getNotModified());
+    char c;
+    auto read = pipe.in->tryRead(&c, 1, 1);
+    EXPECT_TRUE(!read.poll(waitScope_) || read.wait(waitScope_) == 0);
+  }
+
+  {
+    auto pipe = kj::newOneWayPipe();
+    auto req = object.readRequest();
+    req.setStream(factory.kjToCapnp(kj::mv(pipe.out)));
+    req.initConditions().setIfMatch(etag);
+    auto promise = req.send();
+    char data[3];
+    pipe.in->read(data, sizeof(data)).wait(waitScope_);
+    EXPECT_FALSE(promise.wait(waitScope_).getNotModified());
+    EXPECT_EQ(kj::arrayPtr(data, sizeof(data)), "abc"_kj.asArray());
+  }
+}
+
+TEST_F(S3ServerTest, Copy) {
+  auto dir = kj::newInMemoryDirectory(kj::systemPreciseCalendarClock());
+  capnp::ByteStreamFactory factory;
+  auto s3 = newS3Server(dir->clone(), factory);
+
+  auto bucket = [&]{
+    auto req = s3.createBucketRequest();
+    req.setName("bucket");
+    return req.send().getBucket();
+  }();
+
+  auto object = [&](kj::StringPtr key) {
+    auto req = bucket.getObjectRequest();
+    req.setKey(key);
+    return req.send().getObject();
+  };
+
+  {
+    auto stream = object("src").writeRequest().send().getStream();
+    auto req = stream.writeRequest();
+    req.setBytes("0123456789"_kj.asBytes());
+    req.send().wait(waitScope_);
+    stream.endRequest().send().wait(waitScope_);
+  }
+
+  auto copy = [&](kj::StringPtr key, uint64_t first, uint64_t last) {
+    auto req = object(key).copyFromRequest();
+    req.setBucket("bucket");
+    req.setKey("src");
+    req.setFirst(first);
+    req.setLast(last);
+    req.send().wait(waitScope_);
+  };
+
+  auto read = [&](kj::StringPtr key, size_t size) {
+    auto pipe = kj::newOneWayPipe();
+    auto req = object(key).readRequest();
+    req.setStream(factory.kjToCapnp(kj::mv(pipe.out)));
+    auto promise = req.send();
+    auto data = kj::heapString(size);
+    pipe.in->read(data.begin(), size).wait(waitScope_);
+    promise.wait(waitScope_);
+    return data;
+  };
+
+  copy("whole", 0, 0xFFFFFFFFFFFFFFFF);
+  EXPECT_EQ(read("whole", 10), "0123456789"_kj);
+
+  copy("range", 2, 5);
+  EXPECT_EQ(read("range", 4), "2345"_kj);
+}
+
+TEST_F(S3ServerTest, PendingVersions) {
+  auto dir = kj::newInMemoryDirectory(kj::systemPreciseCalendarClock());
+  capnp::ByteStreamFactory factory;
+  auto s3 = newS3Server(dir->clone(), factory);
+
+  auto object = [&]{
+    auto req = s3.createBucketRequest();
+    req.setName("bucket");
+    auto getObject = req.send().getBucket().getObjectRequest();
+    getObject.setKey("foo");
+    return getObject.send().getObject();
+  }();
+
+  auto write = [&](kj::StringPtr txt, bool end) {
+    auto stream = object.uploadRequest().send().getStream();
+    auto req = stream.writeRequest();
+    req.setBytes(txt.asBytes());
+    req.send().wait(waitScope_);
+    if (end) {
+      stream.endRequest().send().wait(waitScope_);
+    }
+    return stream;
+  };
+
+  auto read = [&]{
+    auto pipe = kj::newOneWayPipe();
+    auto req = object.readRequest();
+    req.setStream(factory.kjToCapnp(kj::mv(pipe.out)));
+    auto promise = req.send();
+    char data[3];
+    pipe.in->read(data, sizeof(data)).wait(waitScope_);
+    promise.wait(waitScope_);
+    return kj::heapString(data, sizeof(data));
+  };
+
+  write("abc"_kj, true);
+  write("def"_kj, true);
+  // version 2 is still being written
+  auto pending = write("ghi"_kj, false);
+
+  // a version still being written cannot be deleted from under it
+  {
+    auto req = object.deleteRequest();
+    req.setVersion("2");
+    EXPECT_ANY_THROW(req.send().wait(waitScope_));
+  }
+
+  // versions are numbers, however they are written
+  {
+    auto req = object.deleteRequest();
+    req.setVersion("01");
+    req.send().wait(waitScope_);
+  }
+  EXPECT_EQ(read(), "abc"_kj);
+
+  // an abandoned version is removed
+  auto versions = kj::Path{
+    kj::encodeHex("bucket"_kj.asBytes()), kj::encodeHex("foo"_kj.asBytes()), "versions"
+  };
+  EXPECT_TRUE(dir->exists(versions.append("2")));
+  pending = nullptr;
+  kj::evalLast([]{}).wait(waitScope_);
+  EXPECT_FALSE(dir->exists(versions.append("2")));
+  EXPECT_EQ(read(), "abc"_kj);
+}
+
+TEST_F(S3ServerTest, Dedup) {
+  auto dir = kj::newInMemoryDirectory(kj::systemPreciseCalendarClock());
+  capnp::ByteStreamFactory factory;
+  S3ServerOptions options;
+  options.dedup = true;
+  auto s3 = newS3Server(dir->clone(), factory, options);
+
+  auto bucket = [&]{
+    auto req = s3.createBucketRequest();
+    req.setName("bucket");
+    return req.send().getBucket();
+  }();
+
+  auto object = [&](kj::StringPtr key) {
+    auto req = bucket.getObjectRequest();
+    req.setKey(key);
+    return req.send().getObject();
+  };
+
+  for (auto key: {"a"_kj, "b"_kj}) {
+    auto stream = object(key).writeRequest().send().getStream();
+    auto req = stream.writeRequest();
+    req.setBytes("same"_kj.asBytes());
+    req.send().wait(waitScope_);
+    stream.endRequest().send().wait(waitScope_);
+  }
+
+  // stored once, with an ETag of its hash
+  EXPECT_EQ(dir->openSubdir(kj::Path{".blobs"})->listNames().size(), 1);
+  auto etag = [&](kj::StringPtr key) {
+    auto props = object(key).headRequest().send().wait(waitScope_);
+    for (auto header: props.getHeaders()) {
+      if (header.getUncommon().getName() == "ETag"_kj) {
+	return kj::str(header.getUncommon().getValue());
+      }
+    }
+    return kj::String{};
+  };
+  auto expected = kj::str('"', kj::encodeHex(hash::sha256("same"_kj.asBytes())), '"');
+  EXPECT_EQ(etag("a"), expected);
+  EXPECT_EQ(etag("b"), expected);
+
+  {
+    auto pipe = kj::newOneWayPipe();
+    auto req = object("b").readRequest();
+    req.setStream(factory.kjToCapnp(kj::mv(pipe.out)));
+    auto promise = req.send();
+    char data[4];
+    pipe.in->read(data, sizeof(data)).wait(waitScope_);
+    promise.wait(waitScope_);
+    EXPECT_EQ(kj::arrayPtr(data, sizeof(data)), "same"_kj.asArray());
+  }
+
+  // the blob goes with its last reference
+  object("a").deleteRequest().send().wait(waitScope_);
+  EXPECT_EQ(dir->openSubdir(kj::Path{".blobs"})->listNames().size(), 1);
+  object("b").deleteRequest().send().wait(waitScope_);
+  EXPECT_EQ(dir->openSubdir(kj::Path{".blobs"})->listNames().size(), 0);
+}
+
+TEST_F(S3ServerTest, DedupPending) {
+  FakeClock clock;
+  auto dir = kj::newInMemoryDirectory(clock);
+  capnp::ByteStreamFactory factory;
+  S3ServerOptions options;
+  options.dedup = true;
+  auto s3 = newS3Server(dir->clone(), factory, options);
+
+  auto bucket = [&]{
+    auto req = s3.createBucketRequest();
+    req.setName("bucket");
+    return req.send().getBucket();
+  }();
+
+  auto object = [&](kj::StringPtr key) {
+    auto req = bucket.getObjectRequest();
+    req.setKey(key);
+    return req.send().getObject();
+  };
+
+  auto write = [&](kj::StringPtr key, kj::StringPtr txt, bool end) {
+    auto stream = object(key).writeRequest().send().getStream();
+    auto req = stream.writeRequest();
+    req.setBytes(txt.asBytes());
+    req.send().wait(waitScope_);
+    if (end) {
+      stream.endRequest().send().wait(waitScope_);
+    }
+    return stream;
+  };
+
+  auto lastModified = [&](kj::StringPtr key) {
+    auto props = object(key).headRequest().send().wait(waitScope_);
+    return kj::str(props.getLastModified());
+  };
+
+  // a version is as old as its record, not as the blob it shares
+  write("a", "same", true);
+  clock.now_ = clock.now_ + kj::DAYS;
+  write("b", "same", true);
+  EXPECT_EQ(lastModified("b"), httpDate(clock.now_));
+  EXPECT_NE(lastModified("a"), lastModified("b"));
+
+  // deleting a key leaves the raw data of a version being written alone,
+  // even when it looks like a record
+  auto pending = write("a", "x y", false);
+  object("a").deleteRequest().send().wait(waitScope_);
+  EXPECT_EQ(dir->openSubdir(kj::Path{".blobs"})->listNames().size(), 1);
+
+  pending = nullptr;
+  kj::evalLast([]{}).wait(waitScope_);
+  EXPECT_EQ(dir->openSubdir(kj::Path{".blobs"})->listNames().size(), 1);
+  object("b").deleteRequest().send().wait(waitScope_);
+  EXPECT_EQ(dir->openSubdir(kj::Path{".blobs"})->listNames().size(), 0);
+}
+
+TEST_F(S3ServerTest, Compression) {
+  auto dir = kj::newInMemoryDirectory(kj::systemPreciseCalendarClock());
+  capnp::ByteStreamFactory factory;
+  S3ServerOptions options;
+  options.ioBufferSize = 4096;
+  options.compression = Compression::GZIP;
+  auto s3 = newS3Server(dir->clone(), factory, options);
+
+  auto object = [&]{
+    auto req = s3.createBucketRequest();
+    req.setName("bucket");
+    auto getObject = req.send().getBucket().getObjectRequest();
+    getObject.setKey("log");
+    return getObject.send().getObject();
+  }();
+
+  auto lines = KJ_MAP(ii, kj::range(0, 2000)) {
+    return kj::str("{\"level\": \"info\", \"line\": ", ii, "}\n");
+  };
+  auto txt = kj::strArray(lines, "");
+  {
+    auto stream = object.uploadRequest().send().getStream();
+    auto req = stream.writeRequest();
+    req.setBytes(txt.asBytes());
+    req.send().wait(waitScope_);
+    stream.endRequest().send().wait(waitScope_);
+  }
+
+  // stored compressed, which is the size given
+  auto props = object.headRequest().send().wait(waitScope_);
+  EXPECT_LT(props.getSize(), txt.size() / 4);
+  auto headers = props.getHeaders();
+  ASSERT_EQ(headers.size(), 5);
+  EXPECT_EQ(headers[4].getUncommon().getName(), "Content-Encoding"_kj);
+  EXPECT_EQ(headers[4].getUncommon().getValue(), "gzip"_kj);
+
+  auto read = [&](uint64_t first, uint64_t last) {
+    auto pipe = kj::newOneWayPipe();
+    auto req = object.readRequest();
+    req.setStream(factory.kjToCapnp(kj::mv(pipe.out)));
+    req.setFirst(first);
+    req.setLast(last);
+    auto promise = req.send();
+    auto data = kj::heapString(last - first + 1);
+    pipe.in->read(data.begin(), data.size()).wait(waitScope_);
+    promise.wait(waitScope_);
+    return data;
+  };
+
+  // ranges are of the decoded bytes
+  EXPECT_EQ(read(0, txt.size() - 1), txt);
+  EXPECT_EQ(read(1000, 20000), kj::heapString(txt.slice(1000, 20001)));
+  // and reading stops once the range is done
+  EXPECT_EQ(read(0, 9), kj::heapString(txt.slice(0, 10)));
+}
+
+TEST_F(S3ServerTest, BatchOperations) {
+  auto dir = kj::newInMemoryDirectory(kj::systemPreciseCalendarClock());
+  capnp::ByteStreamFactory factory;
+  auto s3 = newS3Server(dir->clone(), factory);
+
+  auto bucket = [&]{
+    auto req = s3.createBucketRequest();
+    req.setName("bucket");
+    return req.send().getBucket();
+  }();
+
+  auto write = [&](kj::StringPtr key, kj::StringPtr txt) {
+    auto req = bucket.getObjectRequest();
+    req.setKey(key);
+    auto stream = req.send().getObject().writeRequest().send().getStream();
+    auto write = stream.writeRequest();
+    write.setBytes(txt.asBytes());
+    write.send().wait(waitScope_);
+    stream.endRequest().send().wait(waitScope_);
+  };
+
+  for (auto key: {"a"_kj, "b"_kj, "c"_kj}) {
+    write(key, key);
+  }
+
+  auto head = [&]{
+    auto req = bucket.headObjectsRequest();
+    auto keys = req.initKeys(4);
+    keys.set(0, "a");
+    keys.set(1, "missing");
+    keys.set(2, "b");
+    keys.set(3, "c");
+    return req.send().wait(waitScope_);
+  };
+
+  {
+    auto reply = head();
+    auto objects = reply.getObjects();
+    ASSERT_EQ(objects.size(), 3);
+    EXPECT_EQ(objects[0].getKey(), "a"_kj);
+    EXPECT_EQ(objects[2].getKey(), "c"_kj);
+    auto errors = reply.getErrors();
+    ASSERT_EQ(errors.size(), 1);
+    EXPECT_EQ(errors[0].getKey(), "missing"_kj);
+    EXPECT_EQ(errors[0].getCode(), "NoSuchKey"_kj);
+  }
+
+  {
+    auto req = bucket.deleteObjectsRequest();
+    auto keys = req.initKeys(2);
+    keys.set(0, "a");
+    keys.set(1, "c");
+    EXPECT_EQ(req.send().wait(waitScope_).getErrors().size(), 0);
+  }
+
+  {
+    auto reply = head();
+    auto objects = reply.getObjects();
+    ASSERT_EQ(objects.size(), 1);
+    EXPECT_EQ(objects[0].getKey(), "b"_kj);
+    EXPECT_EQ(reply.getErrors().size(), 3);
+  }
+
+  // every version goes, as for a delete without one, so no older
+  // version becomes readable again
+  write("b", "old");
+  write("b", "newer");
+  EXPECT_EQ(head().getObjects().size(), 1);
+  {
+    auto req = bucket.deleteObjectsRequest();
+    req.initKeys(1).set(0, "b");
+    EXPECT_EQ(req.send().wait(waitScope_).getErrors().size(), 0);
+  }
+  EXPECT_EQ(head().getObjects().size(), 0);
 }
 
 int main(int argc, char* argv[]) {
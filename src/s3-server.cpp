@@ -4,12 +4,25 @@
 
 #include "s3.h"
 
+#include "s3-server.h"
+
+#include "callback.h"
+#include "codec.h"
+#include "common.h"
+#include "file-io.h"
+#include "key-index.h"
+#include "sha256.h"
+#include "uuid.h"
+
 #include <capnp/compat/byte-stream.h>
 
 #include <kj/compat/http.h>
 #include <kj/compat/url.h>
 #include <kj/encoding.h>
 #include <kj/filesystem.h>
+#include <kj/map.h>
+
+#include <fcntl.h>
 
 namespace aws {
 
@@ -65,7 +78,8 @@ struct S3ServerImpl
 
   S3ServerImpl(
     kj::Own<const kj::Directory>,
-    capnp::ByteStreamFactory&
+    capnp::ByteStreamFactory&,
+    const S3ServerOptions&
   );
 
   kj::Own<S3ServerImpl> addRef() {
@@ -80,8 +94,53 @@ struct S3ServerImpl
   kj::Promise<void> getBucket(GetBucketContext) override;
   kj::Promise<void> createBucket(CreateBucketContext) override;
 
+  // Returns the key index of the bucket stored in directory `hex`,
+  // opening it on first use.
+  KeyIndex& index(kj::StringPtr hex);
+
+  // With dedup, each blob lives in BLOBS/<sha256>, as `data` plus one
+  // empty file under `refs` for each version record naming it, and is
+  // removed along with its last reference.
+  struct Record {
+    kj::String hash_;
+    kj::String ref_;
+  };
+
+  Record readRecord(const kj::ReadableFile&);
+
+  // Returns null unless `file` holds a well-formed record, rather than
+  // the raw data of a version that has not been interned yet.
+  kj::Maybe<Record> tryReadRecord(const kj::ReadableFile& file);
+
+  // Opens the data of `version` in `versions`.
+  kj::Own<const kj::ReadableFile> openVersion(const kj::Directory& versions, kj::StringPtr version);
+
+  // Adds a reference to blob `hash`, returning the text of its record.
+  kj::String reference(kj::StringPtr hash);
+
+  // Moves the data of `version`, written to `file` in `versions`, into
+  // the blob store as `hash`, or drops it if the blob already exists,
+  // and leaves a record in its place, which is returned.
+  kj::Promise<kj::Own<const kj::File>> intern(
+    const kj::File& file, const kj::Directory& versions, uint32_t version, kj::StringPtr hash);
+
+  // Drops the reference of `version` in `versions`, if it is a record.
+  void release(const kj::Directory& versions, kj::StringPtr version);
+
+  // The name in pending_ of `version` of the key stored in directory
+  // `keyHex` of the bucket in directory `bucketHex`.
+  static kj::String pendingName(kj::StringPtr bucketHex, kj::StringPtr keyHex, uint32_t version) {
+    return kj::str(bucketHex, '/', keyHex, '/', version);
+  }
+
   kj::Own<const kj::Directory> dir_;
   capnp::ByteStreamFactory& factory_;
+  S3ServerOptions options_;
+  kj::Own<FileIo> io_;
+  kj::HashMap<kj::String, kj::Own<KeyIndex>> indexes_;
+  // Versions reserved for writes and copies that are not yet published,
+  // whose files may still be incomplete.
+  kj::HashSet<kj::String> pending_;
   kj::TaskSet tasks_{*this};
 };
 
@@ -102,6 +161,37 @@ struct BucketServerImpl
   kj::Promise<void> listObjects(ListObjectsContext) override;
   kj::Promise<void> listObjectVersions(ListObjectVersionsContext) override;
   kj::Promise<void> getObject(GetObjectContext) override;
+  kj::Promise<void> deleteObjects(DeleteObjectsContext) override;
+  kj::Promise<void> headObjects(HeadObjectsContext) override;
+
+  struct Stat {
+    kj::String version_;
+    kj::FsNode::Metadata meta_;
+    // the content hash, with dedup
+    kj::String hash_;
+  };
+
+  // Finds `version` of `key`, or its latest version.
+  kj::Maybe<Stat> stat(kj::StringPtr key, kj::StringPtr version);
+  kj::String etag(const Stat&);
+  void setProperties(kj::StringPtr key, const Stat&, S3::Object::Properties::Builder);
+
+  // Whether `stat` is unmodified by the conditions, failing if one of
+  // them is not met.
+  bool notModified(const Stat&, S3::Object::Conditions::Reader);
+
+  // Removes `version` of `key`, or every version of it.
+  void remove(kj::StringPtr key, kj::StringPtr version);
+
+  // Makes `version` of `key`, held in `file` in `dir`, as durable as
+  // the server's options require and then visible.
+  kj::Promise<void> publish(
+    kj::StringPtr key, uint32_t version, const kj::File& file, const kj::Directory& dir);
+
+  // Removes what was written of `version` of `key` in `dir`, which will
+  // not be published, releasing its blob if it is a `record`.
+  void abandon(kj::StringPtr key, uint32_t version, const kj::Directory& dir, bool record);
+
   kj::Own<S3ServerImpl> s3_;
   kj::String name_;
   kj::String hex_;
@@ -117,14 +207,134 @@ struct ObjectServerImpl
     , hex_{kj::encodeHex(key_.asBytes())} {
   }
 
+  kj::Promise<void> head(HeadContext) override;
   kj::Promise<void> read(ReadContext) override;
   kj::Promise<void> write(WriteContext) override;
+  kj::Promise<void> delete_(DeleteContext) override;
+  kj::Promise<void> upload(UploadContext) override;
+  kj::Promise<void> copyFrom(CopyFromContext) override;
+
+  // Starts writing the next version, whose length does not need to be
+  // known.
+  capnp::ByteStream::Client newVersion();
+
+  // The directory of this key's versions, and the number of a version
+  // not yet on disk, which is pending until it is published or
+  // abandoned.
+  kj::Own<const kj::Directory> versions();
+  uint32_t reserveVersion(const kj::Directory&);
 
   kj::Own<BucketServerImpl> bucket_;
   kj::String key_;
   kj::String hex_;
 };
 
+// Writes a new version through the I/O threads, one buffer on disk
+// while the next is filled, and records it in the index once the data
+// is as durable as the server's options require. With compression,
+// what is written is encoded on its way to the buffers.
+struct VersionWriter
+  : capnp::ByteStream::Server
+  , kj::AsyncOutputStream {
+
+  VersionWriter(
+    kj::Own<BucketServerImpl> bucket,
+    kj::StringPtr key,
+    kj::Own<const kj::Directory> dir,
+    uint32_t version
+  );
+  ~VersionWriter() noexcept(false);
+
+  kj::Promise<void> write(WriteContext ctx) override {
+    auto params = ctx.getParams();
+    KJ_IF_MAYBE(encoder, encoder_) {
+      auto bytes = params.getBytes();
+      return (*encoder)->write(bytes.begin(), bytes.size());
+    }
+    return append(params.getBytes());
+  }
+
+  kj::Promise<void> end(EndContext) override;
+
+  // The encoder's output.
+  kj::Promise<void> write(const void* buffer, size_t size) override {
+    return append(kj::arrayPtr(reinterpret_cast<const kj::byte*>(buffer), size));
+  }
+
+  kj::Promise<void> write(kj::ArrayPtr<const kj::ArrayPtr<const kj::byte>> pieces) override {
+    if (!pieces.size()) {
+      return kj::READY_NOW;
+    }
+    return
+      append(pieces.front())
+      .then(
+        [this, pieces]{
+	  return write(pieces.slice(1, pieces.size()));
+	}
+      );
+  }
+
+  kj::Promise<void> whenWriteDisconnected() override {
+    return kj::NEVER_DONE;
+  }
+
+  kj::Promise<void> append(kj::ArrayPtr<const kj::byte>);
+
+  // Hands the filled part of buffer_ to an I/O thread once the previous
+  // buffer has been written, and carries on with that one.
+  kj::Promise<void> submit();
+
+  // Writes out the last buffer and publishes the version.
+  kj::Promise<void> finish();
+
+  kj::Own<BucketServerImpl> bucket_;
+  kj::String key_;
+  kj::Own<const kj::Directory> dir_;
+  uint32_t version_;
+  kj::Own<const kj::File> file_;
+  kj::Array<kj::byte> buffer_;
+  size_t filled_{0};
+  uint64_t offset_{0};
+  kj::Promise<kj::Array<kj::byte>> spare_;
+  // only updated by the I/O thread writing the current buffer
+  kj::Maybe<kj::Own<hash::Sha256>> hash_;
+  kj::Maybe<kj::Own<Codec>> encoder_;
+  // file_ holds the version's record rather than its data
+  bool interned_{false};
+  bool published_{false};
+};
+
+// Reads [first, last) of a file through the I/O threads into a stream
+// in chunks of one buffer, reading ahead one while the previous one is
+// being written, so memory stays bounded however large the object.
+struct VersionReader {
+
+  // Stops early once `range`, if given, has had all of its bytes.
+  VersionReader(
+    FileIo& io,
+    kj::Own<const kj::ReadableFile> file,
+    kj::Own<kj::AsyncOutputStream> out,
+    uint64_t first,
+    uint64_t last,
+    size_t bufferSize,
+    kj::Maybe<const RangeStream&> range = nullptr
+  );
+
+  kj::Promise<void> run();
+  kj::Promise<void> pump(kj::Promise<kj::ArrayPtr<const kj::byte>>);
+  kj::Promise<kj::ArrayPtr<const kj::byte>> fetch(kj::Array<kj::byte>& buffer);
+
+  FileIo& io_;
+  kj::Own<const kj::ReadableFile> file_;
+  kj::Own<kj::AsyncOutputStream> out_;
+  kj::Maybe<int> fd_;
+  uint64_t offset_;
+  uint64_t last_;
+  kj::Array<kj::byte> buffers_[2];
+  uint32_t current_{0};
+  kj::Maybe<const RangeStream&> range_;
+};
+
 HttpServiceBase::HttpServiceBase(kj::HttpHeaderTable::Builder& builder, S3::Client s3)
   : table_{builder.getFutureTable()}
   , s3_{kj::mv(s3)} {
@@ -190,67 +400,234 @@ kj::Promise<void> ListBucketsService::request(
     );
 }
 
+// Feeds values to `sender` for as long as `next` adds one and returns
+// true, waiting whenever a batch fills until it may be sent.
+template <typename T, typename Func>
+kj::Promise<void> deliver(kj::Own<BatchSender<T>> sender, Func next) {
+  auto& s = *sender;
+  while (next(s)) {
+    if (s.full()) {
+      return
+	s.flush()
+	.then(
+	  [sender = kj::mv(sender), next = kj::mv(next)]() mutable {
+	    return deliver(kj::mv(sender), kj::mv(next));
+	  }
+	);
+    }
+  }
+  return s.end().attach(kj::mv(sender));
+}
+
 kj::Promise<void> BucketServerImpl::listObjects(ListObjectsContext ctx) {
   auto params = ctx.getParams();
-  auto prefix = kj::encodeHex(params.getPrefix().asBytes());
-  auto callback = params.getCallback();
-
-  kj::Vector<kj::Promise<void>> matches;
+  auto size = batchSize(params.getBatchSize());
+  auto sender = kj::heap<BatchSender<capnp::Text>>(params.getCallback(), size);
+
+  return deliver(
+    kj::mv(sender),
+    [
+      &index = s3_->index(hex_),
+      prefix = kj::str(params.getPrefix()),
+      startAfter = kj::str(params.getStartAfter()),
+      delimiter = kj::str(params.getDelimiter()),
+      size,
+      keys = kj::Array<kj::String>{},
+      ii = 0ul,
+      self = addRef()
+    ](auto& sender) mutable {
+      if (ii == keys.size()) {
+	keys = index.list({prefix, startAfter, delimiter}, size);
+	ii = 0;
+	if (!keys.size()) {
+	  return false;
+	}
+	startAfter = kj::str(keys.back());
+      }
 
-  auto dir = s3_->dir_->openSubdir(kj::Path{hex_});
-  for (auto&& hex: dir->listNames()) {
-    if (!hex.startsWith(prefix)) {
-      continue;
+      sender.add(
+	[&](auto values, auto idx) {
+	  values.set(idx, keys[ii]);
+	}
+      );
+      ++ii;
+      return true;
     }
-
-    auto req = callback.nextRequest();
-    req.setValue(kj::str(kj::decodeHex(hex)));
-    matches.add(req.send().ignoreResult());
-  }
-  return kj::joinPromises(matches.releaseAsArray());
+  );
 }
 
 kj::Promise<void> BucketServerImpl::listObjectVersions(ListObjectVersionsContext ctx) {
   auto params = ctx.getParams();
-  auto prefix = kj::encodeHex(params.getPrefix().asBytes());
-  auto callback = params.getCallback();
+  auto size = batchSize(params.getBatchSize());
+  auto sender = kj::heap<BatchSender<S3::Bucket::ObjectVersion>>(params.getCallback(), size);
+
+  return deliver(
+    kj::mv(sender),
+    [
+      dir = s3_->dir_->openSubdir(kj::Path{hex_}),
+      &index = s3_->index(hex_),
+      prefix = kj::str(params.getPrefix()),
+      startAfter = kj::String{},
+      size,
+      keys = kj::Array<kj::String>{},
+      ii = 0ul,
+      versions = kj::Array<uint32_t>{},
+      jj = 0ul,
+      self = addRef()
+    ](auto& sender) mutable {
+      while (jj == versions.size()) {
+	if (ii == keys.size()) {
+	  keys = index.list({prefix, startAfter}, size);
+	  ii = 0;
+	  if (!keys.size()) {
+	    return false;
+	  }
+	  startAfter = kj::str(keys.back());
+	}
+	auto hex = kj::encodeHex(keys[ii++].asBytes());
+	versions = listVersions(*dir->openSubdir(kj::Path{hex, "versions"}));
+	jj = 0;
+      }
 
-  kj::Vector<kj::Promise<void>> matches;
+      sender.add(
+	[&](auto values, auto idx) {
+	  auto value = values[idx];
+	  value.setKey(keys[ii - 1]);
+	  value.setVersion(kj::str(versions[jj]));
+	  value.setDeleted(false);
+	}
+      );
+      ++jj;
+      return true;
+    }
+  );
+}
 
-  auto dir = s3_->dir_->openSubdir(kj::Path{hex_});
+S3ServerImpl::S3ServerImpl(
+  kj::Own<const kj::Directory> dir,
+  capnp::ByteStreamFactory& factory,
+  const S3ServerOptions& options)
+  : dir_{kj::mv(dir)}
+  , factory_{factory}
+  , options_{options}
+  , io_{newFileIo(options.ioThreads)} {
+}
 
-  for (auto&& hex: dir->listNames()) {
-    if (!hex.startsWith(prefix)) {
-      continue;
+KeyIndex& S3ServerImpl::index(kj::StringPtr hex) {
+  return *indexes_.findOrCreate(hex,
+    [&]() -> decltype(indexes_)::Entry {
+      return {kj::str(hex), newKeyIndex(dir_->openSubdir(kj::Path{hex}))};
     }
+  );
+}
 
-    auto objDir = dir->openSubdir(kj::Path{hex, "versions"});
-    auto key = kj::str(kj::decodeHex(hex));
-    
-    for (auto&& version: objDir->listNames()) {
-      auto req = callback.nextRequest();
-      {
-	auto value = req.initValue();
-	value.setKey(key);
-	value.setVersion(version);
-	value.setDeleted(false);
-      }
-      matches.add(req.send().ignoreResult());
+// Not a bucket, as bucket directories are named in hex.
+constexpr auto BLOBS = ".blobs"_kj;
+
+S3ServerImpl::Record S3ServerImpl::readRecord(const kj::ReadableFile& file) {
+  return KJ_REQUIRE_NONNULL(tryReadRecord(file), "Invalid version record");
+}
+
+kj::Maybe<S3ServerImpl::Record> S3ServerImpl::tryReadRecord(const kj::ReadableFile& file) {
+  // <sha256 in hex> <uuid>
+  constexpr auto HASH_SIZE = 64u;
+  constexpr auto REF_SIZE = 36u;
+  if (file.stat().size != HASH_SIZE + 1 + REF_SIZE) {
+    return nullptr;
+  }
+
+  auto txt = file.readAllText();
+  auto isHex = [](char c) {
+    return ('0' <= c && c <= '9') || ('a' <= c && c <= 'f');
+  };
+  for (auto ii: kj::indices(txt)) {
+    auto c = txt[ii];
+    auto ok = ii < HASH_SIZE ? isHex(c)
+      : ii == HASH_SIZE ? c == ' '
+      : isHex(c) || c == '-';
+    if (!ok) {
+      return nullptr;
     }
   }
-  return kj::joinPromises(matches.releaseAsArray());
+  return Record{
+    kj::heapString(txt.slice(0, HASH_SIZE)), kj::heapString(txt.slice(HASH_SIZE + 1))
+  };
 }
 
-S3ServerImpl::S3ServerImpl(
-  kj::Own<const kj::Directory> dir,
-  capnp::ByteStreamFactory& factory)
-  : dir_{kj::mv(dir)}
-  , factory_{factory} {
+kj::Own<const kj::ReadableFile> S3ServerImpl::openVersion(
+    const kj::Directory& versions, kj::StringPtr version) {
+  auto file = versions.openFile(kj::Path::parse(version));
+  if (!options_.dedup) {
+    return file;
+  }
+  auto record = readRecord(*file);
+  return dir_->openFile(kj::Path{BLOBS, record.hash_, "data"});
+}
+
+kj::String S3ServerImpl::reference(kj::StringPtr hash) {
+  auto ref = uuid::random();
+  dir_->openFile(
+    kj::Path{BLOBS, hash, "refs", ref}, kj::WriteMode::CREATE|kj::WriteMode::CREATE_PARENT
+  );
+  return kj::str(hash, ' ', ref);
+}
+
+kj::Promise<kj::Own<const kj::File>> S3ServerImpl::intern(
+    const kj::File& file, const kj::Directory& versions, uint32_t version, kj::StringPtr hash) {
+
+  // the blob must be on disk before any record refers to it
+  auto synced = options_.durability == Durability::NONE
+    ? kj::Promise<void>{kj::READY_NOW}
+    : io_->run([&file]{ file.datasync(); });
+
+  return
+    synced
+    .then(
+      [this, &versions, version, hash = kj::str(hash)]{
+	auto name = kj::Path{kj::str(version)};
+	auto data = kj::Path{BLOBS, hash, "data"};
+	if (!dir_->tryTransfer(
+	      data, kj::WriteMode::CREATE|kj::WriteMode::CREATE_PARENT,
+	      versions, name, kj::TransferMode::MOVE)) {
+	  // already stored
+	  versions.remove(name);
+	}
+
+	auto record = reference(hash);
+	auto replacer = versions.replaceFile(name, kj::WriteMode::CREATE|kj::WriteMode::MODIFY);
+	replacer->get().writeAll(record);
+	replacer->commit();
+	return versions.openFile(name, kj::WriteMode::MODIFY);
+      }
+    );
+}
+
+void S3ServerImpl::release(const kj::Directory& versions, kj::StringPtr version) {
+  if (!options_.dedup) {
+    return;
+  }
+  KJ_IF_MAYBE(file, versions.tryOpenFile(kj::Path::parse(version))) {
+    KJ_IF_MAYBE(record, tryReadRecord(**file)) {
+      auto blob = kj::Path{BLOBS, record->hash_};
+      dir_->tryRemove(blob.append("refs").append(record->ref_));
+      KJ_IF_MAYBE(refs, dir_->tryOpenSubdir(blob.append("refs"))) {
+	if ((*refs)->listNames().size()) {
+	  return;
+	}
+      }
+      dir_->tryRemove(blob);
+    }
+  }
 }
 
 kj::Promise<void> S3ServerImpl::listBuckets(ListBucketsContext ctx) {
   auto params = ctx.getParams();
-  auto names = dir_->listNames();
+  kj::Vector<kj::String> names;
+  for (auto& name: dir_->listNames()) {
+    if (name != BLOBS) {
+      names.add(kj::mv(name));
+    }
+  }
   auto reply = ctx.getResults();
   {
     auto builder = reply.initBucketNames(names.size());
@@ -274,87 +651,711 @@ kj::Promise<void> S3ServerImpl::createBucket(CreateBucketContext ctx) {
   auto name = params.getName();
 
   auto bucket = kj::refcounted<BucketServerImpl>(addRef(), name);
-  dir_->openSubdir(kj::Path{bucket->hex_}, kj::WriteMode::CREATE);
+  dir_->openSubdir(kj::Path{bucket->hex_}, kj::WriteMode::CREATE|kj::WriteMode::MODIFY);
 
   auto reply = ctx.getResults();
   reply.setBucket(kj::mv(bucket));
   return kj::READY_NOW;
 }
 
+kj::Maybe<BucketServerImpl::Stat> BucketServerImpl::stat(
+    kj::StringPtr key, kj::StringPtr version) {
+
+  auto& s3 = *s3_;
+  auto found = kj::str(version);
+  if (!found.size()) {
+    KJ_IF_MAYBE(latest, s3.index(hex_).latest(key)) {
+      found = kj::str(*latest);
+    }
+    else {
+      return nullptr;
+    }
+  }
+
+  auto path = kj::Path{hex_, kj::encodeHex(key.asBytes()), "versions", found};
+  if (s3.options_.dedup) {
+    KJ_IF_MAYBE(file, s3.dir_->tryOpenFile(path)) {
+      auto record = s3.readRecord(**file);
+      // the blob may be older than this version, so the time is the
+      // record's, and only the size is the blob's
+      auto meta = (*file)->stat();
+      meta.size = s3.dir_->lstat(kj::Path{BLOBS, record.hash_, "data"}).size;
+      return Stat{kj::mv(found), meta, kj::mv(record.hash_)};
+    }
+    return nullptr;
+  }
+
+  KJ_IF_MAYBE(meta, s3.dir_->tryLstat(path)) {
+    return Stat{kj::mv(found), *meta};
+  }
+  return nullptr;
+}
+
+kj::String BucketServerImpl::etag(const Stat& stat) {
+  if (stat.hash_.size()) {
+    return kj::str('"', stat.hash_, '"');
+  }
+
+  // version numbers restart once every version of a key is deleted, so
+  // the tag also covers when and how much was written
+  auto& meta = stat.meta_;
+  return kj::str(
+    '"', stat.version_, '-', meta.size, '-',
+    (meta.lastModified - kj::UNIX_EPOCH) / kj::NANOSECONDS, '"'
+  );
+}
+
+void BucketServerImpl::setProperties(
+    kj::StringPtr key, const Stat& stat, S3::Object::Properties::Builder props) {
+
+  auto& meta = stat.meta_;
+  auto etag = this->etag(stat);
+  auto length = kj::str(meta.size);
+  auto lastModified = httpDate(meta.lastModified);
+
+  props.setKey(key);
+  props.setEtag(etag);
+  props.setSize(meta.size);
+  props.setLastModified(lastModified);
+  auto encoding = contentEncoding(s3_->options_.compression);
+  auto headers = props.initHeaders(encoding.size() ? 5 : 4);
+  auto set = [&](auto ii, kj::StringPtr name, kj::StringPtr value) {
+    auto header = headers[ii].initUncommon();
+    header.setName(name);
+    header.setValue(value);
+  };
+  set(0, "Content-Length"_kj, length);
+  set(1, "ETag"_kj, etag);
+  set(2, "x-amz-version-id"_kj, stat.version_);
+  set(3, "Last-Modified"_kj, lastModified);
+  if (encoding.size()) {
+    set(4, "Content-Encoding"_kj, encoding);
+  }
+}
+
+bool BucketServerImpl::notModified(
+    const Stat& stat, S3::Object::Conditions::Reader conditions) {
+  auto ifNoneMatch = conditions.getIfNoneMatch();
+  switch (checkETag(etag(stat), conditions.getIfMatch(), ifNoneMatch)) {
+    case Precondition::FAILED:
+      KJ_FAIL_REQUIRE("PreconditionFailed");
+    case Precondition::NOT_MODIFIED:
+      return true;
+    case Precondition::MET:
+      break;
+  }
+
+  // ignored alongside If-None-Match, as in HTTP
+  auto ifModifiedSince = conditions.getIfModifiedSince();
+  if (ifModifiedSince.size() && !ifNoneMatch.size()) {
+    KJ_IF_MAYBE(since, parseHttpDate(ifModifiedSince)) {
+      // HTTP dates have whole seconds
+      auto modified = (stat.meta_.lastModified - kj::UNIX_EPOCH) / kj::SECONDS;
+      return modified <= (*since - kj::UNIX_EPOCH) / kj::SECONDS;
+    }
+  }
+  return false;
+}
+
+void BucketServerImpl::remove(kj::StringPtr key, kj::StringPtr version) {
+  auto& s3 = *s3_;
+  auto keyHex = kj::encodeHex(key.asBytes());
+  auto path = kj::Path{hex_, keyHex};
+  auto& index = s3.index(hex_);
+
+  if (version.size()) {
+    auto number = KJ_REQUIRE_NONNULL(version.tryParseAs<uint32_t>(), "Invalid version", key, version);
+    // the writer of a pending version publishes or abandons it
+    KJ_REQUIRE(!s3.pending_.contains(s3.pendingName(hex_, keyHex, number)),
+	       "Version is still being written", key, version);
+    KJ_IF_MAYBE(dir, s3.dir_->tryOpenSubdir(path.append("versions"))) {
+      auto name = kj::str(number);
+      s3.release(**dir, name);
+      (*dir)->tryRemove(kj::Path{kj::mv(name)});
+      KJ_IF_MAYBE(latest, index.latest(key)) {
+	if (*latest != number) {
+	  return;
+	}
+	// the newest published version before it takes its place, rather
+	// than one still being written, or left unpublished by a crash
+	for (auto older: listVersions(**dir)) {
+	  if (older < *latest && !s3.pending_.contains(s3.pendingName(hex_, keyHex, older))) {
+	    index.insert(key, older);
+	    return;
+	  }
+	}
+      }
+    }
+  }
+
+  // no versions are left, but those still being written are theirs to
+  // publish or abandon, along with any reference they hold
+  auto pending = false;
+  KJ_IF_MAYBE(dir, s3.dir_->tryOpenSubdir(path.append("versions"))) {
+    for (auto version: listVersions(**dir)) {
+      if (s3.pending_.contains(s3.pendingName(hex_, keyHex, version))) {
+	pending = true;
+	continue;
+      }
+      auto name = kj::str(version);
+      s3.release(**dir, name);
+      (*dir)->tryRemove(kj::Path{kj::mv(name)});
+    }
+  }
+  if (!pending) {
+    s3.dir_->tryRemove(path);
+  }
+  index.erase(key);
+}
+
+kj::Promise<void> BucketServerImpl::deleteObjects(DeleteObjectsContext ctx) {
+  // as ObjectServerImpl::delete_ without a version, and an unversioned
+  // S3 bucket, each key goes entirely; a failure is the key's alone
+  struct Failure {
+    kj::StringPtr key_;
+    kj::Exception exc_;
+  };
+  kj::Vector<Failure> failures;
+  for (auto key: ctx.getParams().getKeys()) {
+    KJ_IF_MAYBE(exc, kj::runCatchingExceptions([&]{
+      remove(key, nullptr);
+    })) {
+      failures.add(Failure{key, kj::mv(*exc)});
+    }
+  }
+
+  auto errors = ctx.getResults().initErrors(failures.size());
+  for (auto ii: kj::indices(failures)) {
+    auto& failure = failures[ii];
+    auto error = errors[ii];
+    error.setKey(failure.key_);
+    error.setCode("InternalError"_kj);
+    error.setMessage(failure.exc_.getDescription());
+  }
+  return kj::READY_NOW;
+}
+
+kj::Promise<void> BucketServerImpl::headObjects(HeadObjectsContext ctx) {
+  auto keys = ctx.getParams().getKeys();
+  auto stats = KJ_MAP(key, keys) {
+    return stat(key, nullptr);
+  };
+
+  auto found = 0u;
+  for (auto& stat: stats) {
+    found += stat != nullptr;
+  }
+
+  auto reply = ctx.getResults();
+  auto objects = reply.initObjects(found);
+  auto errors = reply.initErrors(stats.size() - found);
+  auto nextObject = 0u;
+  auto nextError = 0u;
+  for (auto ii: kj::indices(stats)) {
+    KJ_IF_MAYBE(stat, stats[ii]) {
+      setProperties(keys[ii], *stat, objects[nextObject++]);
+    }
+    else {
+      auto error = errors[nextError++];
+      error.setKey(keys[ii]);
+      error.setCode("NoSuchKey"_kj);
+      error.setMessage("The specified key does not exist."_kj);
+    }
+  }
+  return kj::READY_NOW;
+}
+
+kj::Promise<void> ObjectServerImpl::head(HeadContext ctx) {
+  auto params = ctx.getParams();
+  auto version = params.getVersion();
+  auto stat = bucket_->stat(key_, version);
+  auto& found = KJ_REQUIRE_NONNULL(stat, "No such key", key_, version);
+  auto reply = ctx.getResults();
+  if (bucket_->notModified(found, params.getConditions())) {
+    reply.setKey(key_);
+    reply.setEtag(bucket_->etag(found));
+    reply.setNotModified(true);
+    return kj::READY_NOW;
+  }
+  bucket_->setProperties(key_, found, reply);
+  return kj::READY_NOW;
+}
+
 kj::Promise<void> ObjectServerImpl::read(ReadContext ctx) {
   auto params = ctx.getParams();
+  auto& s3 = *bucket_->s3_;
   auto path = kj::Path{bucket_->hex_, hex_, "versions"};
-  auto dir = bucket_->s3_->dir_->openSubdir(path);
+  auto dir = s3.dir_->openSubdir(path);
 
   auto version = kj::str(params.getVersion());
   if (!version.size()) {
-    auto names = dir->listNames();
-    KJ_REQUIRE(names.size());
-    version = kj::str(dir->listNames().back());
+    auto latest = s3.index(bucket_->hex_).latest(key_);
+    version = kj::str(KJ_REQUIRE_NONNULL(latest, "No such key", key_));
+  }
+
+  auto conditions = params.getConditions();
+  if (conditions.getIfNoneMatch().size() ||
+      conditions.getIfMatch().size() ||
+      conditions.getIfModifiedSince().size()) {
+    auto stat = bucket_->stat(key_, version);
+    auto& found = KJ_REQUIRE_NONNULL(stat, "No such key", key_, version);
+    if (bucket_->notModified(found, conditions)) {
+      ctx.getResults().setNotModified(true);
+      return kj::READY_NOW;
+    }
+  }
+
+  auto file = s3.openVersion(*dir, version);
+  auto size = file->stat().size;
+
+  // `last` is inclusive, as in an HTTP range, and defaults to the largest
+  // offset there is, so that whole reads go to the end of any object
+  auto first = params.getFirst();
+  auto last = params.getLast();
+  KJ_REQUIRE(first <= last, "Invalid range", first, last);
+
+  auto compression = s3.options_.compression;
+  if (compression != Compression::NONE) {
+    // the range is of the decoded bytes, which start with the file's
+    // and the file is only decoded as far as the range's end
+    auto range = newRangeStream(s3.factory_.capnpToKj(params.getStream()), first, last);
+    auto& r = *range;
+    auto decoder = newDecoder(compression, *range).attach(kj::mv(range));
+    auto& d = *decoder;
+    auto reader = kj::heap<VersionReader>(
+      *s3.io_, kj::mv(file), kj::mv(decoder), 0, size, s3.options_.ioBufferSize, r
+    );
+    return
+      reader->run()
+      .then(
+        [&d, &r]() -> kj::Promise<void> {
+	  if (r.done()) {
+	    return kj::READY_NOW;
+	  }
+	  return d.end();
+	}
+      )
+      .attach(kj::mv(reader));
   }
 
-  auto file = dir->openFile(kj::Path::parse(version));
-  auto stat = file->stat();
-  auto data = file->mmap(0, stat.size);
-  auto stream = bucket_->s3_->factory_.capnpToKj(params.getStream());
+  auto end = last >= size ? size : last + 1;
+  KJ_REQUIRE(first < end || first == 0, "Range not satisfiable", first, size);
+
+  auto reader = kj::heap<VersionReader>(
+    *s3.io_, kj::mv(file), s3.factory_.capnpToKj(params.getStream()),
+    first, end, s3.options_.ioBufferSize
+  );
+  auto promise = reader->run();
+  return promise.attach(kj::mv(reader));
+}
+
+kj::Promise<void> ObjectServerImpl::write(WriteContext ctx) {
+  ctx.getResults().setStream(newVersion());
+  return kj::READY_NOW;
+}
+
+kj::Promise<void> ObjectServerImpl::upload(UploadContext ctx) {
+  ctx.getResults().setStream(newVersion());
+  return kj::READY_NOW;
+}
+
+capnp::ByteStream::Client ObjectServerImpl::newVersion() {
+  auto dir = versions();
+  auto version = reserveVersion(*dir);
+  return kj::heap<VersionWriter>(bucket_->addRef(), key_, kj::mv(dir), version);
+}
+
+kj::Own<const kj::Directory> ObjectServerImpl::versions() {
+  auto path = kj::Path{bucket_->hex_, hex_, "versions"};
+  return bucket_->s3_->dir_->openSubdir(
+    path, kj::WriteMode::CREATE|kj::WriteMode::MODIFY|kj::WriteMode::CREATE_PARENT
+  );
+}
+
+uint32_t ObjectServerImpl::reserveVersion(const kj::Directory& dir) {
+  // a version already on disk completed before a crash lost its index
+  // record, so must not be overwritten
+  auto& s3 = *bucket_->s3_;
+  auto& index = s3.index(bucket_->hex_);
+  auto version = index.nextVersion(key_);
+  while (dir.exists(kj::Path{kj::str(version)})) {
+    version = index.nextVersion(key_);
+  }
+  s3.pending_.insert(s3.pendingName(bucket_->hex_, hex_, version));
+  return version;
+}
+
+kj::Promise<void> ObjectServerImpl::copyFrom(CopyFromContext ctx) {
+  auto params = ctx.getParams();
+  auto& s3 = *bucket_->s3_;
+  auto bucketHex = kj::encodeHex(params.getBucket().asBytes());
+  auto key = params.getKey();
+
+  auto version = kj::str(params.getVersion());
+  if (!version.size()) {
+    auto latest = s3.index(bucketHex).latest(key);
+    version = kj::str(KJ_REQUIRE_NONNULL(latest, "No such key", key));
+  }
+
+  auto source = s3.dir_->openSubdir(kj::Path{bucketHex, kj::encodeHex(key.asBytes()), "versions"});
+  auto from = s3.openVersion(*source, version);
+  auto size = from->stat().size;
+
+  auto first = params.getFirst();
+  auto last = params.getLast();
+  KJ_REQUIRE(first <= last, "Invalid range", first, last);
+  // ranges would be of the decoded bytes
+  KJ_REQUIRE(s3.options_.compression == Compression::NONE || (first == 0 && last == uint64_t(kj::maxValue)),
+	     "Only whole compressed objects can be copied", first, last);
+  auto end = last >= size ? size : last + 1;
+  KJ_REQUIRE(first < end || first == 0, "Range not satisfiable", first, size);
+
+  auto dir = versions();
+  auto copy = reserveVersion(*dir);
+  auto name = kj::Path{kj::str(copy)};
+
+  // so that failures to start it are also abandoned
+  auto written = kj::evalNow([&]() -> kj::Promise<kj::Own<const kj::File>> {
+    if (first == 0 && end == size) {
+      if (s3.options_.dedup) {
+	// another reference to the same blob
+	auto record = s3.readRecord(*source->openFile(kj::Path::parse(version)));
+	auto file = dir->openFile(name, kj::WriteMode::CREATE);
+	file->writeAll(s3.reference(record.hash_));
+	return kj::mv(file);
+      }
+
+      // versions are never modified, so can share the source's data
+      dir->transfer(name, kj::WriteMode::CREATE, *source, kj::Path::parse(version), kj::TransferMode::LINK);
+      return dir->openFile(name, kj::WriteMode::MODIFY);
+    }
+
+    auto file = dir->openFile(name, kj::WriteMode::CREATE);
+    auto& f = *file;
+    if (s3.options_.dedup) {
+      return
+	s3.io_->run(
+	  [&file = f, &from = *from, first, count = end - first]{
+	    auto bytes = from.mmap(first, count);
+	    file.write(0, bytes);
+	    return kj::encodeHex(hash::sha256(bytes));
+	  }
+	)
+	.then(
+	  [&s3, &f, &dir = *dir, copy](auto hash) {
+	    return s3.intern(f, dir, copy, hash);
+	  }
+	)
+	.attach(kj::mv(file));
+    }
+
+    // reflinked where the file system allows
+    return
+      s3.io_->run(
+	[&file = f, &from = *from, first, count = end - first]{
+	  file.copy(0, from, first, count);
+	}
+      )
+      .then(
+	[file = kj::mv(file)]() mutable {
+	  return kj::mv(file);
+	}
+      );
+  });
+
   return
-    stream->write(data.begin(), data.size())
-    .attach(kj::mv(stream), kj::mv(data));
+    written
+    .then(
+      [this, &dir = *dir, copy](auto file) {
+	auto& f = *file;
+	return bucket_->publish(key_, copy, f, dir).attach(kj::mv(file));
+      }
+    )
+    .catch_(
+      [this, &dir = *dir, copy](kj::Exception&& exc) {
+	bucket_->abandon(key_, copy, dir, false);
+	kj::throwFatalException(kj::mv(exc));
+      }
+    )
+    .attach(kj::mv(from), kj::mv(source), kj::mv(dir));
 }
 
-kj::Promise<void> writeImpl(
-  kj::Own<kj::AsyncInputStream> input,
-  kj::Own<kj::OutputStream> output,
-  kj::Array<kj::byte> buffer = kj::heapArray<kj::byte>(65536u)) {
+VersionWriter::VersionWriter(
+    kj::Own<BucketServerImpl> bucket,
+    kj::StringPtr key,
+    kj::Own<const kj::Directory> dir,
+    uint32_t version)
+  : bucket_{kj::mv(bucket)}
+  , key_{kj::str(key)}
+  , dir_{kj::mv(dir)}
+  , version_{version}
+  , file_{dir_->openFile(kj::Path{kj::str(version_)}, kj::WriteMode::CREATE)}
+  , buffer_{alignedBuffer(bucket_->s3_->options_.ioBufferSize)}
+  , spare_{alignedBuffer(bucket_->s3_->options_.ioBufferSize)} {
+
+  auto& options = bucket_->s3_->options_;
+  if (options.dedup) {
+    hash_ = hash::newSha256();
+  }
+  if (options.compression != Compression::NONE) {
+    encoder_ = newEncoder(options.compression, *this);
+  }
+}
+
+VersionWriter::~VersionWriter() noexcept(false) {
+  if (!published_) {
+    // the stream was dropped, or failed, before it ended
+    KJ_IF_MAYBE(exc, kj::runCatchingExceptions([this]{
+      bucket_->abandon(key_, version_, *dir_, interned_);
+    })) {
+      KJ_LOG(ERROR, "Failed to remove abandoned version", key_, version_, *exc);
+    }
+  }
+}
+
+kj::Promise<void> VersionWriter::append(kj::ArrayPtr<const kj::byte> data) {
+  while (data.size()) {
+    auto size = kj::min(data.size(), buffer_.size() - filled_);
+    memcpy(buffer_.begin() + filled_, data.begin(), size);
+    filled_ += size;
+    data = data.slice(size, data.size());
+
+    if (filled_ == buffer_.size()) {
+      return
+	submit()
+	.then(
+	  [this, data]{
+	    return append(data);
+	  }
+	);
+    }
+  }
+  return kj::READY_NOW;
+}
 
+kj::Promise<void> VersionWriter::submit() {
+  auto spare = kj::mv(spare_);
+  spare_ = nullptr;
   return
-    input->tryRead(buffer.begin(), 1, buffer.size())
+    spare
     .then(
-      [
-	input = kj::mv(input),
-	output = kj::mv(output),
-	buffer = kj::mv(buffer)
-      ](auto size) mutable -> kj::Promise<void> {
-	if (size) {
-	  output->write(buffer.begin(), size);
-	  return writeImpl(kj::mv(input), kj::mv(output), kj::mv(buffer));
+      [this](auto spare) {
+	auto full = kj::mv(buffer_);
+	buffer_ = kj::mv(spare);
+	auto data = full.slice(0, filled_);
+	auto offset = offset_;
+	offset_ += filled_;
+	filled_ = 0;
+
+	kj::Maybe<hash::Sha256&> hash;
+	KJ_IF_MAYBE(h, hash_) {
+	  hash = **h;
 	}
-	else {
-	  // EOF
-	  return kj::READY_NOW;
+
+	spare_ =
+	  bucket_->s3_->io_->run(
+	    [&file = *file_, hash, offset, data]{
+	      file.write(offset, data);
+	      KJ_IF_MAYBE(h, hash) {
+		h->update(data);
+	      }
+	    }
+	  )
+	  .then(
+	    [full = kj::mv(full)]() mutable {
+	      return kj::mv(full);
+	    }
+	  );
+      }
+    );
+}
+
+kj::Promise<void> VersionWriter::end(EndContext) {
+  KJ_IF_MAYBE(encoder, encoder_) {
+    return
+      (*encoder)->end()
+      .then(
+        [this]{
+	  return finish();
 	}
+      );
+  }
+  return finish();
+}
+
+kj::Promise<void> VersionWriter::finish() {
+  return
+    submit()
+    .then(
+      [this]{
+	// wait for the last buffer to be written
+	auto spare = kj::mv(spare_);
+	spare_ = nullptr;
+	return spare.ignoreResult();
+      }
+    )
+    .then(
+      [this]() -> kj::Promise<void> {
+	KJ_IF_MAYBE(hash, hash_) {
+	  auto digest = kj::encodeHex((*hash)->digest());
+	  return
+	    bucket_->s3_->intern(*file_, *dir_, version_, digest)
+	    .then(
+	      [this](auto record) {
+		file_ = kj::mv(record);
+		interned_ = true;
+		return bucket_->publish(key_, version_, *file_, *dir_);
+	      }
+	    );
+	}
+	return bucket_->publish(key_, version_, *file_, *dir_);
+      }
+    )
+    .then(
+      [this]{
+	published_ = true;
       }
     );
 }
 
-kj::Promise<void> ObjectServerImpl::write(WriteContext ctx) {
-  auto params = ctx.getParams();
-  auto length = params.getLength();
-  auto path = kj::Path{bucket_->hex_, hex_, "versions"};
-  auto dir = bucket_->s3_->dir_->openSubdir(
-    path, kj::WriteMode::CREATE|kj::WriteMode::MODIFY|kj::WriteMode::CREATE_PARENT
-  );
+kj::Promise<void> BucketServerImpl::publish(
+    kj::StringPtr key, uint32_t version, const kj::File& file, const kj::Directory& dir) {
+  auto& s3 = *s3_;
+  auto durability = s3.options_.durability;
 
-  auto version = [&]{
-    auto names = dir->listNames();
-    if (!names.size()) {
-      return 0u;
-    }
-    else {
-      auto version = names.back().parseAs<uint32_t>();
-      return version+1;
+  auto synced = [&]() -> kj::Promise<void> {
+    if (durability == Durability::NONE) {
+      return kj::READY_NOW;
     }
+    return s3.io_->run(
+      [&file, &dir, durability]{
+	file.datasync();
+	if (durability == Durability::PER_VERSION) {
+	  dir.sync();
+	}
+      }
+    );
   }();
 
-  auto file = dir->appendFile(kj::Path{kj::str(version)}, kj:: WriteMode::CREATE);
+  return
+    synced
+    .then(
+      [this, &s3, key = kj::str(key), version, durability]() -> kj::Promise<void> {
+	// only list objects once they are complete, and keep the newest
+	// version as the latest when writes finish out of order
+	auto& index = s3.index(hex_);
+	s3.pending_.erase(s3.pendingName(hex_, kj::encodeHex(key.asBytes()), version));
+	KJ_IF_MAYBE(latest, index.latest(key)) {
+	  if (*latest > version) {
+	    return kj::READY_NOW;
+	  }
+	}
+	index.insert(key, version);
+
+	if (durability != Durability::PER_VERSION) {
+	  return kj::READY_NOW;
+	}
+	return s3.io_->run(
+	  [log = index.log()]{
+	    log->datasync();
+	  }
+	);
+      }
+    );
+}
+
+void BucketServerImpl::abandon(
+    kj::StringPtr key, uint32_t version, const kj::Directory& dir, bool record) {
+  auto& s3 = *s3_;
+  auto name = kj::str(version);
+  s3.pending_.erase(s3.pendingName(hex_, kj::encodeHex(key.asBytes()), version));
+  if (record) {
+    s3.release(dir, name);
+  }
+  dir.tryRemove(kj::Path{kj::mv(name)});
+}
 
-  auto pipe = kj::newOneWayPipe();
+VersionReader::VersionReader(
+    FileIo& io,
+    kj::Own<const kj::ReadableFile> file,
+    kj::Own<kj::AsyncOutputStream> out,
+    uint64_t first,
+    uint64_t last,
+    size_t bufferSize,
+    kj::Maybe<const RangeStream&> range)
+  : io_{io}
+  , file_{kj::mv(file)}
+  , out_{kj::mv(out)}
+  , fd_{file_->getFd()}
+  , offset_{first}
+  , last_{last}
+  , buffers_{alignedBuffer(bufferSize), alignedBuffer(bufferSize)}
+  , range_{range} {
+
+  KJ_IF_MAYBE(fd, fd_) {
+    // widen the kernel's read-ahead for the range
+    posix_fadvise(*fd, first, last - first, POSIX_FADV_SEQUENTIAL);
+  }
+}
 
-  auto stream = bucket_->s3_->factory_.kjToCapnp(kj::mv(pipe.out));
-  auto reply = ctx.getResults();
-  reply.setStream(kj::mv(stream));
+kj::Promise<kj::ArrayPtr<const kj::byte>> VersionReader::fetch(kj::Array<kj::byte>& buffer) {
+  auto size = kj::min(buffer.size(), last_ - offset_);
+  if (!size) {
+    return kj::ArrayPtr<const kj::byte>{};
+  }
+  auto offset = offset_;
+  offset_ += size;
+  auto ahead = kj::min(size, last_ - offset_);
+  return io_.run(
+    [&file = *file_, fd = fd_, offset, ahead, data = buffer.slice(0, size)]() -> kj::ArrayPtr<const kj::byte> {
+      KJ_IF_MAYBE(f, fd) {
+	// have the kernel start on the following chunk while this one
+	// is read and written out
+	if (ahead) {
+	  posix_fadvise(*f, offset + data.size(), ahead, POSIX_FADV_WILLNEED);
+	}
+      }
+      auto n = file.read(offset, data);
+      KJ_REQUIRE(n == data.size(), "File truncated while being read");
+      return data;
+    }
+  );
+}
+
+kj::Promise<void> VersionReader::run() {
+  return pump(fetch(buffers_[current_]));
+}
+
+kj::Promise<void> VersionReader::pump(kj::Promise<kj::ArrayPtr<const kj::byte>> chunk) {
+  return
+    chunk
+    .then(
+      [this](auto data) -> kj::Promise<void> {
+	if (!data.size()) {
+	  return kj::READY_NOW;
+	}
+
+	// read the next buffer while this one is written
+	current_ ^= 1;
+	auto next = fetch(buffers_[current_]);
+	return
+	  out_->write(data.begin(), data.size())
+	  .then(
+	    [this, next = kj::mv(next)]() mutable -> kj::Promise<void> {
+	      KJ_IF_MAYBE(range, range_) {
+		if (range->done()) {
+		  return kj::READY_NOW;
+		}
+	      }
+	      return pump(kj::mv(next));
+	    }
+	  );
+      }
+    );
+}
 
-  bucket_->s3_->tasks_.add(writeImpl(kj::mv(pipe.in), kj::mv(file)));
+kj::Promise<void> ObjectServerImpl::delete_(DeleteContext ctx) {
+  bucket_->remove(key_, ctx.getParams().getVersion());
   return kj::READY_NOW;
 }
 
@@ -372,14 +1373,15 @@ kj::Promise<void> S3ServerImpl::getBucket(GetBucketContext ctx) {
 
 aws::S3::Client newS3Server(
   kj::Own<const kj::Directory> dir,
-  kj::Maybe<capnp::ByteStreamFactory&> factory) {
+  kj::Maybe<capnp::ByteStreamFactory&> factory,
+  const S3ServerOptions& options) {
 
   KJ_IF_MAYBE(f, factory) {
-    return kj::refcounted<S3ServerImpl>(kj::mv(dir), *f);
+    return kj::refcounted<S3ServerImpl>(kj::mv(dir), *f, options);
   }
   else {
     auto factory = kj::heap<capnp::ByteStreamFactory>();
-    return kj::refcounted<S3ServerImpl>(kj::mv(dir), *factory).attach(kj::mv(factory));
+    return kj::refcounted<S3ServerImpl>(kj::mv(dir), *factory, options).attach(kj::mv(factory));
   }
 }
 
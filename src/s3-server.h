@@ -6,6 +6,8 @@
 
 #include "s3.capnp.h"
 
+#include "codec.h"
+
 #include <kj/compat/http.h>
 #include <kj/filesystem.h>
 
@@ -13,9 +15,44 @@
 
 namespace aws {
 
+// How much of a write must reach stable storage before it completes.
+enum class Durability {
+  // Leave it to the kernel.
+  NONE,
+  // Sync each version's data when it is closed.
+  ON_CLOSE,
+  // ON_CLOSE, and also the directory entry and index record that make
+  // the version visible, so that it survives a crash once written.
+  PER_VERSION
+};
+
+struct S3ServerOptions {
+  // Threads running file reads, writes and syncs, so that a slow disk
+  // does not stall the event loop.
+  uint32_t ioThreads = 4;
+
+  // Size of each buffer handed to an I/O thread. Each read or write has
+  // at most two, one being filled or drained while the other is on disk.
+  size_t ioBufferSize = 1024 * 1024;
+
+  Durability durability = Durability::ON_CLOSE;
+
+  // Stores each distinct content once, under its SHA-256, with versions
+  // as small records referring to it. ETags are then the content hash.
+  // A directory must always be served with the same setting.
+  bool dedup = false;
+
+  // Stores each version compressed, with its Content-Encoding among
+  // the object's headers, and decompresses it again for reads. Sizes
+  // are then those stored, and only whole objects can be copied. A
+  // directory must always be served with the same setting.
+  Compression compression = Compression::NONE;
+};
+
 aws::S3::Client newS3Server(
   kj::Own<const kj::Directory> dir,
-  kj::Maybe<capnp::ByteStreamFactory&> = nullptr
+  kj::Maybe<capnp::ByteStreamFactory&> = nullptr,
+  const S3ServerOptions& = {}
 );
 
 }
@@ -0,0 +1,628 @@
+// Copyright (c) 2023 Vaci Koblizek.
+// Licensed under the Apache 2.0 license found in the LICENSE file or at:
+//     https://opensource.org/licenses/Apache-2.0
+
+#include "s3.h"
+
+#include "metrics.h"
+
+#include <capnp/compat/byte-stream.h>
+#include <capnp/rpc-twoparty.h>
+
+#include <kj/async-io.h>
+#include <kj/debug.h>
+#include <kj/hash.h>
+
+
+namespace aws {
+
+namespace {
+
+// What a worker needs to set up its client, copied so that nothing is
+// shared with the calling thread.
+struct ShardConfig {
+  kj::Maybe<const TlsWrapper&> tls_;
+  kj::String region_;
+  S3Options options_;
+  kj::Array<kj::String> prewarmBuckets_;
+};
+
+// Runs a client on the worker's event loop until the calling thread
+// disconnects. The calling thread's end of the connection exports the
+// credentials provider, and this end the client.
+void runShard(
+    ShardConfig& config,
+    kj::AsyncIoProvider& provider,
+    kj::AsyncIoStream& stream,
+    kj::WaitScope& waitScope) {
+
+  auto& network = provider.getNetwork();
+  kj::Own<kj::Network> tlsNetwork;
+  kj::Maybe<kj::Network&> tls;
+  KJ_IF_MAYBE(wrap, config.tls_) {
+    tlsNetwork = (*wrap)(network);
+    tls = *tlsNetwork;
+  }
+
+  auto prewarm = KJ_MAP(bucket, config.prewarmBuckets_) -> kj::StringPtr {
+    return bucket;
+  };
+  auto options = config.options_;
+  options.poolStats = nullptr;
+  options.prewarmBuckets = prewarm;
+
+  // the client holds the table, so it must outlive the connection
+  // that holds the client
+  kj::HttpHeaderTable::Builder builder;
+  kj::Own<kj::HttpHeaderTable> table;
+
+  auto paf = kj::newPromiseAndFulfiller<S3::Client>();
+  capnp::TwoPartyClient rpc{
+    stream, S3::Client{kj::mv(paf.promise)}, capnp::rpc::twoparty::Side::SERVER
+  };
+  auto credsProvider = rpc.bootstrap().castAs<Credentials::Provider>();
+
+  auto s3 = newS3(
+    kj::systemPreciseCalendarClock(), provider.getTimer(), network, tls,
+    builder, kj::mv(credsProvider), config.region_, options
+  );
+  table = builder.build();
+  paf.fulfiller->fulfill(kj::mv(s3));
+
+  rpc.onDisconnect().wait(waitScope);
+}
+
+struct Shard {
+  // destroyed in reverse, so that the connection is closed before the
+  // thread is joined
+  kj::Own<kj::Thread> thread_;
+  kj::Own<kj::AsyncIoStream> pipe_;
+  kj::Own<capnp::TwoPartyClient> rpc_;
+  S3::Client s3_;
+};
+
+struct ShardedS3
+  : S3::Server
+  , kj::Refcounted
+  , kj::TaskSet::ErrorHandler {
+
+  ShardedS3(kj::Array<Shard> shards, const S3Options& options)
+    : shards_{kj::mv(shards)}
+    , readChunkSize_{options.readChunkSize}
+    // compressed objects can only be decoded from their start
+    , readParallelism_{options.compression == Compression::NONE ? options.readParallelism : 1} {
+  }
+
+  kj::Own<ShardedS3> addRef() {
+    return kj::addRef(*this);
+  }
+
+  void taskFailed(kj::Exception&& exc) override {
+    KJ_LOG(ERROR, exc);
+  }
+
+  kj::Promise<void> listBuckets(ListBucketsContext) override;
+  kj::Promise<void> getBucket(GetBucketContext) override;
+  kj::Promise<void> createBucket(CreateBucketContext) override;
+  kj::Promise<void> getMetrics(GetMetricsContext) override;
+
+  S3::Client& next() {
+    return shards_[next_++ % shards_.size()].s3_;
+  }
+
+  // The bucket `name` of each shard, or of those after the first.
+  kj::Vector<S3::Bucket::Client> buckets(kj::StringPtr name, size_t first = 0);
+
+  kj::Array<Shard> shards_;
+  size_t readChunkSize_;
+  uint32_t readParallelism_;
+  size_t next_{0};
+  capnp::ByteStreamFactory factory_;
+  kj::TaskSet tasks_{*this};
+};
+
+struct ShardedBucket
+  : S3::Bucket::Server
+  , kj::Refcounted {
+
+  ShardedBucket(kj::Own<ShardedS3> s3, kj::Vector<S3::Bucket::Client> buckets)
+    : s3_{kj::mv(s3)}
+    , buckets_{kj::mv(buckets)} {
+  }
+
+  kj::Own<ShardedBucket> addRef() {
+    return kj::addRef(*this);
+  }
+
+  kj::Promise<void> head(HeadContext) override;
+  kj::Promise<void> listObjects(ListObjectsContext) override;
+  kj::Promise<void> listObjectVersions(ListObjectVersionsContext) override;
+  kj::Promise<void> getObject(GetObjectContext) override;
+  kj::Promise<void> deleteObjects(DeleteObjectsContext) override;
+  kj::Promise<void> headObjects(HeadObjectsContext) override;
+
+  S3::Bucket::Client& next() {
+    return buckets_[next_++ % buckets_.size()];
+  }
+
+  kj::Own<ShardedS3> s3_;
+  kj::Vector<S3::Bucket::Client> buckets_;
+  size_t next_{0};
+};
+
+struct ShardedObject
+  : S3::Object::Server
+  , kj::Refcounted {
+
+  ShardedObject(kj::Own<ShardedBucket> bucket, kj::StringPtr key);
+
+  kj::Own<ShardedObject> addRef() {
+    return kj::addRef(*this);
+  }
+
+  kj::Promise<void> head(HeadContext) override;
+  kj::Promise<void> getBucket(GetBucketContext) override;
+  kj::Promise<void> read(ReadContext) override;
+  kj::Promise<void> write(WriteContext) override;
+  kj::Promise<void> multipart(MultipartContext) override;
+  kj::Promise<void> delete_(DeleteContext) override;
+  kj::Promise<void> upload(UploadContext) override;
+  kj::Promise<void> copyFrom(CopyFromContext) override;
+  kj::Promise<void> resumeMultipart(ResumeMultipartContext) override;
+
+  // The object on shard `ii`.
+  S3::Object::Client shard(size_t ii);
+
+  // Reads [first, last] of `version`, only if its ETag is `ifMatch`,
+  // when that is not null.
+  kj::Promise<void> read(
+    S3::Object::Client&, capnp::ByteStream::Client,
+    uint64_t first, uint64_t last, kj::StringPtr version,
+    kj::StringPtr ifMatch = nullptr);
+
+  kj::Own<ShardedBucket> bucket_;
+  kj::String key_;
+  size_t home_;
+  S3::Object::Client object_;
+};
+
+// Collects a range of known size written by a shard.
+struct ChunkSink
+  : capnp::ByteStream::Server {
+
+  ChunkSink(size_t size, kj::Own<kj::PromiseFulfiller<kj::Array<kj::byte>>> done)
+    : data_{kj::heapArray<kj::byte>(size)}
+    , done_{kj::mv(done)} {
+  }
+
+  ~ChunkSink() noexcept {
+    if (done_->isWaiting()) {
+      done_->reject(KJ_EXCEPTION(DISCONNECTED, "Ranged read ended early", filled_, data_.size()));
+    }
+  }
+
+  kj::Promise<void> write(WriteContext ctx) override {
+    auto bytes = ctx.getParams().getBytes();
+    KJ_REQUIRE(done_->isWaiting() && bytes.size() <= data_.size() - filled_,
+	       "Ranged read returned too much data", data_.size());
+    memcpy(data_.begin() + filled_, bytes.begin(), bytes.size());
+    filled_ += bytes.size();
+    if (filled_ == data_.size()) {
+      done_->fulfill(kj::mv(data_));
+    }
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> end(EndContext) override {
+    return kj::READY_NOW;
+  }
+
+  kj::Array<kj::byte> data_;
+  size_t filled_{0};
+  kj::Own<kj::PromiseFulfiller<kj::Array<kj::byte>>> done_;
+};
+
+// Fetches [first, last] of an object as chunks read by successive
+// shards, starting with the object's own, and writes them to the
+// output stream in order.
+struct ShardedRead {
+
+  // Each chunk is read only if the object's ETag is still `etag`, so
+  // that shards cannot return different versions.
+  ShardedRead(
+    kj::Own<ShardedObject> object,
+    kj::Own<kj::AsyncOutputStream> out,
+    kj::StringPtr version,
+    kj::StringPtr etag,
+    uint64_t first,
+    uint64_t last);
+
+  // Resolves once the first chunk has arrived.
+  kj::Promise<void> start();
+
+  // Streams the remaining chunks to the output.
+  kj::Promise<void> run();
+
+private:
+  kj::Promise<kj::Array<kj::byte>> fetch(uint64_t index);
+  kj::Promise<kj::Array<kj::byte>> take(uint64_t index);
+  kj::Promise<void> pump(uint64_t index);
+
+  kj::Own<ShardedObject> object_;
+  kj::Own<kj::AsyncOutputStream> out_;
+  kj::String version_;
+  kj::String etag_;
+  uint64_t first_;
+  uint64_t last_;
+  uint64_t chunkSize_;
+  uint64_t count_;
+  kj::Array<kj::Maybe<kj::Promise<kj::Array<kj::byte>>>> window_;
+  kj::Maybe<kj::Array<kj::byte>> head_;
+};
+
+kj::Vector<S3::Bucket::Client> ShardedS3::buckets(kj::StringPtr name, size_t first) {
+  kj::Vector<S3::Bucket::Client> buckets(shards_.size());
+  for (auto ii: kj::range(first, shards_.size())) {
+    auto req = shards_[ii].s3_.getBucketRequest();
+    req.setName(name);
+    buckets.add(req.send().getBucket());
+  }
+  return buckets;
+}
+
+kj::Promise<void> ShardedS3::listBuckets(ListBucketsContext ctx) {
+  return ctx.tailCall(next().listBucketsRequest());
+}
+
+kj::Promise<void> ShardedS3::getBucket(GetBucketContext ctx) {
+  auto name = ctx.getParams().getName();
+  auto reply = ctx.getResults();
+  reply.setBucket(kj::refcounted<ShardedBucket>(addRef(), buckets(name)));
+  return kj::READY_NOW;
+}
+
+kj::Promise<void> ShardedS3::createBucket(CreateBucketContext ctx) {
+  auto req = shards_[0].s3_.createBucketRequest();
+  req.setName(ctx.getParams().getName());
+  return
+    req.send()
+    .then(
+      [this, ctx = kj::mv(ctx)](auto created) mutable {
+	auto others = buckets(ctx.getParams().getName(), 1);
+	kj::Vector<S3::Bucket::Client> all(shards_.size());
+	all.add(created.getBucket());
+	for (auto& bucket: others) {
+	  all.add(kj::mv(bucket));
+	}
+	auto reply = ctx.getResults();
+	reply.setBucket(kj::refcounted<ShardedBucket>(addRef(), kj::mv(all)));
+      }
+    );
+}
+
+kj::Promise<void> ShardedS3::getMetrics(GetMetricsContext ctx) {
+  auto metrics = KJ_MAP(shard, shards_) {
+    return shard.s3_.getMetricsRequest().send().getMetrics();
+  };
+  ctx.getResults().setMetrics(newMetricsServer(kj::mv(metrics)));
+  return kj::READY_NOW;
+}
+
+kj::Promise<void> ShardedBucket::head(HeadContext ctx) {
+  return ctx.tailCall(next().headRequest());
+}
+
+kj::Promise<void> ShardedBucket::listObjects(ListObjectsContext ctx) {
+  auto params = ctx.getParams();
+  auto req = next().listObjectsRequest();
+  req.setPrefix(params.getPrefix());
+  req.setCallback(params.getCallback());
+  req.setBatchSize(params.getBatchSize());
+  req.setStartAfter(params.getStartAfter());
+  req.setDelimiter(params.getDelimiter());
+  return ctx.tailCall(kj::mv(req));
+}
+
+kj::Promise<void> ShardedBucket::listObjectVersions(ListObjectVersionsContext ctx) {
+  auto params = ctx.getParams();
+  auto req = next().listObjectVersionsRequest();
+  req.setPrefix(params.getPrefix());
+  req.setCallback(params.getCallback());
+  req.setBatchSize(params.getBatchSize());
+  return ctx.tailCall(kj::mv(req));
+}
+
+kj::Promise<void> ShardedBucket::getObject(GetObjectContext ctx) {
+  auto key = ctx.getParams().getKey();
+  auto reply = ctx.getResults();
+  reply.setObject(kj::refcounted<ShardedObject>(addRef(), key));
+  return kj::READY_NOW;
+}
+
+kj::Promise<void> ShardedBucket::deleteObjects(DeleteObjectsContext ctx) {
+  auto req = next().deleteObjectsRequest();
+  req.setKeys(ctx.getParams().getKeys());
+  return ctx.tailCall(kj::mv(req));
+}
+
+kj::Promise<void> ShardedBucket::headObjects(HeadObjectsContext ctx) {
+  auto req = next().headObjectsRequest();
+  req.setKeys(ctx.getParams().getKeys());
+  return ctx.tailCall(kj::mv(req));
+}
+
+ShardedObject::ShardedObject(kj::Own<ShardedBucket> bucket, kj::StringPtr key)
+  : bucket_{kj::mv(bucket)}
+  , key_{kj::str(key)}
+  , home_{kj::hashCode(key_) % bucket_->buckets_.size()}
+  , object_{shard(home_)} {
+}
+
+S3::Object::Client ShardedObject::shard(size_t ii) {
+  auto req = bucket_->buckets_[ii].getObjectRequest();
+  req.setKey(key_);
+  return req.send().getObject();
+}
+
+kj::Promise<void> ShardedObject::head(HeadContext ctx) {
+  auto params = ctx.getParams();
+  auto req = object_.headRequest();
+  req.setVersion(params.getVersion());
+  req.setConditions(params.getConditions());
+  return ctx.tailCall(kj::mv(req));
+}
+
+kj::Promise<void> ShardedObject::getBucket(GetBucketContext ctx) {
+  ctx.getResults().setBucket(bucket_->addRef());
+  return kj::READY_NOW;
+}
+
+kj::Promise<void> ShardedObject::read(ReadContext ctx) {
+  auto params = ctx.getParams();
+  auto first = params.getFirst();
+  auto last = params.getLast();
+  auto& s3 = *bucket_->s3_;
+
+  auto conditions = params.getConditions();
+  if (conditions.getIfNoneMatch().size() ||
+      conditions.getIfMatch().size() ||
+      conditions.getIfModifiedSince().size()) {
+    // left to the object's own shard, whose metadata cache may answer
+    auto req = object_.readRequest();
+    req.setStream(params.getStream());
+    req.setFirst(first);
+    req.setLast(last);
+    req.setVersion(params.getVersion());
+    req.setConditions(conditions);
+    return ctx.tailCall(kj::mv(req));
+  }
+
+  if (s3.shards_.size() < 2 || s3.readParallelism_ < 2 || last - first < s3.readChunkSize_) {
+    return read(object_, params.getStream(), first, last, params.getVersion());
+  }
+
+  // the object's size is needed to know how many chunks to fetch
+  auto req = object_.headRequest();
+  req.setVersion(params.getVersion());
+  return
+    req.send()
+    .then(
+      [this, &s3, ctx = kj::mv(ctx)](auto props) mutable -> kj::Promise<void> {
+	auto params = ctx.getParams();
+	auto first = params.getFirst();
+	auto last = params.getLast();
+	auto size = props.getSize();
+
+	if (first >= size || kj::min(last, size - 1) - first < s3.readChunkSize_) {
+	  return read(object_, params.getStream(), first, last, params.getVersion());
+	}
+
+	auto reader = kj::heap<ShardedRead>(
+	  addRef(), s3.factory_.capnpToKj(params.getStream()),
+	  params.getVersion(), props.getEtag(), first, kj::min(last, size - 1)
+	);
+	auto promise = reader->start();
+	return
+	  promise
+	  .then(
+	    [&s3, reader = kj::mv(reader)]() mutable {
+	      auto& r = *reader;
+	      s3.tasks_.add(r.run().attach(kj::mv(reader)));
+	    }
+	  );
+      }
+    );
+}
+
+kj::Promise<void> ShardedObject::read(
+    S3::Object::Client& object, capnp::ByteStream::Client stream,
+    uint64_t first, uint64_t last, kj::StringPtr version, kj::StringPtr ifMatch) {
+  auto req = object.readRequest();
+  req.setStream(kj::mv(stream));
+  req.setFirst(first);
+  req.setLast(last);
+  req.setVersion(version);
+  if (ifMatch.size()) {
+    req.initConditions().setIfMatch(ifMatch);
+  }
+  return req.send().ignoreResult();
+}
+
+kj::Promise<void> ShardedObject::write(WriteContext ctx) {
+  auto req = object_.writeRequest();
+  req.setLength(ctx.getParams().getLength());
+  return ctx.tailCall(kj::mv(req));
+}
+
+kj::Promise<void> ShardedObject::multipart(MultipartContext ctx) {
+  return ctx.tailCall(object_.multipartRequest());
+}
+
+kj::Promise<void> ShardedObject::resumeMultipart(ResumeMultipartContext ctx) {
+  auto req = object_.resumeMultipartRequest();
+  req.setUploadId(ctx.getParams().getUploadId());
+  return ctx.tailCall(kj::mv(req));
+}
+
+kj::Promise<void> ShardedObject::delete_(DeleteContext ctx) {
+  auto req = object_.deleteRequest();
+  req.setVersion(ctx.getParams().getVersion());
+  return ctx.tailCall(kj::mv(req));
+}
+
+kj::Promise<void> ShardedObject::upload(UploadContext ctx) {
+  return ctx.tailCall(object_.uploadRequest());
+}
+
+kj::Promise<void> ShardedObject::copyFrom(CopyFromContext ctx) {
+  auto params = ctx.getParams();
+  auto req = object_.copyFromRequest();
+  req.setBucket(params.getBucket());
+  req.setKey(params.getKey());
+  req.setVersion(params.getVersion());
+  req.setFirst(params.getFirst());
+  req.setLast(params.getLast());
+  return ctx.tailCall(kj::mv(req));
+}
+
+ShardedRead::ShardedRead(
+    kj::Own<ShardedObject> object,
+    kj::Own<kj::AsyncOutputStream> out,
+    kj::StringPtr version,
+    kj::StringPtr etag,
+    uint64_t first,
+    uint64_t last)
+  : object_{kj::mv(object)}
+  , out_{kj::mv(out)}
+  , version_{kj::str(version)}
+  , etag_{kj::str(etag)}
+  , first_{first}
+  , last_{last} {
+
+  auto& s3 = *object_->bucket_->s3_;
+  chunkSize_ = s3.readChunkSize_;
+  count_ = (last_ - first_) / chunkSize_ + 1;
+  window_ = kj::heapArray<kj::Maybe<kj::Promise<kj::Array<kj::byte>>>>(s3.readParallelism_);
+}
+
+kj::Promise<void> ShardedRead::start() {
+  for (auto index = 0u; index < window_.size() && index < count_; ++index) {
+    window_[index] = fetch(index);
+  }
+
+  return
+    take(0)
+    .then(
+      [this](auto data) {
+	head_ = kj::mv(data);
+      }
+    );
+}
+
+kj::Promise<void> ShardedRead::run() {
+  auto& data = KJ_ASSERT_NONNULL(head_);
+  return
+    out_->write(data.begin(), data.size())
+    .then(
+      [this]{
+	head_ = nullptr;
+	return pump(1);
+      }
+    );
+}
+
+kj::Promise<kj::Array<kj::byte>> ShardedRead::take(uint64_t index) {
+  auto& slot = window_[index % window_.size()];
+  auto promise = kj::mv(KJ_ASSERT_NONNULL(slot));
+  slot = nullptr;
+
+  // keep the window full
+  auto next = index + window_.size();
+  if (next < count_) {
+    slot = fetch(next);
+  }
+  return promise;
+}
+
+kj::Promise<void> ShardedRead::pump(uint64_t index) {
+  if (index >= count_) {
+    return kj::READY_NOW;
+  }
+
+  return
+    take(index)
+    .then(
+      [this](auto data) {
+	return out_->write(data.begin(), data.size()).attach(kj::mv(data));
+      }
+    )
+    .then(
+      [this, index]{
+	return pump(index + 1);
+      }
+    );
+}
+
+kj::Promise<kj::Array<kj::byte>> ShardedRead::fetch(uint64_t index) {
+  auto first = first_ + index * chunkSize_;
+  auto last = kj::min(first + chunkSize_ - 1, last_);
+  auto shards = object_->bucket_->buckets_.size();
+  auto shard = (object_->home_ + index) % shards;
+
+  auto object = shard == object_->home_
+    ? object_->object_
+    : object_->shard(shard);
+
+  auto paf = kj::newPromiseAndFulfiller<kj::Array<kj::byte>>();
+  auto sink = kj::heap<ChunkSink>(last - first + 1, kj::mv(paf.fulfiller));
+  return
+    object_->read(object, kj::mv(sink), first, last, version_, etag_)
+    .then(
+      [promise = kj::mv(paf.promise)]() mutable {
+	return kj::mv(promise);
+      }
+    );
+}
+
+}
+
+aws::S3::Client newShardedS3(
+  kj::AsyncIoProvider& provider,
+  kj::Maybe<const TlsWrapper&> tls,
+  Credentials::Provider::Client credsProvider,
+  kj::StringPtr region,
+  uint32_t threads,
+  const S3Options& options) {
+
+  KJ_REQUIRE(threads > 0);
+  auto shards = kj::heapArrayBuilder<Shard>(threads);
+  for (auto ii = 0u; ii < threads; ++ii) {
+    ShardConfig config{
+      tls,
+      kj::str(region),
+      options,
+      KJ_MAP(bucket, options.prewarmBuckets) {
+	return kj::str(bucket);
+      }
+    };
+    config.options_.prewarmBuckets = nullptr;
+    config.options_.poolStats = nullptr;
+
+    auto thread = provider.newPipeThread(
+      [config = kj::mv(config)](
+	  kj::AsyncIoProvider& provider,
+	  kj::AsyncIoStream& stream,
+	  kj::WaitScope& waitScope) mutable {
+	runShard(config, provider, stream, waitScope);
+      }
+    );
+
+    auto rpc = kj::heap<capnp::TwoPartyClient>(*thread.pipe, credsProvider);
+    auto s3 = rpc->bootstrap().castAs<S3>();
+    shards.add(Shard{kj::mv(thread.thread), kj::mv(thread.pipe), kj::mv(rpc), kj::mv(s3)});
+  }
+
+  return kj::refcounted<ShardedS3>(shards.finish(), options);
+}
+
+}
@@ -5,10 +5,95 @@
 
 #include "s3.capnp.h"
 
+#include "codec.h"
+#include "http.h"
+#include "http-pool.h"
+#include "retry.h"
+
 #include <kj/compat/http.h>
+#include <kj/filesystem.h>
+#include <kj/function.h>
 
 namespace aws {
 
+struct S3Options {
+  // Size of each part of a multipart upload. S3 requires every part
+  // except the last to be at least 5 MiB.
+  size_t partSize = 8 * 1024 * 1024;
+
+  // Maximum number of parts of a single multipart upload being sent
+  // at once. Each upload holds at most one more part-sized buffer than
+  // this, and writes are held back until one of them is free.
+  uint32_t uploadConcurrency = 4;
+
+  // If set, uploads started with multipart() append each part to a
+  // checkpoint file here, named for the bucket, key and upload, as S3
+  // acknowledges it, so that resumeMultipart() can find the upload
+  // after a restart. Checkpoints are written and synced on a thread of
+  // their own. The file is removed once the upload completes or is
+  // aborted.
+  kj::Maybe<const kj::Directory&> checkpoints;
+
+  // Objects written through write(), upload() and multipart() are
+  // compressed as they are sent, and stored with the codec's
+  // Content-Encoding. Reads decode objects stored with a known one as
+  // they arrive, and object sizes are those stored, so this does not
+  // suit layers such as newS3Cache() that copy objects by size. A range
+  // of decoded bytes needs the object from its start, so reads fetch
+  // the whole object and clip it once decoded, rather than in chunks,
+  // and compressed uploads are not checkpointed.
+  Compression compression = Compression::NONE;
+
+  // Uploads of unknown length are buffered up to this size and sent
+  // with a single PUT if they end there, and as a multipart upload
+  // otherwise.
+  size_t singlePutThreshold = 8 * 1024 * 1024;
+
+  // Reads of more than one chunk are split into ranged GETs of this
+  // size when readParallelism is greater than one.
+  size_t readChunkSize = 8 * 1024 * 1024;
+
+  // Maximum number of chunks of a single read being fetched at once.
+  // Chunks are written to the caller in order, so at most this many
+  // are held in memory while earlier ones are still outstanding.
+  uint32_t readParallelism = 1;
+
+  // Request signing, including whether object and part uploads are
+  // sent with signed, aws-chunked payloads.
+  AwsServiceOptions signing;
+
+  // Keep-alive connection pool settings, applied per bucket host.
+  HttpPoolOptions pool;
+
+  // Multi-object delete requests of a single deleteObjects call, each
+  // of up to 1000 keys, and HEADs of a single headObjects call in
+  // flight at once.
+  uint32_t deleteConcurrency = 4;
+  uint32_t headConcurrency = 16;
+
+  // How long the ETag, size and last modified time of an object, as
+  // last seen by a HEAD or GET through this client, answer head() and
+  // ETag conditions of reads without a request. Writes and deletes
+  // through this client drop them at once; those of others can go
+  // unnoticed for this long. Zero disables the cache.
+  kj::Duration metadataTtl = 0 * kj::SECONDS;
+  // Entries of the metadata cache, beyond which expired ones are
+  // dropped, and new ones are not added while it is still full.
+  size_t metadataCacheSize = 64 * 1024;
+
+  // Retries of failed requests and parts, and hedging of small reads.
+  RetryOptions retry;
+
+  // If set, receives counts of connections opened and reused.
+  kj::Maybe<HttpPoolStats&> poolStats;
+
+  // Buckets whose hosts should have prewarmConnections connections
+  // established as soon as the event loop runs, so that the first
+  // requests to them do not pay for a TLS handshake.
+  kj::ArrayPtr<const kj::StringPtr> prewarmBuckets;
+  uint32_t prewarmConnections = 1;
+};
+
 aws::S3::Client newS3(
   const kj::Clock& clock,
   kj::Timer& timer,
@@ -16,7 +101,32 @@ aws::S3::Client newS3(
   kj::Maybe<kj::Network&> tlsNetwork,
   kj::HttpHeaderTable::Builder&,
   Credentials::Provider::Client credsProvider,
-  kj::StringPtr region
+  kj::StringPtr region,
+  const S3Options& = {}
+);
+
+// Wraps a worker thread's network so that it connects with TLS, e.g.
+// with kj::TlsContext::wrapNetwork(). Each worker calls it once, from
+// its own thread and possibly concurrently with the others.
+using TlsWrapper = kj::ConstFunction<kj::Own<kj::Network>(kj::Network&)>;
+
+// An S3 client spread over `threads` worker threads, each running its
+// own event loop with its own client and connection pool, so that
+// signing, TLS and copying are not bound to a single core.
+//
+// Requests for an object all go to the worker its key hashes to, and
+// reads of more than one readChunkSize are split into ranges fetched
+// by several workers when readParallelism is greater than one. The
+// workers share credsProvider, which stays on the calling thread.
+//
+// `tls` must outlive the client, and options.poolStats is ignored.
+aws::S3::Client newShardedS3(
+  kj::AsyncIoProvider&,
+  kj::Maybe<const TlsWrapper&> tls,
+  Credentials::Provider::Client credsProvider,
+  kj::StringPtr region,
+  uint32_t threads,
+  const S3Options& = {}
 );
 
 }
@@ -48,6 +48,7 @@ struct Sha256Impl
   
   void update(kj::ArrayPtr<const uint8_t>) override;
   kj::Array<uint8_t> digest() override;
+  kj::FixedArray<uint8_t, 32> finish() override;
 
   EVP_MD_CTX* ctx_{EVP_MD_CTX_new()};
 };
@@ -72,6 +73,15 @@ kj::Array<uint8_t> Sha256Impl::digest() {
   return kj::heapArray(digest.begin(), size);
 }
 
+kj::FixedArray<uint8_t, 32> Sha256Impl::finish() {
+  kj::FixedArray<uint8_t, 32> digest;
+  unsigned int size = digest.size();
+  KJ_REQUIRE(EVP_DigestFinal_ex(ctx_, digest.begin(), &size) != 0);
+  KJ_DREQUIRE(size == 32);
+  KJ_REQUIRE(EVP_DigestInit_ex2(ctx_, nullptr, nullptr) != 0);
+  return digest;
+}
+
 }
 
 kj::Own<Sha256> newSha256() {
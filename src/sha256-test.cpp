@@ -24,6 +24,61 @@ TEST(Sha256, EmptyString) {
   EXPECT_STREQ(x.cStr(), hash::EMPTY_STRING_SHA256.cStr());
 }
 
+TEST(Sha256, PortableMatchesOpenSsl) {
+  KJ_LOG(INFO, sha256Kernel());
+
+  auto data = kj::heapArray<uint8_t>(10000);
+  for (auto ii: kj::indices(data)) {
+    data[ii] = ii * 7 + 3;
+  }
+
+  for (auto accelerated: {false, true}) {
+    for (size_t size: {0, 1, 55, 56, 63, 64, 65, 127, 128, 1000, 10000}) {
+      auto input = data.slice(0, size);
+      auto expected = kj::encodeHex(sha256(input));
+
+      // in one go, and fed a few bytes at a time across block boundaries
+      for (size_t chunk: {size_t(10000), size_t(7)}) {
+	auto hash = newPortableSha256(accelerated);
+	for (size_t offset = 0; offset < size; offset += chunk) {
+	  hash->update(input.slice(offset, kj::min(offset + chunk, size)));
+	}
+	EXPECT_EQ(kj::encodeHex(hash->digest()), expected) << size << " " << chunk;
+      }
+    }
+  }
+
+  auto hash = newPortableSha256();
+  hash->update("abc"_kj);
+  EXPECT_EQ(
+    kj::encodeHex(hash->digest()),
+    "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"_kj);
+}
+
+TEST(Sha256, Many) {
+  KJ_LOG(INFO, sha256ManyKernel());
+
+  auto data = kj::heapArray<uint8_t>(5000);
+  for (auto ii: kj::indices(data)) {
+    data[ii] = ii * 13 + 1;
+  }
+
+  // more inputs than lanes, of uneven lengths
+  auto inputs = kj::heapArrayBuilder<kj::ArrayPtr<const uint8_t>>(37);
+  for (auto ii = 0u; ii < 37; ++ii) {
+    inputs.add(data.slice(ii, ii + (ii * 977) % 4000));
+  }
+  auto ptrs = inputs.finish();
+
+  for (auto accelerated: {false, true}) {
+    auto digests = sha256Many(ptrs, accelerated);
+    ASSERT_EQ(digests.size(), ptrs.size());
+    for (auto ii: kj::indices(ptrs)) {
+      EXPECT_EQ(kj::encodeHex(digests[ii].asPtr()), kj::encodeHex(sha256(ptrs[ii]))) << ii;
+    }
+  }
+}
+
 int main(int argc, char* argv[]) {
   kj::TopLevelProcessContext processCtx{argv[0]};
   processCtx.increaseLoggingVerbosity();
@@ -1,14 +1,34 @@
+// Copyright (c) 2023 Vaci Koblizek.
+// Licensed under the Apache 2.0 license found in the LICENSE file or at:
+//     https://opensource.org/licenses/Apache-2.0
+
 #include "sha256.h"
 
 #include <kj/array.h>
 #include <kj/common.h>
 #include <kj/debug.h>
 
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define SHA256_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#define SHA256_ARM 1
+#endif
+
+// vector types only cross function boundaries within always_inline code
+#pragma GCC diagnostic ignored "-Wpsabi"
+
 namespace hash {
 
 namespace {
 
-static constexpr uint32_t K[] = {
+alignas(16) static constexpr uint32_t K[] = {
   0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
   0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
   0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
@@ -27,171 +47,485 @@ static constexpr uint32_t K[] = {
   0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
 };
 
-static constexpr uint32_t rotr(uint32_t x, uint32_t n) {
+static constexpr uint32_t IV[] = {
+  0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+  0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+// The round functions are written so that they work unchanged on
+// GCC vector types, one message per lane.
+template <typename T>
+inline __attribute__((always_inline)) T rotr(T x, uint32_t n) {
   return (x >> n) | (x << (32 - n));
 }
 
-static constexpr uint32_t choose(uint32_t e, uint32_t f, uint32_t g) {
-   return (e & f) ^ (~e & g);
- }
+template <typename T>
+inline __attribute__((always_inline)) T choose(T e, T f, T g) {
+  return (e & f) ^ (~e & g);
+}
+
+template <typename T>
+inline __attribute__((always_inline)) T majority(T a, T b, T c) {
+  return (a & (b | c)) | (b & c);
+}
 
-static constexpr uint32_t majority(uint32_t a, uint32_t b, uint32_t c) {
-   return (a & (b | c)) | (b & c);
- }
-  
-static constexpr uint32_t sig0(uint32_t x) {
+template <typename T>
+inline __attribute__((always_inline)) T sig0(T x) {
   return rotr(x, 7) ^ rotr(x, 18) ^ (x >> 3);
 }
 
-static constexpr uint32_t sig1(uint32_t x) {
+template <typename T>
+inline __attribute__((always_inline)) T sig1(T x) {
   return rotr(x, 17) ^ rotr(x, 19) ^ (x >> 10);
 }
 
-struct Sha256x
-  : Sha256 {
+template <typename T>
+inline __attribute__((always_inline)) T sum0(T a) {
+  return rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+}
 
-  Sha256x() {}
-  void update(const char*);
-  void update(kj::StringPtr);
-  void update(kj::ArrayPtr<const uint8_t>);
-  kj::Array<uint8_t> digest();
- 
-private:
-  void transform();
-  void pad();
-  void revert(uint8_t * hash);
-
-  kj::FixedArray<uint8_t, 64> m_data{};
-  kj::FixedArray<uint32_t, 8> m_state{}; // A, B, C, D, E, F, G, H
-  uint64_t m_bitlen{0};
-  uint32_t m_blocklen{0};
-};
+template <typename T>
+inline __attribute__((always_inline)) T sum1(T e) {
+  return rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+}
 
-void Sha256x::update(kj::ArrayPtr<const uint8_t> data) {
-  for (size_t ii = 0 ; ii < data.size() ; ++ii) {
-    m_data[m_blocklen++] = data[ii];
-    if (m_blocklen == 64) {
-      transform();
-      m_bitlen += 512;
-      m_blocklen = 0;
+inline __attribute__((always_inline)) uint32_t loadBigEndian(const uint8_t* data) {
+  uint32_t word;
+  memcpy(&word, data, sizeof(word));
+  return __builtin_bswap32(word);
+}
+
+// Runs the 64 rounds over one block given its first 16 message words
+// in W, with T being either uint32_t or a vector of one lane per
+// message.
+template <typename T>
+inline __attribute__((always_inline)) void rounds(T* state, T* W) {
+  for (auto ii = 16u; ii < 64; ++ii) {
+    W[ii] = sig1(W[ii - 2]) + W[ii - 7] + sig0(W[ii - 15]) + W[ii - 16];
+  }
+
+  auto A = state[0];
+  auto B = state[1];
+  auto C = state[2];
+  auto D = state[3];
+  auto E = state[4];
+  auto F = state[5];
+  auto G = state[6];
+  auto H = state[7];
+
+  for (auto ii = 0u; ii < 64; ++ii) {
+    T t1 = W[ii] + K[ii] + H + choose(E, F, G) + sum1(E);
+    T t2 = sum0(A) + majority(A, B, C);
+    H = G;
+    G = F;
+    F = E;
+    E = D + t1;
+    D = C;
+    C = B;
+    B = A;
+    A = t1 + t2;
+  }
+
+  state[0] += A;
+  state[1] += B;
+  state[2] += C;
+  state[3] += D;
+  state[4] += E;
+  state[5] += F;
+  state[6] += G;
+  state[7] += H;
+}
+
+// Compresses `blocks` consecutive 64-byte blocks into `state`.
+using Compress = void (*)(uint32_t* state, const uint8_t* data, size_t blocks);
+
+void compressPortable(uint32_t* state, const uint8_t* data, size_t blocks) {
+  uint32_t W[64];
+  for (; blocks; --blocks, data += 64) {
+    for (auto ii = 0u; ii < 16; ++ii) {
+      W[ii] = loadBigEndian(data + ii * 4);
     }
+    rounds(state, W);
   }
 }
 
-void Sha256x::transform() {
-  kj::FixedArray<uint32_t, 64> W;
-  
-  for (size_t ii = 0, jj = 0; ii < 16; ii++, jj += 4) {
-    W[ii] =
-      (m_data[jj + 0] << 24) |
-      (m_data[jj + 1] << 16) |
-      (m_data[jj + 2] <<  8) |
-      (m_data[jj + 3]);
+#if SHA256_X86
+
+__attribute__((target("sha,sse4.1")))
+void compressShaNi(uint32_t* state, const uint8_t* data, size_t blocks) {
+  const auto MASK = _mm_set_epi64x(0x0c0d0e0f08090a0bull, 0x0405060700010203ull);
+
+  // the SHA instructions want the state as ABEF and CDGH
+  auto tmp = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(&state[0])), 0xB1);
+  auto state1 = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(&state[4])), 0x1B);
+  auto state0 = _mm_alignr_epi8(tmp, state1, 8);
+  state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+  for (; blocks; --blocks, data += 64) {
+    auto abef = state0;
+    auto cdgh = state1;
+
+    // message schedule, four words at a time
+    __m128i X[4];
+    for (auto ii = 0u; ii < 16; ++ii) {
+      auto& x = X[ii % 4];
+      if (ii < 4) {
+	x = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + ii * 16)), MASK);
+      }
+      else {
+	auto t = _mm_sha256msg1_epu32(x, X[(ii + 1) % 4]);
+	t = _mm_add_epi32(t, _mm_alignr_epi8(X[(ii + 3) % 4], X[(ii + 2) % 4], 4));
+	x = _mm_sha256msg2_epu32(t, X[(ii + 3) % 4]);
+      }
+
+      auto msg = _mm_add_epi32(x, _mm_load_si128(reinterpret_cast<const __m128i*>(&K[ii * 4])));
+      state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+      state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0E));
+    }
+
+    state0 = _mm_add_epi32(state0, abef);
+    state1 = _mm_add_epi32(state1, cdgh);
   }
 
-  for (size_t ii = 16 ; ii < 64; ii++) {
-    W[ii] =
-      sig1(W[ii -  2]) + W[ii -  7] +
-      sig0(W[ii - 15]) + W[ii - 16];
+  tmp = _mm_shuffle_epi32(state0, 0x1B);
+  state1 = _mm_shuffle_epi32(state1, 0xB1);
+  state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+  state1 = _mm_alignr_epi8(state1, tmp, 8);
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(&state[0]), state0);
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(&state[4]), state1);
+}
+
+bool hasShaNi() {
+  uint32_t a, b, c, d;
+  if (!__get_cpuid(1, &a, &b, &c, &d) || !(c & bit_SSE4_1) || !(c & bit_SSSE3)) {
+    return false;
   }
+  return __get_cpuid_count(7, 0, &a, &b, &c, &d) && (b & bit_SHA);
+}
 
-  auto A = m_state[0];
-  auto B = m_state[1];
-  auto C = m_state[2];
-  auto D = m_state[3];
-  auto E = m_state[4];
-  auto F = m_state[5];
-  auto G = m_state[6];
-  auto H = m_state[7];
-  
-  for (size_t ii = 0; ii < 64; ii++) {
-    uint32_t maj = majority(A, B, C);
+#elif SHA256_ARM
+
+__attribute__((target("+crypto")))
+void compressArm(uint32_t* state, const uint8_t* data, size_t blocks) {
+  auto state0 = vld1q_u32(&state[0]);
+  auto state1 = vld1q_u32(&state[4]);
+
+  for (; blocks; --blocks, data += 64) {
+    auto abcd = state0;
+    auto efgh = state1;
+
+    uint32x4_t X[4];
+    for (auto ii = 0u; ii < 16; ++ii) {
+      auto& x = X[ii % 4];
+      if (ii < 4) {
+	x = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + ii * 16)));
+      }
+      else {
+	x = vsha256su1q_u32(vsha256su0q_u32(x, X[(ii + 1) % 4]), X[(ii + 2) % 4], X[(ii + 3) % 4]);
+      }
+
+      auto msg = vaddq_u32(x, vld1q_u32(&K[ii * 4]));
+      auto prev = state0;
+      state0 = vsha256hq_u32(state0, state1, msg);
+      state1 = vsha256h2q_u32(state1, prev, msg);
+    }
 
-    uint32_t S0 = rotr(A, 2) ^ rotr(A, 13) ^ rotr(A, 22);
-    uint32_t S1 = rotr(E, 6) ^ rotr(E, 11) ^ rotr(E, 25);
+    state0 = vaddq_u32(state0, abcd);
+    state1 = vaddq_u32(state1, efgh);
+  }
 
-    uint32_t ch = choose(E, F, G);
- 
+  vst1q_u32(&state[0], state0);
+  vst1q_u32(&state[4], state1);
+}
 
-    uint32_t sum = W[ii] + K[ii] + H + ch + S1;
+#endif
 
-    H = G;
-    G = F;
-    F = E;
-    E = D + sum;
-    D = C;
-    C = B;
-    B = A;
-    A = S0 + maj + sum;
+struct Kernel {
+  Compress compress_;
+  kj::StringPtr name_;
+};
+
+Kernel selectKernel() {
+#if SHA256_X86
+  if (hasShaNi()) {
+    return {compressShaNi, "sha-ni"_kj};
+  }
+#elif SHA256_ARM
+  if (getauxval(AT_HWCAP) & HWCAP_SHA2) {
+    return {compressArm, "armv8"_kj};
   }
+#endif
+  return {compressPortable, "portable"_kj};
+}
 
-  m_state[0] += A;
-  m_state[1] += B;
-  m_state[2] += C;
-  m_state[3] += D;
-  m_state[4] += E;
-  m_state[5] += F;
-  m_state[6] += G;
-  m_state[7] += H;
+// Selected on first use, rather than by a namespace-scope initialiser,
+// so that hashes computed during other static initialisation do not
+// run before it.
+const Kernel& kernel() {
+  static const Kernel KERNEL = selectKernel();
+  return KERNEL;
 }
 
-  void Sha256x::pad() {
+typedef uint8_t U8x16 __attribute__((vector_size(16)));
+typedef uint32_t U32x4 __attribute__((vector_size(16)));
 
-    auto ii = m_blocklen;
-    auto end = m_blocklen < 56 ? 56 : 64;
+inline __attribute__((always_inline)) U32x4 loadBigEndian4(const uint8_t* data) {
+  U8x16 bytes;
+  memcpy(&bytes, data, sizeof(bytes));
+  return (U32x4)__builtin_shuffle(bytes, U8x16{3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12});
+}
 
-    // add 1 bit
-    m_data[ii++] = 0x80;
+// Loads the 16 words at `offset` of each of LANES messages into W, one
+// message per lane. Each message's words are loaded four at a time, and
+// each four messages' transposed into lanes with shuffles, rather than
+// loading each word of each lane on its own.
+template <typename V, size_t LANES>
+inline __attribute__((always_inline)) void loadLanes(
+    V* W, const uint8_t* const* data, size_t offset) {
+
+  static_assert(LANES % 4 == 0, "lanes are transposed in fours");
+  for (auto group = 0u; group < LANES / 4; ++group) {
+    for (auto quad = 0u; quad < 4; ++quad) {
+      U32x4 r[4];
+      for (auto jj = 0u; jj < 4; ++jj) {
+	r[jj] = loadBigEndian4(data[group * 4 + jj] + offset + quad * 16);
+      }
+      auto t0 = __builtin_shuffle(r[0], r[1], U32x4{0, 4, 1, 5});
+      auto t1 = __builtin_shuffle(r[0], r[1], U32x4{2, 6, 3, 7});
+      auto t2 = __builtin_shuffle(r[2], r[3], U32x4{0, 4, 1, 5});
+      auto t3 = __builtin_shuffle(r[2], r[3], U32x4{2, 6, 3, 7});
+      U32x4 words[4] = {
+	__builtin_shuffle(t0, t2, U32x4{0, 1, 4, 5}),
+	__builtin_shuffle(t0, t2, U32x4{2, 3, 6, 7}),
+	__builtin_shuffle(t1, t3, U32x4{0, 1, 4, 5}),
+	__builtin_shuffle(t1, t3, U32x4{2, 3, 6, 7})
+      };
+      for (auto kk = 0u; kk < 4; ++kk) {
+	memcpy(reinterpret_cast<uint8_t*>(&W[quad * 4 + kk]) + group * sizeof(U32x4),
+	       &words[kk], sizeof(U32x4));
+      }
+    }
+  }
+}
 
-    // pad with zeroes
-    while (ii < end) {
-      m_data[ii++] = 0x00;
+// Compresses `blocks` blocks from each of LANES messages at once, with
+// the state of each message in one lane of the vectors in `state`.
+template <typename V, size_t LANES>
+inline __attribute__((always_inline)) void compressLanes(
+    uint32_t (*state)[8], const uint8_t* const* data, size_t blocks) {
+
+  V S[8];
+  for (auto ii = 0u; ii < 8; ++ii) {
+    for (auto lane = 0u; lane < LANES; ++lane) {
+      S[ii][lane] = state[lane][ii];
     }
+  }
 
-    if (m_blocklen >= 56) {
-      transform();
-      memset(m_data.begin(), 0, 56);
+  V W[64];
+  for (auto block = 0u; block < blocks; ++block) {
+    loadLanes<V, LANES>(W, data, block * 64);
+    rounds(S, W);
+  }
+
+  for (auto ii = 0u; ii < 8; ++ii) {
+    for (auto lane = 0u; lane < LANES; ++lane) {
+      state[lane][ii] = S[ii][lane];
     }
+  }
+}
+
+using CompressMany = void (*)(uint32_t (*state)[8], const uint8_t* const* data, size_t blocks);
+
+void compress4(uint32_t (*state)[8], const uint8_t* const* data, size_t blocks) {
+  // SSE2 and NEON are part of the base instruction sets
+  compressLanes<U32x4, 4>(state, data, blocks);
+}
+
+#if SHA256_X86
 
-    m_bitlen += m_blocklen * 8;
+typedef uint32_t U32x8 __attribute__((vector_size(32)));
+typedef uint32_t U32x16 __attribute__((vector_size(64)));
+
+__attribute__((target("avx2")))
+void compress8(uint32_t (*state)[8], const uint8_t* const* data, size_t blocks) {
+  compressLanes<U32x8, 8>(state, data, blocks);
+}
+
+__attribute__((target("avx512f")))
+void compress16(uint32_t (*state)[8], const uint8_t* const* data, size_t blocks) {
+  compressLanes<U32x16, 16>(state, data, blocks);
+}
+
+#endif
+
+struct ManyKernel {
+  CompressMany compress_;
+  size_t lanes_;
+  kj::StringPtr name_;
+};
 
-    m_data[63] = m_bitlen;
-    m_data[62] = m_bitlen >> 8;
-    m_data[61] = m_bitlen >> 16;
-    m_data[60] = m_bitlen >> 24;
-    m_data[59] = m_bitlen >> 32;
-    m_data[58] = m_bitlen >> 40;
-    m_data[57] = m_bitlen >> 48;
-    m_data[56] = m_bitlen >> 56;
+ManyKernel selectManyKernel() {
+#if SHA256_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    return {compress16, 16, "avx512x16"_kj};
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    return {compress8, 8, "avx2x8"_kj};
+  }
+#endif
+  return {compress4, 4, "simd128x4"_kj};
+}
 
-    transform();
+const ManyKernel& manyKernel() {
+  static const ManyKernel MANY_KERNEL = selectManyKernel();
+  return MANY_KERNEL;
+}
+
+struct Sha256x
+  : Sha256 {
+
+  Sha256x(Compress compress)
+    : compress_{compress} {
+    memcpy(state_, IV, sizeof(state_));
+  }
+
+  // Resumes a hash after `length` bytes, a whole number of blocks,
+  // have been compressed into `state`.
+  Sha256x(Compress compress, const uint32_t (&state)[8], uint64_t length)
+    : compress_{compress}
+    , length_{length} {
+    KJ_DREQUIRE(length % 64 == 0);
+    memcpy(state_, state, sizeof(state_));
+  }
+
+  void update(kj::ArrayPtr<const uint8_t>) override;
+  kj::Array<uint8_t> digest() override;
+  kj::FixedArray<uint8_t, 32> finish() override;
+  void finishInto(uint8_t* digest);
+
+private:
+  Compress compress_;
+  uint32_t state_[8];
+  uint8_t block_[64];
+  size_t filled_{0};
+  uint64_t length_{0};
+};
+
+void Sha256x::update(kj::ArrayPtr<const uint8_t> data) {
+  length_ += data.size();
+
+  if (filled_) {
+    auto size = kj::min(sizeof(block_) - filled_, data.size());
+    memcpy(block_ + filled_, data.begin(), size);
+    filled_ += size;
+    data = data.slice(size, data.size());
+    if (filled_ < sizeof(block_)) {
+      return;
+    }
+    compress_(state_, block_, 1);
+    filled_ = 0;
+  }
+
+  // whole blocks are compressed straight from the input
+  auto blocks = data.size() / 64;
+  if (blocks) {
+    compress_(state_, data.begin(), blocks);
+    data = data.slice(blocks * 64, data.size());
+  }
+
+  memcpy(block_, data.begin(), data.size());
+  filled_ = data.size();
+}
+
+void Sha256x::finishInto(uint8_t* digest) {
+  auto bits = length_ * 8;
+
+  block_[filled_++] = 0x80;
+  if (filled_ > 56) {
+    memset(block_ + filled_, 0, sizeof(block_) - filled_);
+    compress_(state_, block_, 1);
+    filled_ = 0;
+  }
+  memset(block_ + filled_, 0, 56 - filled_);
+  for (auto ii = 0u; ii < 8; ++ii) {
+    block_[63 - ii] = bits >> (ii * 8);
+  }
+  compress_(state_, block_, 1);
+
+  // SHA-256 is big endian
+  for (auto ii = 0u; ii < 8; ++ii) {
+    auto word = __builtin_bswap32(state_[ii]);
+    memcpy(digest + ii * 4, &word, sizeof(word));
+  }
 }
 
 kj::Array<uint8_t> Sha256x::digest() {
   auto data = kj::heapArray<uint8_t>(32);
-  pad();
-  revert(data.begin());
+  finishInto(data.begin());
   return data;
 }
 
-void Sha256x::revert(uint8_t * hash) {
-  // SHA uses big endian byte ordering
-  // Revert all bytes
-  for (uint8_t i = 0 ; i < 4 ; i++) {
-    for(uint8_t j = 0 ; j < 8 ; j++) {
-      hash[i + (j * 4)] = (m_state[j] >> (24 - i * 8)) & 0x000000ff;
-    }
-  }
+kj::FixedArray<uint8_t, 32> Sha256x::finish() {
+  kj::FixedArray<uint8_t, 32> digest;
+  finishInto(digest.begin());
+  memcpy(state_, IV, sizeof(state_));
+  filled_ = 0;
+  length_ = 0;
+  return digest;
+}
+
+}
+
+kj::Own<Sha256> newPortableSha256(bool accelerated) {
+  return kj::heap<Sha256x>(accelerated ? kernel().compress_ : compressPortable);
 }
 
-void Sha256x::update(const char* str) {
-  return update(kj::StringPtr{str});
+kj::StringPtr sha256Kernel() {
+  return kernel().name_;
 }
 
-void Sha256x::update(kj::StringPtr str) {
-  return update(str.asBytes());
+kj::StringPtr sha256ManyKernel() {
+  return manyKernel().name_;
 }
 
+kj::Array<kj::FixedArray<uint8_t, 32>> sha256Many(
+    kj::ArrayPtr<const kj::ArrayPtr<const uint8_t>> inputs,
+    bool accelerated) {
+
+  auto digests = kj::heapArray<kj::FixedArray<uint8_t, 32>>(inputs.size());
+  auto many = accelerated ? manyKernel() : ManyKernel{compress4, 4, "simd128x4"_kj};
+  auto lanes = many.lanes_;
+
+  // no kernel has more than 16 lanes
+  const uint8_t* data[16];
+  uint32_t state[16][8];
+
+  for (size_t first = 0; first < inputs.size(); first += lanes) {
+    auto group = inputs.slice(first, kj::min(first + lanes, inputs.size()));
+
+    // the lanes share the blocks that every message in the group has;
+    // idle lanes rehash the first message
+    auto blocks = group[0].size() / 64;
+    for (auto ii: kj::zeroTo(lanes)) {
+      auto& input = group[ii < group.size() ? ii : 0];
+      data[ii] = input.begin();
+      memcpy(state[ii], IV, sizeof(IV));
+      blocks = kj::min(blocks, input.size() / 64);
+    }
+
+    many.compress_(state, data, blocks);
+
+    // and each finishes on its own
+    for (auto ii: kj::indices(group)) {
+      auto& input = group[ii];
+      Sha256x hash{kernel().compress_, state[ii], blocks * 64};
+      hash.update(input.slice(blocks * 64, input.size()));
+      hash.finishInto(digests[first + ii].begin());
+    }
+  }
+
+  return digests;
 }
 
 }
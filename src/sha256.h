@@ -20,6 +20,10 @@ struct Sha256 {
   virtual void update(kj::ArrayPtr<const uint8_t>) = 0;
   virtual kj::Array<uint8_t> digest() = 0;
 
+  // Returns the digest without allocating, and starts a new hash so
+  // that the object can be reused.
+  virtual kj::FixedArray<uint8_t, 32> finish() = 0;
+
   void update(kj::StringPtr txt) {
     update(txt.asBytes());
   }
@@ -29,4 +33,20 @@ kj::Array<uint8_t> sha256(kj::ArrayPtr<const uint8_t>);
 kj::Array<uint8_t> sha256(kj::StringTree&);
 
 kj::Own<Sha256> newSha256();
+
+// The in-tree implementation, which uses the CPU's SHA-256
+// instructions (SHA-NI or the ARMv8 crypto extension) when it has
+// them, unless `accelerated` is false.
+kj::Own<Sha256> newPortableSha256(bool accelerated = true);
+
+// Hashes each input independently, several at a time in SIMD lanes
+// (16 with AVX-512, 8 with AVX2, otherwise 4). Inputs of similar
+// length share the most work.
+kj::Array<kj::FixedArray<uint8_t, 32>> sha256Many(
+  kj::ArrayPtr<const kj::ArrayPtr<const uint8_t>> inputs,
+  bool accelerated = true);
+
+// The names of the kernels chosen for this CPU.
+kj::StringPtr sha256Kernel();
+kj::StringPtr sha256ManyKernel();
 }
@@ -9,7 +9,8 @@
 namespace {
 
 inline auto KJ_STRINGIFY(uuid_t uuid) {
-  kj::FixedArray<char, 36> txt;
+  // uuid_unparse writes a terminating NUL after the 36 characters
+  kj::FixedArray<char, 37> txt;
   uuid_unparse(uuid, txt.begin());
   return kj::mv(txt);
 }
@@ -19,9 +20,14 @@ inline auto KJ_STRINGIFY(uuid_t uuid) {
 namespace aws::uuid {
 
 kj::String random() {
+  auto txt = randomText();
+  return kj::heapString(txt.begin(), txt.size() - 1);
+}
+
+kj::FixedArray<char, 37> randomText() {
   uuid_t uuid;
   uuid_generate_random(uuid);
-  return kj::str(uuid);
+  return KJ_STRINGIFY(uuid);
 }
 
 }
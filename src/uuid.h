@@ -4,8 +4,12 @@
 // Licensed under the Apache 2.0 license found in the LICENSE file or at:
 //     https://opensource.org/licenses/Apache-2.0
 
+#include <kj/array.h>
 #include <kj/string.h>
 
 namespace aws::uuid {
   kj::String random();
+
+  // As random(), NUL-terminated in place rather than on the heap.
+  kj::FixedArray<char, 37> randomText();
 }
@@ -0,0 +1,150 @@
+// Copyright (c) 2023 Vaci Koblizek.
+// Licensed under the Apache 2.0 license found in the LICENSE file or at:
+//     https://opensource.org/licenses/Apache-2.0
+
+#include "xml.h"
+
+#include <kj/debug.h>
+#include <kj/vector.h>
+
+#include <expat.h>
+
+namespace aws::xml {
+
+namespace {
+
+struct Parser {
+
+  Parser(Handler& handler, size_t bufferSize)
+    : handler_{handler}
+    , parser_{XML_ParserCreate(nullptr)}
+    , buffer_{kj::heapArray<kj::byte>(bufferSize)} {
+
+    KJ_REQUIRE(parser_ != nullptr);
+    XML_SetUserData(parser_, this);
+    XML_SetElementHandler(parser_, &Parser::onStart, &Parser::onEnd);
+    XML_SetCharacterDataHandler(parser_, &Parser::onText);
+  }
+
+  ~Parser() noexcept(false) {
+    XML_ParserFree(parser_);
+  }
+
+  kj::Promise<void> run(kj::AsyncInputStream& input);
+
+private:
+  void feed(kj::ArrayPtr<const kj::byte>, bool final);
+
+  // Expat is C, so exceptions thrown by the handler are caught and
+  // rethrown once control has returned from XML_Parse.
+  template <typename Func>
+  void dispatch(Func&& func) {
+    if (exception_ != nullptr) {
+      return;
+    }
+    KJ_IF_MAYBE(exc, kj::runCatchingExceptions(kj::fwd<Func>(func))) {
+      exception_ = kj::mv(*exc);
+      XML_StopParser(parser_, XML_FALSE);
+    }
+  }
+
+  static void XMLCALL onStart(void* data, const XML_Char* name, const XML_Char**) {
+    auto& self = *static_cast<Parser*>(data);
+    self.dispatch(
+      [&]{
+        self.text_.clear();
+        self.handler_.startElement(name, ++self.depth_);
+      }
+    );
+  }
+
+  static void XMLCALL onEnd(void* data, const XML_Char* name) {
+    auto& self = *static_cast<Parser*>(data);
+    self.dispatch(
+      [&]{
+        self.text_.add('\0');
+        kj::StringPtr text{self.text_.begin(), self.text_.size() - 1};
+        self.handler_.endElement(name, text, self.depth_--);
+        self.text_.clear();
+      }
+    );
+  }
+
+  static void XMLCALL onText(void* data, const XML_Char* txt, int len) {
+    auto& self = *static_cast<Parser*>(data);
+    self.text_.addAll(txt, txt + len);
+  }
+
+  Handler& handler_;
+  XML_Parser parser_;
+  kj::Array<kj::byte> buffer_;
+  kj::Vector<char> text_;
+  uint depth_{0};
+  kj::Maybe<kj::Exception> exception_;
+};
+
+void Parser::feed(kj::ArrayPtr<const kj::byte> data, bool final) {
+  auto status = XML_Parse(
+    parser_, reinterpret_cast<const char*>(data.begin()), data.size(), final
+  );
+
+  KJ_IF_MAYBE(exc, exception_) {
+    kj::throwFatalException(kj::mv(*exc));
+  }
+
+  if (status != XML_STATUS_OK) {
+    KJ_FAIL_REQUIRE("Malformed XML",
+      XML_ErrorString(XML_GetErrorCode(parser_)),
+      XML_GetCurrentLineNumber(parser_));
+  }
+}
+
+kj::Promise<void> Parser::run(kj::AsyncInputStream& input) {
+  return
+    input.tryRead(buffer_.begin(), 1, buffer_.size())
+    .then(
+      [this, &input](size_t size) -> kj::Promise<void> {
+        feed(buffer_.slice(0, size), size == 0);
+        auto flushed = handler_.flush();
+        if (size == 0) {
+          return flushed;
+        }
+        return
+          flushed
+          .then(
+            [this, &input]{
+              return run(input);
+            }
+          );
+      }
+    );
+}
+
+}
+
+kj::Promise<void> parse(
+    kj::AsyncInputStream& input,
+    Handler& handler,
+    size_t bufferSize) {
+  auto parser = kj::heap<Parser>(handler, bufferSize);
+  auto promise = parser->run(input);
+  return promise.attach(kj::mv(parser));
+}
+
+kj::String escape(kj::StringPtr txt) {
+  kj::Vector<char> out(txt.size() + 1);
+  for (auto c: txt) {
+    switch (c) {
+      case '&': out.addAll("&amp;"_kj); break;
+      case '<': out.addAll("&lt;"_kj); break;
+      case '>': out.addAll("&gt;"_kj); break;
+      case '"': out.addAll("&quot;"_kj); break;
+      case '\'': out.addAll("&apos;"_kj); break;
+      default: out.add(c);
+    }
+  }
+  out.add('\0');
+  return kj::String{out.releaseAsArray()};
+}
+
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+// Copyright (c) 2023 Vaci Koblizek.
+// Licensed under the Apache 2.0 license found in the LICENSE file or at:
+//     https://opensource.org/licenses/Apache-2.0
+
+#include <kj/async-io.h>
+#include <kj/string.h>
+
+namespace aws::xml {
+
+// Receives the elements of a document as it is parsed.
+struct Handler {
+  virtual ~Handler() noexcept(false) {}
+
+  // Called as each element opens. The root element has depth 1.
+  virtual void startElement(kj::StringPtr name, uint depth) {}
+
+  // Called as each element closes, with the character data that
+  // followed its last child (or all of it, for a leaf element).
+  virtual void endElement(kj::StringPtr name, kj::StringPtr text, uint depth) {}
+
+  // Called after each chunk of input has been parsed. No more input is
+  // read until the returned promise resolves, so handlers can apply
+  // backpressure while delivering what they have seen so far.
+  virtual kj::Promise<void> flush() {
+    return kj::READY_NOW;
+  }
+};
+
+// Parses `input` incrementally until EOF. Only the current chunk and the
+// text of the innermost open element are held in memory.
+kj::Promise<void> parse(
+  kj::AsyncInputStream& input,
+  Handler&,
+  size_t bufferSize = 16 * 1024
+);
+
+// Escapes `txt` for use as character data or an attribute value.
+kj::String escape(kj::StringPtr txt);
+
+}